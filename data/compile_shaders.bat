@@ -20,6 +20,9 @@
 %VK_SDK_PATH%/Bin/glslc.exe shaders/surfelbinning.comp -o shaders/output/surfelbinning.comp.spv
 %VK_SDK_PATH%/Bin/glslc.exe shaders/surfelbinning.comp -o ../x64/Release/data/shaders/output/surfelbinning.comp.spv
 
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelRayAllocate.comp -o shaders/output/surfelRayAllocate.comp.spv
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelRayAllocate.comp -o ../x64/Release/data/shaders/output/surfelRayAllocate.comp.spv
+
 %VK_SDK_PATH%/Bin/glslc.exe shaders/deferred.frag -o shaders/output/deferred.frag.spv
 %VK_SDK_PATH%/Bin/glslc.exe shaders/deferred.frag -o ../x64/Release/data/shaders/output/deferred.frag.spv
 
@@ -35,6 +38,18 @@
 %VK_SDK_PATH%/Bin/glslc.exe shaders/surfelshade.comp -o shaders/output/surfelshade.comp.spv
 %VK_SDK_PATH%/Bin/glslc.exe shaders/surfelshade.comp -o ../x64/Release/data/shaders/output/surfelshade.comp.spv
 
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelFilter.comp -o shaders/output/surfelFilter.comp.spv
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelFilter.comp -o ../x64/Release/data/shaders/output/surfelFilter.comp.spv
+
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortOrder.comp -o shaders/output/surfelSortOrder.comp.spv
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortOrder.comp -o ../x64/Release/data/shaders/output/surfelSortOrder.comp.spv
+
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortScatter.comp -o shaders/output/surfelSortScatter.comp.spv
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortScatter.comp -o ../x64/Release/data/shaders/output/surfelSortScatter.comp.spv
+
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortApply.comp -o shaders/output/surfelSortApply.comp.spv
+%VK_SDK_PATH%/Bin/glslc.exe shaders/surfelSortApply.comp -o ../x64/Release/data/shaders/output/surfelSortApply.comp.spv
+
 
 %VK_SDK_PATH%/Bin/glslc.exe --target-spv=spv1.5 shaders/shadowRayGen.rgen -o shaders/output/shadowRayGen.rgen.spv
 %VK_SDK_PATH%/Bin/glslc.exe --target-spv=spv1.5 shaders/shadowRayGen.rgen -o ../x64/Release/data/shaders/output/shadowRayGen.rgen.spv
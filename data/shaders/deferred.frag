@@ -1,13 +1,31 @@
 #version 460
+#extension GL_EXT_nonuniform_qualifier : enable
 
 #include "random.glsl"
 
+// As stored in the light buffer, 32 bytes (GPULight in light_buffer.h)
+struct PackedLight{
+	vec4 pos;		// w used for max distance
+	uvec2 color;	// rgb as half floats
+	float intensity;
+	float radius;
+};
+
 struct Light{
 	vec4 pos;	// w used for max distance
 	vec4 color;	// w used for intensity
 	float radius;
 };
 
+Light unpackLight(PackedLight packed)
+{
+	Light light;
+	light.pos		= packed.pos;
+	light.color		= vec4(unpackHalf2x16(packed.color.x), unpackHalf2x16(packed.color.y).x, packed.intensity);
+	light.radius	= packed.radius;
+	return light;
+}
+
 // layout(push_constant) uniform constants
 // {
 // 	vec4 data;
@@ -22,7 +40,7 @@ layout (set = 0, binding = 0) uniform sampler2D positionTexture;
 layout (set = 0, binding = 1) uniform sampler2D normalTexture;
 layout (set = 0, binding = 2) uniform sampler2D albedoTexture;
 layout (set = 0, binding = 3) uniform sampler2D motionTexture;
-layout (std140, set = 0, binding = 4) buffer LightBuffer {Light lights[];} lightBuffer;
+layout (std140, set = 0, binding = 4) buffer LightBuffer {PackedLight lights[];} lightBuffer;
 layout (set = 0, binding = 5) uniform debugInfo {int target;} debug;
 layout (set = 0, binding = 6) uniform sampler2D materialTexture;
 layout (set = 0, binding = 8) uniform sampler2D emissiveTexture;
@@ -31,6 +49,21 @@ layout (set = 0, binding = 10) uniform sampler2D debugGI;
 layout (set = 0, binding = 11) uniform sampler2D resultGI;
 layout (set = 0, binding = 12) uniform sampler2D[2] shadow;
 
+// Must match light_clusters.h
+const uint LIGHT_CLUSTER_X		= 16;
+const uint LIGHT_CLUSTER_Y		= 9;
+const uint LIGHT_CLUSTER_Z		= 24;
+const uint LIGHT_CLUSTER_COUNT	= LIGHT_CLUSTER_X * LIGHT_CLUSTER_Y * LIGHT_CLUSTER_Z;
+
+layout (std430, set = 0, binding = 13) buffer LightClusters {
+	mat4 view;
+	mat4 projection;
+	uvec4 dims;		// xyz clusters, w lights lit everywhere, first in the index list
+	vec4 depth;		// near, far, slices / log(far / near)
+	uvec2 cells[LIGHT_CLUSTER_COUNT];	// offset, count into indices
+	uint indices[];
+} clusters;
+
 const float PI = 3.14159265359;
 
 float DistributionGGX(vec3 N, vec3 H, float a);
@@ -48,6 +81,20 @@ vec3 gamma(vec3 c)
 	return pow(c,vec3(1.0/2.2));;
 }
 
+// Same as LightClusters::cluster
+uint lightCluster(vec3 position)
+{
+	vec4 viewPosition	= clusters.view * vec4(position, 1.0);
+	vec4 clip			= clusters.projection * viewPosition;
+	vec2 uv				= clip.xy / clip.w * 0.5 + 0.5;
+
+	uvec2 tile	= uvec2(clamp(uv * vec2(clusters.dims.xy), vec2(0), vec2(clusters.dims.xy) - 1.0));
+	float z		= log(max(-viewPosition.z, clusters.depth.x) / clusters.depth.x) * clusters.depth.z;
+	uint slice	= min(uint(z), clusters.dims.z - 1);
+
+	return tile.x + clusters.dims.x * (tile.y + clusters.dims.y * slice);
+}
+
 void main() 
 {
 	vec3 position 	= texture(positionTexture, inUV).xyz;
@@ -99,11 +146,18 @@ void main()
 	vec3 color = vec3(1), Lo = vec3(0);
 	float attenuation = 1.0, light_intensity = 1.0;
 	
-	for(int i = 0; i < lightBuffer.lights.length(); i++)
+	// Global lights first, then the ones binned in this pixel's cluster
+	const uvec2 cell = clusters.cells[lightCluster(position)];
+	const uint lightCount = clusters.dims.w + cell.y;
+
+	for(uint n = 0; n < lightCount; n++)
 	{
-		float shadowFactor 	= texture(shadow[i], inUV).r;
+		const uint i = clusters.indices[n < clusters.dims.w ? n : cell.x + n - clusters.dims.w];
+		float shadowFactor 	= texture(shadow[nonuniformEXT(i)], inUV).r;
+		lightning = vec3(0);
+		NdotL = 0;
 
-		Light light						= lightBuffer.lights[i];
+		Light light						= unpackLight(lightBuffer.lights[i]);
 		const bool isDirectional        = light.pos.w < 0;
 		vec3 L							= (light.pos.xyz - position);
 		const float light_max_distance 	= light.pos.w;
@@ -17,12 +17,29 @@ struct Vertex
   vec4 uv;
 };
 
+// As stored in the light buffer, 32 bytes (GPULight in light_buffer.h)
+struct PackedLight{
+  vec4  pos;        // w used for max distance, < 0 for directional lights
+  uvec2 color;      // rgb as half floats
+  float intensity;
+  float radius;
+};
+
 struct Light{
   vec4  pos;
-  vec4  color;
+  vec4  color;      // w used for intensity
   float radius;
 };
 
+Light unpackLight(PackedLight packed)
+{
+  Light light;
+  light.pos     = packed.pos;
+  light.color   = vec4(unpackHalf2x16(packed.color.x), unpackHalf2x16(packed.color.y).x, packed.intensity);
+  light.radius  = packed.radius;
+  return light;
+}
+
 struct Material{
 	vec4 diffuse;
     vec4 textures;
@@ -0,0 +1,94 @@
+// Sample sequences of the surfel rays and of the spawn chance, src/sampling.cpp is the same on the CPU.
+// Needs tea from random.glsl. Everything up to the conversion to float is integer arithmetic, so
+// both sides produce the same bits.
+
+const uint GOLDEN_RATIO	= 0x9E3779B9u;		// 2^32 / phi
+const uint R2_X			= 0xC13FA9A9u;		// 2^32 / g, g the plastic number
+const uint R2_Y			= 0x91E10DA5u;		// 2^32 / g^2
+
+// Each bit only depends on the ones below it, so on reversed bits it permutes every subinterval on its own
+uint laine_karras_permutation(uint x, uint seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+// Nested uniform (Owen) scramble of the bits of x, "Practical Hash-based Owen Scrambling", Burley 2020
+uint owen_scramble(uint x, uint seed)
+{
+	return bitfieldReverse(laine_karras_permutation(bitfieldReverse(x), seed));
+}
+
+// First two dimensions of the Sobol sequence, in 0.32 fixed point. Dimension 0 is the
+// van der Corput sequence, dimension 1 has the direction numbers of x + 1
+uvec2 sobol2(uint index)
+{
+	uint x = bitfieldReverse(index);
+	uint y = 0;
+	for (uint v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+	{
+		if ((index & 1) != 0)
+			y ^= v;
+	}
+	return uvec2(x, y);
+}
+
+// Sobol point of index, shuffled and scrambled with seed. Any power of two prefix is a (0, m, 2)-net.
+uvec2 sobol2_owen(uint index, uint seed)
+{
+	uvec2 p = sobol2(owen_scramble(index, seed));
+	p.x = owen_scramble(p.x, tea(seed, 0));
+	p.y = owen_scramble(p.y, tea(seed, 1));
+	return p;
+}
+
+// R2, the additive recurrence of the plastic number. Adding it wraps around the unit square,
+// a toroidal shift that keeps the stratification of the point it moves.
+uvec2 r2(uint index)
+{
+	return uvec2(index * R2_X, index * R2_Y);
+}
+
+// 0.32 fixed point to [0, 1), the top 24 bits so the float is exact
+float sample_float(uint x)
+{
+	return float(x >> 8) * (1.0 / 16777216.0);
+}
+
+vec2 sample_float(uvec2 x)
+{
+	return vec2(sample_float(x.x), sample_float(x.y));
+}
+
+// The rays of a surfel in a frame are a scrambled Sobol net seeded per surfel, rotated every
+// frame by R2 so consecutive frames fill the gaps of each other
+vec2 surfel_ray_sample(uint surfel_index, uint sample_index, uint frame)
+{
+	return sample_float(sobol2_owen(sample_index, tea(surfel_index, 0)) + r2(frame));
+}
+
+// Spatiotemporal blue noise: the texel of a 2D blue noise tile, animated by the golden ratio so
+// every texel runs a low discrepancy sequence over the frames while neighbours stay blue
+float blue_noise_sample(float texel, uint frame)
+{
+	return sample_float((uint(texel * 16777216.0) << 8) + frame * GOLDEN_RATIO);
+}
+
+// Cosine distributed direction about n, basis of "Building an Orthonormal Basis, Revisited"
+vec3 sample_cosine_hemisphere(vec3 n, vec2 u)
+{
+	float flip = n.z >= 0.0 ? 1.0 : -1.0;
+	float a = -1.0 / (flip + n.z);
+	float b = n.x * n.y * a;
+	vec3 b1 = vec3(1.0 + flip * n.x * n.x * a, flip * b, -flip * n.x);
+	vec3 b2 = vec3(b, flip + n.y * n.y * a, -n.y);
+
+	float r = sqrt(u.x);
+	float phi = 2.0 * 3.14159265 * u.y;
+
+	return normalize(r * cos(phi) * b1 + r * sin(phi) * b2 + sqrt(max(0.0, 1.0 - u.x)) * n);
+}
@@ -1,8 +1,22 @@
-const uvec3 SURFEL_GRID_DIMENSIONS = uvec3(128, 64, 128) ; //(64, 32, 64)   (128, 64, 128)
-const uint SURFEL_TABLE_SIZE = SURFEL_GRID_DIMENSIONS.x * SURFEL_GRID_DIMENSIONS.y * SURFEL_GRID_DIMENSIONS.z; //1048576, 131072
+// Budget and grid are specialization constants set from SurfelConfig (surfel_gi.h) when the
+// pipelines are created, the values here are only the defaults. The indirect thread count is
+// constant_id 5, taken by local_size_x_id in the passes dispatched over the alive surfels, and
+// the coverage tile is constant_id 6 and 7, taken by local_size_x_id and local_size_y_id in
+// surfelRandomPos.comp.
+layout (constant_id = 0) const uint SURFEL_CAPACITY = 100000;
+layout (constant_id = 1) const uint SURFEL_GRID_DIMENSIONS_X = 64;
+layout (constant_id = 2) const uint SURFEL_GRID_DIMENSIONS_Y = 32;
+layout (constant_id = 3) const uint SURFEL_GRID_DIMENSIONS_Z = 64;
+layout (constant_id = 4) const uint SURFEL_CELL_LIMIT = 100;
+layout (constant_id = 8) const uint SURFEL_RAY_BUDGET = 100000;		// rays traced a frame at most
+
+// Nested grids centred on the camera, the cells of each cascade are twice as big as the previous one's.
+// Dimensions must be powers of two, cells wrap around their cascade
+const uint SURFEL_CASCADE_COUNT = 4;
+const uvec3 SURFEL_GRID_DIMENSIONS = uvec3(SURFEL_GRID_DIMENSIONS_X, SURFEL_GRID_DIMENSIONS_Y, SURFEL_GRID_DIMENSIONS_Z); // cells of one cascade
+const uint SURFEL_CASCADE_SIZE = SURFEL_GRID_DIMENSIONS_X * SURFEL_GRID_DIMENSIONS_Y * SURFEL_GRID_DIMENSIONS_Z;
+const uint SURFEL_TABLE_SIZE = SURFEL_CASCADE_SIZE * SURFEL_CASCADE_COUNT;
 const float SURFEL_MAX_RADIUS = 1;
-const uint SURFEL_CAPACITY = 100000;
-const uint SURFEL_INDIRECT_NUMTHREADS = 32;
 const float SURFEL_TARGET_COVERAGE = 0.5;
 
 
@@ -10,19 +24,75 @@ vec3 fakepos = vec3(0.0, 5.0, 5.0);
 
 #define PI 3.14159265358979323846
 
-const uint SURFEL_CELL_LIMIT = 100;
+// A surfel overlaps at most 27 cells, so the index list can never run out
+const uint SURFEL_CELL_INDEX_CAPACITY = SURFEL_CAPACITY * 27;
+
+const uint SURFEL_STATS_OFFSET_COUNT = 0;			// alive surfels, the alive list is [0, count)
+const uint SURFEL_STATS_OFFSET_NEXTCOUNT = 1;		// survivors appended by updateSurfels.comp
+const uint SURFEL_STATS_OFFSET_INDIRECT = 2;		// dispatch arguments over the alive surfels
+const uint SURFEL_STATS_OFFSET_CELLALLOCATOR = 5;
+const uint SURFEL_STATS_OFFSET_DEADCOUNT = 6;		// free indices on the dead stack
+const uint SURFEL_STATS_OFFSET_LOWPOOL = 7;			// 1 when the dead stack runs low
+const uint SURFEL_STATS_OFFSET_TRACE = 8;			// trace rays arguments over the ray queue
+const uint SURFEL_STATS_OFFSET_RAYALLOCATOR = 11;	// rays queued this frame, may run past the budget
+const uint SURFEL_STATS_OFFSET_RAYDEMAND = 12;		// rays the surfels asked for last frame, fixed point
+const uint SURFEL_STATS_OFFSET_NEXTRAYDEMAND = 13;	// same, summed by surfelRayAllocate.comp this frame
+const uint SURFEL_STATS_OFFSET_SORT = 14;			// dispatch arguments over the alive surfels on frames that sort them, 0 groups otherwise
+const uint SURFEL_STATS_OFFSET_SORTCELLS = 17;		// same over the cells of the grid
+const uint SURFEL_STATS_OFFSET_SORTSLOTS = 20;		// same over the surfel slots
+const uint SURFEL_STATS_OFFSET_SORTALLOCATOR = 23;	// sorted slots handed out by surfelSortOrder.comp and surfelSortScatter.comp
+const uint SURFEL_STATS_OFFSET_SORTCLOCK = 24;		// frames since the last sort
+const uint SURFEL_STATS_OFFSET_CELLOVERFLOW = 25;	// cells holding more than SURFEL_CELL_LIMIT surfels, counted by gridOffset.comp
+const uint SURFEL_STATS_OFFSET_SPAWNS = 26;			// surfels spawned since the start, wraps around
+const uint SURFEL_STATS_OFFSET_RECYCLES = 27;		// surfels recycled since the start, wraps around
+const uint SURFEL_STATS_SIZE = 28;
+const uint SURFEL_GRID_UNBUILT = 0xFFFFFFFFu;		// cell allocator of a loaded snapshot, surfelRandomPos.comp sees no grid and spawns nothing
+
+// The dead stack starts with SURFEL_BUDGET indices, so no more surfels than that are ever alive
+const uint SURFEL_BUDGET = SURFEL_CAPACITY;
+const uint SURFEL_RECYCLE_RESERVE = SURFEL_BUDGET / 16;	// free indices under which the pool runs low
+const uint SURFEL_RECYCLE_FRAMES = 64;					// frames without covering a pixel before a surfel is recycled
+const uint SURFEL_RECYCLE_FRAMES_LOW = 8;				// same when the pool runs low
+const uint SURFEL_RECYCLE_MIN_AGE = 16;					// younger surfels are only recycled when out of the grid
+
+// Ray allocation, see surfelRayAllocate.comp
+const uint SURFEL_RAYS_MAX = 16;						// rays of one surfel a frame
+const float SURFEL_RAYS_MIN = 0.125;					// rays a frame of a converged surfel, on average
+const uint SURFEL_RAY_WARMUP = 16;						// frames a new surfel asks for SURFEL_RAYS_MAX
+const float SURFEL_RAY_DEMAND_SCALE = 256.0;			// fixed point of the demand sums
+
+const float SURFEL_SH_BLEND = 0.08;						// weight of a frame in the SH once warmed up
+
+const uint SURFEL_SORT_INTERVAL = 64;					// frames between two sorts of the surfels by the Morton order of their cell
+
+// Spatial filter, see surfelFilter.comp
+const float SURFEL_FILTER_NORMAL_POWER = 8.0;			// falloff of the weight with the angle between the normals
+const float SURFEL_FILTER_PLANE = 0.25;					// distance off the plane of a surfel, in cells, where a neighbour stops counting
+const float SURFEL_FILTER_VARIANCE = 1.0 / 16;			// added to every relative variance, converged surfels don't take all the weight
+
+// The surfels of a cell are indexSurf[offset, offset + count) in the cell buffer
+struct SurfelGridCell
+{
+	uint count;
+	uint offset;
+};
 
 struct Surfel
 {
 	vec3 position;
-    float pad0;
+	uint age;		// frames alive
 	vec3 normal;
-    float pad1;
+	uint unseen;	// frames since it last covered a pixel
 	vec3 color;
 	float radius;
 };
 
 
+// SURFEL_SH adds the linear part of the irradiance to SurfelData, see surfel_gi.h
+#ifndef SURFEL_SH
+#define SURFEL_SH 0
+#endif
+
 struct SurfelData
 {
 	vec3 mean;
@@ -34,25 +104,243 @@ struct SurfelData
 	vec3 variance;
 	float inconsistency;
 
-	vec3 hitpos;
-	float padding0;
+#if SURFEL_SH
+	vec3 shX;
+	float pad1;
+	vec3 shY;
+	float pad2;
+	vec3 shZ;
+	float pad3;
+#endif
+};
 
-	vec3 hitnormal;
-	float padding1;
+// One traced ray of a surfel, always packed, see SurfelRay
+struct SurfelRay
+{
+	uint radiance;		// rgb9e5
+#if SURFEL_SH
+	uint direction;		// octahedral
+#endif
+};
 
-	vec3 hitenergy;
-	float padding2;
+// The rays of a surfel are rayQueue[offset, offset + count)
+struct SurfelRayRange
+{
+	uint offset;
+	uint count;
+};
+
+// Storage layouts of surfel_gi.h, selected with SURFEL_PACKED like there. Every surfel shader
+// goes through surfel_unpack / surfel_pack, so the passes work on Surfel and SurfelData either way.
+#ifndef SURFEL_PACKED
+#define SURFEL_PACKED 1
+#endif
+
+// 28 bytes, see SurfelPacked
+struct SurfelPacked
+{
+	float position[3];
+	uint normal;		// octahedral, snorm 16 x 2
+	uint color;			// rgb9e5
+	float radius;
+	uint lifetime;		// age in the low half, unseen in the high one
+};
 
-	vec3 traceresult;
-	float padding3;
+// 20 bytes, see SurfelDataPacked
+struct SurfelDataPacked
+{
+	uint mean;			// rgb9e5
+	uint shortMean;		// rgb9e5
+	uint varianceRG;	// half2
+	uint varianceBVbbr;	// half2, variance.b and vbbr
+	float inconsistency;
+#if SURFEL_SH
+	uint sh[5];			// half2, shX, shY and shZ one channel after the other
+#endif
 };
 
-bool surfel_cellvalid(ivec3 cell){
-	if (cell.x < 0 || cell.x >= SURFEL_GRID_DIMENSIONS.x)
+const int RGB9E5_BIAS = 15;
+const int RGB9E5_MANTISSA = 9;
+const float RGB9E5_MAX = 65408.0;
+const float HALF_MAX = 65504.0;
+
+// Shared exponent RGB for non negative radiance, 9 bit mantissas and a 5 bit exponent
+uint rgb9e5_encode(vec3 rgb)
+{
+	vec3 c = clamp(rgb, vec3(0.0), vec3(RGB9E5_MAX));
+	float maxc = max(c.r, max(c.g, c.b));
+
+	// floor(log2(maxc)) from frexp, log2 can round across a power of two
+	int exponent;
+	frexp(maxc, exponent);
+	int sharedExp = max(-RGB9E5_BIAS - 1, exponent - 1) + 1 + RGB9E5_BIAS;
+	if (floor(ldexp(maxc, RGB9E5_MANTISSA + RGB9E5_BIAS - sharedExp) + 0.5) == float(1 << RGB9E5_MANTISSA))
+		sharedExp++;
+
+	float scale = ldexp(1.0, RGB9E5_MANTISSA + RGB9E5_BIAS - sharedExp);
+	uvec3 m = uvec3(floor(c * scale + 0.5));
+	return m.x | (m.y << 9) | (m.z << 18) | (uint(sharedExp) << 27);
+}
+
+vec3 rgb9e5_decode(uint stored)
+{
+	float scale = ldexp(1.0, int(stored >> 27) - RGB9E5_BIAS - RGB9E5_MANTISSA);
+	return vec3(stored & 0x1FF, (stored >> 9) & 0x1FF, (stored >> 18) & 0x1FF) * scale;
+}
+
+uint oct_encode(vec3 n)
+{
+	float l1 = abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 p = l1 > 0.0 ? n.xy / l1 : vec2(0.0);
+	if (n.z < 0.0)
+		p = (1.0 - abs(p.yx)) * vec2(p.x >= 0.0 ? 1.0 : -1.0, p.y >= 0.0 ? 1.0 : -1.0);
+	return packSnorm2x16(p);
+}
+
+vec3 oct_decode(uint stored)
+{
+	vec2 p = unpackSnorm2x16(stored);
+	vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+	float t = max(-n.z, 0.0);
+	n.x += n.x >= 0.0 ? -t : t;
+	n.y += n.y >= 0.0 ? -t : t;
+	return normalize(n);
+}
+
+uint pack_half2(float a, float b)
+{
+	return packHalf2x16(clamp(vec2(a, b), vec2(-HALF_MAX), vec2(HALF_MAX)));
+}
+
+#if SURFEL_PACKED
+#define SurfelStorage SurfelPacked
+#define SurfelDataStorage SurfelDataPacked
+
+Surfel surfel_unpack(SurfelPacked stored)
+{
+	Surfel surfel;
+	surfel.position = vec3(stored.position[0], stored.position[1], stored.position[2]);
+	surfel.normal = oct_decode(stored.normal);
+	surfel.color = rgb9e5_decode(stored.color);
+	surfel.radius = stored.radius;
+	surfel.age = stored.lifetime & 0xFFFF;
+	surfel.unseen = stored.lifetime >> 16;
+	return surfel;
+}
+
+SurfelPacked surfel_pack(Surfel surfel)
+{
+	SurfelPacked stored;
+	stored.position[0] = surfel.position.x;
+	stored.position[1] = surfel.position.y;
+	stored.position[2] = surfel.position.z;
+	stored.normal = oct_encode(surfel.normal);
+	stored.color = rgb9e5_encode(surfel.color);
+	stored.radius = surfel.radius;
+	stored.lifetime = min(surfel.age, 0xFFFFu) | (min(surfel.unseen, 0xFFFFu) << 16);
+	return stored;
+}
+
+SurfelData surfel_data_unpack(SurfelDataPacked stored)
+{
+	vec2 rg = unpackHalf2x16(stored.varianceRG);
+	vec2 bv = unpackHalf2x16(stored.varianceBVbbr);
+
+	SurfelData data;
+	data.mean = rgb9e5_decode(stored.mean);
+	data.pad0 = 0;
+	data.shortMean = rgb9e5_decode(stored.shortMean);
+	data.vbbr = bv.y;
+	data.variance = vec3(rg, bv.x);
+	data.inconsistency = stored.inconsistency;
+#if SURFEL_SH
+	vec2 sh0 = unpackHalf2x16(stored.sh[0]);
+	vec2 sh1 = unpackHalf2x16(stored.sh[1]);
+	vec2 sh2 = unpackHalf2x16(stored.sh[2]);
+	vec2 sh3 = unpackHalf2x16(stored.sh[3]);
+	vec2 sh4 = unpackHalf2x16(stored.sh[4]);
+	data.shX = vec3(sh0, sh1.x);
+	data.shY = vec3(sh1.y, sh2);
+	data.shZ = vec3(sh3, sh4.x);
+	data.pad1 = 0;
+	data.pad2 = 0;
+	data.pad3 = 0;
+#endif
+	return data;
+}
+
+SurfelDataPacked surfel_data_pack(SurfelData data)
+{
+	SurfelDataPacked stored;
+	stored.mean = rgb9e5_encode(data.mean);
+	stored.shortMean = rgb9e5_encode(data.shortMean);
+	stored.varianceRG = pack_half2(data.variance.r, data.variance.g);
+	stored.varianceBVbbr = pack_half2(data.variance.b, data.vbbr);
+	stored.inconsistency = data.inconsistency;
+#if SURFEL_SH
+	stored.sh[0] = pack_half2(data.shX.r, data.shX.g);
+	stored.sh[1] = pack_half2(data.shX.b, data.shY.r);
+	stored.sh[2] = pack_half2(data.shY.g, data.shY.b);
+	stored.sh[3] = pack_half2(data.shZ.r, data.shZ.g);
+	stored.sh[4] = pack_half2(data.shZ.b, 0.0);
+#endif
+	return stored;
+}
+
+// Type of the color member of the stored surfel
+uint surfel_pack_color(vec3 color) { return rgb9e5_encode(color); }
+#else
+#define SurfelStorage Surfel
+#define SurfelDataStorage SurfelData
+
+Surfel surfel_unpack(Surfel surfel) { return surfel; }
+Surfel surfel_pack(Surfel surfel) { return surfel; }
+SurfelData surfel_data_unpack(SurfelData data) { return data; }
+SurfelData surfel_data_pack(SurfelData data) { return data; }
+vec3 surfel_pack_color(vec3 color) { return color; }
+#endif
+
+SurfelRay surfel_ray_pack(vec3 radiance, vec3 direction)
+{
+	SurfelRay ray;
+	ray.radiance = rgb9e5_encode(radiance);
+#if SURFEL_SH
+	ray.direction = oct_encode(direction);
+#endif
+	return ray;
+}
+
+// Irradiance of a surfel towards a normal, its color unless SURFEL_SH
+vec3 surfel_irradiance(vec3 color, SurfelData data, vec3 N)
+{
+#if SURFEL_SH
+	return max(vec3(0.0), color + data.shX * N.x + data.shY * N.y + data.shZ * N.z);
+#else
+	return color;
+#endif
+}
+
+float surfel_cascade_cellsize(uint cascade)
+{
+	return SURFEL_MAX_RADIUS * float(1u << cascade);
+}
+
+// World space cell of a position in a cascade
+ivec3 surfel_cell(vec3 position, uint cascade)
+{
+	return ivec3(floor(position / surfel_cascade_cellsize(cascade)));
+}
+
+bool surfel_cellvalid(ivec3 cell, uint cascade, vec3 campos){
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return false;
+
+	ivec3 local = cell - surfel_cell(campos, cascade) + ivec3(SURFEL_GRID_DIMENSIONS / 2);
+	if (local.x < 0 || local.x >= SURFEL_GRID_DIMENSIONS.x)
 		return false;
-	if (cell.y < 0 || cell.y >= SURFEL_GRID_DIMENSIONS.y)
+	if (local.y < 0 || local.y >= SURFEL_GRID_DIMENSIONS.y)
 		return false;
-	if (cell.z < 0 || cell.z >= SURFEL_GRID_DIMENSIONS.z)
+	if (local.z < 0 || local.z >= SURFEL_GRID_DIMENSIONS.z)
 		return false;
 	return true;
 }
@@ -62,43 +350,101 @@ uint flatten3D(uvec3 coord, uvec3 dim)
 	return (coord.z * dim.x * dim.y) + (coord.y * dim.x) + coord.x;
 }
 
-uint surfel_cellindex(ivec3 cell)
+// The low 10 bits of x spread to every third bit
+uint part1by2(uint x)
 {
-	return flatten3D(uvec3(cell), SURFEL_GRID_DIMENSIONS);
-    // const uint p1 = 73856093;   // some large primes 
-	// const uint p2 = 19349663;
-	// const uint p3 = 83492791;
-	// int n = int(p1 * pow(cell.x, p2) * pow(cell.y, p3) * cell.z);
-	// n %= int(SURFEL_TABLE_SIZE);
-	// return n;
+	x &= 0x3FFu;
+	x = (x | (x << 16)) & 0x030000FFu;
+	x = (x | (x << 8)) & 0x0300F00Fu;
+	x = (x | (x << 4)) & 0x030C30C3u;
+	x = (x | (x << 2)) & 0x09249249u;
+	return x;
 }
 
-float rand(vec2 co){
-    return fract(sin(dot(co, vec2(12.9898, 78.233))) * 43758.5453);
+// Morton (z-order) index of a coordinate in a grid of power of two dimensions. The bits all axes
+// have are interleaved, the extra high bits of the longer axes go on top in z-y-x order, so the
+// index still covers [0, dim.x * dim.y * dim.z) once.
+uint surfel_morton(uvec3 coord, uvec3 dim)
+{
+	uint bits = uint(findMSB(min(dim.x, min(dim.y, dim.z))));
+	uvec3 low = coord & ((1u << bits) - 1u);
+	uint morton = part1by2(low.x) | (part1by2(low.y) << 1) | (part1by2(low.z) << 2);
+	return (flatten3D(coord >> bits, dim >> bits) << (3 * bits)) | morton;
 }
 
-ivec3 surfel_cell(vec3 position, vec3 campos){
-	//return ivec3(floor((position - floor(campos)) / SURFEL_MAX_RADIUS) + SURFEL_GRID_DIMENSIONS / 2);
+// Cells wrap around the cascade, so a world cell keeps its slot while the camera moves. The grid
+// is still cleared and rebuilt every frame, nothing is carried over from one position to the next.
+// Slots are in Morton order, the 27 neighbours of a cell and the cells a group of 64 threads walks
+// are mostly close in memory.
+uint surfel_cellindex(ivec3 cell, uint cascade)
+{
+	uvec3 wrapped = uvec3(cell) & (SURFEL_GRID_DIMENSIONS - 1);
+	return cascade * SURFEL_CASCADE_SIZE + surfel_morton(wrapped, SURFEL_GRID_DIMENSIONS);
+}
 
-	return ivec3(floor((position - floor(campos)) / SURFEL_MAX_RADIUS) + SURFEL_GRID_DIMENSIONS / 2);
-    //return ivec3(floor(position / SURFEL_MAX_RADIUS));
+// Innermost cascade holding the position, SURFEL_CASCADE_COUNT when it is outside all of them
+uint surfel_position_cascade(vec3 position, vec3 campos)
+{
+	for (uint cascade = 0; cascade < SURFEL_CASCADE_COUNT; ++cascade)
+	{
+		if (surfel_cellvalid(surfel_cell(position, cascade), cascade, campos))
+			return cascade;
+	}
+	return SURFEL_CASCADE_COUNT;
+}
+
+// Smallest cascade whose cells are as big as the radius
+uint surfel_radius_cascade(float radius)
+{
+	uint cascade = 0;
+	while (cascade + 1 < SURFEL_CASCADE_COUNT && surfel_cascade_cellsize(cascade) < radius)
+		cascade++;
+	return cascade;
+}
+
+// Outermost cascade a surfel is binned into, its radius one unless it is out of it. It is also binned
+// into the cascades from its position one up to this one, where lookups inside it land.
+uint surfel_cascade(Surfel surfel, vec3 campos)
+{
+	return max(surfel_radius_cascade(surfel.radius), surfel_position_cascade(surfel.position, campos));
+}
+
+// Cell of a position in the innermost cascade holding it, SURFEL_TABLE_SIZE when there is none
+uint surfel_lookup_cellindex(vec3 position, vec3 campos)
+{
+	uint cascade = surfel_position_cascade(position, campos);
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return SURFEL_TABLE_SIZE;
+	return surfel_cellindex(surfel_cell(position, cascade), cascade);
 }
 
-bool surfel_cellintersects(Surfel surfel, ivec3 cell, vec3 campos)
+// Whether updateSurfels.comp gives the surfel back to the dead stack, age and unseen already count this frame
+bool surfel_recycle(Surfel surfel, uint cascade, bool lowPool)
 {
-	if (!surfel_cellvalid(cell)){
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return true;
+	if (surfel.age < SURFEL_RECYCLE_MIN_AGE)
 		return false;
-    }
+	return surfel.unseen > (lowPool ? SURFEL_RECYCLE_FRAMES_LOW : SURFEL_RECYCLE_FRAMES);
+}
+
+float rand(vec2 co){
+    return fract(sin(dot(co, vec2(12.9898, 78.233))) * 43758.5453);
+}
 
-    // vec3 gridmin = cell * SURFEL_MAX_RADIUS;
-	// vec3 gridmax = (cell + 1) * SURFEL_MAX_RADIUS;
+bool surfel_cellintersects(Surfel surfel, ivec3 cell, uint cascade, vec3 campos)
+{
+	if (!surfel_cellvalid(cell, cascade, campos)){
+		return false;
+    }
 
-	vec3 gridmin = cell - SURFEL_GRID_DIMENSIONS / 2 * SURFEL_MAX_RADIUS + floor(campos);
-	vec3 gridmax = (cell + 1) - SURFEL_GRID_DIMENSIONS / 2 * SURFEL_MAX_RADIUS + floor(campos);
+	float cellsize = surfel_cascade_cellsize(cascade);
+	vec3 gridmin = vec3(cell) * cellsize;
+	vec3 gridmax = vec3(cell + 1) * cellsize;
 
 	vec3 closestPointInAabb = min(max(surfel.position, gridmin), gridmax);
 	float dist = distance(closestPointInAabb, surfel.position);
-	if (dist < SURFEL_MAX_RADIUS){
+	if (dist < surfel.radius){
 		return true;
 	}
 	return false;
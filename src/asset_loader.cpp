@@ -0,0 +1,360 @@
+#include "asset_loader.h"
+
+#include "vk_engine.h"
+#include "vk_initializers.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+//------------------------------------------------------------------- UploadQueue
+
+void UploadQueue::init(VkDeviceSize size)
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+
+	VkSemaphoreTypeCreateInfo timelineInfo{};
+	timelineInfo.sType			= VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	timelineInfo.semaphoreType	= VK_SEMAPHORE_TYPE_TIMELINE;
+	timelineInfo.initialValue	= 0;
+
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreInfo.pNext = &timelineInfo;
+	VK_CHECK(vkCreateSemaphore(engine->_device, &semaphoreInfo, nullptr, &_timeline));
+
+	VkCommandPoolCreateInfo poolInfo = vkinit::command_pool_create_info(engine->_graphicsQueueFamily, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
+	VK_CHECK(vkCreateCommandPool(engine->_device, &poolInfo, nullptr, &_commandPool));
+
+	_ring.init(this, size);
+}
+
+void UploadQueue::cleanup()
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+
+	submit();
+	wait(_submitted);
+	_ring.cleanup();
+
+	vkDestroyCommandPool(engine->_device, _commandPool, nullptr);
+	vkDestroySemaphore(engine->_device, _timeline, nullptr);
+}
+
+uint8_t* UploadQueue::map(uint64_t size)
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+	engine->create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, _buffer, false);
+
+	void* data;
+	vmaMapMemory(engine->_allocator, _buffer._allocation, &data);
+	return static_cast<uint8_t*>(data);
+}
+
+void UploadQueue::unmap()
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+	vmaUnmapMemory(engine->_allocator, _buffer._allocation);
+	vmaDestroyBuffer(engine->_allocator, _buffer._buffer, _buffer._allocation);
+}
+
+VkCommandBuffer UploadQueue::command_buffer()
+{
+	if (_cmd)
+		return _cmd;
+
+	if (_freeCommandBuffers.empty())
+	{
+		VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_commandPool, 1);
+		VK_CHECK(vkAllocateCommandBuffers(VulkanEngine::engine->_device, &allocInfo, &_cmd));
+	}
+	else
+	{
+		_cmd = _freeCommandBuffers.back();
+		_freeCommandBuffers.pop_back();
+		vkResetCommandBuffer(_cmd, 0);
+	}
+
+	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+	VK_CHECK(vkBeginCommandBuffer(_cmd, &beginInfo));
+
+	return _cmd;
+}
+
+StagingAllocation UploadQueue::allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+	StagingAllocation allocation;
+	command_buffer();
+	if (!_ring.allocate(size, alignment, allocation))
+	{
+		// The batch being recorded holds the space, send it and try again
+		submit();
+		command_buffer();
+		if (!_ring.allocate(size, alignment, allocation))
+		{
+			std::cout << "Upload of " << size << " bytes does not fit the staging ring" << std::endl;
+			abort();
+		}
+	}
+	return allocation;
+}
+
+void UploadQueue::copy_buffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset)
+{
+	const uint8_t* src = static_cast<const uint8_t*>(data);
+	for (VkDeviceSize done = 0; done < size; )
+	{
+		const VkDeviceSize bytes = std::min(size - done, UPLOAD_CHUNK_SIZE);
+		const StagingAllocation staging = allocate(bytes, UPLOAD_ALIGNMENT);
+		memcpy(staging.data, src + done, static_cast<size_t>(bytes));
+
+		VkBufferCopy copy;
+		copy.srcOffset	= staging.offset;
+		copy.dstOffset	= dstOffset + done;
+		copy.size		= bytes;
+		vkCmdCopyBuffer(_cmd, _buffer._buffer, dst, 1, &copy);
+
+		done += bytes;
+	}
+}
+
+void UploadQueue::wait_for_readers()
+{
+	vkCmdPipelineBarrier(command_buffer(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+void UploadQueue::copy_image(const void* texels, VkExtent3D extent, uint32_t texelSize, VkImage image)
+{
+	VkImageSubresourceRange range;
+	range.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
+	range.baseMipLevel		= 0;
+	range.levelCount		= 1;
+	range.baseArrayLayer	= 0;
+	range.layerCount		= 1;
+
+	VkImageMemoryBarrier toTransfer = {};
+	toTransfer.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	toTransfer.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
+	toTransfer.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	toTransfer.srcQueueFamilyIndex	= VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.dstQueueFamilyIndex	= VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.image				= image;
+	toTransfer.subresourceRange		= range;
+	toTransfer.srcAccessMask		= 0;
+	toTransfer.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
+
+	vkCmdPipelineBarrier(command_buffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &toTransfer);
+
+	// Big images go up in bands of rows so a single copy never needs the whole ring
+	const VkDeviceSize rowSize = static_cast<VkDeviceSize>(extent.width) * texelSize;
+	const uint32_t bandRows = static_cast<uint32_t>(std::max<VkDeviceSize>(UPLOAD_CHUNK_SIZE / rowSize, 1));
+	const uint8_t* src = static_cast<const uint8_t*>(texels);
+
+	for (uint32_t y = 0; y < extent.height; y += bandRows)
+	{
+		const uint32_t rows = std::min(bandRows, extent.height - y);
+		const VkDeviceSize bytes = rowSize * rows;
+
+		// bufferOffset has to be a multiple of the texel size, which is not always a power of two
+		const StagingAllocation staging = allocate(bytes, texelSize);
+		memcpy(staging.data, src + rowSize * y, static_cast<size_t>(bytes));
+
+		VkBufferImageCopy copyRegion = {};
+		copyRegion.bufferOffset						= staging.offset;
+		copyRegion.imageSubresource.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegion.imageSubresource.mipLevel		= 0;
+		copyRegion.imageSubresource.baseArrayLayer	= 0;
+		copyRegion.imageSubresource.layerCount		= 1;
+		copyRegion.imageOffset						= { 0, static_cast<int32_t>(y), 0 };
+		copyRegion.imageExtent						= { extent.width, rows, 1 };
+
+		vkCmdCopyBufferToImage(_cmd, _buffer._buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+	}
+
+	VkImageMemoryBarrier toReadable = toTransfer;
+	toReadable.oldLayout		= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	toReadable.newLayout		= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	toReadable.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+	toReadable.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
+
+	vkCmdPipelineBarrier(command_buffer(), VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &toReadable);
+}
+
+uint64_t UploadQueue::submit()
+{
+	if (!_cmd)
+		return _submitted;
+
+	// Make every copy of the batch visible to whatever is submitted after it
+	VkMemoryBarrier barrier{};
+	barrier.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask	= VK_ACCESS_MEMORY_READ_BIT;
+	vkCmdPipelineBarrier(_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	VK_CHECK(vkEndCommandBuffer(_cmd));
+
+	const uint64_t ticket = ++_submitted;
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType						= VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.signalSemaphoreValueCount	= 1;
+	timelineInfo.pSignalSemaphoreValues		= &ticket;
+
+	VkSubmitInfo submitInfo = vkinit::submit_info(&_cmd);
+	submitInfo.pNext				= &timelineInfo;
+	submitInfo.signalSemaphoreCount	= 1;
+	submitInfo.pSignalSemaphores	= &_timeline;
+
+	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE));
+
+	_inFlight.push_back({ _cmd, ticket });
+	_ring.fence(ticket);
+	_cmd = VK_NULL_HANDLE;
+
+	return ticket;
+}
+
+uint64_t UploadQueue::completed()
+{
+	uint64_t value = 0;
+	vkGetSemaphoreCounterValue(VulkanEngine::engine->_device, _timeline, &value);
+	return value;
+}
+
+void UploadQueue::wait(uint64_t ticket)
+{
+	VkSemaphoreWaitInfo waitInfo{};
+	waitInfo.sType			= VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount	= 1;
+	waitInfo.pSemaphores	= &_timeline;
+	waitInfo.pValues		= &ticket;
+	VK_CHECK(vkWaitSemaphores(VulkanEngine::engine->_device, &waitInfo, UINT64_MAX));
+
+	retire();
+}
+
+void UploadQueue::retire()
+{
+	const uint64_t done = completed();
+	while (!_inFlight.empty() && _inFlight.front().ticket <= done)
+	{
+		_freeCommandBuffers.push_back(_inFlight.front().cmd);
+		_inFlight.pop_front();
+	}
+	_ring.retire();
+}
+
+//------------------------------------------------------------------- AssetLoader
+
+AssetLoader& AssetLoader::get()
+{
+	static AssetLoader loader;
+	return loader;
+}
+
+void AssetLoader::init()
+{
+	_queue.init(UPLOAD_RING_SIZE);
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		wait_idle();
+		_queue.cleanup();
+		});
+}
+
+void AssetLoader::load(std::function<void()>&& decode, std::function<void(UploadQueue&)>&& record, std::function<void()>&& resident)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_decoding++;
+	}
+
+	Decoded job{ std::move(record), std::move(resident) };
+	std::function<void()> work = std::move(decode);
+
+	ThreadPool::get().enqueue([this, job, work]() {
+		work();
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_decoded.push_back(job);
+		_decoding--;
+		_condition.notify_all();
+		});
+}
+
+void AssetLoader::upload(std::function<void(UploadQueue&)>&& record, std::function<void()>&& resident)
+{
+	record(_queue);
+	_recorded.push_back(std::move(resident));
+}
+
+void AssetLoader::update()
+{
+	std::vector<Decoded> decoded;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		decoded.swap(_decoded);
+	}
+
+	for (Decoded& job : decoded)
+	{
+		job.record(_queue);
+		_recorded.push_back(std::move(job.resident));
+	}
+
+	flush();
+	_queue.retire();
+
+	const uint64_t done = _queue.completed();
+	while (!_pending.empty() && _pending.front().ticket <= done)
+	{
+		_pending.front().resident();
+		_pending.pop_front();
+	}
+}
+
+void AssetLoader::flush()
+{
+	if (_recorded.empty() && !_queue.recording())
+		return;
+
+	const uint64_t ticket = _queue.submit();
+	for (std::function<void()>& resident : _recorded)
+		_pending.push_back({ ticket, std::move(resident) });
+	_recorded.clear();
+}
+
+bool AssetLoader::idle()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _decoding == 0 && _decoded.empty() && _recorded.empty() && _pending.empty();
+}
+
+void AssetLoader::wait(const std::function<bool()>& done)
+{
+	// Stops early if nothing is left in flight that could make done true
+	update();
+	while (!done() && !idle())
+	{
+		if (!_pending.empty())
+		{
+			_queue.wait(_pending.front().ticket);
+		}
+		else
+		{
+			// Nothing on the GPU yet, sleep until a worker hands something over
+			std::unique_lock<std::mutex> lock(_mutex);
+			_condition.wait_for(lock, std::chrono::milliseconds(1), [this]() { return !_decoded.empty() || _decoding == 0; });
+		}
+		update();
+	}
+}
+
+void AssetLoader::wait_idle()
+{
+	wait([this]() { return idle(); });
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include "staging_ring.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+static const VkDeviceSize UPLOAD_RING_SIZE	= 64 * 1024 * 1024;
+static const VkDeviceSize UPLOAD_CHUNK_SIZE	= UPLOAD_RING_SIZE / 4;		// largest single copy, bigger ones are split
+static const VkDeviceSize UPLOAD_ALIGNMENT	= 16;
+
+// Records buffer and image copies out of a StagingRing into one command buffer per batch.
+// Batches signal a timeline semaphore, which is also what the ring fences its regions with.
+class UploadQueue : public StagingAllocator
+{
+public:
+	void init(VkDeviceSize size);
+	void cleanup();
+
+	// StagingAllocator, the ring lives in a persistently mapped CPU_ONLY buffer
+	uint8_t* map(uint64_t size) override;
+	void unmap() override;
+	uint64_t completed() override;
+	void wait(uint64_t ticket) override;
+
+	void copy_buffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset = 0);
+
+	// Makes the copies recorded after it wait for the work submitted before the batch, for
+	// buffers that frames still in flight may be reading
+	void wait_for_readers();
+
+	// Copies tightly packed texels into mip 0 of image and leaves it in SHADER_READ_ONLY_OPTIMAL
+	void copy_image(const void* texels, VkExtent3D extent, uint32_t texelSize, VkImage image);
+
+	// Submits the copies recorded so far, returns the timeline value that signals they are done
+	uint64_t submit();
+
+	bool recording() const { return _cmd != VK_NULL_HANDLE; }
+
+	// Recycles the command buffers and ring space of finished batches
+	void retire();
+
+	const StagingStats& stats() const { return _ring.stats(); }
+	uint64_t batches() const { return _submitted; }
+
+private:
+	struct Batch
+	{
+		VkCommandBuffer	cmd;
+		uint64_t		ticket;
+	};
+
+	VkSemaphore					_timeline{ VK_NULL_HANDLE };
+	VkCommandPool				_commandPool{ VK_NULL_HANDLE };
+	AllocatedBuffer				_buffer;
+	StagingRing					_ring;
+	uint64_t					_submitted{ 0 };
+
+	VkCommandBuffer				_cmd{ VK_NULL_HANDLE };
+	std::deque<Batch>			_inFlight;
+	std::vector<VkCommandBuffer> _freeCommandBuffers;
+
+	VkCommandBuffer command_buffer();
+	StagingAllocation allocate(VkDeviceSize size, VkDeviceSize alignment);
+};
+
+// Streams assets in. Decode jobs (file reads, image/mesh decoding) run on the ThreadPool,
+// their GPU copies are recorded and submitted as one batch per update() on the main thread.
+class AssetLoader
+{
+public:
+	static AssetLoader& get();
+
+	void init();
+
+	// decode runs on a worker thread, record then runs on the main thread to create the
+	// GPU resources and record their copies, and resident once those copies are done
+	void load(std::function<void()>&& decode, std::function<void(UploadQueue&)>&& record, std::function<void()>&& resident);
+
+	// Same as load for data that is already in memory, records right away. Main thread only.
+	void upload(std::function<void(UploadQueue&)>&& record, std::function<void()>&& resident);
+
+	// Records the decoded assets, submits the batch and runs the callbacks of the finished ones.
+	// Main thread only, called once per frame.
+	void update();
+
+	// Submits what has been recorded so later work on the graphics queue sees it
+	void flush();
+
+	// Updates until done returns true
+	void wait(const std::function<bool()>& done);
+
+	// Updates until every requested asset is resident
+	void wait_idle();
+
+	const UploadQueue& queue() const { return _queue; }
+
+private:
+	struct Decoded
+	{
+		std::function<void(UploadQueue&)>	record;
+		std::function<void()>				resident;
+	};
+
+	struct Pending
+	{
+		uint64_t				ticket;
+		std::function<void()>	resident;
+	};
+
+	UploadQueue							_queue;
+
+	std::mutex							_mutex;
+	std::condition_variable				_condition;
+	std::vector<Decoded>				_decoded;		// guarded by _mutex
+	size_t								_decoding{ 0 };	// guarded by _mutex
+
+	std::vector<std::function<void()>>	_recorded;		// resident callbacks of the open batch
+	std::deque<Pending>					_pending;
+
+	bool idle();
+};
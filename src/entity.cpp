@@ -38,5 +38,5 @@ void Light::update()
 }
 
 void Light::setColor(glm::vec3 color) {
-	color = color;
+	this->color = color;
 }
\ No newline at end of file
@@ -0,0 +1,72 @@
+#include "frame_uniforms.h"
+#include "vk_engine.h"
+
+#include <algorithm>
+
+void FrameUniforms::reserve(FrameBlock block, VkDeviceSize size)
+{
+	_blockSize[block] = size;
+}
+
+void FrameUniforms::init(uint32_t frames)
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+
+	_blockSize[FRAME_CAMERA]			= sizeof(GPUCameraData);
+	_blockSize[FRAME_RT_CAMERA]			= sizeof(RTCameraData);
+	_blockSize[FRAME_CAMERA_POSITION]	= sizeof(glm::vec3);
+	_blockSize[FRAME_COUNT]				= sizeof(int);
+	_blockSize[FRAME_DEBUG]				= sizeof(uint32_t);
+	_blockSize[FRAME_SKYBOX]			= sizeof(glm::mat4);
+	_blockSize[FRAME_LIGHTS]			= std::max<VkDeviceSize>(_blockSize[FRAME_LIGHTS], 16);
+	_blockSize[FRAME_LIGHT_CLUSTERS]	= std::max<VkDeviceSize>(_blockSize[FRAME_LIGHT_CLUSTERS], 16);
+
+	// Every block starts at both the uniform and storage offset alignments, so does every slice
+	const VkDeviceSize alignment = std::max(engine->_gpuProperties.limits.minUniformBufferOffsetAlignment, engine->_gpuProperties.limits.minStorageBufferOffsetAlignment);
+	_sliceSize = 0;
+	for (uint32_t i = 0; i < FRAME_BLOCK_COUNT; i++)
+	{
+		_blockOffset[i] = _sliceSize;
+		_sliceSize += (_blockSize[i] + alignment - 1) / alignment * alignment;
+	}
+
+	engine->create_buffer(_sliceSize * frames, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _buffer, false);
+
+	void* data;
+	vmaMapMemory(engine->_allocator, _buffer._allocation, &data);
+	_mapped = static_cast<uint8_t*>(data);
+	memset(_mapped, 0, static_cast<size_t>(_sliceSize * frames));
+
+	_offsets.resize(frames);
+	for (uint32_t frame = 0; frame < frames; frame++)
+		_offsets[frame].fill(static_cast<uint32_t>(_sliceSize * frame));
+}
+
+void FrameUniforms::cleanup()
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+	vmaUnmapMemory(engine->_allocator, _buffer._allocation);
+	vmaDestroyBuffer(engine->_allocator, _buffer._buffer, _buffer._allocation);
+	_mapped = nullptr;
+}
+
+void FrameUniforms::write(uint32_t frame, FrameBlock block, const void* data, size_t size)
+{
+	memcpy(_mapped + _sliceSize * frame + _blockOffset[block], data, std::min(size, static_cast<size_t>(_blockSize[block])));
+}
+
+void FrameUniforms::write(uint32_t frame, FrameBlock block, VkDeviceSize offset, const void* data, size_t size)
+{
+	if (offset >= _blockSize[block])
+		return;
+	memcpy(_mapped + _sliceSize * frame + _blockOffset[block] + offset, data, std::min(size, static_cast<size_t>(_blockSize[block] - offset)));
+}
+
+VkDescriptorBufferInfo FrameUniforms::descriptor(FrameBlock block) const
+{
+	VkDescriptorBufferInfo info;
+	info.buffer	= _buffer._buffer;
+	info.offset	= _blockOffset[block];
+	info.range	= _blockSize[block];
+	return info;
+}
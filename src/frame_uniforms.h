@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vk_types.h>
+
+// Blocks of the per frame constants, one aligned range each inside a slice
+enum FrameBlock
+{
+	FRAME_CAMERA,				// GPUCameraData
+	FRAME_RT_CAMERA,			// RTCameraData
+	FRAME_CAMERA_POSITION,		// vec3
+	FRAME_COUNT,				// int, frames accumulated by the denoiser
+	FRAME_DEBUG,				// uint, debug target
+	FRAME_SKYBOX,				// mat4, sphere following the camera
+	FRAME_LIGHTS,				// GPULight[], storage, kept up to date by LightBuffer
+	FRAME_LIGHT_CLUSTERS,		// GPULightClusterInfo, cells and index list, storage, built by LightClusters
+	FRAME_BLOCK_COUNT
+};
+
+// Scene and frame constants of every frame in flight in one persistently mapped buffer.
+// Each frame writes its own slice once, descriptors are UNIFORM_BUFFER_DYNAMIC (STORAGE_BUFFER_DYNAMIC
+// for the lights) and point at the block inside the first slice, the slice is picked with the dynamic offset.
+class FrameUniforms
+{
+public:
+	// Sets the size of a block that depends on the scene, call before init
+	void reserve(FrameBlock block, VkDeviceSize size);
+
+	void init(uint32_t frames);
+	void cleanup();
+
+	void write(uint32_t frame, FrameBlock block, const void* data, size_t size);
+
+	// Writes a range inside the block, for blocks that are only partially updated
+	void write(uint32_t frame, FrameBlock block, VkDeviceSize offset, const void* data, size_t size);
+
+	template<typename T>
+	void write(uint32_t frame, FrameBlock block, const T& data) { write(frame, block, &data, sizeof(T)); }
+
+	VkDescriptorBufferInfo descriptor(FrameBlock block) const;
+
+	// Dynamic offsets of a frame, every dynamic binding of a set takes the same one
+	const uint32_t* offsets(uint32_t frame) const { return _offsets[frame].data(); }
+
+	VkBuffer buffer() const { return _buffer._buffer; }
+	VkDeviceSize slice_size() const { return _sliceSize; }
+
+private:
+	AllocatedBuffer				_buffer;
+	uint8_t*					_mapped{ nullptr };
+	VkDeviceSize				_sliceSize{ 0 };
+	VkDeviceSize				_blockOffset[FRAME_BLOCK_COUNT]{};
+	VkDeviceSize				_blockSize[FRAME_BLOCK_COUNT]{};
+	std::vector<std::array<uint32_t, FRAME_BLOCK_COUNT>>	_offsets;
+};
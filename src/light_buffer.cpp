@@ -0,0 +1,67 @@
+#include "light_buffer.h"
+#include "entity.h"
+
+#include <glm/glm/gtc/packing.hpp>
+
+#include <cassert>
+
+static GPULight pack_light(const Light& light)
+{
+	GPULight packed;
+	packed.position		= glm::vec4(light.position, light.type == DIRECTIONAL_LIGHT ? -1.0f : light.maxDistance);
+	packed.color[0]		= glm::packHalf2x16(glm::vec2(light.color.x, light.color.y));
+	packed.color[1]		= glm::packHalf2x16(glm::vec2(light.color.z, 0.0f));
+	packed.intensity	= light.intensity;
+	packed.radius		= light.radius;
+	return packed;
+}
+
+void LightBuffer::init(uint32_t frames, size_t count)
+{
+	assert(frames <= 8 && "LightBuffer keeps one dirty bit per frame in a byte");
+
+	_allFrames = static_cast<uint8_t>((1u << frames) - 1);
+	_packed.assign(count, GPULight{});
+	_dirty.assign(count, _allFrames);
+}
+
+void LightBuffer::update(const std::vector<Light*>& lights)
+{
+	const size_t count = std::min(lights.size(), _packed.size());
+	for (size_t i = 0; i < count; i++)
+	{
+		const GPULight packed = pack_light(*lights[i]);
+		if (memcmp(&packed, &_packed[i], sizeof(GPULight)) != 0)
+		{
+			_packed[i] = packed;
+			_dirty[i] = _allFrames;
+		}
+	}
+}
+
+void LightBuffer::mark_dirty(size_t index)
+{
+	if (index < _dirty.size())
+		_dirty[index] = _allFrames;
+}
+
+void LightBuffer::upload(uint32_t frame, FrameUniforms& uniforms)
+{
+	const uint8_t bit = static_cast<uint8_t>(1u << frame);
+
+	size_t i = 0;
+	while (i < _dirty.size())
+	{
+		if (!(_dirty[i] & bit))
+		{
+			i++;
+			continue;
+		}
+
+		const size_t first = i;
+		while (i < _dirty.size() && (_dirty[i] & bit))
+			_dirty[i++] &= ~bit;
+
+		uniforms.write(frame, FRAME_LIGHTS, sizeof(GPULight) * first, &_packed[first], sizeof(GPULight) * (i - first));
+	}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include "frame_uniforms.h"
+
+class Light;
+
+// Light as the shaders read it, PackedLight in helpers.glsl and deferred.frag
+struct GPULight
+{
+	glm::vec4	position;	// w used for maxDistance, < 0 for directional lights
+	uint32_t	color[2];	// rgb as half floats, the last half is unused
+	float		intensity;
+	float		radius;		// the radius of sphere light for soft shadows purpose
+};
+static_assert(sizeof(GPULight) == 32, "GPULight must match PackedLight in the shaders");
+
+// Packs the scene lights into the FRAME_LIGHTS block of FrameUniforms.
+// Every light keeps one dirty bit per frame in flight, a light that changes is written
+// once into each slice and untouched lights are never copied again.
+class LightBuffer
+{
+public:
+	void init(uint32_t frames, size_t count);
+
+	// Repacks the lights and flags the ones whose record changed
+	void update(const std::vector<Light*>& lights);
+
+	// Flags a light as changed even if its record did not
+	void mark_dirty(size_t index);
+
+	// Copies the dirty lights of a frame into its slice, runs of dirty lights go in one write
+	void upload(uint32_t frame, FrameUniforms& uniforms);
+
+	const std::vector<GPULight>& records() const { return _packed; }
+	size_t size() const { return _packed.size(); }
+	VkDeviceSize bytes() const { return sizeof(GPULight) * _packed.size(); }
+
+private:
+	std::vector<GPULight>	_packed;
+	std::vector<uint8_t>	_dirty;			// bit per frame in flight
+	uint8_t					_allFrames{ 0 };
+};
@@ -0,0 +1,289 @@
+#include "light_clusters.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+void LightClusters::init(size_t lights)
+{
+	_capacity = std::min<size_t>(lights, LIGHT_CLUSTER_AVERAGE) * LIGHT_CLUSTER_COUNT + lights;
+	_cells.assign(LIGHT_CLUSTER_COUNT, glm::uvec2(0));
+	_indices.reserve(_capacity);
+	_ranges.reserve(lights);
+	_info = GPULightClusterInfo();
+}
+
+uint32_t LightClusters::slice(float depth) const
+{
+	const float z = std::log(std::max(depth, _info.depth.x) / _info.depth.x) * _info.depth.z;
+	return std::min(static_cast<uint32_t>(z), LIGHT_CLUSTER_Z - 1);
+}
+
+bool LightClusters::light_range(const GPULight& light, Range& range) const
+{
+	const float near	= _info.depth.x;
+	const float far		= _info.depth.y;
+	const float radius	= light.position.w;
+
+	const glm::vec3 center = glm::vec3(_info.view * glm::vec4(glm::vec3(light.position), 1.0f));
+
+	// View space looks down -z, clip the sphere bounds against the depth range
+	float front = -center.z - radius;
+	float back	= -center.z + radius;
+	if (back < near || front > far)
+		return false;
+	front	= std::max(front, near);
+	back	= std::min(back, far);
+
+	// x / depth is monotonic inside the box, so its projected corners bound the sphere on screen
+	glm::vec2 uvMin(std::numeric_limits<float>::max()), uvMax(-std::numeric_limits<float>::max());
+	for (int i = 0; i < 8; i++)
+	{
+		const glm::vec4 corner(
+			center.x + ((i & 1) ? radius : -radius),
+			center.y + ((i & 2) ? radius : -radius),
+			(i & 4) ? -back : -front,
+			1.0f);
+		const glm::vec4 clip = _info.projection * corner;
+		const glm::vec2 uv = glm::vec2(clip) / clip.w * 0.5f + 0.5f;
+		uvMin = glm::min(uvMin, uv);
+		uvMax = glm::max(uvMax, uv);
+	}
+	if (uvMax.x < 0.0f || uvMax.y < 0.0f || uvMin.x > 1.0f || uvMin.y > 1.0f)
+		return false;
+
+	const glm::vec2 tiles(LIGHT_CLUSTER_X, LIGHT_CLUSTER_Y);
+	const glm::uvec2 first	= glm::uvec2(glm::clamp(uvMin * tiles, glm::vec2(0.0f), tiles - 1.0f));
+	const glm::uvec2 last	= glm::uvec2(glm::clamp(uvMax * tiles, glm::vec2(0.0f), tiles - 1.0f));
+
+	range.min = glm::uvec3(first, slice(front));
+	range.max = glm::uvec3(last, slice(back));
+	return true;
+}
+
+void LightClusters::build(const std::vector<GPULight>& lights, const glm::mat4& view, const glm::mat4& projection, float near, float far)
+{
+	_info.view			= view;
+	_info.projection	= projection;
+	_info.depth			= glm::vec4(near, far, LIGHT_CLUSTER_Z / std::log(far / near), 0.0f);
+
+	_indices.clear();
+	_ranges.clear();
+	_overflow = false;
+	std::fill(_cells.begin(), _cells.end(), glm::uvec2(0));
+
+	// Directional lights reach every cluster, they go first and are not binned
+	for (uint32_t i = 0; i < lights.size(); i++)
+	{
+		if (lights[i].position.w < 0)
+			_indices.push_back(i);
+	}
+	const uint32_t global = static_cast<uint32_t>(_indices.size());
+	_info.dims = glm::uvec4(LIGHT_CLUSTER_X, LIGHT_CLUSTER_Y, LIGHT_CLUSTER_Z, global);
+
+	// Count, prefix sum, fill. The ranges are kept so the lights are projected once
+	for (uint32_t i = 0; i < lights.size(); i++)
+	{
+		Range range;
+		if (lights[i].position.w < 0 || !light_range(lights[i], range))
+			continue;
+
+		range.light = i;
+		_ranges.push_back(range);
+		for (uint32_t z = range.min.z; z <= range.max.z; z++)
+			for (uint32_t y = range.min.y; y <= range.max.y; y++)
+				for (uint32_t x = range.min.x; x <= range.max.x; x++)
+					_cells[x + LIGHT_CLUSTER_X * (y + LIGHT_CLUSTER_Y * z)].y++;
+	}
+
+	// Clusters that do not fit in the index list lose their last lights
+	size_t offset = global;
+	for (glm::uvec2& cell : _cells)
+	{
+		const size_t count = std::min<size_t>(cell.y, _capacity - std::min(offset, _capacity));
+		_overflow |= count < cell.y;
+		cell = glm::uvec2(static_cast<uint32_t>(offset), 0);
+		offset += count;
+	}
+	_indices.resize(std::min(offset, _capacity));
+
+	for (const Range& range : _ranges)
+	{
+		for (uint32_t z = range.min.z; z <= range.max.z; z++)
+			for (uint32_t y = range.min.y; y <= range.max.y; y++)
+				for (uint32_t x = range.min.x; x <= range.max.x; x++)
+				{
+					const uint32_t c = x + LIGHT_CLUSTER_X * (y + LIGHT_CLUSTER_Y * z);
+					glm::uvec2& cell = _cells[c];
+					const uint32_t end = (c + 1 < LIGHT_CLUSTER_COUNT) ? _cells[c + 1].x : static_cast<uint32_t>(_indices.size());
+					if (cell.x + cell.y < end)
+						_indices[cell.x + cell.y++] = range.light;
+				}
+	}
+}
+
+uint32_t LightClusters::cluster(const glm::vec3& position) const
+{
+	const glm::vec4 viewPosition	= _info.view * glm::vec4(position, 1.0f);
+	const glm::vec4 clip			= _info.projection * viewPosition;
+	const glm::vec2 uv				= glm::vec2(clip) / clip.w * 0.5f + 0.5f;
+
+	const glm::vec2 tiles(LIGHT_CLUSTER_X, LIGHT_CLUSTER_Y);
+	const glm::uvec2 tile = glm::uvec2(glm::clamp(uv * tiles, glm::vec2(0.0f), tiles - 1.0f));
+
+	return tile.x + LIGHT_CLUSTER_X * (tile.y + LIGHT_CLUSTER_Y * slice(-viewPosition.z));
+}
+
+void LightClusters::upload(uint32_t frame, FrameUniforms& uniforms) const
+{
+	const VkDeviceSize cells = sizeof(GPULightClusterInfo);
+	const VkDeviceSize indices = cells + sizeof(glm::uvec2) * LIGHT_CLUSTER_COUNT;
+
+	uniforms.write(frame, FRAME_LIGHT_CLUSTERS, 0, &_info, sizeof(GPULightClusterInfo));
+	uniforms.write(frame, FRAME_LIGHT_CLUSTERS, cells, _cells.data(), sizeof(glm::uvec2) * _cells.size());
+	if (!_indices.empty())
+		uniforms.write(frame, FRAME_LIGHT_CLUSTERS, indices, _indices.data(), sizeof(uint32_t) * _indices.size());
+}
+
+static GPULight point_light(const glm::vec3& position, float maxDistance)
+{
+	GPULight light = {};
+	light.position = glm::vec4(position, maxDistance);
+	return light;
+}
+
+// Offsets and counts that stay inside the index list and never overlap, each positional light once per cluster
+static bool cells_valid(const LightClusters& clusters, const std::vector<GPULight>& lights)
+{
+	uint32_t next = clusters.info().dims.w;
+	for (uint32_t c = 0; c < LIGHT_CLUSTER_COUNT; c++)
+	{
+		const glm::uvec2& cell = clusters.cell(c);
+		if (cell.x < next || cell.x + cell.y > clusters.indices().size())
+			return false;
+		next = cell.x + cell.y;
+
+		std::vector<uint32_t> binned(clusters.indices().begin() + cell.x, clusters.indices().begin() + cell.x + cell.y);
+		std::sort(binned.begin(), binned.end());
+		if (std::adjacent_find(binned.begin(), binned.end()) != binned.end() || (!binned.empty() && binned.back() >= lights.size()))
+			return false;
+		for (uint32_t light : binned)
+		{
+			if (lights[light].position.w < 0.0f)
+				return false;
+		}
+	}
+	return true;
+}
+
+int light_cluster_check()
+{
+	const float near	= 0.1f;
+	const float far		= 200.0f;
+	const glm::vec3 eye	= glm::vec3(1.0f, 2.0f, 3.0f);
+
+	// A camera without rotation, so view space positions only need eye added to be in world space
+	const glm::mat4 view		= glm::translate(glm::mat4(1.0f), -eye);
+	const glm::mat4 projection	= glm::perspective(glm::radians(70.0f), 1712.f / 912.f, near, far);
+
+	std::vector<GPULight> lights;
+	lights.push_back(point_light(eye + glm::vec3(0.0f, 0.0f, -0.05f), 0.5f));		// straddles the near plane
+	lights.push_back(point_light(eye + glm::vec3(0.0f, 0.0f, 0.3f), 1.0f));			// behind the camera, reaching in front of it
+	lights.push_back(point_light(eye + glm::vec3(0.0f, 0.0f, 5.0f), 1.0f));			// behind the camera
+	lights.push_back(point_light(eye + glm::vec3(100.0f, 0.0f, -10.0f), 2.0f));		// off screen
+	lights.push_back(point_light(eye + glm::vec3(-14.0f, 3.0f, -10.0f), 2.0f));		// across the left edge of the screen
+	lights.push_back(point_light(eye + glm::vec3(2.0f, -1.0f, -198.0f), 5.0f));		// straddles the far plane
+	lights.push_back(point_light(glm::vec3(0.0f), -1.0f));							// directional
+	for (uint32_t i = 0; i < 24; i++)
+	{
+		// Spread over the whole depth range and the screen
+		const float depth = near * std::pow(far / near, (i + 0.5f) / 24.0f);
+		const float x = std::sin(i * 2.4f) * depth * 0.6f;
+		const float y = std::cos(i * 1.7f) * depth * 0.3f;
+		lights.push_back(point_light(eye + glm::vec3(x, y, -depth), 0.2f + depth * 0.1f * (i % 3)));
+	}
+
+	LightClusters clusters;
+	clusters.init(lights.size());
+	clusters.build(lights, view, projection, near, far);
+
+	uint32_t failed = 0;
+	auto expect = [&](bool condition, const char* what) {
+		if (!condition)
+		{
+			std::cout << "Light clusters: " << what << " FAILED" << std::endl;
+			failed++;
+		}
+	};
+
+	expect(!clusters.overflowed() && cells_valid(clusters, lights), "cells");
+	expect(clusters.info().dims.w == 1 && clusters.indices()[0] == 6, "directional lights");
+
+	// Points inside every cluster, placed in its screen tile and depth slice like the shader does
+	const uint32_t samples = 4;
+	const float slices = LIGHT_CLUSTER_Z / std::log(far / near);
+	uint64_t required = 0, missing = 0, mismatches = 0, offscreen = 0;
+	for (uint32_t z = 0; z < LIGHT_CLUSTER_Z; z++)
+		for (uint32_t y = 0; y < LIGHT_CLUSTER_Y; y++)
+			for (uint32_t x = 0; x < LIGHT_CLUSTER_X; x++)
+			{
+				const uint32_t c = x + LIGHT_CLUSTER_X * (y + LIGHT_CLUSTER_Y * z);
+				const glm::uvec2& cell = clusters.cell(c);
+				std::vector<bool> touched(lights.size(), false);
+
+				for (uint32_t s = 0; s < samples * samples * samples; s++)
+				{
+					const glm::vec3 t = (glm::vec3(glm::uvec3(s % samples, (s / samples) % samples, s / (samples * samples))) + 0.5f) / (float)samples;
+					const glm::vec2 ndc = glm::vec2((x + t.x) / LIGHT_CLUSTER_X, (y + t.y) / LIGHT_CLUSTER_Y) * 2.0f - 1.0f;
+					const float depth = near * std::exp((z + t.z) / slices);
+					const glm::vec3 viewPosition(ndc.x * depth / projection[0][0], ndc.y * depth / projection[1][1], -depth);
+
+					mismatches += clusters.cluster(viewPosition + eye) != c;
+
+					for (size_t l = 0; l < lights.size(); l++)
+					{
+						const glm::vec4& light = lights[l].position;
+						if (light.w >= 0.0f && glm::distance(viewPosition + eye, glm::vec3(light)) < light.w)
+							touched[l] = true;
+					}
+				}
+
+				for (size_t l = 0; l < lights.size(); l++)
+				{
+					if (!touched[l])
+						continue;
+					required++;
+					missing += std::find(clusters.indices().begin() + cell.x, clusters.indices().begin() + cell.x + cell.y, (uint32_t)l) ==
+						clusters.indices().begin() + cell.x + cell.y;
+				}
+
+				for (uint32_t i = cell.x; i < cell.x + cell.y; i++)
+					offscreen += clusters.indices()[i] == 2 || clusters.indices()[i] == 3;
+			}
+
+	expect(mismatches == 0, "cluster() against the binned layout");
+	expect(missing == 0, "lights reaching a cluster binned in it");
+	expect(offscreen == 0, "lights out of the view left out");
+
+	const size_t binned = clusters.indices().size() - clusters.info().dims.w;
+
+	// Every light reaching every cluster overflows an index list sized for LIGHT_CLUSTER_AVERAGE
+	std::vector<GPULight> crowd(LIGHT_CLUSTER_AVERAGE + 8, point_light(eye, far * 2.0f));
+	LightClusters crowded;
+	crowded.init(crowd.size());
+	crowded.build(crowd, view, projection, near, far);
+
+	uint32_t full = 0;
+	for (uint32_t c = 0; c < LIGHT_CLUSTER_COUNT; c++)
+		full += crowded.cell(c).y == crowd.size();
+	expect(crowded.overflowed() && cells_valid(crowded, crowd), "overflowed cells");
+	expect(full > 0 && full < LIGHT_CLUSTER_COUNT && crowded.indices().size() <= (crowded.bytes() - sizeof(GPULightClusterInfo) - sizeof(glm::uvec2) * LIGHT_CLUSTER_COUNT) / sizeof(uint32_t),
+		"overflow keeps the index list in budget");
+
+	std::cout << "Light clusters: " << lights.size() << " lights, " << required << " light-cluster pairs reached, " << binned
+		<< " binned (" << (double)binned / std::max<uint64_t>(required, 1) << "x), overflow kept " << full << " of " << LIGHT_CLUSTER_COUNT
+		<< " clusters whole, " << (failed == 0 ? "all checks passed" : "checks FAILED") << std::endl;
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include "light_buffer.h"
+
+// Must match the constants in deferred.frag
+static const uint32_t LIGHT_CLUSTER_X		= 16;
+static const uint32_t LIGHT_CLUSTER_Y		= 9;
+static const uint32_t LIGHT_CLUSTER_Z		= 24;
+static const uint32_t LIGHT_CLUSTER_COUNT	= LIGHT_CLUSTER_X * LIGHT_CLUSTER_Y * LIGHT_CLUSTER_Z;
+static const uint32_t LIGHT_CLUSTER_AVERAGE	= 32;		// index list entries budgeted per cluster
+
+// Header of the FRAME_LIGHT_CLUSTERS block, followed by the cells and the index list
+struct GPULightClusterInfo
+{
+	glm::mat4	view;
+	glm::mat4	projection;
+	glm::uvec4	dims;		// xyz clusters, w lights lit everywhere (directional), first in the index list
+	glm::vec4	depth;		// near, far, slices / log(far / near)
+};
+
+// Froxel light assignment for the deferred lighting pass. The screen is split in
+// LIGHT_CLUSTER_X x LIGHT_CLUSTER_Y tiles and the view depth in LIGHT_CLUSTER_Z exponential
+// slices, every cluster gets an offset and count into one compact index list.
+// Built on the CPU from the packed lights, nothing here touches Vulkan but upload().
+class LightClusters
+{
+public:
+	void init(size_t lights);
+
+	void build(const std::vector<GPULight>& lights, const glm::mat4& view, const glm::mat4& projection, float near, float far);
+
+	// Writes the header, cells and the used part of the index list into the frame slice
+	void upload(uint32_t frame, FrameUniforms& uniforms) const;
+
+	// Cluster of a world space position, the same math as deferred.frag
+	uint32_t cluster(const glm::vec3& position) const;
+
+	// Offset and count into indices()
+	const glm::uvec2& cell(uint32_t cluster) const { return _cells[cluster]; }
+	const std::vector<uint32_t>& indices() const { return _indices; }
+	const GPULightClusterInfo& info() const { return _info; }
+
+	// True if the last build dropped lights because the index list was full
+	bool overflowed() const { return _overflow; }
+
+	VkDeviceSize bytes() const { return sizeof(GPULightClusterInfo) + sizeof(glm::uvec2) * LIGHT_CLUSTER_COUNT + sizeof(uint32_t) * _capacity; }
+
+private:
+	struct Range
+	{
+		uint32_t	light;
+		glm::uvec3	min;
+		glm::uvec3	max;
+	};
+
+	GPULightClusterInfo		_info;
+	std::vector<glm::uvec2>	_cells;
+	std::vector<uint32_t>	_indices;
+	std::vector<Range>		_ranges;	// cluster box of every binned light, build scratch
+	size_t					_capacity{ 0 };
+	bool					_overflow{ false };
+
+	uint32_t slice(float depth) const;
+	bool light_range(const GPULight& light, Range& range) const;
+};
+
+// Compares the binning of a synthetic set of lights against a brute force test of every
+// light against every cluster, returns the process exit code
+int light_cluster_check();
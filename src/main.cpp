@@ -1,9 +1,61 @@
 #include "vk_engine.h"
+#include "surfel_reference.h"
+#include "sampling.h"
+#include "vertex_weld.h"
+#include "staging_ring.h"
+#include "render_graph.h"
+#include "light_clusters.h"
+
+#include <cstring>
 
 int main(int argc, char* argv[])
 {
+	// Headless run of the CPU surfel reference: --surfel-bench [width height frames]
+	if (argc > 1 && strcmp(argv[1], "--surfel-bench") == 0)
+	{
+		const uint32_t width	= argc > 2 ? (uint32_t)atoi(argv[2]) : 1712;
+		const uint32_t height	= argc > 3 ? (uint32_t)atoi(argv[3]) : 912;
+		const uint32_t frames	= argc > 4 ? (uint32_t)atoi(argv[4]) : 16;
+		return SurfelReference::benchmark(width, height, frames);
+	}
+
+	// OBJ vertex welding against the old unordered_map path: --weld-bench file.obj [runs]
+	if (argc > 2 && strcmp(argv[1], "--weld-bench") == 0)
+	{
+		const uint32_t runs = argc > 3 ? (uint32_t)atoi(argv[3]) : 3;
+		return weld_benchmark(argv[2], runs);
+	}
+
+	// Equidistribution of the Sobol, R2 and golden ratio sequences: --sampling-check
+	if (argc > 1 && strcmp(argv[1], "--sampling-check") == 0)
+		return sampling_check();
+
+	// Round trip of the packed surfel layouts: --pack-check
+	if (argc > 1 && strcmp(argv[1], "--pack-check") == 0)
+		return surfel_pack_check();
+
+	// Staging ring against a mock allocator: --staging-check
+	if (argc > 1 && strcmp(argv[1], "--staging-check") == 0)
+		return staging_check();
+
+	// Barriers the render graph derives for a synthetic frame: --graph-check
+	if (argc > 1 && strcmp(argv[1], "--graph-check") == 0)
+		return render_graph_check();
+
+	// Light clusters against a brute force test of every light and cluster: --cluster-check
+	if (argc > 1 && strcmp(argv[1], "--cluster-check") == 0)
+		return light_cluster_check();
+
 	VulkanEngine engine;
 
+	// Surfel budget and grid per deployment: --surfel-capacity N --surfel-grid X Y Z --surfel-cell-limit N --surfel-threads N
+	engine._surfelConfig = SurfelConfig::from_args(argc, argv);
+
+	// Per frame surfel counters: --surfel-telemetry file.csv or file.json
+	for (int i = 1; i + 1 < argc; i++)
+		if (strcmp(argv[i], "--surfel-telemetry") == 0)
+			engine._surfelTelemetryPath = argv[i + 1];
+
 	engine.init();
 
 	engine.run();
@@ -11,4 +63,4 @@ int main(int argc, char* argv[])
 	engine.cleanup();
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,89 @@
+#include "mapped_file.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (_data)
+		UnmapViewOfFile(_data);
+	if (_mapping)
+		CloseHandle(_mapping);
+	if (_file)
+		CloseHandle(_file);
+#else
+	if (_data)
+		munmap(const_cast<uint8_t*>(_data), _size);
+	if (_fd >= 0)
+		close(_fd);
+#endif
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path)
+{
+	std::shared_ptr<MappedFile> file(new MappedFile());
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+		return nullptr;
+	file->_file = handle;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0)
+		return nullptr;
+	file->_size = static_cast<size_t>(size.QuadPart);
+
+	file->_mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!file->_mapping)
+		return nullptr;
+
+	file->_data = static_cast<const uint8_t*>(MapViewOfFile(file->_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!file->_data)
+		return nullptr;
+#else
+	file->_fd = ::open(path.c_str(), O_RDONLY);
+	if (file->_fd < 0)
+		return nullptr;
+
+	struct stat st;
+	if (fstat(file->_fd, &st) != 0 || st.st_size == 0)
+		return nullptr;
+	file->_size = static_cast<size_t>(st.st_size);
+
+	void* data = mmap(nullptr, file->_size, PROT_READ, MAP_PRIVATE, file->_fd, 0);
+	if (data == MAP_FAILED)
+		return nullptr;
+	file->_data = static_cast<const uint8_t*>(data);
+#endif
+
+	return file;
+}
+
+bool MappedFile::stamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path.c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (::stat(path.c_str(), &st) != 0)
+		return false;
+#endif
+
+	size = static_cast<uint64_t>(st.st_size);
+	mtime = static_cast<int64_t>(st.st_mtime);
+	return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Read-only view of a whole file mapped into memory
+class MappedFile
+{
+public:
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// Returns nullptr if the file does not exist or cannot be mapped
+	static std::shared_ptr<MappedFile> open(const std::string& path);
+
+	// Size and last write time of a file, false if it does not exist
+	static bool stamp(const std::string& path, uint64_t& size, int64_t& mtime);
+
+	const uint8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+
+private:
+	MappedFile() {}
+
+	const uint8_t*	_data{ nullptr };
+	size_t			_size{ 0 };
+
+#ifdef _WIN32
+	void*			_file{ nullptr };
+	void*			_mapping{ nullptr };
+#else
+	int				_fd{ -1 };
+#endif
+};
@@ -0,0 +1,256 @@
+#include "mesh_cache.h"
+
+#include <cstdio>
+#include <cstring>
+
+static uint64_t align_offset(uint64_t offset)
+{
+	return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+}
+
+static bool section_valid(const MeshCacheSection& s, const size_t elementSize, const uint64_t fileSize)
+{
+	if (s.offset % MESH_CACHE_ALIGNMENT != 0 || s.offset > fileSize)
+		return false;
+	return s.count <= (fileSize - s.offset) / elementSize;
+}
+
+std::string MeshCache::get_path(const std::string& source)
+{
+	return source + ".meshcache";
+}
+
+bool MeshCache::load(const std::string& source, const uint32_t flags)
+{
+	_file.reset();
+	_header = nullptr;
+
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!MappedFile::stamp(source, sourceSize, sourceTime))
+		return false;
+
+	std::shared_ptr<MappedFile> file = MappedFile::open(get_path(source));
+	if (!file || file->size() < sizeof(MeshCacheHeader))
+		return false;
+
+	const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file->data());
+	const uint64_t fileSize = file->size();
+
+	if (header->magic != MESH_CACHE_MAGIC || header->version != MESH_CACHE_VERSION)
+		return false;
+	if (header->vertexStride != sizeof(Vertex) || header->flags != flags || header->fileSize != fileSize)
+		return false;
+	if (header->sourceSize != sourceSize || header->sourceTime != sourceTime)
+		return false;
+
+	if (!section_valid(header->path, 1, fileSize) ||
+		!section_valid(header->vertices, sizeof(Vertex), fileSize) ||
+		!section_valid(header->indices, sizeof(uint32_t), fileSize) ||
+		!section_valid(header->nodes, sizeof(MeshCacheNode), fileSize) ||
+		!section_valid(header->primitives, sizeof(MeshCachePrimitive), fileSize) ||
+		!section_valid(header->materials, sizeof(MeshCacheMaterial), fileSize) ||
+		!section_valid(header->strings, 1, fileSize))
+		return false;
+
+	const char* path = reinterpret_cast<const char*>(file->data() + header->path.offset);
+	if (source.size() != header->path.count || memcmp(path, source.data(), source.size()) != 0)
+		return false;
+
+	// The strings section must end with a terminator so string() can not run past it
+	if (header->strings.count > 0 && file->data()[header->strings.offset + header->strings.count - 1] != '\0')
+		return false;
+
+	_file = file;
+	_header = header;
+
+	// Reject indices that point outside of the tables, a cache written by a
+	// broken import would otherwise only fail once it reaches the GPU
+	const MeshCacheNode* cacheNodes = nodes();
+	for (uint64_t i = 0; i < _header->nodes.count; i++)
+	{
+		const MeshCacheNode& node = cacheNodes[i];
+		if (node.parent >= (int64_t)i || (uint64_t)node.firstPrimitive + node.primitiveCount > _header->primitives.count)
+		{
+			_file.reset();
+			_header = nullptr;
+			return false;
+		}
+	}
+
+	const MeshCachePrimitive* cachePrimitives = primitives();
+	for (uint64_t i = 0; i < _header->primitives.count; i++)
+	{
+		const MeshCachePrimitive& prim = cachePrimitives[i];
+		if (prim.material >= _header->materials.count ||
+			(uint64_t)prim.firstIndex + prim.indexCount > _header->indices.count ||
+			(uint64_t)prim.firstVertex + prim.vertexCount > _header->vertices.count)
+		{
+			_file.reset();
+			_header = nullptr;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const char* MeshCache::string(const uint32_t offset) const
+{
+	if (offset == MESH_CACHE_NO_STRING || offset >= _header->strings.count)
+		return nullptr;
+	return reinterpret_cast<const char*>(_file->data() + _header->strings.offset + offset);
+}
+
+bool MeshCache::write(const std::string& source, const uint32_t flags, const Mesh& mesh, const std::vector<Node*>& roots)
+{
+	MeshCacheHeader header{};
+	header.magic		= MESH_CACHE_MAGIC;
+	header.version		= MESH_CACHE_VERSION;
+	header.vertexStride	= sizeof(Vertex);
+	header.flags		= flags;
+
+	if (!MappedFile::stamp(source, header.sourceSize, header.sourceTime))
+		return false;
+
+	// Flatten the hierarchy, parents first so the loader can link in one pass
+	std::vector<MeshCacheNode>		nodes;
+	std::vector<MeshCachePrimitive>	primitives;
+	std::vector<MeshCacheMaterial>	materials;
+	std::vector<int>				materialIDs;
+	std::string						strings;
+
+	auto add_texture = [&](const int id) {
+		if (id < 0 || id >= (int)Texture::_textures.size())
+			return MESH_CACHE_NO_STRING;
+		const uint32_t offset = static_cast<uint32_t>(strings.size());
+		strings += Texture::_textures[id].first;
+		strings.push_back('\0');
+		return offset;
+	};
+
+	auto add_material = [&](const int id) {
+		for (size_t i = 0; i < materialIDs.size(); i++)
+			if (materialIDs[i] == id)
+				return static_cast<uint32_t>(i);
+
+		const Material* mat = Material::_materials[id];
+		MeshCacheMaterial m{};
+		memcpy(m.diffuseColor, &mat->diffuseColor, sizeof(m.diffuseColor));
+		m.metallicFactor			= mat->metallicFactor;
+		m.roughnessFactor			= mat->roughnessFactor;
+		m.ior						= mat->ior;
+		m.uvFactor					= mat->uvFactor;
+		m.shadingModel				= mat->shadingModel;
+		m.diffuseTexture			= add_texture(mat->diffuseTexture);
+		m.metallicRoughnessTexture	= add_texture(mat->metallicRoughnessTexture);
+		m.emissiveTexture			= add_texture(mat->emissiveTexture);
+		m.normalTexture				= add_texture(mat->normalTexture);
+
+		materialIDs.push_back(id);
+		materials.push_back(m);
+		return static_cast<uint32_t>(materials.size() - 1);
+	};
+
+	std::vector<std::pair<Node*, int32_t>> stack;
+	for (auto it = roots.rbegin(); it != roots.rend(); it++)
+		stack.push_back({ *it, -1 });
+
+	while (!stack.empty())
+	{
+		Node* node = stack.back().first;
+		const int32_t parent = stack.back().second;
+		stack.pop_back();
+
+		MeshCacheNode n{};
+		n.parent			= parent;
+		n.firstPrimitive	= static_cast<uint32_t>(primitives.size());
+		n.primitiveCount	= static_cast<uint32_t>(node->_primitives.size());
+		memcpy(n.matrix, &node->_matrix, sizeof(n.matrix));
+
+		for (const Primitive* prim : node->_primitives)
+		{
+			MeshCachePrimitive p{};
+			p.firstIndex	= prim->firstIndex;
+			p.indexCount	= prim->indexCount;
+			p.firstVertex	= prim->firstVertex;
+			p.vertexCount	= prim->vertexCount;
+			p.material		= add_material(prim->materialID);
+			primitives.push_back(p);
+		}
+
+		const int32_t index = static_cast<int32_t>(nodes.size());
+		nodes.push_back(n);
+
+		for (auto it = node->_children.rbegin(); it != node->_children.rend(); it++)
+			stack.push_back({ *it, index });
+	}
+
+	// Lay out the sections
+	uint64_t offset = align_offset(sizeof(MeshCacheHeader));
+	auto place = [&](MeshCacheSection& s, const uint64_t count, const size_t elementSize) {
+		s.offset	= offset;
+		s.count		= count;
+		offset		= align_offset(offset + count * elementSize);
+	};
+
+	place(header.path,			source.size(),				1);
+	place(header.vertices,		mesh.vertex_count(),		sizeof(Vertex));
+	place(header.indices,		mesh.index_count(),			sizeof(uint32_t));
+	place(header.nodes,			nodes.size(),				sizeof(MeshCacheNode));
+	place(header.primitives,	primitives.size(),			sizeof(MeshCachePrimitive));
+	place(header.materials,		materials.size(),			sizeof(MeshCacheMaterial));
+	place(header.strings,		strings.size(),				1);
+	header.fileSize = offset;
+
+	// Write to a temporary file first so an interrupted write never looks valid
+	const std::string path = get_path(source);
+	const std::string tmpPath = path + ".tmp";
+
+	FILE* f = fopen(tmpPath.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << "Could not write mesh cache " << path << std::endl;
+		return false;
+	}
+
+	bool ok = true;
+	uint64_t written = 0;
+	auto put = [&](const MeshCacheSection& s, const void* data, const size_t elementSize) {
+		static const char zeros[MESH_CACHE_ALIGNMENT] = {};
+		if (s.offset > written)
+			ok = ok && fwrite(zeros, 1, (size_t)(s.offset - written), f) == s.offset - written;
+		const size_t bytes = (size_t)(s.count * elementSize);
+		if (bytes > 0)
+			ok = ok && fwrite(data, 1, bytes, f) == bytes;
+		written = s.offset + bytes;
+	};
+
+	ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	written = sizeof(header);
+
+	put(header.path,		source.data(),			1);
+	put(header.vertices,	mesh.vertex_data(),		sizeof(Vertex));
+	put(header.indices,		mesh.index_data(),		sizeof(uint32_t));
+	put(header.nodes,		nodes.data(),			sizeof(MeshCacheNode));
+	put(header.primitives,	primitives.data(),		sizeof(MeshCachePrimitive));
+	put(header.materials,	materials.data(),		sizeof(MeshCacheMaterial));
+	put(header.strings,		strings.data(),			1);
+	put({ header.fileSize, 0 }, nullptr, 1);
+
+	ok = (fclose(f) == 0) && ok;
+
+	if (ok)
+	{
+		std::remove(path.c_str());
+		ok = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+
+	if (!ok)
+	{
+		std::remove(tmpPath.c_str());
+		std::cout << "Could not write mesh cache " << path << std::endl;
+	}
+
+	return ok;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "vk_mesh.h"
+
+// Binary cache of imported meshes, written next to the source as <source>.meshcache.
+// It holds the welded vertex/index arrays, the node hierarchy and the materials,
+// laid out so a mapped file can be used in place. A cache is only used when its
+// version, vertex layout, flags, source path, size and mtime all match.
+
+static const uint32_t MESH_CACHE_MAGIC				= 0x434D4753;	// "SGMC"
+static const uint32_t MESH_CACHE_VERSION			= 3;
+static const uint32_t MESH_CACHE_ALIGNMENT			= 16;
+static const uint32_t MESH_CACHE_NO_STRING			= UINT32_MAX;
+
+enum MeshCacheFlags
+{
+	MESH_CACHE_INVERT_NORMALS	= 1 << 0
+};
+
+struct MeshCacheSection
+{
+	uint64_t	offset;
+	uint64_t	count;
+};
+
+struct MeshCacheHeader
+{
+	uint32_t			magic;
+	uint32_t			version;
+	uint32_t			vertexStride;
+	uint32_t			flags;
+	uint64_t			sourceSize;
+	int64_t				sourceTime;
+	uint64_t			fileSize;
+
+	MeshCacheSection	path;			// chars, not null terminated
+	MeshCacheSection	vertices;		// Vertex
+	MeshCacheSection	indices;		// uint32_t
+	MeshCacheSection	nodes;			// MeshCacheNode, parents always come before their children
+	MeshCacheSection	primitives;		// MeshCachePrimitive
+	MeshCacheSection	materials;		// MeshCacheMaterial
+	MeshCacheSection	strings;		// null terminated texture paths
+};
+
+struct MeshCacheNode
+{
+	int32_t		parent;
+	uint32_t	firstPrimitive;
+	uint32_t	primitiveCount;
+	uint32_t	padding;
+	float		matrix[16];
+};
+
+struct MeshCachePrimitive
+{
+	uint32_t	firstIndex;
+	uint32_t	indexCount;
+	uint32_t	firstVertex;
+	uint32_t	vertexCount;
+	uint32_t	material;
+	uint32_t	padding[3];
+};
+
+struct MeshCacheMaterial
+{
+	float		diffuseColor[4];
+	float		metallicFactor;
+	float		roughnessFactor;
+	float		ior;
+	float		uvFactor;
+	int32_t		shadingModel;
+	uint32_t	diffuseTexture;				// offsets in the string section
+	uint32_t	metallicRoughnessTexture;
+	uint32_t	emissiveTexture;
+	uint32_t	normalTexture;
+	uint32_t	padding[3];
+};
+
+class MeshCache
+{
+public:
+	std::shared_ptr<MappedFile>	_file;
+	const MeshCacheHeader*		_header{ nullptr };
+
+	static std::string get_path(const std::string& source);
+
+	// Maps the cache of source, false if it is missing, stale or corrupt
+	bool load(const std::string& source, const uint32_t flags);
+
+	// Writes mesh (and the hierarchy under roots, if any) as the cache of source
+	static bool write(const std::string& source, const uint32_t flags, const Mesh& mesh, const std::vector<Node*>& roots);
+
+	const Vertex*				vertices() const		{ return section<Vertex>(_header->vertices); }
+	const uint32_t*				indices() const			{ return section<uint32_t>(_header->indices); }
+	const MeshCacheNode*		nodes() const			{ return section<MeshCacheNode>(_header->nodes); }
+	const MeshCachePrimitive*	primitives() const		{ return section<MeshCachePrimitive>(_header->primitives); }
+	const MeshCacheMaterial*	materials() const		{ return section<MeshCacheMaterial>(_header->materials); }
+
+	// Texture path stored at offset, nullptr for MESH_CACHE_NO_STRING
+	const char* string(const uint32_t offset) const;
+
+private:
+	template<typename T>
+	const T* section(const MeshCacheSection& s) const
+	{
+		return reinterpret_cast<const T*>(_file->data() + s.offset);
+	}
+};
@@ -0,0 +1,325 @@
+#include "render_graph.h"
+#include "vk_engine.h"
+
+#include <iostream>
+
+static const VkAccessFlags WRITE_ACCESS =
+	VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+	VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+
+uint32_t RenderGraph::add_buffer(const std::string& name, VkBuffer buffer)
+{
+	Resource resource;
+	resource.name	= name;
+	resource.buffer	= buffer;
+	_resources.push_back(resource);
+	return static_cast<uint32_t>(_resources.size() - 1);
+}
+
+uint32_t RenderGraph::add_image(const std::string& name, VkImage image, VkImageAspectFlags aspect, VkImageLayout layout)
+{
+	Resource resource;
+	resource.name	= name;
+	resource.image	= image;
+	resource.aspect	= aspect;
+	resource.layout	= layout;
+	_resources.push_back(resource);
+	return static_cast<uint32_t>(_resources.size() - 1);
+}
+
+void RenderGraph::replace_image(VkImage old, VkImage image)
+{
+	for (Resource& resource : _resources)
+	{
+		if (resource.image == old)
+			resource.image = image;
+	}
+}
+
+uint32_t RenderGraph::add_pass(const std::string& name)
+{
+	Pass pass;
+	pass.name = name;
+	_passes.push_back(pass);
+	return static_cast<uint32_t>(_passes.size() - 1);
+}
+
+void RenderGraph::read(uint32_t pass, uint32_t resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout)
+{
+	use(pass, { resource, stages, access & ~WRITE_ACCESS, layout, VK_IMAGE_LAYOUT_UNDEFINED });
+}
+
+void RenderGraph::write(uint32_t pass, uint32_t resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout, VkImageLayout finalLayout)
+{
+	use(pass, { resource, stages, access, layout, finalLayout });
+}
+
+void RenderGraph::use(uint32_t pass, const RenderGraphAccess& access)
+{
+	// A pass touching a resource more than once (several bindings, stages) is one merged access
+	for (RenderGraphAccess& existing : _passes[pass].accesses)
+	{
+		if (existing.resource != access.resource)
+			continue;
+
+		existing.stages	|= access.stages;
+		existing.access	|= access.access;
+		if (existing.layout == VK_IMAGE_LAYOUT_UNDEFINED)
+			existing.layout = access.layout;
+		if (access.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+			existing.finalLayout = access.finalLayout;
+		return;
+	}
+
+	_passes[pass].accesses.push_back(access);
+}
+
+void RenderGraph::set_command_buffer(uint32_t pass, uint32_t frame, VkCommandBuffer cmd)
+{
+	std::vector<VkCommandBuffer>& commands = _passes[pass].commands;
+	if (commands.size() <= frame)
+		commands.resize(frame + 1, VK_NULL_HANDLE);
+	commands[frame] = cmd;
+}
+
+void RenderGraph::compile()
+{
+	std::vector<State> states(_resources.size());
+	for (size_t i = 0; i < _resources.size(); i++)
+		states[i].layout = _resources[i].layout;
+
+	// The first run leaves the state of a whole previous frame behind, the second is the one kept
+	for (int run = 0; run < 2; run++)
+	{
+		for (Pass& pass : _passes)
+		{
+			pass.barrier = RenderGraphBarrier();
+			compile_pass(pass, states);
+		}
+	}
+
+	_summary = RenderGraphSummary();
+	for (const Pass& pass : _passes)
+	{
+		_summary.barriers += pass.barrier.empty() ? 0 : 1;
+		_summary.transitions += static_cast<uint32_t>(pass.barrier.transitions.size());
+	}
+
+	for (size_t i = 0; i < _resources.size(); i++)
+	{
+		if (_resources[i].image != VK_NULL_HANDLE && states[i].layout != _resources[i].layout)
+			_summary.layoutMismatches.push_back(_resources[i].name);
+	}
+}
+
+void RenderGraph::compile_pass(Pass& pass, std::vector<State>& states) const
+{
+	RenderGraphBarrier& barrier = pass.barrier;
+
+	for (const RenderGraphAccess& access : pass.accesses)
+	{
+		const Resource& resource = _resources[access.resource];
+		State& state = states[access.resource];
+		const bool writes = (access.access & WRITE_ACCESS) != 0;
+
+		if (resource.image != VK_NULL_HANDLE && access.layout != VK_IMAGE_LAYOUT_UNDEFINED && access.layout != state.layout)
+		{
+			// Transitions are writes, they wait on everything since the last write
+			VkImageMemoryBarrier transition = {};
+			transition.sType							= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			transition.srcAccessMask					= state.writeAccess;
+			transition.dstAccessMask					= access.access;
+			transition.oldLayout						= state.layout;
+			transition.newLayout						= access.layout;
+			transition.srcQueueFamilyIndex				= VK_QUEUE_FAMILY_IGNORED;
+			transition.dstQueueFamilyIndex				= VK_QUEUE_FAMILY_IGNORED;
+			transition.image							= resource.image;
+			transition.subresourceRange.aspectMask		= resource.aspect;
+			transition.subresourceRange.levelCount		= VK_REMAINING_MIP_LEVELS;
+			transition.subresourceRange.layerCount		= VK_REMAINING_ARRAY_LAYERS;
+			barrier.transitions.push_back(transition);
+
+			barrier.srcStages |= state.writeStages | state.readStages;
+			barrier.dstStages |= access.stages;
+		}
+		else if (writes)
+		{
+			// Write after write needs the memory dependency, write after read only the execution one
+			if (state.writeStages | state.readStages)
+			{
+				barrier.srcStages |= state.writeStages | state.readStages;
+				barrier.srcAccess |= state.writeAccess;
+				barrier.dstStages |= access.stages;
+				if (state.writeAccess)
+					barrier.dstAccess |= access.access;
+			}
+		}
+		else if (state.writeStages && ((access.stages & ~state.visibleStages) || (access.access & ~state.visibleAccess)))
+		{
+			// Read after write, once per stage and access since the write
+			barrier.srcStages |= state.writeStages;
+			barrier.srcAccess |= state.writeAccess;
+			barrier.dstStages |= access.stages;
+			barrier.dstAccess |= access.access;
+		}
+
+		if (writes)
+		{
+			state.writeStages	= access.stages;
+			state.writeAccess	= access.access & WRITE_ACCESS;
+			state.readStages	= 0;
+			state.visibleStages	= 0;
+			state.visibleAccess	= 0;
+		}
+		else
+		{
+			state.readStages	|= access.stages;
+			state.visibleStages	|= access.stages;
+			state.visibleAccess	|= access.access;
+		}
+
+		if (access.finalLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+			state.layout = access.finalLayout;
+		else if (access.layout != VK_IMAGE_LAYOUT_UNDEFINED)
+			state.layout = access.layout;
+	}
+}
+
+void RenderGraph::record(VkCommandBuffer cmd, uint32_t pass) const
+{
+	const RenderGraphBarrier& barrier = _passes[pass].barrier;
+	if (barrier.empty())
+		return;
+
+	VkMemoryBarrier memory = {};
+	memory.sType			= VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	memory.srcAccessMask	= barrier.srcAccess;
+	memory.dstAccessMask	= barrier.dstAccess;
+	const uint32_t memoryCount = (barrier.srcAccess | barrier.dstAccess) ? 1 : 0;
+
+	// Transitions out of a layout nothing used yet have nothing to wait on
+	const VkPipelineStageFlags srcStages = barrier.srcStages ? barrier.srcStages : static_cast<VkPipelineStageFlags>(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+
+	vkCmdPipelineBarrier(cmd, srcStages, barrier.dstStages, 0,
+		memoryCount, &memory, 0, nullptr,
+		static_cast<uint32_t>(barrier.transitions.size()), barrier.transitions.data());
+}
+
+void RenderGraph::submit(VkQueue queue, uint32_t frame, VkSemaphore wait, VkPipelineStageFlags waitStage, VkSemaphore signal, VkFence fence) const
+{
+	std::vector<VkCommandBuffer> commands;
+	for (const Pass& pass : _passes)
+	{
+		if (frame >= pass.commands.size() || pass.commands[frame] == VK_NULL_HANDLE)
+			continue;
+		if (commands.empty() || commands.back() != pass.commands[frame])
+			commands.push_back(pass.commands[frame]);
+	}
+
+	VkSubmitInfo submit = {};
+	submit.sType				= VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.waitSemaphoreCount	= wait != VK_NULL_HANDLE ? 1 : 0;
+	submit.pWaitSemaphores		= &wait;
+	submit.pWaitDstStageMask	= &waitStage;
+	submit.signalSemaphoreCount	= signal != VK_NULL_HANDLE ? 1 : 0;
+	submit.pSignalSemaphores	= &signal;
+	submit.commandBufferCount	= static_cast<uint32_t>(commands.size());
+	submit.pCommandBuffers		= commands.data();
+
+	VK_CHECK(vkQueueSubmit(queue, 1, &submit, fence));
+}
+
+static bool barrier_is(const RenderGraphBarrier& barrier, VkPipelineStageFlags srcStages, VkAccessFlags srcAccess, VkPipelineStageFlags dstStages, VkAccessFlags dstAccess, size_t transitions)
+{
+	return barrier.srcStages == srcStages && barrier.srcAccess == srcAccess && barrier.dstStages == dstStages &&
+		barrier.dstAccess == dstAccess && barrier.transitions.size() == transitions;
+}
+
+int render_graph_check()
+{
+	const VkPipelineStageFlags transfer	= VK_PIPELINE_STAGE_TRANSFER_BIT;
+	const VkPipelineStageFlags compute	= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	const VkPipelineStageFlags vertex	= VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+	const VkPipelineStageFlags fragment	= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	const VkPipelineStageFlags color	= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+	// Handles are only compared, never used
+	const VkImage colorImage = (VkImage)(uintptr_t)1;
+
+	RenderGraph graph;
+	const uint32_t counters	= graph.add_buffer("counters", VK_NULL_HANDLE);
+	const uint32_t lights	= graph.add_buffer("lights", VK_NULL_HANDLE);
+	const uint32_t image	= graph.add_image("color", colorImage, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+	const uint32_t clear		= graph.add_pass("clear");
+	const uint32_t count		= graph.add_pass("count");
+	const uint32_t shade		= graph.add_pass("shade");
+	const uint32_t sample		= graph.add_pass("sample");
+	const uint32_t sampleAgain	= graph.add_pass("sample again");
+	const uint32_t readback		= graph.add_pass("readback");
+	const uint32_t lightsRead	= graph.add_pass("lights read");
+	const uint32_t lightsWrite	= graph.add_pass("lights write");
+
+	graph.write(clear, counters, transfer, VK_ACCESS_TRANSFER_WRITE_BIT);
+	graph.write(count, counters, compute, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	graph.read(shade, counters, fragment, VK_ACCESS_SHADER_READ_BIT);
+	graph.write(shade, image, color, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	graph.read(sample, image, fragment, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	graph.read(sampleAgain, image, fragment, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+	graph.read(readback, counters, transfer, VK_ACCESS_TRANSFER_READ_BIT);
+	graph.read(lightsRead, lights, vertex, VK_ACCESS_SHADER_READ_BIT);
+	graph.write(lightsWrite, lights, transfer, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	graph.compile();
+
+	uint32_t failed = 0;
+	auto expect = [&](bool condition, const char* what) {
+		if (!condition)
+		{
+			std::cout << "Render graph: " << what << " FAILED" << std::endl;
+			failed++;
+		}
+	};
+
+	// The first pass waits on the previous frame, its write on both the reads and the write left in flight
+	expect(barrier_is(graph.barrier(clear), compute | fragment | transfer, VK_ACCESS_SHADER_WRITE_BIT, transfer, VK_ACCESS_TRANSFER_WRITE_BIT, 0),
+		"write after the previous frame");
+
+	expect(barrier_is(graph.barrier(count), transfer, VK_ACCESS_TRANSFER_WRITE_BIT, compute, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, 0),
+		"write after write");
+
+	// Read after write on the counters and the transition of the image into the same barrier
+	const RenderGraphBarrier& shadeBarrier = graph.barrier(shade);
+	expect(barrier_is(shadeBarrier, compute | color | fragment, VK_ACCESS_SHADER_WRITE_BIT, fragment | color, VK_ACCESS_SHADER_READ_BIT, 1),
+		"read after write with a layout transition");
+	if (shadeBarrier.transitions.size() == 1)
+	{
+		const VkImageMemoryBarrier& transition = shadeBarrier.transitions[0];
+		expect(transition.image == colorImage && transition.oldLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL &&
+			transition.newLayout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL && transition.srcAccessMask == VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT &&
+			transition.dstAccessMask == VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, "layout transition");
+	}
+
+	// The render pass leaves the image in the layout it is sampled in, no transition
+	expect(barrier_is(graph.barrier(sample), color, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, fragment, VK_ACCESS_SHADER_READ_BIT, 0),
+		"read after a render pass");
+	expect(graph.barrier(sampleAgain).empty(), "repeated read");
+
+	expect(barrier_is(graph.barrier(readback), compute, VK_ACCESS_SHADER_WRITE_BIT, transfer, VK_ACCESS_TRANSFER_READ_BIT, 0),
+		"read after write on a new stage");
+
+	expect(barrier_is(graph.barrier(lightsRead), transfer, VK_ACCESS_TRANSFER_WRITE_BIT, vertex, VK_ACCESS_SHADER_READ_BIT, 0),
+		"read after the previous frame");
+	expect(barrier_is(graph.barrier(lightsWrite), transfer | vertex, VK_ACCESS_TRANSFER_WRITE_BIT, transfer, VK_ACCESS_TRANSFER_WRITE_BIT, 0),
+		"write after read");
+
+	// Every image is back in the layout it started the frame in
+	const RenderGraphSummary& summary = graph.summary();
+	for (const std::string& name : summary.layoutMismatches)
+		std::cout << "Render graph: " << name << " ends the frame in another layout" << std::endl;
+	expect(summary.layoutMismatches.empty(), "final layouts");
+
+	std::cout << "Render graph: " << graph.pass_count() << " passes, " << summary.barriers << " barriers, " << summary.transitions << " layout transitions checked, " << (failed == 0 ? "all checks passed" : "checks FAILED") << std::endl;
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vk_types.h>
+
+#include <string>
+
+// One use of a resource by a pass
+struct RenderGraphAccess
+{
+	uint32_t				resource;
+	VkPipelineStageFlags	stages;
+	VkAccessFlags			access;
+	VkImageLayout			layout;			// layout the pass uses the image in, UNDEFINED if its render pass transitions it
+	VkImageLayout			finalLayout;	// layout the pass leaves the image in, UNDEFINED if it stays in layout
+};
+
+// Everything that has to happen in front of a pass, recorded as one vkCmdPipelineBarrier
+struct RenderGraphBarrier
+{
+	VkPipelineStageFlags				srcStages{ 0 };
+	VkPipelineStageFlags				dstStages{ 0 };
+	VkAccessFlags						srcAccess{ 0 };
+	VkAccessFlags						dstAccess{ 0 };
+	std::vector<VkImageMemoryBarrier>	transitions;
+
+	bool empty() const { return srcStages == 0 && transitions.empty(); }
+};
+
+// What compile() derived from the declarations
+struct RenderGraphSummary
+{
+	uint32_t					barriers{ 0 };
+	uint32_t					transitions{ 0 };
+	std::vector<std::string>	layoutMismatches;	// images that end the frame in another layout than they start it in
+};
+
+// Declarative description of a frame. Passes are added in submission order and declare what they
+// read and write, compile() derives the barrier in front of each pass from those declarations.
+// Frames repeat on the same queue, so the first passes also wait on what the last passes of the
+// previous frame did with their resources. Dependencies are global memory barriers with the exact
+// stages involved, images only get image barriers for layout transitions.
+// Adding, declaring and compiling is plain CPU work, only record() and submit() touch the device.
+class RenderGraph
+{
+public:
+	uint32_t add_buffer(const std::string& name, VkBuffer buffer);
+
+	// layout is the one the image is in between frames
+	uint32_t add_image(const std::string& name, VkImage image, VkImageAspectFlags aspect, VkImageLayout layout);
+
+	// Points the resources of old at a recreated image, compile() again before recording
+	void replace_image(VkImage old, VkImage image);
+
+	uint32_t add_pass(const std::string& name);
+
+	void read(uint32_t pass, uint32_t resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED);
+	void write(uint32_t pass, uint32_t resource, VkPipelineStageFlags stages, VkAccessFlags access, VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED, VkImageLayout finalLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+	// Command buffer holding the pass for a frame in flight, consecutive passes may share one
+	void set_command_buffer(uint32_t pass, uint32_t frame, VkCommandBuffer cmd);
+
+	void compile();
+
+	const RenderGraphSummary& summary() const { return _summary; }
+	const RenderGraphBarrier& barrier(uint32_t pass) const { return _passes[pass].barrier; }
+	const std::string& name(uint32_t pass) const { return _passes[pass].name; }
+	uint32_t pass_count() const { return static_cast<uint32_t>(_passes.size()); }
+
+	// Records the barrier in front of pass, before its commands and outside any render pass
+	void record(VkCommandBuffer cmd, uint32_t pass) const;
+
+	// Submits the command buffers of every pass of a frame in one vkQueueSubmit
+	void submit(VkQueue queue, uint32_t frame, VkSemaphore wait, VkPipelineStageFlags waitStage, VkSemaphore signal, VkFence fence) const;
+
+private:
+	struct Resource
+	{
+		std::string			name;
+		VkBuffer			buffer{ VK_NULL_HANDLE };
+		VkImage				image{ VK_NULL_HANDLE };
+		VkImageAspectFlags	aspect{ 0 };
+		VkImageLayout		layout{ VK_IMAGE_LAYOUT_UNDEFINED };
+	};
+
+	// What the passes compiled so far did to a resource
+	struct State
+	{
+		VkPipelineStageFlags	writeStages{ 0 };
+		VkAccessFlags			writeAccess{ 0 };
+		VkPipelineStageFlags	readStages{ 0 };		// since the last write
+		VkPipelineStageFlags	visibleStages{ 0 };		// already waiting on the last write
+		VkAccessFlags			visibleAccess{ 0 };
+		VkImageLayout			layout{ VK_IMAGE_LAYOUT_UNDEFINED };
+	};
+
+	struct Pass
+	{
+		std::string						name;
+		std::vector<RenderGraphAccess>	accesses;
+		std::vector<VkCommandBuffer>	commands;	// per frame in flight
+		RenderGraphBarrier				barrier;
+	};
+
+	std::vector<Resource>	_resources;
+	std::vector<Pass>		_passes;
+	RenderGraphSummary		_summary;
+
+	void use(uint32_t pass, const RenderGraphAccess& access);
+	void compile_pass(Pass& pass, std::vector<State>& states) const;
+};
+
+// Compiles a small synthetic graph and checks the derived barriers, returns the process exit code
+int render_graph_check();
@@ -5,6 +5,9 @@
 #include <ctime>
 #include "window.h"
 #include "vk_utils.h"
+#include "asset_loader.h"
+#include "surfel_cache.h"
+#include "thread_pool.h"
 
 extern std::vector<std::string> searchPaths;
 
@@ -25,7 +28,9 @@ Renderer::Renderer(Scene* scene)
 	init_sync_structures();
 
 	load_data_to_gpu();
-	
+
+	// The coverage images are sized from the surfel config
+	init_surfel_config();
 	create_storage_image();
 	init_descriptors();
 	init_deferred_descriptors();
@@ -42,6 +47,7 @@ Renderer::Renderer(Scene* scene)
 	vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(*device, "vkGetRayTracingShaderGroupHandlesKHR"));
 	vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(*device, "vkCreateRayTracingPipelinesKHR"));
 	vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(*device, "vkCmdTraceRaysKHR"));
+	vkCmdTraceRaysIndirectKHR = reinterpret_cast<PFN_vkCmdTraceRaysIndirectKHR>(vkGetDeviceProcAddr(*device, "vkCmdTraceRaysIndirectKHR"));
 	vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(vkGetDeviceProcAddr(*device, "vkDestroyAccelerationStructureKHR"));
 
 
@@ -66,15 +72,22 @@ Renderer::Renderer(Scene* scene)
 	//init_compute_pipeline();
 	//build_compute_command_buffer();
 	create_SurfelGi_resources();
+	create_surfel_stats_readback();
+	init_render_graph();
 	surfel_position();
 	prepare_indirect();
-	//grid_reset();
-	//update_surfels();
-	//grid_offset();
-	//surfel_binning();
+	grid_reset();
+	update_surfels();
+	grid_offset();
+	surfel_binning();
+	surfel_sort();
+	surfel_ray_allocate();
 	surfel_ray_tracing();
 	surfel_shade();
 	//todo_de_nuevo();
+
+	// The snapshot was read while the pipelines were built, the first frame needs it on the GPU
+	AssetLoader::get().wait([&]() { return _surfelCacheDone; });
 }
 
 void Renderer::init_commands()
@@ -100,23 +113,29 @@ void Renderer::init_commands()
 	VK_CHECK(vkCreateCommandPool(*device, &uploadCommandPoolInfo, nullptr, &_commandPool));
 	VK_CHECK(vkCreateCommandPool(*device, &commandPoolInfo, nullptr, &_resetCommandPool));
 
-	VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_resetCommandPool, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
-	VK_CHECK(vkAllocateCommandBuffers(*device, &allocInfo, &_offscreenComandBuffer));
+	// The G-buffer pass is recorded every frame, one buffer per frame in flight so it never waits on the other
+	VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_resetCommandPool, FRAME_OVERLAP);
+	VK_CHECK(vkAllocateCommandBuffers(*device, &allocInfo, _offscreenComandBuffer));
 
 	VkCommandBufferAllocateInfo cmdDeferredAllocInfo = vkinit::command_buffer_allocate_info(_commandPool);
 	VkCommandBufferAllocateInfo cmdPostAllocInfo = vkinit::command_buffer_allocate_info(_commandPool);
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_rtCommandBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_hybridCommandBuffer));
-	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_shadowCommandBuffer));
-	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_denoiseCommandBuffer));
+
+	// Passes reading the frame uniforms are recorded once per frame in flight, each binds its own slice
+	VkCommandBufferAllocateInfo cmdFrameAllocInfo = vkinit::command_buffer_allocate_info(_commandPool, FRAME_OVERLAP);
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdFrameAllocInfo, _shadowCommandBuffer));
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdFrameAllocInfo, _denoiseCommandBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_GridResetCmdBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_PrepareIndirectCmdBuffer));
-	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_SurfelPositionCmd));
+	// The surfel update chain is recorded again when the coverage images are resized
+	VkCommandBufferAllocateInfo cmdResetFrameAllocInfo = vkinit::command_buffer_allocate_info(_resetCommandPool, FRAME_OVERLAP);
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdResetFrameAllocInfo, _SurfelPositionCmd));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_UpdateSurfelsCmdBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_GridOffsetCmdBuffer));
 	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_SurfelBinningCmdBuffer));
-	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_SurfelRTXCommandBuffer));
-	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdPostAllocInfo, &_SurfelShadeCmdBuffer));
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdFrameAllocInfo, _SurfelRTXCommandBuffer));
+	VK_CHECK(vkAllocateCommandBuffers(*device, &cmdFrameAllocInfo, _SurfelShadeCmdBuffer));
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vkDestroyCommandPool(*device, _commandPool, nullptr);
@@ -430,6 +449,14 @@ void Renderer::render()
 	VK_CHECK(vkWaitForFences(*device, 1, &get_current_frame()._renderFence, VK_TRUE, 1000000000));
 	VK_CHECK(vkResetFences(*device, 1, &get_current_frame()._renderFence));
 
+	// Every frame up to the one that last used this fence is done, its stats are read without waiting
+	if (*frameNumber >= (int)FRAME_OVERLAP)
+		collect_surfel_stats(*frameNumber - FRAME_OVERLAP);
+
+	// Same for the snapshot copy
+	if (_surfelCacheSaveFrame >= 0 && _surfelCacheSaveFrame <= *frameNumber - (int)FRAME_OVERLAP)
+		write_surfel_cache();
+
 	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
 
 	VkResult result = vkAcquireNextImageKHR(*device, *swapchain, UINT64_MAX, get_current_frame()._presentSemaphore, VK_NULL_HANDLE, &VulkanEngine::engine->_indexSwapchainImage);
@@ -442,68 +469,15 @@ void Renderer::render()
 		throw std::runtime_error("Failed to acquire swap chain image");
 	}
 
-	VK_CHECK(vkResetCommandBuffer(_offscreenComandBuffer, 0));
+	VK_CHECK(vkResetCommandBuffer(_offscreenComandBuffer[frame_index()], 0));
 	build_previous_command_buffer();
-
-	// First pass
-	VkSubmitInfo submit = {};
-	submit.sType					= VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submit.pNext					= nullptr;
-	submit.pWaitDstStageMask		= waitStages;
-	submit.waitSemaphoreCount		= 1;
-	submit.pWaitSemaphores			= &get_current_frame()._presentSemaphore;
-	submit.signalSemaphoreCount		= 1;
-	submit.pSignalSemaphores		= &_shadowSemaphore;
-	submit.commandBufferCount		= 1;
-	submit.pCommandBuffers			= &_offscreenComandBuffer;
-
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	
-
-	//surfel coverage
-	submit.pWaitSemaphores = &_shadowSemaphore;
-	submit.pSignalSemaphores = &_SurfelPositionSemaphore;
-	submit.pCommandBuffers = &_SurfelPositionCmd;
-
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
-
-	
-
-	//update
-	submit.pWaitSemaphores = &_SurfelPositionSemaphore;
-	submit.pSignalSemaphores = &_UpdateSurfelsSemaphore;
-	submit.pCommandBuffers = &_SurfelRTXCommandBuffer;
-
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
-
-
-	submit.pWaitSemaphores = &_UpdateSurfelsSemaphore;
-	submit.pSignalSemaphores = &_shadowSemaphore;
-	submit.pCommandBuffers = &_shadowCommandBuffer;
-
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
-
-
-
-	submit.pWaitSemaphores = &_shadowSemaphore;
-	submit.pSignalSemaphores = &_SurfelShadeSemaphore;
-	submit.pCommandBuffers = &_SurfelShadeCmdBuffer;
-
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, VK_NULL_HANDLE));
-	vkQueueWaitIdle(VulkanEngine::engine->_graphicsQueue);
-
-
-
 	build_deferred_command_buffer();
 
-	// Second pass
-	submit.pWaitSemaphores			= &_SurfelShadeSemaphore;
-	submit.pSignalSemaphores		= &get_current_frame()._renderSemaphore;
-	submit.pCommandBuffers			= &get_current_frame()._mainCommandBuffer;
-	VK_CHECK(vkQueueSubmit(VulkanEngine::engine->_graphicsQueue, 1, &submit, get_current_frame()._renderFence));
+	// Every pass in one submit, the barriers recorded from the render graph order them on the GPU.
+	// Only the deferred pass writes the swapchain image so only it waits on the acquire.
+	_graph.submit(VulkanEngine::engine->_graphicsQueue, frame_index(),
+		get_current_frame()._presentSemaphore, waitStages[0],
+		get_current_frame()._renderSemaphore, get_current_frame()._renderFence);
 
 	VkPresentInfoKHR presentInfo = {};
 	presentInfo.sType				= VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -535,6 +509,10 @@ void Renderer::render_gui()
 
 	ImGui::Begin("Debug window");
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+
+	const SurfelFrameStats& surfelStats = surfel_stats();
+	ImGui::Text("Surfels %u alive, %u free, %u spawned, %u recycled", surfelStats.surfels, surfelStats.free, surfelStats.spawns, surfelStats.recycles);
+	ImGui::Text("Surfel rays %u traced of %u queued, %u cells over the limit", surfelStats.raysTraced, surfelStats.raysQueued, surfelStats.cellsOverLimit);
 	ImGui::Checkbox("Denoise", &VulkanEngine::engine->_denoise);
 
 	const std::vector<std::string> renderers = { "Deferred Shading Renderer", "Ray Traced Renderer", "Hybrid Shading Renderer" };
@@ -569,10 +547,6 @@ void Renderer::render_gui()
 		if (ImGui::Combo(title, &index, &charTargets[0], targets.size(), targets.size()))
 		{
 			VulkanEngine::engine->debugTarget = index;
-			void* debugData;
-			vmaMapMemory(VulkanEngine::engine->_allocator, VulkanEngine::engine->renderer->_debugBuffer._allocation, &debugData);
-			memcpy(debugData, &VulkanEngine::engine->debugTarget, sizeof(uint32_t));
-			vmaUnmapMemory(VulkanEngine::engine->_allocator, VulkanEngine::engine->renderer->_debugBuffer._allocation);
 		}
 	}
 
@@ -690,10 +664,13 @@ void Renderer::render_gui()
 			materials.push_back(mat);
 		}
 
-		void* matData;
-		vmaMapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation, &matData);
-		memcpy(matData, materials.data(), sizeof(GPUMaterial) * materials.size());
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation);
+		// The frames in flight still read the old materials
+		AssetLoader::get().upload(
+			[&](UploadQueue& queue) {
+				queue.wait_for_readers();
+				queue.copy_buffer(materials.data(), sizeof(GPUMaterial) * materials.size(), _matBuffer._buffer);
+			},
+			[]() {});
 	}
 }
 
@@ -764,18 +741,7 @@ void Renderer::init_sync_structures()
 	VkFenceCreateInfo fenceCreateInfo = vkinit::fence_create_info(VK_FENCE_CREATE_SIGNALED_BIT);
 	VkSemaphoreCreateInfo semaphoreCreateInfo = vkinit::semaphore_create_info();
 
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_offscreenSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_rtSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_shadowSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_denoiseSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_GridResetSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_PrepareIndirectSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_SurfelPositionSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_UpdateSurfelsSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_GridOffsetSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_SurfelBinningSemaphore));
-	VK_CHECK(vkCreateSemaphore(*device, &semaphoreCreateInfo, nullptr, &_SurfelShadeSemaphore));
-
+	// The render graph orders the passes of a frame, only acquire and present need semaphores
 	for (int i = 0; i < FRAME_OVERLAP; i++)
 	{
 		VK_CHECK(vkCreateFence(*device, &fenceCreateInfo, nullptr, &_frames[i]._renderFence));
@@ -794,20 +760,6 @@ void Renderer::init_sync_structures()
 			vkDestroySemaphore(*device, _frames[i]._renderSemaphore, nullptr);
 			});
 	}
-
-	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
-		vkDestroySemaphore(*device, _offscreenSemaphore, nullptr);
-		vkDestroySemaphore(*device, _rtSemaphore, nullptr);
-		vkDestroySemaphore(*device, _shadowSemaphore, nullptr);
-		vkDestroySemaphore(*device, _denoiseSemaphore, nullptr);
-		vkDestroySemaphore(*device, _GridResetSemaphore, nullptr);
-		vkDestroySemaphore(*device, _PrepareIndirectSemaphore, nullptr);
-		vkDestroySemaphore(*device, _SurfelPositionSemaphore, nullptr);
-		vkDestroySemaphore(*device, _UpdateSurfelsSemaphore, nullptr);
-		vkDestroySemaphore(*device, _GridOffsetSemaphore, nullptr);
-		vkDestroySemaphore(*device, _SurfelBinningSemaphore, nullptr);
-		vkDestroySemaphore(*device, _SurfelShadeSemaphore, nullptr);
-		});
 }
 
 void Renderer::init_descriptors()
@@ -815,6 +767,7 @@ void Renderer::init_descriptors()
 	std::vector<VkDescriptorPoolSize> sizes = {
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100}
 	};
@@ -824,7 +777,7 @@ void Renderer::init_descriptors()
 	vkCreateDescriptorPool(*device, &pool_info, nullptr, &_descriptorPool);
 
 	uint32_t nText = (uint32_t)Texture::_textures.size();
-	VkDescriptorSetLayoutBinding cameraBind		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0);
+	VkDescriptorSetLayoutBinding cameraBind		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 0);
 	VkDescriptorSetLayoutBinding textureBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1, nText);
 	VkDescriptorSetLayoutBinding materialBind	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 0);
 
@@ -867,7 +820,7 @@ void Renderer::init_descriptors()
 
 	// Create descriptors infos to write
 	// Camera descriptor buffer
-	VkDescriptorBufferInfo cameraInfo = vkinit::descriptor_buffer_info(_cameraBuffer._buffer, sizeof(GPUCameraData), 0);
+	VkDescriptorBufferInfo cameraInfo = _frameUniforms.descriptor(FRAME_CAMERA);
 
 	// Textures descriptor image infos
 	VkSamplerCreateInfo samplerInfo = vkinit::sampler_create_info(VK_FILTER_NEAREST);
@@ -889,7 +842,7 @@ void Renderer::init_descriptors()
 	VkDescriptorBufferInfo materialInfo = vkinit::descriptor_buffer_info(VulkanEngine::engine->_objectBuffer._buffer, sizeof(GPUMaterial), 0);
 
 	// Writes
-	VkWriteDescriptorSet cameraWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _offscreenDescriptorSet, &cameraInfo, 0);
+	VkWriteDescriptorSet cameraWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _offscreenDescriptorSet, &cameraInfo, 0);
 	VkWriteDescriptorSet texturesWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _offscreenDescriptorSet, imageInfos.data(), 1, nText);
 	VkWriteDescriptorSet materialWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _objectDescriptorSet, &materialInfo, 0);
 
@@ -901,7 +854,7 @@ void Renderer::init_descriptors()
 	// Skybox set = 0
 	// binding single texture as skybox and matrix to position the sphere around camera
 	VkDescriptorSetLayoutBinding skyBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1);
-	VkDescriptorSetLayoutBinding skyBufferBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 2);
+	VkDescriptorSetLayoutBinding skyBufferBind = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 2);
 
 	std::vector<VkDescriptorSetLayoutBinding> skyboxBindings = {
 		cameraBind,		// binding = 0 camera info
@@ -928,19 +881,14 @@ void Renderer::init_descriptors()
 
 	VkDescriptorImageInfo skyboxImageInfo = {};
 	skyboxImageInfo.sampler				= sampler;
-	skyboxImageInfo.imageView = Texture::GET("data/textures/LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView; // Texture::GET("data/textures/woods.jpg")->imageView;
+	skyboxImageInfo.imageView = Texture::GET("data/textures/LA_Downtown_Helipad_GoldenHour_8k.jpg")->wait()->imageView; // Texture::GET("data/textures/woods.jpg")->imageView;
 	skyboxImageInfo.imageLayout			= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	VulkanEngine::engine->create_buffer(sizeof(glm::mat4), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _skyboxBuffer);
-
-	VkDescriptorBufferInfo skyboxBufferInfo = {};
-	skyboxBufferInfo.buffer				= _skyboxBuffer._buffer;
-	skyboxBufferInfo.offset				= 0;
-	skyboxBufferInfo.range				= sizeof(glm::mat4);
+	VkDescriptorBufferInfo skyboxBufferInfo = _frameUniforms.descriptor(FRAME_SKYBOX);
 
-	VkWriteDescriptorSet camWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _skyboxDescriptorSet, &cameraInfo, 0);
+	VkWriteDescriptorSet camWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _skyboxDescriptorSet, &cameraInfo, 0);
 	VkWriteDescriptorSet skyboxWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _skyboxDescriptorSet, &skyboxImageInfo, 1);
-	VkWriteDescriptorSet skyboxBuffer	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _skyboxDescriptorSet, &skyboxBufferInfo, 2);
+	VkWriteDescriptorSet skyboxBuffer	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _skyboxDescriptorSet, &skyboxBufferInfo, 2);
 
 	std::vector<VkWriteDescriptorSet> skyboxWrites = {
 		camWrite,
@@ -972,15 +920,16 @@ void Renderer::init_deferred_descriptors()
 	VkDescriptorSetLayoutBinding normalBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 1);	// Normals
 	VkDescriptorSetLayoutBinding albedoBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 2);	// Albedo
 	VkDescriptorSetLayoutBinding motionBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 3);	// Motion
-	VkDescriptorSetLayoutBinding lightBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 4);	// Lights buffer
-	VkDescriptorSetLayoutBinding debugBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT, 5);	// Debug display
+	VkDescriptorSetLayoutBinding lightBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT, 4);	// Lights buffer
+	VkDescriptorSetLayoutBinding debugBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT, 5);	// Debug display
 	VkDescriptorSetLayoutBinding materialBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 6); // Metallic Roughness
-	VkDescriptorSetLayoutBinding cameraBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 7); // Camera position buffer
+	VkDescriptorSetLayoutBinding cameraBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT, 7); // Camera position buffer
 	VkDescriptorSetLayoutBinding emissiveBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 8); // Emissive
 	VkDescriptorSetLayoutBinding environtmentBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 9);
 	VkDescriptorSetLayoutBinding surfelDebugBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 10);
 	VkDescriptorSetLayoutBinding surfelResultBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 11);
 	VkDescriptorSetLayoutBinding shadowResultBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 12, _scene->_lights.size());
+	VkDescriptorSetLayoutBinding clustersBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_FRAGMENT_BIT, 13);	// Light clusters
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -996,7 +945,8 @@ void Renderer::init_deferred_descriptors()
 		environtmentBinding,
 		surfelDebugBinding,
 		surfelResultBinding,
-		shadowResultBinding
+		shadowResultBinding,
+		clustersBinding
 	};
 
 	VkDescriptorSetLayoutCreateInfo setInfo = {};
@@ -1039,25 +989,16 @@ void Renderer::init_deferred_descriptors()
 			_deferredTextures[5].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _offscreenSampler);	// Material
 
 		// Binding = 4 Light buffer
-		VkDescriptorBufferInfo lightBufferDesc;
-		lightBufferDesc.buffer	= _lightBuffer._buffer;
-		lightBufferDesc.offset	= 0;
-		lightBufferDesc.range	= sizeof(uboLight) * nLights;
+		VkDescriptorBufferInfo lightBufferDesc = _frameUniforms.descriptor(FRAME_LIGHTS);
 
 		// Binding = 5 Debug value buffer
-		VkDescriptorBufferInfo debugDesc;
-		debugDesc.buffer		= _debugBuffer._buffer;
-		debugDesc.offset		= 0;
-		debugDesc.range			= sizeof(uint32_t);
+		VkDescriptorBufferInfo debugDesc = _frameUniforms.descriptor(FRAME_DEBUG);
 
 		// Binding = 7 Camera buffer
-		VkDescriptorBufferInfo cameraDesc;
-		cameraDesc.buffer		= _cameraPositionBuffer._buffer;
-		cameraDesc.offset		= 0;
-		cameraDesc.range		= sizeof(glm::vec3);
+		VkDescriptorBufferInfo cameraDesc = _frameUniforms.descriptor(FRAME_CAMERA_POSITION);
 
 		// Binding = 9 Environment image
-		VkDescriptorImageInfo environmentDesc = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		VkDescriptorImageInfo environmentDesc = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
 
 		//B 10 debug gi
 		VkDescriptorImageInfo debugGIdesc = vkinit::descriptor_image_info(
@@ -1078,20 +1019,23 @@ void Renderer::init_deferred_descriptors()
 				_shadowImages.at(i).imageView, VK_IMAGE_LAYOUT_GENERAL, _offscreenSampler));
 		}
 
+		// Binding = 13 Light clusters
+		VkDescriptorBufferInfo clustersDesc = _frameUniforms.descriptor(FRAME_LIGHT_CLUSTERS);
 
 		VkWriteDescriptorSet positionWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorPosition, 0);
 		VkWriteDescriptorSet normalWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorNormal, 1);
 		VkWriteDescriptorSet albedoWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorAlbedo, 2);
 		VkWriteDescriptorSet motionWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorMotion, 3);
-		VkWriteDescriptorSet lightBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _frames[i].deferredDescriptorSet, &lightBufferDesc, 4);
-		VkWriteDescriptorSet debugWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _frames[i].deferredDescriptorSet, &debugDesc, 5);
+		VkWriteDescriptorSet lightBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _frames[i].deferredDescriptorSet, &lightBufferDesc, 4);
+		VkWriteDescriptorSet debugWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _frames[i].deferredDescriptorSet, &debugDesc, 5);
 		VkWriteDescriptorSet materialWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorMaterial, 6);
-		VkWriteDescriptorSet cameraWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _frames[i].deferredDescriptorSet, &cameraDesc, 7);
+		VkWriteDescriptorSet cameraWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _frames[i].deferredDescriptorSet, &cameraDesc, 7);
 		VkWriteDescriptorSet emissiveWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &texDescriptorEmissive, 8);
 		VkWriteDescriptorSet environmentWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &environmentDesc, 9);
 		VkWriteDescriptorSet debugGIWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &debugGIdesc, 10);
 		VkWriteDescriptorSet resultGIWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &resultGIdesc, 11);
 		VkWriteDescriptorSet shadowGIWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, shadowdesc.data(), 12, shadowdesc.size());
+		VkWriteDescriptorSet clustersWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _frames[i].deferredDescriptorSet, &clustersDesc, 13);
 
 		std::vector<VkWriteDescriptorSet> writes = {
 			positionWrite,
@@ -1106,7 +1050,8 @@ void Renderer::init_deferred_descriptors()
 			environmentWrite,
 			debugGIWrite,
 			resultGIWrite,
-			shadowGIWrite
+			shadowGIWrite,
+			clustersWrite
 		};
 
 		vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
@@ -1310,8 +1255,7 @@ void Renderer::build_forward_command_buffer()
 
 	vkCmdBeginRenderPass(*cmd, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 	// Set = 0 Camera data descriptor
-	uint32_t uniform_offset = VulkanEngine::engine->pad_uniform_buffer_size(sizeof(GPUSceneData));
-	vkCmdBindDescriptorSets(*cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _forwardPipelineLayout, 0, 1, &_offscreenDescriptorSet, 1, &uniform_offset);
+	vkCmdBindDescriptorSets(*cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _forwardPipelineLayout, 0, 1, &_offscreenDescriptorSet, 1, _frameUniforms.offsets(frame_index()));
 	// Set = 1 Object data descriptor
 	vkCmdBindDescriptorSets(*cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _forwardPipelineLayout, 1, 1, &_objectDescriptorSet, 0, nullptr);
 	// Set = 2 Texture data descriptor
@@ -1329,15 +1273,15 @@ void Renderer::build_forward_command_buffer()
 
 		int constant = object->id;
 		int matIdx = object->materialIdx;
-		vkCmdPushConstants(_offscreenComandBuffer, _offscreenPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(int), &constant);
-		vkCmdPushConstants(_offscreenComandBuffer, _offscreenPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, sizeof(int), sizeof(int), &matIdx);
+		vkCmdPushConstants(_offscreenComandBuffer[frame_index()], _offscreenPipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(int), &constant);
+		vkCmdPushConstants(_offscreenComandBuffer[frame_index()], _offscreenPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, sizeof(int), sizeof(int), &matIdx);
 
 		if (lastMesh != object->prefab->_mesh) {
 			vkCmdBindVertexBuffers(*cmd, 0, 1, &object->prefab->_mesh->_vertexBuffer._buffer, &offset);
 			vkCmdBindIndexBuffer(*cmd, object->prefab->_mesh->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
 			lastMesh = object->prefab->_mesh;
 		}
-		vkCmdDrawIndexed(*cmd, static_cast<uint32_t>(object->prefab->_mesh->_indices.size()), _scene->_entities.size(), 0, 0, i);
+		vkCmdDrawIndexed(*cmd, static_cast<uint32_t>(object->prefab->_mesh->index_count()), _scene->_entities.size(), 0, 0, i);
 	}
 
 	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), *cmd);
@@ -1348,16 +1292,13 @@ void Renderer::build_forward_command_buffer()
 
 void Renderer::build_previous_command_buffer()
 {
-	if (_offscreenComandBuffer == VK_NULL_HANDLE)
-	{
-		VkCommandBufferAllocateInfo allocInfo = vkinit::command_buffer_allocate_info(_commandPool, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
-		VK_CHECK(vkAllocateCommandBuffers(*device, &allocInfo, &_offscreenComandBuffer));
-	}
+	VkCommandBufferBeginInfo cmdBufInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
-	VkCommandBufferBeginInfo cmdBufInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+	VkCommandBuffer& cmd = _offscreenComandBuffer[frame_index()];
 
-	vkDeviceWaitIdle(*device);
-	VK_CHECK(vkBeginCommandBuffer(_offscreenComandBuffer, &cmdBufInfo));
+	VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBufInfo));
+
+	_graph.record(cmd, PASS_GBUFFER);
 
 	VkDeviceSize offset = { 0 };
 
@@ -1380,31 +1321,31 @@ void Renderer::build_previous_command_buffer()
 	renderPassBeginInfo.pClearValues				= clearValues.data();
 
 
-	vkCmdBeginRenderPass(_offscreenComandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBeginRenderPass(cmd, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 	// Skybox pass
-	vkCmdBindDescriptorSets(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _skyboxPipelineLayout, 0, 1, &_skyboxDescriptorSet, 0, nullptr);
-	vkCmdBindPipeline(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _skyboxPipeline);
-	Mesh* sphere = Mesh::GET("sphere.obj");
-	vkCmdBindVertexBuffers(_offscreenComandBuffer, 0, 1, &sphere->_vertexBuffer._buffer, &offset);
-	vkCmdBindIndexBuffer(_offscreenComandBuffer, sphere->_indexBuffer._buffer, offset, VK_INDEX_TYPE_UINT32);
-	vkCmdDrawIndexed(_offscreenComandBuffer, static_cast<uint32_t>(sphere->_indices.size()), 1, 0, 0, 1);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _skyboxPipelineLayout, 0, 1, &_skyboxDescriptorSet, 2, _frameUniforms.offsets(frame_index()));
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _skyboxPipeline);
+	Mesh* sphere = Mesh::GET("sphere.obj")->wait();
+	vkCmdBindVertexBuffers(cmd, 0, 1, &sphere->_vertexBuffer._buffer, &offset);
+	vkCmdBindIndexBuffer(cmd, sphere->_indexBuffer._buffer, offset, VK_INDEX_TYPE_UINT32);
+	vkCmdDrawIndexed(cmd, static_cast<uint32_t>(sphere->index_count()), 1, 0, 0, 1);
 
 	// Geometry pass
 	// Set = 0 Camera data descriptor
-	vkCmdBindDescriptorSets(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipelineLayout, 0, 1, &_offscreenDescriptorSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipelineLayout, 0, 1, &_offscreenDescriptorSet, 1, _frameUniforms.offsets(frame_index()));
 
-	vkCmdBindPipeline(_offscreenComandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipeline);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _offscreenPipeline);
 
 	uint32_t instance = 0;
 	for (size_t i = 0; i < _scene->_entities.size(); i++)
 	{
 		Object* object = _scene->_entities[i];
-		object->draw(_offscreenComandBuffer, _offscreenPipelineLayout, object->m_matrix);
+		object->draw(cmd, _offscreenPipelineLayout, object->m_matrix);
 	}
 
-	vkCmdEndRenderPass(_offscreenComandBuffer);
-	VK_CHECK(vkEndCommandBuffer(_offscreenComandBuffer));
+	vkCmdEndRenderPass(cmd);
+	VK_CHECK(vkEndCommandBuffer(cmd));
 }
 
 void Renderer::build_deferred_command_buffer()
@@ -1429,6 +1370,13 @@ void Renderer::build_deferred_command_buffer()
 
 	vkBeginCommandBuffer(get_current_frame()._mainCommandBuffer, &cmdBufInfo);
 
+	record_surfel_stats(get_current_frame()._mainCommandBuffer);
+
+	if (_surfelCacheSaveRequested)
+		record_surfel_cache_save(get_current_frame()._mainCommandBuffer);
+
+	_graph.record(get_current_frame()._mainCommandBuffer, PASS_DEFERRED);
+
 	vkCmdBeginRenderPass(get_current_frame()._mainCommandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 	vkCmdBindPipeline(get_current_frame()._mainCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _finalPipeline);
 
@@ -1438,10 +1386,10 @@ void Renderer::build_deferred_command_buffer()
 
 	vkCmdPushConstants(get_current_frame()._mainCommandBuffer, _finalPipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(pushConstants), &_constants);
 
-	vkCmdBindDescriptorSets(get_current_frame()._mainCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _finalPipelineLayout, 0, 1, &get_current_frame().deferredDescriptorSet, 0, nullptr);
+	vkCmdBindDescriptorSets(get_current_frame()._mainCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _finalPipelineLayout, 0, 1, &get_current_frame().deferredDescriptorSet, 4, _frameUniforms.offsets(frame_index()));
 	vkCmdBindVertexBuffers(get_current_frame()._mainCommandBuffer, 0, 1, &quad->_vertexBuffer._buffer, &offset);
 	vkCmdBindIndexBuffer(get_current_frame()._mainCommandBuffer, quad->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
-	vkCmdDrawIndexed(get_current_frame()._mainCommandBuffer, static_cast<uint32_t>(quad->_indices.size()), 1, 0, 0, 1);
+	vkCmdDrawIndexed(get_current_frame()._mainCommandBuffer, static_cast<uint32_t>(quad->index_count()), 1, 0, 0, 1);
 
 	//ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), get_current_frame()._mainCommandBuffer);
 
@@ -1452,27 +1400,25 @@ void Renderer::build_deferred_command_buffer()
 void Renderer::load_data_to_gpu()
 {
 	// Raster data
-	if(!_cameraBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(GPUCameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _cameraBuffer);
+	if (!_frameUniforms.buffer())
+	{
+		_lights.init(FRAME_OVERLAP, _scene->_lights.size());
+		_lightClusters.init(_scene->_lights.size());
+		_frameUniforms.reserve(FRAME_LIGHTS, _lights.bytes());
+		_frameUniforms.reserve(FRAME_LIGHT_CLUSTERS, _lightClusters.bytes());
+		_frameUniforms.init(FRAME_OVERLAP);
+		VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+			_frameUniforms.cleanup();
+			});
+	}
 	if(!VulkanEngine::engine->_objectBuffer._buffer)
 		VulkanEngine::engine->create_buffer(sizeof(GPUMaterial), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VulkanEngine::engine->_objectBuffer);
-	if (!_debugBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(uint32_t), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _debugBuffer);
-	if (!_cameraPositionBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::vec3), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _cameraPositionBuffer);
-	if (!_frameCountBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(sizeof(int)), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _frameCountBuffer);
 
 	// Raytracing data
-	const unsigned int nLights		= _scene->_lights.size();
 	const unsigned int nMaterials	= Material::_materials.size();
 
-	if (!_lightBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(uboLight) * nLights, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _lightBuffer);
 	if (!_matBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(GPUMaterial) * nMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _matBuffer);
-	if (!_rtCameraBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(RTCameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _rtCameraBuffer);
+		VulkanEngine::engine->create_buffer(sizeof(GPUMaterial) * nMaterials, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _matBuffer);
 
 	// TODO: rethink how to update vertex and index for each entity
 	for (Object* obj : _scene->_entities)
@@ -1484,12 +1430,7 @@ void Renderer::load_data_to_gpu()
 	}
 
 	if(!_matricesBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::mat4) * _scene->_matricesVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _matricesBuffer);
-
-	void* matricesData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _matricesBuffer._allocation, &matricesData);
-	memcpy(matricesData, _scene->_matricesVector.data(), sizeof(glm::mat4) * _scene->_matricesVector.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _matricesBuffer._allocation);
+		VulkanEngine::engine->create_buffer(sizeof(glm::mat4) * _scene->_matricesVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _matricesBuffer);
 
 
 	// Update material data
@@ -1500,11 +1441,13 @@ void Renderer::load_data_to_gpu()
 		materials.push_back(mat);
 	}
 
-	void* matData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation, &matData);
-	memcpy(matData, materials.data(), sizeof(GPUMaterial) * materials.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _matBuffer._allocation);
-
+	// Through the staging ring, the batch is submitted before the first frame reads them
+	AssetLoader::get().upload(
+		[&](UploadQueue& queue) {
+			queue.copy_buffer(_scene->_matricesVector.data(), sizeof(glm::mat4) * _scene->_matricesVector.size(), _matricesBuffer._buffer);
+			queue.copy_buffer(materials.data(), sizeof(GPUMaterial) * materials.size(), _matBuffer._buffer);
+		},
+		[]() {});
 }
 
 void Renderer::create_storage_image()
@@ -1516,15 +1459,6 @@ void Renderer::create_storage_image()
 	VkImageCreateInfo shadowImageInfo	= vkinit::image_create_info(VK_FORMAT_R8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
 	shadowImageInfo.initialLayout		= VK_IMAGE_LAYOUT_UNDEFINED;
 
-	VkImageCreateInfo debugImageInfo = vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
-	debugImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-
-
-	VkImageCreateInfo resutlGIinfo = vkinit::image_create_info(VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
-	resutlGIinfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-
-	
-
 	VmaAllocationCreateInfo allocInfo{};
 	allocInfo.usage			= VMA_MEMORY_USAGE_GPU_ONLY;
 	allocInfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
@@ -1535,19 +1469,7 @@ void Renderer::create_storage_image()
 	VkImageViewCreateInfo imageViewInfo = vkinit::image_view_create_info(VK_FORMAT_B8G8R8A8_UNORM, _rtImage.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
 	VK_CHECK(vkCreateImageView(*device, &imageViewInfo, nullptr, &_rtImage.imageView));
 
-	vmaCreateImage(VulkanEngine::engine->_allocator, &debugImageInfo, &allocInfo,
-		&_debugGI.image._image, &_debugGI.image._allocation, nullptr);
-
-	VkImageViewCreateInfo dubugImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, _debugGI.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-	VK_CHECK(vkCreateImageView(*device, &dubugImageViewInfo, nullptr, &_debugGI.imageView));
-
-
-	vmaCreateImage(VulkanEngine::engine->_allocator, &resutlGIinfo, &allocInfo,
-		&_result.image._image, &_result.image._allocation, nullptr);
-
-	VkImageViewCreateInfo resultImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R16G16B16A16_SFLOAT, _result.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-	VK_CHECK(vkCreateImageView(*device, &resultImageViewInfo, nullptr, &_result.imageView));
-
+	create_surfel_coverage_images();
 
 	_shadowImages.reserve(_scene->_lights.size());
 
@@ -1610,33 +1532,6 @@ void Renderer::create_storage_image()
 		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, _shadowImages.size(), denoisedBarriers.data());
 	});
 
-	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
-		VkImageMemoryBarrier imageMemoryBarrier{};
-		imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		imageMemoryBarrier.image = _debugGI.image._image;
-		imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-		VkImageMemoryBarrier barrier[] = { imageMemoryBarrier };
-
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, barrier);
-		});
-
-
-	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
-		VkImageMemoryBarrier imageMemoryBarrier{};
-		imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		imageMemoryBarrier.image = _result.image._image;
-		imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-		imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-
-		VkImageMemoryBarrier barrier[] = { imageMemoryBarrier };
-
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, barrier);
-		});
-
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vmaDestroyImage(VulkanEngine::engine->_allocator, _rtImage.image._image, _rtImage.image._allocation);
 		vkDestroyImageView(*device, _rtImage.imageView, nullptr);
@@ -1658,6 +1553,90 @@ void Renderer::create_storage_image()
 	});
 }
 
+// The debug and result images of the surfel coverage pass, SurfelConfig::coverage_extent of the window
+void Renderer::create_surfel_coverage_images()
+{
+	const glm::uvec2 coverage	= _surfelConfig.coverage_extent(VulkanEngine::engine->_window->getWidth(), VulkanEngine::engine->_window->getHeight());
+	VkExtent3D extent			= { coverage.x, coverage.y, 1 };
+
+	VkImageCreateInfo debugImageInfo = vkinit::image_create_info(VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
+	debugImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkImageCreateInfo resutlGIinfo = vkinit::image_create_info(VK_FORMAT_R16G16B16A16_SFLOAT, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, extent);
+	resutlGIinfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VmaAllocationCreateInfo allocInfo{};
+	allocInfo.usage			= VMA_MEMORY_USAGE_GPU_ONLY;
+	allocInfo.requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	vmaCreateImage(VulkanEngine::engine->_allocator, &debugImageInfo, &allocInfo,
+		&_debugGI.image._image, &_debugGI.image._allocation, nullptr);
+
+	VkImageViewCreateInfo dubugImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, _debugGI.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	VK_CHECK(vkCreateImageView(*device, &dubugImageViewInfo, nullptr, &_debugGI.imageView));
+
+	vmaCreateImage(VulkanEngine::engine->_allocator, &resutlGIinfo, &allocInfo,
+		&_result.image._image, &_result.image._allocation, nullptr);
+
+	VkImageViewCreateInfo resultImageViewInfo = vkinit::image_view_create_info(VK_FORMAT_R16G16B16A16_SFLOAT, _result.image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+	VK_CHECK(vkCreateImageView(*device, &resultImageViewInfo, nullptr, &_result.imageView));
+
+	VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
+		VkImageMemoryBarrier imageMemoryBarrier{};
+		imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+		imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+		VkImageMemoryBarrier barrier[] = { imageMemoryBarrier, imageMemoryBarrier };
+		barrier[0].image = _debugGI.image._image;
+		barrier[1].image = _result.image._image;
+
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 2, barrier);
+		});
+}
+
+// Recreates the coverage images at the new window size and points everything that used the old ones at them.
+// The pipelines read the sizes of the images at runtime and stay as they are.
+void Renderer::resize_surfel_coverage()
+{
+	vkDeviceWaitIdle(*device);
+
+	VkImage oldDebug	= _debugGI.image._image;
+	VkImage oldResult	= _result.image._image;
+
+	vkDestroyImageView(*device, _debugGI.imageView, nullptr);
+	vmaDestroyImage(VulkanEngine::engine->_allocator, _debugGI.image._image, _debugGI.image._allocation);
+	vkDestroyImageView(*device, _result.imageView, nullptr);
+	vmaDestroyImage(VulkanEngine::engine->_allocator, _result.image._image, _result.image._allocation);
+
+	create_surfel_coverage_images();
+
+	_graph.replace_image(oldDebug, _debugGI.image._image);
+	_graph.replace_image(oldResult, _result.image._image);
+	_graph.compile();
+
+	VkDescriptorImageInfo debugImageDescriptor	= vkinit::descriptor_image_info(_debugGI.imageView, VK_IMAGE_LAYOUT_GENERAL);
+	VkDescriptorImageInfo resultImageDescriptor	= vkinit::descriptor_image_info(_result.imageView, VK_IMAGE_LAYOUT_GENERAL);
+	VkDescriptorImageInfo debugGIdesc			= vkinit::descriptor_image_info(_debugGI.imageView, VK_IMAGE_LAYOUT_GENERAL, _offscreenSampler);
+	VkDescriptorImageInfo resultGIdesc			= vkinit::descriptor_image_info(_result.imageView, VK_IMAGE_LAYOUT_GENERAL, _offscreenSampler);
+
+	std::vector<VkWriteDescriptorSet> writes = {
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _SurfelPositionDescSet, &debugImageDescriptor, 8),
+		vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _SurfelPositionDescSet, &resultImageDescriptor, 9)
+	};
+	for (uint32_t i = 0; i < FRAME_OVERLAP; i++)
+	{
+		writes.push_back(vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &debugGIdesc, 10));
+		writes.push_back(vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _frames[i].deferredDescriptorSet, &resultGIdesc, 11));
+	}
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
+
+	// The dispatch size and the barriers live in the prerecorded surfel update chain
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		record_surfel_update_chain(frame);
+}
+
 void Renderer::recreate_renderer()
 {
 	init_render_pass();
@@ -1667,6 +1646,7 @@ void Renderer::recreate_renderer()
 	init_raytracing_pipeline();
 	init_framebuffers();
 	init_offscreen_framebuffers();
+	resize_surfel_coverage();
 }
 
 // VKRAY
@@ -2041,6 +2021,8 @@ void Renderer::create_shadow_descriptors()
 			{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 			{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
 			{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+			{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+			{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
 			{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 			{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1}
 	};
@@ -2061,8 +2043,8 @@ void Renderer::create_shadow_descriptors()
 
 	VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);
 	VkDescriptorSetLayoutBinding storageImageLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, nLights);
-	VkDescriptorSetLayoutBinding uniformBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
-	VkDescriptorSetLayoutBinding lightBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3);
+	VkDescriptorSetLayoutBinding uniformBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
+	VkDescriptorSetLayoutBinding lightBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3);
 	VkDescriptorSetLayoutBinding sampleBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 4);	// Samples buffer
 	VkDescriptorSetLayoutBinding gbuffersBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 5, 3);
 	VkDescriptorSetLayoutBinding materialBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 6);
@@ -2102,10 +2084,10 @@ void Renderer::create_shadow_descriptors()
 	}
 
 	// Binding = 2 Camera data
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_RT_CAMERA);
 
 	// Binding = 3 lights
-	VkDescriptorBufferInfo lightBufferInfo = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
+	VkDescriptorBufferInfo lightBufferInfo = _frameUniforms.descriptor(FRAME_LIGHTS);
 
 	// Binding = 4 Samples
 	if (!_shadowSamplesBuffer._buffer)
@@ -2128,8 +2110,8 @@ void Renderer::create_shadow_descriptors()
 	// WRITES ---
 	VkWriteDescriptorSet accelerationStructureWrite = vkinit::write_descriptor_acceleration_structure(_shadowDescSet, &descriptorSetAS, 0);
 	VkWriteDescriptorSet resultImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _shadowDescSet, shadowsInfo.data(), 1, nLights);
-	VkWriteDescriptorSet uniformBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _shadowDescSet, &cameraBufferInfo, 2);
-	VkWriteDescriptorSet lightsBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &lightBufferInfo, 3);
+	VkWriteDescriptorSet uniformBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _shadowDescSet, &cameraBufferInfo, 2);
+	VkWriteDescriptorSet lightsBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _shadowDescSet, &lightBufferInfo, 3);
 	VkWriteDescriptorSet samplesWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _shadowDescSet, &samplesDescInfo, 4);
 	VkWriteDescriptorSet gbuffersWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _shadowDescSet, gbuffersDescInfo.data(), 5, gbuffersDescInfo.size());
 	VkWriteDescriptorSet materialWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _shadowDescSet, &materialDescInfo, 6);
@@ -2150,7 +2132,7 @@ void Renderer::create_shadow_descriptors()
 	//-------------
 	VkDescriptorSetLayoutBinding inputImageLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0, nLights);
 	VkDescriptorSetLayoutBinding resultImageLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1, nLights);
-	VkDescriptorSetLayoutBinding frameLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding frameLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	VkDescriptorSetLayoutBinding motionLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
 
 	std::vector<VkDescriptorSetLayoutBinding> denoiseBindings({
@@ -2183,12 +2165,11 @@ void Renderer::create_shadow_descriptors()
 	}
 
 	// Binding = 2 Frame Count Buffer
-	VulkanEngine::engine->create_buffer(sizeof(int), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _frameCountBuffer);
-	VkDescriptorBufferInfo frameDescInfo = vkinit::descriptor_buffer_info(_frameCountBuffer._buffer, sizeof(int));
+	VkDescriptorBufferInfo frameDescInfo = _frameUniforms.descriptor(FRAME_COUNT);
 
 	VkWriteDescriptorSet inputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, inputImagesInfo.data(), 0, nLights);
 	VkWriteDescriptorSet outputImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _sPostDescSet, outputImagesInfo.data(), 1, nLights);
-	VkWriteDescriptorSet frameBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _sPostDescSet, &frameDescInfo, 2);
+	VkWriteDescriptorSet frameBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _sPostDescSet, &frameDescInfo, 2);
 	VkWriteDescriptorSet motionImageWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _sPostDescSet, &motionDescInfo, 3);
 
 	std::vector<VkWriteDescriptorSet> writeDenoiseDescriptorSets = {
@@ -2214,6 +2195,8 @@ void Renderer::create_rt_descriptors()
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 100}
 	};
@@ -2242,11 +2225,11 @@ void Renderer::create_rt_descriptors()
 
 	VkDescriptorSetLayoutBinding accelerationStructureLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);
 	VkDescriptorSetLayoutBinding resultImageLayoutBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1);
-	VkDescriptorSetLayoutBinding uniformBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
+	VkDescriptorSetLayoutBinding uniformBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);
 	VkDescriptorSetLayoutBinding vertexBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 3, nInstances);
 	VkDescriptorSetLayoutBinding indexBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4, nInstances);
 	VkDescriptorSetLayoutBinding matrixBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5);
-	VkDescriptorSetLayoutBinding lightBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6);
+	VkDescriptorSetLayoutBinding lightBufferBinding					= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6);
 	VkDescriptorSetLayoutBinding materialBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 7);
 	VkDescriptorSetLayoutBinding matIdxBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 8);
 	VkDescriptorSetLayoutBinding texturesBufferBinding				= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 9, nTextures);
@@ -2295,30 +2278,28 @@ void Renderer::create_rt_descriptors()
 	VkDescriptorImageInfo storageImageDescriptor = vkinit::descriptor_image_info(_rtImage.imageView, VK_IMAGE_LAYOUT_GENERAL);
 
 	// Binding = 2 Camera 
-	VkDescriptorBufferInfo _rtDescriptorBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
+	VkDescriptorBufferInfo _rtDescriptorBufferInfo = _frameUniforms.descriptor(FRAME_RT_CAMERA);
 
 	std::vector<VkDescriptorBufferInfo> vertexDescInfo;
 	std::vector<VkDescriptorBufferInfo> indexDescInfo;
 	std::vector<glm::vec4> idVector;
 	for (Object* obj : _scene->_entities)
 	{
-		std::vector<Vertex> vertices = obj->prefab->_mesh->_vertices;
-		std::vector<uint32_t> indices = obj->prefab->_mesh->_indices;
-		size_t vertexBufferSize = sizeof(rtVertexAttribute) * vertices.size();
-		size_t indexBufferSize = sizeof(uint32_t) * indices.size();
+		const Vertex* vertices = obj->prefab->_mesh->vertex_data();
+		const size_t vertexCount = obj->prefab->_mesh->vertex_count();
+		size_t vertexBufferSize = sizeof(rtVertexAttribute) * vertexCount;
+		size_t indexBufferSize = sizeof(uint32_t) * obj->prefab->_mesh->index_count();
 		AllocatedBuffer vBuffer;
-		VulkanEngine::engine->create_buffer(vertexBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, vBuffer);
+		VulkanEngine::engine->create_buffer(vertexBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, vBuffer);
 
 		std::vector<rtVertexAttribute> vAttr;
-		vAttr.reserve(vertices.size());
-		for (Vertex& v : vertices) {
+		vAttr.reserve(vertexCount);
+		for (size_t i = 0; i < vertexCount; i++) {
+			const Vertex& v = vertices[i];
 			vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, 1, 1} });
 		}
 
-		void* vdata;
-		vmaMapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation, &vdata);
-		memcpy(vdata, vAttr.data(), vertexBufferSize);
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation);
+		AssetLoader::get().upload([&](UploadQueue& queue) { queue.copy_buffer(vAttr.data(), vertexBufferSize, vBuffer._buffer); }, []() {});
 
 		// Binding = 3 Vertices buffer
 		VkDescriptorBufferInfo vertexBufferDescriptor = vkinit::descriptor_buffer_info(vBuffer._buffer, vertexBufferSize);
@@ -2338,16 +2319,15 @@ void Renderer::create_rt_descriptors()
 	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _scene->_matricesVector.size());
 
 	// Binding = 6 lights
-	VkDescriptorBufferInfo lightBufferInfo = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
+	VkDescriptorBufferInfo lightBufferInfo = _frameUniforms.descriptor(FRAME_LIGHTS);
 
 	// Binding = 7 ID buffer
+	// The ids are the same for every set that binds them, the first one uploads them
 	if (!_idBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * idVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _idBuffer);
-
-	void* idData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation, &idData);
-	memcpy(idData, idVector.data(), sizeof(glm::vec4) * idVector.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation);
+	{
+		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * idVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _idBuffer);
+		AssetLoader::get().upload([&](UploadQueue& queue) { queue.copy_buffer(idVector.data(), sizeof(glm::vec4) * idVector.size(), _idBuffer._buffer); }, []() {});
+	}
 
 	VkDescriptorBufferInfo idDescInfo = vkinit::descriptor_buffer_info(_idBuffer._buffer, sizeof(glm::vec4) * idVector.size());
 
@@ -2368,8 +2348,8 @@ void Renderer::create_rt_descriptors()
 
 	// Binding = 10 Skybox
 	VkDescriptorImageInfo skyboxImagesDesc[2];
-	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
-	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
 
 	// Binding = 11 Shadow texture
 	std::vector<VkDescriptorImageInfo> shadowImagesDesc(_denoisedImages.size());
@@ -2386,11 +2366,11 @@ void Renderer::create_rt_descriptors()
 
 	// WRITES ---
 	VkWriteDescriptorSet resultImageWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _rtDescriptorSet, &storageImageDescriptor, 1);
-	VkWriteDescriptorSet uniformBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _rtDescriptorSet, &_rtDescriptorBufferInfo, 2);
+	VkWriteDescriptorSet uniformBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _rtDescriptorSet, &_rtDescriptorBufferInfo, 2);
 	VkWriteDescriptorSet vertexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, vertexDescInfo.data(), 3, nInstances);
 	VkWriteDescriptorSet indexBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, indexDescInfo.data(), 4, nInstances);
 	VkWriteDescriptorSet matrixBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &matrixDescInfo, 5);
-	VkWriteDescriptorSet lightsBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &lightBufferInfo, 6);
+	VkWriteDescriptorSet lightsBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _rtDescriptorSet, &lightBufferInfo, 6);
 	VkWriteDescriptorSet matBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &materialBufferInfo, 7);
 	VkWriteDescriptorSet matIdxBufferWrite	= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _rtDescriptorSet, &idDescInfo, 8);
 	VkWriteDescriptorSet textureBufferWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _rtDescriptorSet, imageInfos.data(), 9, nTextures);
@@ -2634,16 +2614,16 @@ void Renderer::create_shader_binding_table()
 	vmaUnmapMemory(VulkanEngine::engine->_allocator, shitSBT._allocation);
 }
 
-void Renderer::build_compute_command_buffer()
+void Renderer::build_compute_command_buffer(uint32_t frame)
 {
 	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
-	VkCommandBuffer &cmd = _denoiseCommandBuffer;
+	VkCommandBuffer &cmd = _denoiseCommandBuffer[frame];
 
 	VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _sPostPipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _sPostPipelineLayout, 0, 1, &_sPostDescSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _sPostPipelineLayout, 0, 1, &_sPostDescSet, 1, _frameUniforms.offsets(frame));
 
 	//shaderIf = 1;
 
@@ -2656,18 +2636,477 @@ void Renderer::build_compute_command_buffer()
 	VK_CHECK(vkEndCommandBuffer(cmd));
 }
 
+void Renderer::init_surfel_config()
+{
+	_surfelConfig = VulkanEngine::engine->_surfelConfig;
+
+	// One specialization info shared by every surfel pipeline, stages skip the ids they do not declare
+	_surfelConfig.specialization(_surfelSpecData);
+	for (uint32_t i = 0; i < SURFEL_SPEC_COUNT; i++)
+	{
+		_surfelSpecEntries[i].constantID	= i;
+		_surfelSpecEntries[i].offset		= i * sizeof(uint32_t);
+		_surfelSpecEntries[i].size			= sizeof(uint32_t);
+	}
+
+	_surfelSpecInfo.mapEntryCount	= SURFEL_SPEC_COUNT;
+	_surfelSpecInfo.pMapEntries		= _surfelSpecEntries;
+	_surfelSpecInfo.dataSize		= sizeof(_surfelSpecData);
+	_surfelSpecInfo.pData			= _surfelSpecData;
+
+	std::cout << "Surfel config: " << _surfelConfig.capacity << " surfels, grid " << _surfelConfig.gridDimensions.x << "x" << _surfelConfig.gridDimensions.y << "x" << _surfelConfig.gridDimensions.z
+		<< " x " << SURFEL_CASCADE_COUNT << " cascades, " << _surfelConfig.cellLimit << " per cell, " << _surfelConfig.indirectThreads << " threads per group, coverage at 1/"
+		<< _surfelConfig.coverageScale << " resolution in " << _surfelConfig.tileSize.x << "x" << _surfelConfig.tileSize.y << " tiles" << std::endl;
+}
+
 void Renderer::create_SurfelGi_resources()
 {
-	//preguntar pau cmo crear texturas
-	//sizeof(SurfelGridCell)* SURFEL_TABLE_SIZE
-	VulkanEngine::engine->create_buffer(
-		(VulkanEngine::engine->_window->getWidth() / 16) * (VulkanEngine::engine->_window->getHeight() / 16 * sizeof(glm::vec2)), 
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelPositionBuffer);
-	VulkanEngine::engine->create_buffer(sizeof(Surfel) * SURFEL_CAPACITY, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelBuffer);
-	VulkanEngine::engine->create_buffer(sizeof(SurfelData) * SURFEL_CAPACITY, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelDataBuffer);
-	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * 8, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelStatsBuffer);
-	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * SURFEL_TABLE_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelGridBuffer);
-	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelCellBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(SurfelStorage) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(SurfelDataStorage) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelDataBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * SURFEL_STATS_SIZE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelStatsBuffer);
+
+	// Surfel slots are handed out from a stack of free indices and given back when a surfel is recycled.
+	// The alive list holds the indices in use and, in its second half, the survivors of the update pass.
+	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * _surfelConfig.capacity * 2, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelAliveBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelDeadBuffer);
+
+	// The ray budget of a frame is split between the surfels, each one owns a range of the queue and of the ray results
+	VulkanEngine::engine->create_buffer(sizeof(SurfelRayRange) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelRayRangeBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * _surfelConfig.rayBudget, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelRayQueueBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(SurfelRay) * _surfelConfig.rayBudget, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelRayBuffer);
+
+	// Every SURFEL_SORT_INTERVAL frames the surfels are moved to the slots of their cell's Morton order, through a second copy
+	VulkanEngine::engine->create_buffer(sizeof(unsigned int) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelRemapBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(SurfelStorage) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelSortBuffer);
+	VulkanEngine::engine->create_buffer(sizeof(SurfelDataStorage) * _surfelConfig.capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelDataSortBuffer);
+
+	// Every slot starts free, popped in ascending order
+	const unsigned int budget = _surfelConfig.budget();
+	std::vector<unsigned int> dead(_surfelConfig.capacity, 0);
+	for (unsigned int i = 0; i < budget; i++)
+		dead[i] = budget - 1 - i;
+
+	std::vector<unsigned int> stats(SURFEL_STATS_SIZE, 0);
+	stats[SURFEL_STATS_OFFSET_DEADCOUNT] = budget;
+
+	bool seeded = false;
+	AssetLoader::get().upload(
+		[&](UploadQueue& queue) {
+			queue.copy_buffer(dead.data(), sizeof(unsigned int) * dead.size(), _SurfelDeadBuffer._buffer);
+			queue.copy_buffer(stats.data(), sizeof(unsigned int) * stats.size(), _SurfelStatsBuffer._buffer);
+		},
+		[&]() { seeded = true; });
+	AssetLoader::get().wait([&]() { return seeded; });
+
+	// Cells point into one index list filled by the binning passes every frame, instead of
+	// reserving a fixed number of slots for every cell of the grid
+	const VkDeviceSize gridSize = sizeof(SurfelGridCell) * _surfelConfig.table_size();
+	const VkDeviceSize cellSize = sizeof(unsigned int) * _surfelConfig.cell_index_capacity();
+	const VkDeviceSize denseSize = sizeof(unsigned int) * (VkDeviceSize)_surfelConfig.table_size() * (_surfelConfig.cellLimit + 1);
+	VulkanEngine::engine->create_buffer(gridSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelGridBuffer);
+	VulkanEngine::engine->create_buffer(cellSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _SurfelCellBuffer);
+
+	std::cout << "Surfel grid: " << (gridSize + cellSize) / (1024 * 1024) << " MB, the dense layout took " << denseSize / (1024 * 1024) << " MB" << std::endl;
+
+	load_surfel_cache();
+}
+
+void Renderer::load_surfel_cache()
+{
+	const std::string path = SurfelCache::get_path(_scene->_index);
+	const uint64_t key = SurfelCache::scene_key(_scene->_index, _scene->_matricesVector);
+	std::shared_ptr<SurfelCache> cache = std::make_shared<SurfelCache>();
+
+	// Mapped and validated on a worker, the sections are then streamed from the mapping through
+	// the staging ring over the seeded buffers, in one batch so no frame sees half a snapshot
+	const SurfelConfig config = _surfelConfig;
+	AssetLoader::get().load(
+		[cache, path, key, config]() { cache->load(path, key, config); },
+		[this, cache](UploadQueue& queue) {
+			if (!cache->_header)
+				return;
+
+			const SurfelCacheHeader& header = *cache->_header;
+			queue.copy_buffer(cache->surfels(), sizeof(SurfelStorage) * header.surfels.count, _SurfelBuffer._buffer);
+			queue.copy_buffer(cache->surfelData(), sizeof(SurfelDataStorage) * header.surfelData.count, _SurfelDataBuffer._buffer);
+			queue.copy_buffer(cache->alive(), sizeof(uint32_t) * header.alive.count, _SurfelAliveBuffer._buffer);
+			queue.copy_buffer(cache->dead(), sizeof(uint32_t) * header.dead.count, _SurfelDeadBuffer._buffer);
+
+			// The grid is not in the snapshot, the first frame bins it before anything spawns against it
+			std::vector<uint32_t> stats(cache->stats(), cache->stats() + header.stats.count);
+			stats[SURFEL_STATS_OFFSET_CELLALLOCATOR] = SURFEL_GRID_UNBUILT;
+			queue.copy_buffer(stats.data(), sizeof(uint32_t) * stats.size(), _SurfelStatsBuffer._buffer);
+		},
+		[this, cache, path]() {
+			if (cache->_header)
+				std::cout << "Surfel cache: " << cache->stats()[SURFEL_STATS_OFFSET_COUNT] << " surfels from " << path << std::endl;
+			else
+				std::cout << "Surfel cache: no valid snapshot in " << path << ", starting cold" << std::endl;
+			_surfelCacheDone = true;
+		});
+}
+
+void Renderer::request_surfel_cache_save()
+{
+	if (_surfelCacheSaveRequested || _surfelCacheSaveFrame >= 0 || _surfelCacheSaved)
+		return;
+
+	// The readback buffer has the layout of the file, it is written out as is
+	const SurfelCacheHeader header = SurfelCache::layout(SurfelCache::scene_key(_scene->_index, _scene->_matricesVector), _surfelConfig);
+	if (_surfelCacheReadback._buffer == VK_NULL_HANDLE)
+		VulkanEngine::engine->create_buffer(header.fileSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, _surfelCacheReadback);
+
+	_surfelCacheSaveRequested = true;
+}
+
+void Renderer::record_surfel_cache_save(VkCommandBuffer cmd)
+{
+	const SurfelCacheHeader header = SurfelCache::layout(SurfelCache::scene_key(_scene->_index, _scene->_matricesVector), _surfelConfig);
+
+	auto copy = [&](VkBuffer src, const SurfelCacheSection& section, VkDeviceSize elementSize) {
+		VkBufferCopy region = {};
+		region.srcOffset = 0;
+		region.dstOffset = section.offset;
+		region.size = section.count * elementSize;
+		vkCmdCopyBuffer(cmd, src, _surfelCacheReadback._buffer, 1, &region);
+	};
+
+	copy(_SurfelBuffer._buffer, header.surfels, sizeof(SurfelStorage));
+	copy(_SurfelDataBuffer._buffer, header.surfelData, sizeof(SurfelDataStorage));
+	copy(_SurfelStatsBuffer._buffer, header.stats, sizeof(uint32_t));
+	copy(_SurfelAliveBuffer._buffer, header.alive, sizeof(uint32_t));
+	copy(_SurfelDeadBuffer._buffer, header.dead, sizeof(uint32_t));
+
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	_surfelCacheSaveRequested = false;
+	_surfelCacheSaveFrame = *frameNumber;
+}
+
+void Renderer::write_surfel_cache()
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+
+	const std::string path = SurfelCache::get_path(_scene->_index);
+	const SurfelCacheHeader header = SurfelCache::layout(SurfelCache::scene_key(_scene->_index, _scene->_matricesVector), _surfelConfig);
+
+	void* data;
+	vmaMapMemory(engine->_allocator, _surfelCacheReadback._allocation, &data);
+	vmaInvalidateAllocation(engine->_allocator, _surfelCacheReadback._allocation, 0, VK_WHOLE_SIZE);
+	const uint8_t* image = static_cast<const uint8_t*>(data);
+
+	// The file is written while the engine keeps running or shuts down, the mapping goes once it is done
+	std::shared_future<void> written = ThreadPool::get().enqueue([header, path, image]() {
+		if (SurfelCache::write(path, header, image))
+			std::cout << "Surfel cache: saved " << reinterpret_cast<const uint32_t*>(image + header.stats.offset)[SURFEL_STATS_OFFSET_COUNT] << " surfels to " << path << std::endl;
+		}).share();
+
+	engine->_mainDeletionQueue.push_function([=]() {
+		written.wait();
+		vmaUnmapMemory(engine->_allocator, _surfelCacheReadback._allocation);
+		});
+
+	_surfelCacheSaveFrame = -1;
+	_surfelCacheSaved = true;
+}
+
+void Renderer::flush_surfel_cache()
+{
+	// No frame got to record the copy, the GPU is idle so it is done here with a barrier on everything
+	if (_surfelCacheSaveRequested)
+	{
+		VulkanEngine::engine->immediate_submit([&](VkCommandBuffer cmd) {
+			VkMemoryBarrier barrier = {};
+			barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+			record_surfel_cache_save(cmd);
+			});
+	}
+
+	if (_surfelCacheSaveFrame >= 0)
+		write_surfel_cache();
+}
+
+void Renderer::create_surfel_stats_readback()
+{
+	VulkanEngine* engine = VulkanEngine::engine;
+
+	engine->create_buffer(sizeof(uint32_t) * SURFEL_STATS_SIZE * SURFEL_STATS_READBACK_FRAMES, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU, _surfelStatsReadback, false);
+
+	void* data;
+	vmaMapMemory(engine->_allocator, _surfelStatsReadback._allocation, &data);
+	memset(data, 0, sizeof(uint32_t) * SURFEL_STATS_SIZE * SURFEL_STATS_READBACK_FRAMES);
+	_surfelStatsRing.init(static_cast<const uint32_t*>(data), SURFEL_STATS_READBACK_FRAMES);
+
+	if (!engine->_surfelTelemetryPath.empty())
+		_surfelTelemetry.open(engine->_surfelTelemetryPath);
+
+	engine->_mainDeletionQueue.push_function([=]() {
+		vmaUnmapMemory(engine->_allocator, _surfelStatsReadback._allocation);
+		vmaDestroyBuffer(engine->_allocator, _surfelStatsReadback._buffer, _surfelStatsReadback._allocation);
+		});
+}
+
+void Renderer::record_surfel_stats(VkCommandBuffer cmd)
+{
+	const uint32_t slot = _surfelStatsRing.begin_frame(*frameNumber);
+
+	_graph.record(cmd, PASS_SURFEL_STATS);
+
+	VkBufferCopy region = {};
+	region.srcOffset	= 0;
+	region.dstOffset	= sizeof(uint32_t) * SURFEL_STATS_SIZE * slot;
+	region.size			= sizeof(uint32_t) * SURFEL_STATS_SIZE;
+	vkCmdCopyBuffer(cmd, _SurfelStatsBuffer._buffer, _surfelStatsReadback._buffer, 1, &region);
+
+	VkMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void Renderer::collect_surfel_stats(uint64_t completed)
+{
+	vmaInvalidateAllocation(VulkanEngine::engine->_allocator, _surfelStatsReadback._allocation, 0, VK_WHOLE_SIZE);
+
+	std::vector<SurfelFrameStats> frames;
+	_surfelStatsRing.collect(completed, frames);
+	for (const SurfelFrameStats& stats : frames)
+		_surfelTelemetry.write(stats);
+}
+
+void Renderer::flush_surfel_stats()
+{
+	collect_surfel_stats(UINT64_MAX);
+	_surfelTelemetry.close();
+
+	if (_surfelStatsRing.dropped() > 0)
+		std::cout << "Surfel telemetry: " << _surfelStatsRing.dropped() << " frames overwritten before they were read" << std::endl;
+}
+
+void Renderer::init_render_graph()
+{
+	const VkPipelineStageFlags compute		= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	const VkPipelineStageFlags raytracing	= VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+	const VkPipelineStageFlags fragment		= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	const VkAccessFlags read				= VK_ACCESS_SHADER_READ_BIT;
+	const VkAccessFlags readWrite			= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	const VkImageLayout sampled				= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	const VkImageLayout storage				= VK_IMAGE_LAYOUT_GENERAL;
+
+	// Resources, images in the layout they are in between passes
+	std::vector<uint32_t> gbuffer;
+	for (size_t i = 0; i < _deferredTextures.size(); i++)
+	{
+		const bool depth = i == _deferredTextures.size() - 1;
+		gbuffer.push_back(_graph.add_image("gbuffer" + std::to_string(i), _deferredTextures[i].image._image, depth ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT, sampled));
+	}
+
+	std::vector<uint32_t> shadows;
+	for (size_t i = 0; i < _shadowImages.size(); i++)
+		shadows.push_back(_graph.add_image("shadow" + std::to_string(i), _shadowImages[i].image._image, VK_IMAGE_ASPECT_COLOR_BIT, storage));
+
+	const uint32_t debugGI		= _graph.add_image("debugGI", _debugGI.image._image, VK_IMAGE_ASPECT_COLOR_BIT, storage);
+	const uint32_t result		= _graph.add_image("result", _result.image._image, VK_IMAGE_ASPECT_COLOR_BIT, storage);
+	const uint32_t surfels		= _graph.add_buffer("surfels", _SurfelBuffer._buffer);
+	const uint32_t surfelData	= _graph.add_buffer("surfelData", _SurfelDataBuffer._buffer);
+	const uint32_t stats		= _graph.add_buffer("surfelStats", _SurfelStatsBuffer._buffer);
+	const uint32_t grid			= _graph.add_buffer("surfelGrid", _SurfelGridBuffer._buffer);
+	const uint32_t cells		= _graph.add_buffer("surfelCells", _SurfelCellBuffer._buffer);
+	const uint32_t alive		= _graph.add_buffer("surfelAlive", _SurfelAliveBuffer._buffer);
+	const uint32_t dead			= _graph.add_buffer("surfelDead", _SurfelDeadBuffer._buffer);
+	const uint32_t rayRanges	= _graph.add_buffer("surfelRayRanges", _SurfelRayRangeBuffer._buffer);
+	const uint32_t rayQueue		= _graph.add_buffer("surfelRayQueue", _SurfelRayQueueBuffer._buffer);
+	const uint32_t rays			= _graph.add_buffer("surfelRays", _SurfelRayBuffer._buffer);
+	const uint32_t remap		= _graph.add_buffer("surfelRemap", _SurfelRemapBuffer._buffer);
+	const uint32_t sorted		= _graph.add_buffer("surfelSorted", _SurfelSortBuffer._buffer);
+	const uint32_t sortedData	= _graph.add_buffer("surfelSortedData", _SurfelDataSortBuffer._buffer);
+
+	// Passes, in FramePass order
+	_graph.add_pass("gbuffer");
+	_graph.add_pass("surfel coverage");
+	_graph.add_pass("prepare indirect");
+	_graph.add_pass("grid reset");
+	_graph.add_pass("update surfels");
+	_graph.add_pass("surfel compact");
+	_graph.add_pass("grid offset");
+	_graph.add_pass("surfel binning");
+	_graph.add_pass("surfel sort order");
+	_graph.add_pass("surfel sort scatter");
+	_graph.add_pass("surfel sort apply");
+	_graph.add_pass("surfel ray allocate");
+	_graph.add_pass("surfel trace");
+	_graph.add_pass("shadow");
+	_graph.add_pass("surfel shade");
+	_graph.add_pass("surfel filter");
+	_graph.add_pass("surfel stats");
+	_graph.add_pass("deferred");
+
+	// The offscreen render pass clears the G-buffer and leaves it ready to be sampled
+	for (size_t i = 0; i < gbuffer.size() - 1; i++)
+		_graph.write(PASS_GBUFFER, gbuffer[i], VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, sampled);
+	_graph.write(PASS_GBUFFER, gbuffer.back(), VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, sampled);
+
+	_graph.read(PASS_SURFEL_COVERAGE, gbuffer[1], compute, read, sampled);
+	_graph.read(PASS_SURFEL_COVERAGE, gbuffer.back(), compute, read, sampled);
+	_graph.write(PASS_SURFEL_COVERAGE, surfels, compute, readWrite);
+	_graph.write(PASS_SURFEL_COVERAGE, stats, compute, readWrite);
+	_graph.read(PASS_SURFEL_COVERAGE, grid, compute, read);
+	_graph.read(PASS_SURFEL_COVERAGE, cells, compute, read);
+	_graph.write(PASS_SURFEL_COVERAGE, alive, compute, readWrite);
+	_graph.read(PASS_SURFEL_COVERAGE, dead, compute, read);
+	_graph.read(PASS_SURFEL_COVERAGE, surfelData, compute, read);
+	_graph.write(PASS_SURFEL_COVERAGE, debugGI, compute, VK_ACCESS_SHADER_WRITE_BIT, storage);
+	_graph.write(PASS_SURFEL_COVERAGE, result, compute, VK_ACCESS_SHADER_WRITE_BIT, storage);
+
+	_graph.write(PASS_PREPARE_INDIRECT, stats, compute, readWrite);
+
+	// Cells are counted, prefix summed into offsets and filled from scratch every frame
+	_graph.write(PASS_GRID_RESET, grid, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_UPDATE_SURFELS, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.read(PASS_UPDATE_SURFELS, stats, compute, read);
+	_graph.read(PASS_UPDATE_SURFELS, surfelData, compute, read);
+	_graph.write(PASS_UPDATE_SURFELS, surfels, compute, readWrite);
+	_graph.write(PASS_UPDATE_SURFELS, grid, compute, readWrite);
+	_graph.write(PASS_UPDATE_SURFELS, alive, compute, readWrite);
+	_graph.write(PASS_UPDATE_SURFELS, dead, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	// Survivors are copied to the front of the alive list and become the count
+	_graph.write(PASS_SURFEL_COMPACT, alive, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_COMPACT, stats, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+
+	_graph.write(PASS_GRID_OFFSET, stats, compute, readWrite);
+	_graph.write(PASS_GRID_OFFSET, grid, compute, readWrite);
+
+	_graph.read(PASS_SURFEL_BINNING, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.read(PASS_SURFEL_BINNING, stats, compute, read);
+	_graph.read(PASS_SURFEL_BINNING, surfels, compute, read);
+	_graph.read(PASS_SURFEL_BINNING, alive, compute, read);
+	_graph.write(PASS_SURFEL_BINNING, grid, compute, readWrite);
+	_graph.write(PASS_SURFEL_BINNING, cells, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_SURFEL_SORT_ORDER, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.write(PASS_SURFEL_SORT_ORDER, stats, compute, readWrite);
+	_graph.read(PASS_SURFEL_SORT_ORDER, surfels, compute, read);
+	_graph.read(PASS_SURFEL_SORT_ORDER, grid, compute, read);
+	_graph.read(PASS_SURFEL_SORT_ORDER, cells, compute, read);
+	_graph.write(PASS_SURFEL_SORT_ORDER, remap, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_SURFEL_SORT_SCATTER, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.write(PASS_SURFEL_SORT_SCATTER, stats, compute, readWrite);
+	_graph.read(PASS_SURFEL_SORT_SCATTER, surfels, compute, read);
+	_graph.read(PASS_SURFEL_SORT_SCATTER, surfelData, compute, read);
+	_graph.read(PASS_SURFEL_SORT_SCATTER, alive, compute, read);
+	_graph.write(PASS_SURFEL_SORT_SCATTER, remap, compute, readWrite);
+	_graph.write(PASS_SURFEL_SORT_SCATTER, sorted, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_SORT_SCATTER, sortedData, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_SURFEL_SORT_APPLY, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.write(PASS_SURFEL_SORT_APPLY, stats, compute, readWrite);
+	_graph.write(PASS_SURFEL_SORT_APPLY, surfels, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_SORT_APPLY, surfelData, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_SORT_APPLY, alive, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_SORT_APPLY, dead, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_SORT_APPLY, cells, compute, readWrite);
+	_graph.read(PASS_SURFEL_SORT_APPLY, remap, compute, read);
+	_graph.read(PASS_SURFEL_SORT_APPLY, sorted, compute, read);
+	_graph.read(PASS_SURFEL_SORT_APPLY, sortedData, compute, read);
+
+	_graph.read(PASS_SURFEL_RAY_ALLOCATE, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.write(PASS_SURFEL_RAY_ALLOCATE, stats, compute, readWrite);
+	_graph.read(PASS_SURFEL_RAY_ALLOCATE, surfels, compute, read);
+	_graph.read(PASS_SURFEL_RAY_ALLOCATE, surfelData, compute, read);
+	_graph.read(PASS_SURFEL_RAY_ALLOCATE, alive, compute, read);
+	_graph.write(PASS_SURFEL_RAY_ALLOCATE, rayRanges, compute, VK_ACCESS_SHADER_WRITE_BIT);
+	_graph.write(PASS_SURFEL_RAY_ALLOCATE, rayQueue, compute, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_SURFEL_TRACE, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.read(PASS_SURFEL_TRACE, surfels, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, stats, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, alive, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, surfelData, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, rayRanges, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, rayQueue, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, grid, raytracing, read);
+	_graph.read(PASS_SURFEL_TRACE, cells, raytracing, read);
+	_graph.write(PASS_SURFEL_TRACE, rays, raytracing, VK_ACCESS_SHADER_WRITE_BIT);
+
+	_graph.read(PASS_SHADOW, gbuffer[0], raytracing, read, sampled);
+	_graph.read(PASS_SHADOW, gbuffer[1], raytracing, read, sampled);
+	_graph.read(PASS_SHADOW, gbuffer[3], raytracing, read, sampled);
+	for (uint32_t shadow : shadows)
+		_graph.write(PASS_SHADOW, shadow, raytracing, VK_ACCESS_SHADER_WRITE_BIT, storage);
+
+	_graph.read(PASS_SURFEL_SHADE, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+	_graph.write(PASS_SURFEL_SHADE, stats, compute, readWrite);
+	_graph.write(PASS_SURFEL_SHADE, surfels, compute, readWrite);
+	_graph.write(PASS_SURFEL_SHADE, surfelData, compute, readWrite);
+	_graph.read(PASS_SURFEL_SHADE, grid, compute, read);
+	_graph.read(PASS_SURFEL_SHADE, cells, compute, read);
+	_graph.read(PASS_SURFEL_SHADE, alive, compute, read);
+	_graph.read(PASS_SURFEL_SHADE, rayRanges, compute, read);
+	_graph.read(PASS_SURFEL_SHADE, rays, compute, read);
+
+	if (_surfelConfig.filter)
+	{
+		_graph.read(PASS_SURFEL_FILTER, stats, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT);
+		_graph.read(PASS_SURFEL_FILTER, stats, compute, read);
+		_graph.read(PASS_SURFEL_FILTER, surfelData, compute, read);
+		_graph.read(PASS_SURFEL_FILTER, grid, compute, read);
+		_graph.read(PASS_SURFEL_FILTER, cells, compute, read);
+		_graph.read(PASS_SURFEL_FILTER, alive, compute, read);
+		_graph.write(PASS_SURFEL_FILTER, surfels, compute, readWrite);
+	}
+
+	// Copied into the readback ring once the frame is done with it, with the surfels on the frame a snapshot is saved
+	_graph.read(PASS_SURFEL_STATS, stats, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	_graph.read(PASS_SURFEL_STATS, surfels, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	_graph.read(PASS_SURFEL_STATS, surfelData, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	_graph.read(PASS_SURFEL_STATS, alive, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	_graph.read(PASS_SURFEL_STATS, dead, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+
+	for (size_t i = 0; i < gbuffer.size() - 1; i++)
+		_graph.read(PASS_DEFERRED, gbuffer[i], fragment, read, sampled);
+	_graph.read(PASS_DEFERRED, debugGI, fragment, read, storage);
+	_graph.read(PASS_DEFERRED, result, fragment, read, storage);
+	for (uint32_t shadow : shadows)
+		_graph.read(PASS_DEFERRED, shadow, fragment, read, storage);
+
+	// Coverage up to binning share a command buffer
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+	{
+		_graph.set_command_buffer(PASS_GBUFFER, frame, _offscreenComandBuffer[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_COVERAGE, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_PREPARE_INDIRECT, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_GRID_RESET, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_UPDATE_SURFELS, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_COMPACT, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_GRID_OFFSET, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_BINNING, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_SORT_ORDER, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_SORT_SCATTER, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_SORT_APPLY, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_RAY_ALLOCATE, frame, _SurfelPositionCmd[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_TRACE, frame, _SurfelRTXCommandBuffer[frame]);
+		_graph.set_command_buffer(PASS_SHADOW, frame, _shadowCommandBuffer[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_SHADE, frame, _SurfelShadeCmdBuffer[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_FILTER, frame, _SurfelShadeCmdBuffer[frame]);
+		_graph.set_command_buffer(PASS_SURFEL_STATS, frame, _frames[frame]._mainCommandBuffer);
+		_graph.set_command_buffer(PASS_DEFERRED, frame, _frames[frame]._mainCommandBuffer);
+	}
+
+	_graph.compile();
+	assert(_graph.summary().layoutMismatches.empty() && "an image ends the frame in another layout than it starts it in");
 }
 
 
@@ -2682,7 +3121,8 @@ void Renderer::surfel_position()
 
 	//-------------------------------------------------------------------------------------------------------------------------------------
 
-	build_surfel_position_command_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_surfel_position_command_buffer(frame);
 
 }
 
@@ -2692,7 +3132,8 @@ void Renderer::prepare_indirect()
 
 	init_prepare_indirect_pipeline();
 
-	build_prepare_indirect_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_prepare_indirect_buffer(frame);
 }
 
 void Renderer::grid_reset()
@@ -2701,7 +3142,8 @@ void Renderer::grid_reset()
 
 	init_grid_reset_pipeline();
 
-	build_grid_reset_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_grid_reset_buffer(frame);
 }
 
 void Renderer::update_surfels()
@@ -2710,7 +3152,11 @@ void Renderer::update_surfels()
 
 	init_update_surfels_pipeline();
 
-	build_update_surfels_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+	{
+		build_update_surfels_buffer(frame);
+		build_surfel_compact_buffer(frame);
+	}
 }
 
 void Renderer::grid_offset()
@@ -2719,7 +3165,8 @@ void Renderer::grid_offset()
 
 	init_grid_offset_pipeline();
 
-	build_grid_offset_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_grid_offset_buffer(frame);
 }
 
 void Renderer::surfel_binning()
@@ -2728,7 +3175,42 @@ void Renderer::surfel_binning()
 
 	init_surfel_binning_pipeline();
 
-	build_surfel_binning_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_surfel_binning_buffer(frame);
+}
+
+void Renderer::surfel_sort()
+{
+	create_surfel_sort_descriptors();
+
+	init_surfel_sort_pipelines();
+
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_surfel_sort_buffer(frame);
+}
+
+void Renderer::surfel_ray_allocate()
+{
+	create_surfel_ray_allocate_descriptors();
+
+	init_surfel_ray_allocate_pipeline();
+
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_surfel_ray_allocate_buffer(frame);
+}
+
+// Every pass recorded into _SurfelPositionCmd, in the order the wrappers above record them
+void Renderer::record_surfel_update_chain(uint32_t frame)
+{
+	build_surfel_position_command_buffer(frame);
+	build_prepare_indirect_buffer(frame);
+	build_grid_reset_buffer(frame);
+	build_update_surfels_buffer(frame);
+	build_surfel_compact_buffer(frame);
+	build_grid_offset_buffer(frame);
+	build_surfel_binning_buffer(frame);
+	build_surfel_sort_buffer(frame);
+	build_surfel_ray_allocate_buffer(frame);
 }
 
 void Renderer::surfel_ray_tracing()
@@ -2739,9 +3221,11 @@ void Renderer::surfel_ray_tracing()
 
 	create_surfel_rtx_SBT();
 
-	build_shadow_command_buffer();
-
-	create_surfel_rtx_cmd_buffer();
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+	{
+		build_shadow_command_buffer(frame);
+		create_surfel_rtx_cmd_buffer(frame);
+	}
 }
 
 void Renderer::surfel_shade()
@@ -2750,7 +3234,15 @@ void Renderer::surfel_shade()
 
 	init_surfel_shade_pipeline();
 
-	build_surfel_shade_buffer();
+	if (_surfelConfig.filter)
+	{
+		create_surfel_filter_descriptors();
+
+		init_surfel_filter_pipeline();
+	}
+
+	for (uint32_t frame = 0; frame < FRAME_OVERLAP; frame++)
+		build_surfel_shade_buffer(frame);
 }
 
 
@@ -2762,6 +3254,7 @@ void Renderer::create_surfel_position_descriptors()
 	{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 	{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
 	{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+	{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
 	{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 	{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 	{VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1}
@@ -2776,13 +3269,16 @@ void Renderer::create_surfel_position_descriptors()
 	VkDescriptorSetLayoutBinding positionBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
 	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
 	VkDescriptorSetLayoutBinding _CellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
-	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 6);			// Camera buffer
 	VkDescriptorSetLayoutBinding depthBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 7);
 
 	VkDescriptorSetLayoutBinding debugImageLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 8);
 	VkDescriptorSetLayoutBinding resultImageLayoutBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 9);
 
-	VkDescriptorSetLayoutBinding cameraBufferBinding2 = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 10);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding2 = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 10);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 11);
+	VkDescriptorSetLayoutBinding deadBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 12);
+	VkDescriptorSetLayoutBinding dataBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 13);
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -2796,7 +3292,10 @@ void Renderer::create_surfel_position_descriptors()
 		cameraBufferBinding,
 		debugImageLayoutBinding,
 		resultImageLayoutBinding,
-		cameraBufferBinding2
+		cameraBufferBinding2,
+		aliveBinding,
+		deadBinding,
+		dataBinding
 	};
 
 	
@@ -2819,27 +3318,33 @@ void Renderer::create_surfel_position_descriptors()
 	sampler.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
 	VK_CHECK(vkCreateSampler(*device, &sampler, nullptr, &_SurfelPositionNormalSampler));
 
-	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(Surfel) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
 
 	VkDescriptorImageInfo texDescriptorNormal = vkinit::descriptor_image_info(_deferredTextures[1].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _SurfelPositionNormalSampler);
 
 	VkDescriptorImageInfo depthDescriptorDepth = vkinit::descriptor_image_info(_deferredTextures[6].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _SurfelPositionNormalSampler);
 
-	VkDescriptorImageInfo positionDescriptorInfo = { _SurfelPositionNormalSampler, Texture::GET("blueNoise.png")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	VkDescriptorImageInfo positionDescriptorInfo = { _SurfelPositionNormalSampler, Texture::GET("blueNoise.png")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
 	
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
 	
-	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100);
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_cameraBuffer._buffer, sizeof(GPUCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
 
 	VkDescriptorImageInfo debugImageDescriptor = vkinit::descriptor_image_info(_debugGI.imageView, VK_IMAGE_LAYOUT_GENERAL);
 
 	VkDescriptorImageInfo resultImageDescriptor = vkinit::descriptor_image_info(_result.imageView, VK_IMAGE_LAYOUT_GENERAL);
 
-	VkDescriptorBufferInfo cameraBufferInfo2 = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo2 = _frameUniforms.descriptor(FRAME_RT_CAMERA);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkDescriptorBufferInfo deadDescInfo = vkinit::descriptor_buffer_info(_SurfelDeadBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo dataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
 
 	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &surfelDescInfo, 0);
 	VkWriteDescriptorSet normalWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _SurfelPositionDescSet, &texDescriptorNormal, 1);
@@ -2847,11 +3352,14 @@ void Renderer::create_surfel_position_descriptors()
 	VkWriteDescriptorSet positionWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _SurfelPositionDescSet, &positionDescriptorInfo, 3);
 	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &gridDescInfo, 4);
 	VkWriteDescriptorSet CellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &cellDescInfo, 5);
-	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _SurfelPositionDescSet, &cameraBufferInfo, 6);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelPositionDescSet, &cameraBufferInfo, 6);
 	VkWriteDescriptorSet depthWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _SurfelPositionDescSet, &depthDescriptorDepth, 7);
 	VkWriteDescriptorSet debugWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _SurfelPositionDescSet, &debugImageDescriptor, 8);
 	VkWriteDescriptorSet resultWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _SurfelPositionDescSet, &resultImageDescriptor, 9);
-	VkWriteDescriptorSet cameraWrite2 = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _SurfelPositionDescSet, &cameraBufferInfo2, 10);
+	VkWriteDescriptorSet cameraWrite2 = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelPositionDescSet, &cameraBufferInfo2, 10);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &aliveDescInfo, 11);
+	VkWriteDescriptorSet deadWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &deadDescInfo, 12);
+	VkWriteDescriptorSet dataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelPositionDescSet, &dataDescInfo, 13);
 
 	std::vector<VkWriteDescriptorSet> DescriptorWrites =
 	{
@@ -2865,7 +3373,10 @@ void Renderer::create_surfel_position_descriptors()
 		cameraWrite,
 		debugWrite,
 		resultWrite,
-		cameraWrite2
+		cameraWrite2,
+		aliveWrite,
+		deadWrite,
+		dataWrite
 	};
 
 
@@ -2886,6 +3397,7 @@ void Renderer::init_surfel_position_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("surfelRandomPos.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	VkPushConstantRange _constantRangeCI = {};
 	_constantRangeCI.offset = 0;
@@ -2915,70 +3427,23 @@ void Renderer::init_surfel_position_pipeline()
 		});
 }
 
-void Renderer::build_surfel_position_command_buffer()
+void Renderer::build_surfel_position_command_buffer(uint32_t frame)
 {
 	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
 	VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
 
-	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelPositionPipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelPositionPipelineLayout, 0, 1, &_SurfelPositionDescSet, 0, nullptr);
-
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-
-
-	VkBufferMemoryBarrier bufferbarrierdesc = {};
-	bufferbarrierdesc.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc.pNext = nullptr;
-	bufferbarrierdesc.buffer = _SurfelStatsBuffer._buffer;
-	bufferbarrierdesc.size = sizeof(unsigned int) * 8;
-	bufferbarrierdesc.offset = 0;
-	bufferbarrierdesc.srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; 
-	bufferbarrierdesc.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	_graph.record(cmd, PASS_SURFEL_COVERAGE);
 
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelPositionPipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelPositionPipelineLayout, 0, 1, &_SurfelPositionDescSet, 2, _frameUniforms.offsets(frame));
 
 	//shaderIf = 2;
 
-
-	
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		0, nullptr,
-		1, &bufferbarrierdesc,
-		0, nullptr
-	);
-
-
-	vkCmdDispatch(cmd, ((uint32_t)VulkanEngine::engine->_window->getWidth() + 15) / 16, ((uint32_t)VulkanEngine::engine->_window->getHeight() + 15) / 16, 1);
-
-
-
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-	vkCmdPipelineBarrier(
-		cmd,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-		0,
-		1, &memorybarrierdesc,
-		0, nullptr,
-		0, nullptr
-	);
-
+	const glm::uvec2 groups = _surfelConfig.coverage_groups(VulkanEngine::engine->_window->getWidth(), VulkanEngine::engine->_window->getHeight());
+	vkCmdDispatch(cmd, groups.x, groups.y, 1);
 
 	//VK_CHECK(vkEndCommandBuffer(cmd));
 }
@@ -3013,7 +3478,7 @@ void Renderer::create_prepare_indirect_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &prepareIndirectDescriptorSetAllocateInfo, &_PrepareIndirectDescSet));
 
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
 	VkWriteDescriptorSet StatsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _PrepareIndirectDescSet, &statsDescInfo, 0);
 
@@ -3043,6 +3508,7 @@ void Renderer::init_prepare_indirect_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("prepareIndirect.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	//VkPushConstantRange _constantRangeCI = {};
 	//_constantRangeCI.offset = 0;
@@ -3072,12 +3538,12 @@ void Renderer::init_prepare_indirect_pipeline()
 		});
 }
 
-void Renderer::build_prepare_indirect_buffer()
+void Renderer::build_prepare_indirect_buffer(uint32_t frame)
 {
 	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
 	//VkCommandBuffer& cmd = _PrepareIndirectCmdBuffer;
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
 	//VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
@@ -3087,6 +3553,8 @@ void Renderer::build_prepare_indirect_buffer()
 
 	//VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
 
+	_graph.record(cmd, PASS_PREPARE_INDIRECT);
+
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _PrepareIndirectPipeline);
 	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _PrepareIndirectPipelineLayout, 0, 1, &_PrepareIndirectDescSet, 0, nullptr);
 
@@ -3102,8 +3570,6 @@ void Renderer::build_prepare_indirect_buffer()
 
 	vkCmdDispatch(cmd, 1, 1, 1);
 
-	VK_CHECK(vkEndCommandBuffer(cmd));
-
 	//VK_CHECK(vkEndCommandBuffer(cmd));
 }
 
@@ -3137,7 +3603,7 @@ void Renderer::create_grid_reset_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &gridResetDescriptorSetAllocateInfo, &_GridResetDescSet));
 
 
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
 
 	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _GridResetDescSet, &gridDescInfo, 0);
 
@@ -3165,6 +3631,7 @@ void Renderer::init_grid_reset_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("gridReset.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	//VkPushConstantRange _constantRangeCI = {};
 	//_constantRangeCI.offset = 0;
@@ -3194,57 +3661,16 @@ void Renderer::init_grid_reset_pipeline()
 		});
 }
 
-void Renderer::build_grid_reset_buffer()
+void Renderer::build_grid_reset_buffer(uint32_t frame)
 {
-	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
-
-	//VkCommandBuffer& cmd = _GridResetCmdBuffer;
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
-	//VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+	_graph.record(cmd, PASS_GRID_RESET);
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _GridResetPipeline);
 	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _GridResetPipelineLayout, 0, 1, &_GridResetDescSet, 0, nullptr);
 
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc = {};
-	bufferbarrierdesc.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc.pNext = nullptr;
-	bufferbarrierdesc.buffer = _SurfelGridBuffer._buffer;
-	bufferbarrierdesc.size = sizeof(unsigned int) * SURFEL_TABLE_SIZE;
-	bufferbarrierdesc.offset = 0;
-	bufferbarrierdesc.srcAccessMask = VK_ACCESS_SHADER_READ_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		0, nullptr,
-		1, &bufferbarrierdesc,
-		0, nullptr
-	);
-
-	//shaderIf = 2;
-
-
-	//int t = static_cast<int> (time(NULL));
-
-
-	//vkCmdPushConstants(cmd, _GridResetPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(int), &t);
-
-	vkCmdDispatch(cmd, (SURFEL_TABLE_SIZE + 63) / 64, 1, 1);
-
-	//VK_CHECK(vkEndCommandBuffer(cmd));
+	vkCmdDispatch(cmd, (_surfelConfig.table_size() + 63) / 64, 1, 1);
 }
 
 
@@ -3257,6 +3683,7 @@ void Renderer::create_update_surfels_descriptors()
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 		{VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1}
@@ -3271,7 +3698,9 @@ void Renderer::create_update_surfels_descriptors()
 	VkDescriptorSetLayoutBinding statsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	//VkDescriptorSetLayoutBinding depthBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
 	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
-	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 4);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
+	VkDescriptorSetLayoutBinding deadBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -3279,7 +3708,9 @@ void Renderer::create_update_surfels_descriptors()
 		_SurfelDataBufferBinding,
 		statsBinding,
 		_GridBufferBinding,
-		cameraBufferBinding
+		cameraBufferBinding,
+		aliveBinding,
+		deadBinding
 	};
 
 
@@ -3296,26 +3727,31 @@ void Renderer::create_update_surfels_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &updateDescriptorSetAllocateInfo, &_UpdateSurfelsDescSet));
 
 
-	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(Surfel) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
 
-	VkDescriptorBufferInfo surfelDataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelData) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
 	
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
 	//VkDescriptorImageInfo depthDescriptorDepth = vkinit::descriptor_image_info(_deferredTextures[6].imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, _SurfelPositionNormalSampler);
 
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
+
 
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
 
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_cameraBuffer._buffer, sizeof(GPUCameraData));
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
 
+	VkDescriptorBufferInfo deadDescInfo = vkinit::descriptor_buffer_info(_SurfelDeadBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity);
 
 
 	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &surfelDescInfo, 0);
 	VkWriteDescriptorSet surfelDataBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &surfelDataDescInfo, 1);
 	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &statsDescInfo, 2);
 	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &gridDescInfo, 3);
-	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _UpdateSurfelsDescSet, &cameraBufferInfo, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _UpdateSurfelsDescSet, &cameraBufferInfo, 4);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &aliveDescInfo, 5);
+	VkWriteDescriptorSet deadWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _UpdateSurfelsDescSet, &deadDescInfo, 6);
 
 
 	std::vector<VkWriteDescriptorSet> DescriptorWrites =
@@ -3324,7 +3760,9 @@ void Renderer::create_update_surfels_descriptors()
 		surfelDataBufferWrite,
 		statsWrite,
 		GridWrite,
-		cameraWrite
+		cameraWrite,
+		aliveWrite,
+		deadWrite
 	};
 
 
@@ -3348,6 +3786,7 @@ void Renderer::init_update_surfels_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("updateSurfels.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	//VkPushConstantRange _constantRangeCI = {};
 	//_constantRangeCI.offset = 0;
@@ -3377,91 +3816,36 @@ void Renderer::init_update_surfels_pipeline()
 		});
 }
 
-void Renderer::build_update_surfels_buffer()
+void Renderer::build_update_surfels_buffer(uint32_t frame)
 {
-	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
-	//VkCommandBuffer& cmd = _UpdateSurfelsCmdBuffer;
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
-
-	//VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+	_graph.record(cmd, PASS_UPDATE_SURFELS);
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _UpdateSurfelsPipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _UpdateSurfelsPipelineLayout, 0, 1, &_UpdateSurfelsDescSet, 0, nullptr);
-
-
-	//shaderIf = 2;
-
-
-	int t = static_cast<int> (time(NULL));
-
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc1 = {};
-	bufferbarrierdesc1.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc1.pNext = nullptr;
-	bufferbarrierdesc1.buffer = _SurfelBuffer._buffer;
-	bufferbarrierdesc1.size = sizeof(Surfel) * SURFEL_CAPACITY;
-	bufferbarrierdesc1.offset = 0;
-	bufferbarrierdesc1.srcAccessMask = VK_ACCESS_SHADER_READ_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc1.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc1.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc1.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		0, nullptr,
-		1, &bufferbarrierdesc1,
-		0, nullptr
-	);
-
-
-
-	//vkCmdPushConstants(cmd, _UpdateSurfelsPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(int), &t);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _UpdateSurfelsPipelineLayout, 0, 1, &_UpdateSurfelsDescSet, 1, _frameUniforms.offsets(frame));
 
 	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
+}
 
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc2 = {};
-	bufferbarrierdesc2.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc2.pNext = nullptr;
-	bufferbarrierdesc2.buffer = _SurfelBuffer._buffer;
-	bufferbarrierdesc2.size = sizeof(Surfel) * SURFEL_CAPACITY;
-	bufferbarrierdesc2.offset = 0;
-	bufferbarrierdesc2.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // 
-
-	bufferbarrierdesc2.dstAccessMask = VK_ACCESS_SHADER_READ_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc2.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc2.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		1, &memorybarrierdesc,
-		1, &bufferbarrierdesc2,
-		0, nullptr
-	);
-
-	VK_CHECK(vkEndCommandBuffer(cmd));
-
-	//VK_CHECK(vkEndCommandBuffer(cmd));
+void Renderer::build_surfel_compact_buffer(uint32_t frame)
+{
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
+
+	_graph.record(cmd, PASS_SURFEL_COMPACT);
+
+	// The whole survivor half is copied, the count tells the later passes how much of it is valid
+	VkBufferCopy aliveCopy = {};
+	aliveCopy.srcOffset = sizeof(unsigned int) * _surfelConfig.capacity;
+	aliveCopy.dstOffset = 0;
+	aliveCopy.size = sizeof(unsigned int) * _surfelConfig.capacity;
+	vkCmdCopyBuffer(cmd, _SurfelAliveBuffer._buffer, _SurfelAliveBuffer._buffer, 1, &aliveCopy);
+
+	VkBufferCopy countCopy = {};
+	countCopy.srcOffset = sizeof(unsigned int) * SURFEL_STATS_OFFSET_NEXTCOUNT;
+	countCopy.dstOffset = sizeof(unsigned int) * SURFEL_STATS_OFFSET_COUNT;
+	countCopy.size = sizeof(unsigned int);
+	vkCmdCopyBuffer(cmd, _SurfelStatsBuffer._buffer, _SurfelStatsBuffer._buffer, 1, &countCopy);
 }
 
 
@@ -3505,11 +3889,11 @@ void Renderer::create_grid_offset_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &gridOffsetDescriptorSetAllocateInfo, &_GridOffsetDescSet));
 
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
 
-	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100);
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
 
 
 	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _GridOffsetDescSet, &statsDescInfo, 0);
@@ -3541,6 +3925,7 @@ void Renderer::init_grid_offset_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("gridOffset.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	//VkPushConstantRange _constantRangeCI = {};
 	//_constantRangeCI.offset = 0;
@@ -3570,109 +3955,16 @@ void Renderer::init_grid_offset_pipeline()
 		});
 }
 
-void Renderer::build_grid_offset_buffer()
+void Renderer::build_grid_offset_buffer(uint32_t frame)
 {
-	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
-
-	//VkCommandBuffer& cmd = _GridOffsetCmdBuffer;
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
-	//VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+	_graph.record(cmd, PASS_GRID_OFFSET);
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _GridOffsetPipeline);
 	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _GridOffsetPipelineLayout, 0, 1, &_GridOffsetDescSet, 0, nullptr);
 
-
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc1 = {};
-	bufferbarrierdesc1.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc1.pNext = nullptr;
-	bufferbarrierdesc1.buffer = _SurfelCellBuffer._buffer;
-	bufferbarrierdesc1.size = sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100;
-	bufferbarrierdesc1.offset = 0;
-	bufferbarrierdesc1.srcAccessMask = VK_ACCESS_SHADER_READ_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc1.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc1.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc1.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-	VkBufferMemoryBarrier bufferbarrierdesc2 = {};
-	bufferbarrierdesc2.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc2.pNext = nullptr;
-	bufferbarrierdesc2.buffer = _SurfelStatsBuffer._buffer;
-	bufferbarrierdesc2.size = sizeof(unsigned int) * 8;
-	bufferbarrierdesc2.offset = 0;
-	bufferbarrierdesc2.srcAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc2.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc2.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc2.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-
-	std::vector<VkBufferMemoryBarrier> bufferBarriers =
-	{
-		bufferbarrierdesc1,
-		bufferbarrierdesc2
-	};
-
-
-	vkCmdPipelineBarrier(
-		cmd,
-		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-		dstStage,
-		0,
-		0, nullptr,
-		bufferBarriers.size(), bufferBarriers.data(),
-		0, nullptr
-	);
-
-
-
-
-	/*int t = static_cast<int> (time(NULL));
-
-	vkCmdPushConstants(cmd, _GridOffsetPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(int), &t);*/
-
-	vkCmdDispatch(cmd, (SURFEL_TABLE_SIZE + 63) / 64, 1, 1);
-
-
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc = {};
-	bufferbarrierdesc.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc.pNext = nullptr;
-	bufferbarrierdesc.buffer = _SurfelStatsBuffer._buffer;
-	bufferbarrierdesc.size = sizeof(unsigned int) * 8;
-	bufferbarrierdesc.offset = 0;
-	bufferbarrierdesc.srcAccessMask =  VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-		0,
-		1, &memorybarrierdesc,
-		1, &bufferbarrierdesc,
-		0, nullptr
-	);
-
-	//VK_CHECK(vkEndCommandBuffer(cmd));
+	vkCmdDispatch(cmd, (_surfelConfig.table_size() + 63) / 64, 1, 1);
 }
 
 
@@ -3685,6 +3977,7 @@ void Renderer::create_surfel_binning_descriptors()
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 		{VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1}
@@ -3697,7 +3990,8 @@ void Renderer::create_surfel_binning_descriptors()
 	VkDescriptorSetLayoutBinding statsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
 	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	VkDescriptorSetLayoutBinding _CellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
-	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 4);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -3705,7 +3999,8 @@ void Renderer::create_surfel_binning_descriptors()
 		statsBinding,
 		_GridBufferBinding,
 		_CellBufferBinding,
-		cameraBufferBinding
+		cameraBufferBinding,
+		aliveBinding
 	};
 
 
@@ -3719,23 +4014,25 @@ void Renderer::create_surfel_binning_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &surfelBinningDescriptorSetAllocateInfo, &_SurfelBinningDescSet));
 
 
-	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(Surfel) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
 
-	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100);
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
 
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_cameraBuffer._buffer, sizeof(GPUCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
 
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
 
 
 	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelBinningDescSet, &surfelDescInfo, 0);
 	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelBinningDescSet, &statsDescInfo, 1);
 	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelBinningDescSet, &gridDescInfo, 2);
 	VkWriteDescriptorSet cellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelBinningDescSet, &cellDescInfo, 3);
-	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _SurfelBinningDescSet, &cameraBufferInfo, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelBinningDescSet, &cameraBufferInfo, 4);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelBinningDescSet, &aliveDescInfo, 5);
 
 
 	std::vector<VkWriteDescriptorSet> DescriptorWrites =
@@ -3744,7 +4041,8 @@ void Renderer::create_surfel_binning_descriptors()
 		statsWrite,
 		GridWrite,
 		cellWrite,
-		cameraWrite
+		cameraWrite,
+		aliveWrite
 	};
 
 
@@ -3764,6 +4062,7 @@ void Renderer::init_surfel_binning_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("surfelbinning.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 	//VkPushConstantRange _constantRangeCI = {};
 	//_constantRangeCI.offset = 0;
@@ -3793,82 +4092,309 @@ void Renderer::init_surfel_binning_pipeline()
 		});
 }
 
-void Renderer::build_surfel_binning_buffer()
+void Renderer::build_surfel_binning_buffer(uint32_t frame)
 {
-	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
 
-	//VkCommandBuffer& cmd = _SurfelBinningCmdBuffer;
-	VkCommandBuffer& cmd = _SurfelPositionCmd;
-
-	//VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+	_graph.record(cmd, PASS_SURFEL_BINNING);
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelBinningPipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelBinningPipelineLayout, 0, 1, &_SurfelBinningDescSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelBinningPipelineLayout, 0, 1, &_SurfelBinningDescSet, 1, _frameUniforms.offsets(frame));
 
+	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
+}
 
-	int t = static_cast<int> (time(NULL));
 
+//------------------------------------------------------------------- Surfel Sort
 
-	//vkCmdPushConstants(cmd, _GridResetPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(int), &t);
 
-	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
+void Renderer::create_surfel_sort_descriptors()
+{
+	std::vector<VkDescriptorPoolSize> poolSize = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10}
+	};
+
+	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vkinit::descriptor_pool_create_info(poolSize, 1);
+	VK_CHECK(vkCreateDescriptorPool(*device, &descriptorPoolCreateInfo, nullptr, &_SurfelSortDescPool));
 
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-
-	VkBufferMemoryBarrier bufferbarrierdesc1 = {};
-	bufferbarrierdesc1.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc1.pNext = nullptr;
-	bufferbarrierdesc1.buffer = _SurfelCellBuffer._buffer;
-	bufferbarrierdesc1.size = sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100;
-	bufferbarrierdesc1.offset = 0;
-	bufferbarrierdesc1.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc1.dstAccessMask = VK_ACCESS_SHADER_READ_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc1.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc1.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-	VkBufferMemoryBarrier bufferbarrierdesc2 = {};
-	bufferbarrierdesc2.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc2.pNext = nullptr;
-	bufferbarrierdesc2.buffer = _SurfelGridBuffer._buffer;
-	bufferbarrierdesc2.size = sizeof(unsigned int) * SURFEL_TABLE_SIZE;
-	bufferbarrierdesc2.offset = 0;
-	bufferbarrierdesc2.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
-
-	bufferbarrierdesc2.dstAccessMask = VK_ACCESS_SHADER_READ_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc2.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc2.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-
-
-	std::vector<VkBufferMemoryBarrier> bufferBarriers =
+	VkDescriptorSetLayoutBinding _SurfelBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding statsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding _CellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+	VkDescriptorSetLayoutBinding _DataBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 5);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
+	VkDescriptorSetLayoutBinding deadBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7);
+	VkDescriptorSetLayoutBinding remapBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 8);
+	VkDescriptorSetLayoutBinding sortedBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 9);
+	VkDescriptorSetLayoutBinding sortedDataBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 10);
+
+	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
-		bufferbarrierdesc1,
-		bufferbarrierdesc2
+		_SurfelBufferBinding,
+		statsBinding,
+		_GridBufferBinding,
+		_CellBufferBinding,
+		_DataBufferBinding,
+		cameraBufferBinding,
+		aliveBinding,
+		deadBinding,
+		remapBinding,
+		sortedBinding,
+		sortedDataBinding
 	};
 
+	VkDescriptorSetLayoutCreateInfo surfelSortDescriptorSetLayoutCreateInfo = {};
+	surfelSortDescriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	surfelSortDescriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
+	surfelSortDescriptorSetLayoutCreateInfo.pBindings = setLayoutBindings.data();
+	VK_CHECK(vkCreateDescriptorSetLayout(*device, &surfelSortDescriptorSetLayoutCreateInfo, nullptr, &_SurfelSortDescSetLayout));
 
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	VkDescriptorSetAllocateInfo surfelSortDescriptorSetAllocateInfo = vkinit::descriptor_set_allocate_info(_SurfelSortDescPool, &_SurfelSortDescSetLayout, 1);
+	VK_CHECK(vkAllocateDescriptorSets(*device, &surfelSortDescriptorSetAllocateInfo, &_SurfelSortDescSet));
 
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		1, &memorybarrierdesc,
-		bufferBarriers.size(), bufferBarriers.data(),
-		0, nullptr
-	);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
+
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
+
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
+
+	VkDescriptorBufferInfo dataBufferInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkDescriptorBufferInfo deadDescInfo = vkinit::descriptor_buffer_info(_SurfelDeadBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo remapDescInfo = vkinit::descriptor_buffer_info(_SurfelRemapBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo sortedDescInfo = vkinit::descriptor_buffer_info(_SurfelSortBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo sortedDataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataSortBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
+
+	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &surfelDescInfo, 0);
+	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &statsDescInfo, 1);
+	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &gridDescInfo, 2);
+	VkWriteDescriptorSet cellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &cellDescInfo, 3);
+	VkWriteDescriptorSet dataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &dataBufferInfo, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelSortDescSet, &cameraBufferInfo, 5);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &aliveDescInfo, 6);
+	VkWriteDescriptorSet deadWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &deadDescInfo, 7);
+	VkWriteDescriptorSet remapWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &remapDescInfo, 8);
+	VkWriteDescriptorSet sortedWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &sortedDescInfo, 9);
+	VkWriteDescriptorSet sortedDataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelSortDescSet, &sortedDataDescInfo, 10);
+
+	std::vector<VkWriteDescriptorSet> DescriptorWrites =
+	{
+		surfelBufferWrite,
+		statsWrite,
+		GridWrite,
+		cellWrite,
+		dataWrite,
+		cameraWrite,
+		aliveWrite,
+		deadWrite,
+		remapWrite,
+		sortedWrite,
+		sortedDataWrite
+	};
+
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(DescriptorWrites.size()), DescriptorWrites.data(), 0, VK_NULL_HANDLE);
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyDescriptorSetLayout(*device, _SurfelSortDescSetLayout, nullptr);
+		vkDestroyDescriptorPool(*device, _SurfelSortDescPool, nullptr);
+		});
+}
+
+void Renderer::init_surfel_sort_pipelines()
+{
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount = 1;
+	pipelineLayoutCI.pSetLayouts = &_SurfelSortDescSetLayout;
+	VK_CHECK(vkCreatePipelineLayout(*device, &pipelineLayoutCI, nullptr, &_SurfelSortPipelineLayout));
+
+	auto create_pipeline = [&](const char* shader, VkPipeline& pipeline) {
+		VkShaderModule computeShaderModule;
+		VulkanEngine::engine->load_shader_module(vkutil::findFile(shader, searchPaths, true).c_str(), &computeShaderModule);
+
+		VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+		shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
+
+		VkComputePipelineCreateInfo computePipelineCI = {};
+		computePipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		computePipelineCI.stage = shaderStageCI;
+		computePipelineCI.layout = _SurfelSortPipelineLayout;
+
+		VK_CHECK(vkCreateComputePipelines(*device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &pipeline));
+
+		vkDestroyShaderModule(*device, computeShaderModule, nullptr);
+	};
+
+	create_pipeline("surfelSortOrder.comp.spv", _SurfelSortOrderPipeline);
+	create_pipeline("surfelSortScatter.comp.spv", _SurfelSortScatterPipeline);
+	create_pipeline("surfelSortApply.comp.spv", _SurfelSortApplyPipeline);
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyPipeline(*device, _SurfelSortOrderPipeline, nullptr);
+		vkDestroyPipeline(*device, _SurfelSortScatterPipeline, nullptr);
+		vkDestroyPipeline(*device, _SurfelSortApplyPipeline, nullptr);
+		vkDestroyPipelineLayout(*device, _SurfelSortPipelineLayout, nullptr);
+		});
+}
+
+void Renderer::build_surfel_sort_buffer(uint32_t frame)
+{
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
+
+	// Recorded every frame, prepareIndirect.comp only gives them groups every SURFEL_SORT_INTERVAL frames
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelSortPipelineLayout, 0, 1, &_SurfelSortDescSet, 1, _frameUniforms.offsets(frame));
 
+	_graph.record(cmd, PASS_SURFEL_SORT_ORDER);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelSortOrderPipeline);
+	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_OFFSET_SORTCELLS);
 
+	_graph.record(cmd, PASS_SURFEL_SORT_SCATTER);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelSortScatterPipeline);
+	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_OFFSET_SORT);
+
+	_graph.record(cmd, PASS_SURFEL_SORT_APPLY);
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelSortApplyPipeline);
+	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_OFFSET_SORTSLOTS);
+}
+
+
+//------------------------------------------------------------------- Surfel Ray Allocate
+
+
+void Renderer::create_surfel_ray_allocate_descriptors()
+{
+	std::vector<VkDescriptorPoolSize> poolSize = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100}
+	};
+
+	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vkinit::descriptor_pool_create_info(poolSize, 2);
+	VK_CHECK(vkCreateDescriptorPool(*device, &descriptorPoolCreateInfo, nullptr, &_SurfelRayAllocateDescPool));
+
+	VkDescriptorSetLayoutBinding _SurfelBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding _DataBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding statsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+	VkDescriptorSetLayoutBinding rayRangeBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding rayQueueBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5);
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 6);			// Camera buffer, frame index
+
+	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
+	{
+		_SurfelBufferBinding,
+		_DataBufferBinding,
+		statsBinding,
+		aliveBinding,
+		rayRangeBinding,
+		rayQueueBinding,
+		cameraBufferBinding
+	};
+
+
+	VkDescriptorSetLayoutCreateInfo surfelRayAllocateDescriptorSetLayoutCreateInfo = {};
+	surfelRayAllocateDescriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	surfelRayAllocateDescriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
+	surfelRayAllocateDescriptorSetLayoutCreateInfo.pBindings = setLayoutBindings.data();
+	VK_CHECK(vkCreateDescriptorSetLayout(*device, &surfelRayAllocateDescriptorSetLayoutCreateInfo, nullptr, &_SurfelRayAllocateDescSetLayout));
+
+	VkDescriptorSetAllocateInfo surfelRayAllocateDescriptorSetAllocateInfo = vkinit::descriptor_set_allocate_info(_SurfelRayAllocateDescPool, &_SurfelRayAllocateDescSetLayout, 1);
+	VK_CHECK(vkAllocateDescriptorSets(*device, &surfelRayAllocateDescriptorSetAllocateInfo, &_SurfelRayAllocateDescSet));
+
+
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo dataBufferInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkDescriptorBufferInfo rayRangeDescInfo = vkinit::descriptor_buffer_info(_SurfelRayRangeBuffer._buffer, sizeof(SurfelRayRange) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo rayQueueDescInfo = vkinit::descriptor_buffer_info(_SurfelRayQueueBuffer._buffer, sizeof(unsigned int) * _surfelConfig.rayBudget);
+
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_RT_CAMERA);
+
+
+	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &surfelDescInfo, 0);
+	VkWriteDescriptorSet dataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &dataBufferInfo, 1);
+	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &statsDescInfo, 2);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &aliveDescInfo, 3);
+	VkWriteDescriptorSet rayRangeWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &rayRangeDescInfo, 4);
+	VkWriteDescriptorSet rayQueueWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRayAllocateDescSet, &rayQueueDescInfo, 5);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelRayAllocateDescSet, &cameraBufferInfo, 6);
+
+
+	std::vector<VkWriteDescriptorSet> DescriptorWrites =
+	{
+		surfelBufferWrite,
+		dataWrite,
+		statsWrite,
+		aliveWrite,
+		rayRangeWrite,
+		rayQueueWrite,
+		cameraWrite
+	};
+
+
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(DescriptorWrites.size()), DescriptorWrites.data(), 0, VK_NULL_HANDLE);
+
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyDescriptorSetLayout(*device, _SurfelRayAllocateDescSetLayout, nullptr);
+		vkDestroyDescriptorPool(*device, _SurfelRayAllocateDescPool, nullptr);
+		});
+}
+
+void Renderer::init_surfel_ray_allocate_pipeline()
+{
+	VkShaderModule computeShaderModule;
+
+	VulkanEngine::engine->load_shader_module(vkutil::findFile("surfelRayAllocate.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
+
+	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount = 1;
+	pipelineLayoutCI.pSetLayouts = &_SurfelRayAllocateDescSetLayout;
+	VK_CHECK(vkCreatePipelineLayout(*device, &pipelineLayoutCI, nullptr, &_SurfelRayAllocatePipelineLayout));
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage = shaderStageCI;
+	computePipelineCI.layout = _SurfelRayAllocatePipelineLayout;
+
+	VK_CHECK(vkCreateComputePipelines(*device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_SurfelRayAllocatePipeline));
+
+	vkDestroyShaderModule(*device, computeShaderModule, nullptr);
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyPipeline(*device, _SurfelRayAllocatePipeline, nullptr);
+		vkDestroyPipelineLayout(*device, _SurfelRayAllocatePipelineLayout, nullptr);
+		});
+}
+
+void Renderer::build_surfel_ray_allocate_buffer(uint32_t frame)
+{
+	VkCommandBuffer& cmd = _SurfelPositionCmd[frame];
+
+	_graph.record(cmd, PASS_SURFEL_RAY_ALLOCATE);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelRayAllocatePipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelRayAllocatePipelineLayout, 0, 1, &_SurfelRayAllocateDescSet, 1, _frameUniforms.offsets(frame));
+
+	// One thread per alive surfel, the trace launch is sized by the rays handed out
+	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
 
 	VK_CHECK(vkEndCommandBuffer(cmd));
 }
@@ -3880,6 +4406,8 @@ void Renderer::create_surfel_rtx_descriptors()
 	std::vector<VkDescriptorPoolSize> poolSizes = {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100}
 	};
@@ -3891,7 +4419,6 @@ void Renderer::create_surfel_rtx_descriptors()
 	const uint32_t nDrawables = static_cast<uint32_t>(_scene->get_drawable_nodes_size());
 	const uint32_t nMaterials = static_cast<uint32_t>(Material::_materials.size());
 	const uint32_t nTextures = static_cast<uint32_t>(Texture::_textures.size());
-	const uint32_t nLights = static_cast<uint32_t>(_scene->_lights.size());
 
 	// binding = 0 TLAS
 	// binding = 1 Storage image
@@ -3908,8 +4435,8 @@ void Renderer::create_surfel_rtx_descriptors()
 	// binding = 12 Shadow image
 
 	VkDescriptorSetLayoutBinding TLASBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);			// TLAS
-	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);			// Camera buffer
-	VkDescriptorSetLayoutBinding lightsBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);	// Lights
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);			// Camera buffer
+	VkDescriptorSetLayoutBinding lightsBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);	// Lights
 	VkDescriptorSetLayoutBinding vertexBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5, nInstances);	// Vertices
 	VkDescriptorSetLayoutBinding indexBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6, nInstances);	// Indices
 	VkDescriptorSetLayoutBinding texturesBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 7, nTextures); // Textures buffer
@@ -3920,6 +4447,13 @@ void Renderer::create_surfel_rtx_descriptors()
 	VkDescriptorSetLayoutBinding surfelBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 13);	// surfels
 	VkDescriptorSetLayoutBinding surfelStatsBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 14);	// stats
 	VkDescriptorSetLayoutBinding surfelDataBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 15);	// data
+	VkDescriptorSetLayoutBinding surfelAliveBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 16);	// alive list
+	VkDescriptorSetLayoutBinding surfelRayRangeBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 17);	// ray ranges
+	VkDescriptorSetLayoutBinding surfelRayQueueBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 18);	// ray queue
+	VkDescriptorSetLayoutBinding surfelRayBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 19);	// ray results
+	VkDescriptorSetLayoutBinding surfelGridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 20);	// grid cells
+	VkDescriptorSetLayoutBinding surfelCellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 21);	// cell index list
+	VkDescriptorSetLayoutBinding gridCameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 22);	// camera, centre of the cascades
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
 	{
@@ -3935,7 +4469,14 @@ void Renderer::create_surfel_rtx_descriptors()
 		skyboxBufferBinding,
 		surfelBufferBinding,
 		surfelStatsBufferBinding,
-		surfelDataBufferBinding
+		surfelDataBufferBinding,
+		surfelAliveBufferBinding,
+		surfelRayRangeBufferBinding,
+		surfelRayQueueBufferBinding,
+		surfelRayBufferBinding,
+		surfelGridBufferBinding,
+		surfelCellBufferBinding,
+		gridCameraBufferBinding
 	};
 
 	VkDescriptorSetLayoutCreateInfo setInfo = vkinit::descriptor_set_layout_create_info(static_cast<uint32_t>(setLayoutBindings.size()), setLayoutBindings);
@@ -3951,10 +4492,10 @@ void Renderer::create_surfel_rtx_descriptors()
 	descriptorAccelerationStructureInfo.pAccelerationStructures = &_topLevelAS.handle;
 
 	// Binding = 1 Camera write
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_RT_CAMERA);
 
 	// Binding = 4 Lights buffer descriptor
-	VkDescriptorBufferInfo lightDescBuffer = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
+	VkDescriptorBufferInfo lightDescBuffer = _frameUniforms.descriptor(FRAME_LIGHTS);
 
 	std::vector<VkDescriptorBufferInfo> vertexDescInfo;
 	std::vector<VkDescriptorBufferInfo> indexDescInfo;
@@ -3962,27 +4503,25 @@ void Renderer::create_surfel_rtx_descriptors()
 	for (Object* obj : _scene->_entities)
 	{
 		AllocatedBuffer vBuffer;
-		size_t bufferSize = sizeof(rtVertexAttribute) * obj->prefab->_mesh->_vertices.size();
-		VulkanEngine::engine->create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, vBuffer);
+		size_t bufferSize = sizeof(rtVertexAttribute) * obj->prefab->_mesh->vertex_count();
+		VulkanEngine::engine->create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, vBuffer);
 
 		std::vector<rtVertexAttribute> vAttr;
-		std::vector<Vertex> vertices = obj->prefab->_mesh->_vertices;
-		vAttr.reserve(vertices.size());
-		for (Vertex& v : vertices) {
+		const Vertex* vertices = obj->prefab->_mesh->vertex_data();
+		vAttr.reserve(obj->prefab->_mesh->vertex_count());
+		for (size_t i = 0; i < obj->prefab->_mesh->vertex_count(); i++) {
+			const Vertex& v = vertices[i];
 			vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, 1, 1} });
 		}
 
-		void* vdata;
-		vmaMapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation, &vdata);
-		memcpy(vdata, vAttr.data(), bufferSize);
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation);
+		AssetLoader::get().upload([&](UploadQueue& queue) { queue.copy_buffer(vAttr.data(), bufferSize, vBuffer._buffer); }, []() {});
 
 		// Binding = 5 Vertices Info
 		VkDescriptorBufferInfo vertexBufferDescriptor = vkinit::descriptor_buffer_info(vBuffer._buffer, bufferSize);
 		vertexDescInfo.push_back(vertexBufferDescriptor);
 
 		// Binding = 6 Indices Info
-		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, sizeof(uint32_t) * obj->prefab->_mesh->_indices.size());
+		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, sizeof(uint32_t) * obj->prefab->_mesh->index_count());
 		indexDescInfo.push_back(indexBufferDescriptor);
 
 		for (Node* root : obj->prefab->_root)
@@ -4014,20 +4553,19 @@ void Renderer::create_surfel_rtx_descriptors()
 
 	// Binding = 8 Skybox
 	VkDescriptorImageInfo skyboxImagesDesc[2];
-	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
-	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
 
 	// Binding = 9 Material info
 	VkDescriptorBufferInfo materialBufferInfo = vkinit::descriptor_buffer_info(_matBuffer._buffer, sizeof(GPUMaterial) * nMaterials);
 
 	// Binding = 10 ID info
+	// The ids are the same for every set that binds them, the first one uploads them
 	if (!_idBuffer._buffer)
-		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * idVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, _idBuffer);
-
-	void* idData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation, &idData);
-	memcpy(idData, idVector.data(), sizeof(glm::vec4) * idVector.size());
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, _idBuffer._allocation);
+	{
+		VulkanEngine::engine->create_buffer(sizeof(glm::vec4) * idVector.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, _idBuffer);
+		AssetLoader::get().upload([&](UploadQueue& queue) { queue.copy_buffer(idVector.data(), sizeof(glm::vec4) * idVector.size(), _idBuffer._buffer); }, []() {});
+	}
 
 
 
@@ -4037,18 +4575,33 @@ void Renderer::create_surfel_rtx_descriptors()
 	VkDescriptorBufferInfo matrixDescInfo = vkinit::descriptor_buffer_info(_matricesBuffer._buffer, sizeof(glm::mat4) * _scene->_matricesVector.size());
 
 
-	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(Surfel) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
 
-	VkDescriptorBufferInfo surfelDataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelData) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDataDescInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkDescriptorBufferInfo rayRangeDescInfo = vkinit::descriptor_buffer_info(_SurfelRayRangeBuffer._buffer, sizeof(SurfelRayRange) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo rayQueueDescInfo = vkinit::descriptor_buffer_info(_SurfelRayQueueBuffer._buffer, sizeof(unsigned int) * _surfelConfig.rayBudget);
+
+	VkDescriptorBufferInfo raysDescInfo = vkinit::descriptor_buffer_info(_SurfelRayBuffer._buffer, sizeof(SurfelRay) * _surfelConfig.rayBudget);
+
+	// Binding = 20, 21 and 22, the grid binned this frame for the lookups at the hits
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
+
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
+
+	VkDescriptorBufferInfo gridCameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
 
 
 	// Writes list
 	VkWriteDescriptorSet accelerationStructureWrite = vkinit::write_descriptor_acceleration_structure(_SurfelRTXDescSet, &descriptorAccelerationStructureInfo, 0);
-	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _SurfelRTXDescSet, &cameraBufferInfo, 2);
-	VkWriteDescriptorSet lightWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &lightDescBuffer, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelRTXDescSet, &cameraBufferInfo, 2);
+	VkWriteDescriptorSet lightWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _SurfelRTXDescSet, &lightDescBuffer, 4);
 	VkWriteDescriptorSet vertexBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, vertexDescInfo.data(), 5, nInstances);
 	VkWriteDescriptorSet indexBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, indexDescInfo.data(), 6, nInstances);
 	VkWriteDescriptorSet texturesBufferWrite = vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _SurfelRTXDescSet, imageInfos.data(), 7, nTextures);
@@ -4059,6 +4612,13 @@ void Renderer::create_surfel_rtx_descriptors()
 	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &surfelDescInfo, 13);
 	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &statsDescInfo, 14);
 	VkWriteDescriptorSet surfelDataBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &surfelDataDescInfo, 15);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &aliveDescInfo, 16);
+	VkWriteDescriptorSet rayRangeWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &rayRangeDescInfo, 17);
+	VkWriteDescriptorSet rayQueueWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &rayQueueDescInfo, 18);
+	VkWriteDescriptorSet raysWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &raysDescInfo, 19);
+	VkWriteDescriptorSet gridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &gridDescInfo, 20);
+	VkWriteDescriptorSet cellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelRTXDescSet, &cellDescInfo, 21);
+	VkWriteDescriptorSet gridCameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelRTXDescSet, &gridCameraBufferInfo, 22);
 
 	std::vector<VkWriteDescriptorSet> writes = {
 		accelerationStructureWrite,	// 0 TLAS
@@ -4073,7 +4633,14 @@ void Renderer::create_surfel_rtx_descriptors()
 		skyboxBufferWrite,
 		surfelBufferWrite,
 		statsWrite,
-		surfelDataBufferWrite
+		surfelDataBufferWrite,
+		aliveWrite,
+		rayRangeWrite,
+		rayQueueWrite,
+		raysWrite,
+		gridWrite,
+		cellWrite,
+		gridCameraWrite
 		};
 
 	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(writes.size()), writes.data(), 0, nullptr);
@@ -4179,6 +4746,9 @@ void Renderer::create_surfel_rtx_pipeline()
 
 	VkRayTracingPipelineCreateInfoKHR SurfelPipelineInfo{};
 	SurfelPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+	for (VkPipelineShaderStageCreateInfo& stage : SurfelShaderStages)
+		stage.pSpecializationInfo = &_surfelSpecInfo;
+
 	SurfelPipelineInfo.stageCount = static_cast<uint32_t>(SurfelShaderStages.size());
 	SurfelPipelineInfo.pStages = SurfelShaderStages.data();
 	SurfelPipelineInfo.groupCount = static_cast<uint32_t>(surfelShaderGroups.size());
@@ -4299,16 +4869,18 @@ void Renderer::create_surfel_rtx_SBT()
 }
 
 
-void Renderer::build_shadow_command_buffer()
+void Renderer::build_shadow_command_buffer(uint32_t frame)
 {
 	VkCommandBufferBeginInfo cmdBufInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
 	VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 
-	VkCommandBuffer& cmd = _shadowCommandBuffer;
+	VkCommandBuffer& cmd = _shadowCommandBuffer[frame];
 
 	VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBufInfo));
 
+	_graph.record(cmd, PASS_SHADOW);
+
 	VkBufferDeviceAddressInfoKHR bufferDeviceAddressInfo{};
 	bufferDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
 	bufferDeviceAddressInfo.buffer = sraygenSBT._buffer;
@@ -4341,7 +4913,7 @@ void Renderer::build_shadow_command_buffer()
 
 
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _shadowPipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _shadowPipelineLayout, 0, 1, &_shadowDescSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _shadowPipelineLayout, 0, 1, &_shadowDescSet, 2, _frameUniforms.offsets(frame));
 
 	vkCmdTraceRaysKHR(
 		cmd,
@@ -4354,39 +4926,21 @@ void Renderer::build_shadow_command_buffer()
 		1
 	);
 
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		1, &memorybarrierdesc,
-		0, nullptr,
-		0, nullptr
-	);
-
-
 	VK_CHECK(vkEndCommandBuffer(cmd));
 }
 
 
-void Renderer::create_surfel_rtx_cmd_buffer()
+void Renderer::create_surfel_rtx_cmd_buffer(uint32_t frame)
 {
 		VkCommandBufferBeginInfo cmdBufInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 	
 		VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 	
-		VkCommandBuffer& cmd = _SurfelRTXCommandBuffer;
+		VkCommandBuffer& cmd = _SurfelRTXCommandBuffer[frame];
 	
 		VK_CHECK(vkBeginCommandBuffer(cmd, &cmdBufInfo));
+
+		_graph.record(cmd, PASS_SURFEL_TRACE);
 	
 		VkBufferDeviceAddressInfoKHR bufferDeviceAddressInfo{};
 		bufferDeviceAddressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
@@ -4414,44 +4968,22 @@ void Renderer::create_surfel_rtx_cmd_buffer()
 		hitShaderSbtEntry.size				= VulkanEngine::engine->_rtProperties.shaderGroupHandleSize;
 	
 		VkStridedDeviceAddressRegionKHR callableShaderSbtEntry{};
-	
-		uint32_t width = VulkanEngine::engine->_window->getWidth(), height = VulkanEngine::engine->_window->getHeight();
-	
 
+		// One ray per alive surfel, the launch size is written by prepareIndirect.comp
+		bufferDeviceAddressInfo.buffer = _SurfelStatsBuffer._buffer;
+		const VkDeviceAddress traceArguments = VulkanEngine::engine->vkGetBufferDeviceAddressKHR(*device, &bufferDeviceAddressInfo) + sizeof(unsigned int) * SURFEL_STATS_OFFSET_TRACE;
 
 		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _SurfelRTXPipeline);
-		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _SurfelRTXPipelineLayout, 0, 1, &_SurfelRTXDescSet, 0, nullptr);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, _SurfelRTXPipelineLayout, 0, 1, &_SurfelRTXDescSet, 3, _frameUniforms.offsets(frame));
 	
-		vkCmdTraceRaysKHR(
+		vkCmdTraceRaysIndirectKHR(
 			cmd,
 			&raygenShaderSbtEntry,
 			&missShaderSbtEntry,
 			&hitShaderSbtEntry,
 			&callableShaderSbtEntry,
-			SURFEL_CAPACITY,
-			1,
-			1
+			traceArguments
 		);
-	
-		VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-		VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
-
-		VkMemoryBarrier memorybarrierdesc = {};
-		memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-		memorybarrierdesc.pNext = nullptr;
-		memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-		memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-
-		vkCmdPipelineBarrier(
-			cmd,
-			srcStage,
-			dstStage,
-			0,
-			1, &memorybarrierdesc,
-			0, nullptr,
-			0, nullptr
-		);
-
 
 		VK_CHECK(vkEndCommandBuffer(cmd));
 	}
@@ -4462,6 +4994,7 @@ void Renderer::create_surfel_shade_descriptors()
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 100},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 100},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 		{VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, 1}
@@ -4475,6 +5008,10 @@ void Renderer::create_surfel_shade_descriptors()
 	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
 	VkDescriptorSetLayoutBinding _CellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
 	VkDescriptorSetLayoutBinding _DataBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 5);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
+	VkDescriptorSetLayoutBinding rayRangeBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7);
+	VkDescriptorSetLayoutBinding raysBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 8);
 
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
@@ -4483,7 +5020,11 @@ void Renderer::create_surfel_shade_descriptors()
 		statsBinding,
 		_GridBufferBinding,
 		_CellBufferBinding,
-		_DataBufferBinding
+		_DataBufferBinding,
+		cameraBufferBinding,
+		aliveBinding,
+		rayRangeBinding,
+		raysBinding
 	};
 
 
@@ -4497,15 +5038,23 @@ void Renderer::create_surfel_shade_descriptors()
 	VK_CHECK(vkAllocateDescriptorSets(*device, &surfelShadeDescriptorSetAllocateInfo, &_SurfelShadeDescSet));
 
 
-	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(Surfel) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
 
-	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * 8);
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
 
-	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE);
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
 
-	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * SURFEL_TABLE_SIZE * 100);
+	VkDescriptorBufferInfo dataBufferInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
 
-	VkDescriptorBufferInfo dataBufferInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelData) * SURFEL_CAPACITY);
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkDescriptorBufferInfo rayRangeDescInfo = vkinit::descriptor_buffer_info(_SurfelRayRangeBuffer._buffer, sizeof(SurfelRayRange) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo raysDescInfo = vkinit::descriptor_buffer_info(_SurfelRayBuffer._buffer, sizeof(SurfelRay) * _surfelConfig.rayBudget);
 
 
 
@@ -4514,6 +5063,10 @@ void Renderer::create_surfel_shade_descriptors()
 	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &gridDescInfo, 2);
 	VkWriteDescriptorSet cellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &cellDescInfo, 3);
 	VkWriteDescriptorSet dataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &dataBufferInfo, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelShadeDescSet, &cameraBufferInfo, 5);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &aliveDescInfo, 6);
+	VkWriteDescriptorSet rayRangeWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &rayRangeDescInfo, 7);
+	VkWriteDescriptorSet raysWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelShadeDescSet, &raysDescInfo, 8);
 
 
 	std::vector<VkWriteDescriptorSet> DescriptorWrites =
@@ -4522,7 +5075,11 @@ void Renderer::create_surfel_shade_descriptors()
 		statsWrite,
 		GridWrite,
 		cellWrite,
-		dataWrite
+		dataWrite,
+		cameraWrite,
+		aliveWrite,
+		rayRangeWrite,
+		raysWrite
 	};
 
 
@@ -4542,6 +5099,7 @@ void Renderer::init_surfel_shade_pipeline()
 	VulkanEngine::engine->load_shader_module(vkutil::findFile("surfelshade.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
 
 
 	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
@@ -4567,16 +5125,18 @@ void Renderer::init_surfel_shade_pipeline()
 		});
 }
 
-void Renderer::build_surfel_shade_buffer()
+void Renderer::build_surfel_shade_buffer(uint32_t frame)
 {
 	VkCommandBufferBeginInfo beginInfo = vkinit::command_buffer_begin_info(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
 
-	VkCommandBuffer& cmd = _SurfelShadeCmdBuffer;
+	VkCommandBuffer& cmd = _SurfelShadeCmdBuffer[frame];
 
 	VK_CHECK(vkBeginCommandBuffer(cmd, &beginInfo));
 
+	_graph.record(cmd, PASS_SURFEL_SHADE);
+
 	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelShadePipeline);
-	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelShadePipelineLayout, 0, 1, &_SurfelShadeDescSet, 0, nullptr);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelShadePipelineLayout, 0, 1, &_SurfelShadeDescSet, 1, _frameUniforms.offsets(frame));
 
 
 	int t = static_cast<int> (time(NULL));
@@ -4585,43 +5145,124 @@ void Renderer::build_surfel_shade_buffer()
 
 	vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
 
-	VkPipelineStageFlags srcStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-	VkPipelineStageFlags dstStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	if (_surfelConfig.filter)
+	{
+		_graph.record(cmd, PASS_SURFEL_FILTER);
 
-	VkBufferMemoryBarrier bufferbarrierdesc1 = {};
-	bufferbarrierdesc1.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	bufferbarrierdesc1.pNext = nullptr;
-	bufferbarrierdesc1.buffer = _SurfelDataBuffer._buffer;
-	bufferbarrierdesc1.size = sizeof(SurfelData) * SURFEL_CAPACITY;
-	bufferbarrierdesc1.offset = 0;
-	bufferbarrierdesc1.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT; // VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelFilterPipeline);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _SurfelFilterPipelineLayout, 0, 1, &_SurfelFilterDescSet, 1, _frameUniforms.offsets(frame));
 
-	bufferbarrierdesc1.dstAccessMask = VK_ACCESS_SHADER_READ_BIT; //RESOURCE_STATE_UNORDERED_ACCESS
-																				//flags |= VK_ACCESS_SHADER_READ_BIT;
-																				//flags |= VK_ACCESS_SHADER_WRITE_BIT;
-	bufferbarrierdesc1.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	bufferbarrierdesc1.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		vkCmdDispatchIndirect(cmd, _SurfelStatsBuffer._buffer, sizeof(unsigned int) * 2);
+	}
 
+	VK_CHECK(vkEndCommandBuffer(cmd));
+}
 
-	VkMemoryBarrier memorybarrierdesc = {};
-	memorybarrierdesc.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
-	memorybarrierdesc.pNext = nullptr;
-	memorybarrierdesc.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	memorybarrierdesc.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+void Renderer::create_surfel_filter_descriptors()
+{
+	std::vector<VkDescriptorPoolSize> poolSize = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6}
+	};
 
-	vkCmdPipelineBarrier(
-		cmd,
-		srcStage,
-		dstStage,
-		0,
-		1, &memorybarrierdesc,
-		1, &bufferbarrierdesc1,
-		0, nullptr
-	);
+	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = vkinit::descriptor_pool_create_info(poolSize, 1);
+	VK_CHECK(vkCreateDescriptorPool(*device, &descriptorPoolCreateInfo, nullptr, &_SurfelFilterDescPool));
 
+	VkDescriptorSetLayoutBinding _SurfelBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0);
+	VkDescriptorSetLayoutBinding statsBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1);
+	VkDescriptorSetLayoutBinding _GridBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2);
+	VkDescriptorSetLayoutBinding _CellBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3);
+	VkDescriptorSetLayoutBinding _DataBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4);
+	VkDescriptorSetLayoutBinding cameraBufferBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT, 5);			// Camera buffer
+	VkDescriptorSetLayoutBinding aliveBinding = vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6);
 
+	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings =
+	{
+		_SurfelBufferBinding,
+		statsBinding,
+		_GridBufferBinding,
+		_CellBufferBinding,
+		_DataBufferBinding,
+		cameraBufferBinding,
+		aliveBinding
+	};
 
-	VK_CHECK(vkEndCommandBuffer(cmd));
+	VkDescriptorSetLayoutCreateInfo surfelFilterDescriptorSetLayoutCreateInfo = {};
+	surfelFilterDescriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	surfelFilterDescriptorSetLayoutCreateInfo.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
+	surfelFilterDescriptorSetLayoutCreateInfo.pBindings = setLayoutBindings.data();
+	VK_CHECK(vkCreateDescriptorSetLayout(*device, &surfelFilterDescriptorSetLayoutCreateInfo, nullptr, &_SurfelFilterDescSetLayout));
+
+	VkDescriptorSetAllocateInfo surfelFilterDescriptorSetAllocateInfo = vkinit::descriptor_set_allocate_info(_SurfelFilterDescPool, &_SurfelFilterDescSetLayout, 1);
+	VK_CHECK(vkAllocateDescriptorSets(*device, &surfelFilterDescriptorSetAllocateInfo, &_SurfelFilterDescSet));
+
+	VkDescriptorBufferInfo surfelDescInfo = vkinit::descriptor_buffer_info(_SurfelBuffer._buffer, sizeof(SurfelStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo statsDescInfo = vkinit::descriptor_buffer_info(_SurfelStatsBuffer._buffer, sizeof(unsigned int) * SURFEL_STATS_SIZE);
+
+	VkDescriptorBufferInfo gridDescInfo = vkinit::descriptor_buffer_info(_SurfelGridBuffer._buffer, sizeof(SurfelGridCell) * _surfelConfig.table_size());
+
+	VkDescriptorBufferInfo cellDescInfo = vkinit::descriptor_buffer_info(_SurfelCellBuffer._buffer, sizeof(unsigned int) * _surfelConfig.cell_index_capacity());
+
+	VkDescriptorBufferInfo dataBufferInfo = vkinit::descriptor_buffer_info(_SurfelDataBuffer._buffer, sizeof(SurfelDataStorage) * _surfelConfig.capacity);
+
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_CAMERA);
+
+	VkDescriptorBufferInfo aliveDescInfo = vkinit::descriptor_buffer_info(_SurfelAliveBuffer._buffer, sizeof(unsigned int) * _surfelConfig.capacity * 2);
+
+	VkWriteDescriptorSet surfelBufferWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &surfelDescInfo, 0);
+	VkWriteDescriptorSet statsWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &statsDescInfo, 1);
+	VkWriteDescriptorSet GridWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &gridDescInfo, 2);
+	VkWriteDescriptorSet cellWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &cellDescInfo, 3);
+	VkWriteDescriptorSet dataWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &dataBufferInfo, 4);
+	VkWriteDescriptorSet cameraWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _SurfelFilterDescSet, &cameraBufferInfo, 5);
+	VkWriteDescriptorSet aliveWrite = vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _SurfelFilterDescSet, &aliveDescInfo, 6);
+
+	std::vector<VkWriteDescriptorSet> DescriptorWrites =
+	{
+		surfelBufferWrite,
+		statsWrite,
+		GridWrite,
+		cellWrite,
+		dataWrite,
+		cameraWrite,
+		aliveWrite
+	};
+
+	vkUpdateDescriptorSets(*device, static_cast<uint32_t>(DescriptorWrites.size()), DescriptorWrites.data(), 0, VK_NULL_HANDLE);
+
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyDescriptorSetLayout(*device, _SurfelFilterDescSetLayout, nullptr);
+		vkDestroyDescriptorPool(*device, _SurfelFilterDescPool, nullptr);
+		});
+}
+
+void Renderer::init_surfel_filter_pipeline()
+{
+	VkShaderModule computeShaderModule;
+
+	VulkanEngine::engine->load_shader_module(vkutil::findFile("surfelFilter.comp.spv", searchPaths, true).c_str(), &computeShaderModule);
+
+	VkPipelineShaderStageCreateInfo shaderStageCI = vkinit::pipeline_shader_stage_create_info(VK_SHADER_STAGE_COMPUTE_BIT, computeShaderModule);
+	shaderStageCI.pSpecializationInfo = &_surfelSpecInfo;
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCI = vkinit::pipeline_layout_create_info();
+	pipelineLayoutCI.setLayoutCount = 1;
+	pipelineLayoutCI.pSetLayouts = &_SurfelFilterDescSetLayout;
+	VK_CHECK(vkCreatePipelineLayout(*device, &pipelineLayoutCI, nullptr, &_SurfelFilterPipelineLayout));
+
+	VkComputePipelineCreateInfo computePipelineCI = {};
+	computePipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computePipelineCI.stage = shaderStageCI;
+	computePipelineCI.layout = _SurfelFilterPipelineLayout;
+
+	VK_CHECK(vkCreateComputePipelines(*device, VK_NULL_HANDLE, 1, &computePipelineCI, nullptr, &_SurfelFilterPipeline));
+
+	vkDestroyShaderModule(*device, computeShaderModule, nullptr);
+	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+		vkDestroyPipeline(*device, _SurfelFilterPipeline, nullptr);
+		vkDestroyPipelineLayout(*device, _SurfelFilterPipelineLayout, nullptr);
+		});
 }
 
 // POST
@@ -4852,7 +5493,7 @@ void Renderer::build_post_command_buffers()
 	vkCmdBindDescriptorSets(get_current_frame()._mainCommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, _postPipelineLayout, 0, 1, &get_current_frame().postDescriptorSet, 0, nullptr);
 	vkCmdBindVertexBuffers(get_current_frame()._mainCommandBuffer, 0, 1, &quad->_vertexBuffer._buffer, &offset);
 	vkCmdBindIndexBuffer(get_current_frame()._mainCommandBuffer, quad->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
-	vkCmdDrawIndexed(get_current_frame()._mainCommandBuffer, static_cast<uint32_t>(quad->_indices.size()), 1, 0, 0, 1);
+	vkCmdDrawIndexed(get_current_frame()._mainCommandBuffer, static_cast<uint32_t>(quad->index_count()), 1, 0, 0, 1);
 
 	ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), get_current_frame()._mainCommandBuffer);
 
@@ -4868,6 +5509,8 @@ void Renderer::create_hybrid_descriptors()
 	std::vector<VkDescriptorPoolSize> poolSizes = {
 		{VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
 		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 10},
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 10},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 10},
 		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10},
 		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 10}
 	};
@@ -4894,9 +5537,9 @@ void Renderer::create_hybrid_descriptors()
 
 	VkDescriptorSetLayoutBinding TLASBinding			= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 0);			// TLAS
 	VkDescriptorSetLayoutBinding storageImageBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 1);			// storage image
-	VkDescriptorSetLayoutBinding cameraBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);			// Camera buffer
+	VkDescriptorSetLayoutBinding cameraBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 2);			// Camera buffer
 	VkDescriptorSetLayoutBinding gBuffersBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 3, 6);
-	VkDescriptorSetLayoutBinding lightsBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);	// Lights
+	VkDescriptorSetLayoutBinding lightsBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 4);	// Lights
 	VkDescriptorSetLayoutBinding vertexBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 5, nInstances);	// Vertices
 	VkDescriptorSetLayoutBinding indexBufferBinding		= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 6, nInstances);	// Indices
 	VkDescriptorSetLayoutBinding texturesBufferBinding	= vkinit::descriptorset_layout_binding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_MISS_BIT_KHR, 7, nTextures); // Textures buffer
@@ -4936,7 +5579,7 @@ void Renderer::create_hybrid_descriptors()
 	descriptorAccelerationStructureInfo.pAccelerationStructures		= &_topLevelAS.handle;
 
 	// Binding = 1 Camera write
-	VkDescriptorBufferInfo cameraBufferInfo = vkinit::descriptor_buffer_info(_rtCameraBuffer._buffer, sizeof(RTCameraData));
+	VkDescriptorBufferInfo cameraBufferInfo = _frameUniforms.descriptor(FRAME_RT_CAMERA);
 
 	// Binding = 2 Output image write
 	VkDescriptorImageInfo storageImageDescriptor = vkinit::descriptor_image_info(_rtImage.imageView, VK_IMAGE_LAYOUT_GENERAL);
@@ -4959,7 +5602,7 @@ void Renderer::create_hybrid_descriptors()
 	std::vector<VkDescriptorImageInfo> gbuffersDescInfo = { texDescriptorPosition, texDescriptorNormal, texDescriptorAlbedo, texDescriptorMotion, texDescriptorMaterial, texDescriptorEmissive };
 
 	// Binding = 4 Lights buffer descriptor
-	VkDescriptorBufferInfo lightDescBuffer = vkinit::descriptor_buffer_info(_lightBuffer._buffer, sizeof(uboLight) * nLights);
+	VkDescriptorBufferInfo lightDescBuffer = _frameUniforms.descriptor(FRAME_LIGHTS);
 
 	std::vector<VkDescriptorBufferInfo> vertexDescInfo;
 	std::vector<VkDescriptorBufferInfo> indexDescInfo;
@@ -4967,27 +5610,25 @@ void Renderer::create_hybrid_descriptors()
 	for (Object* obj : _scene->_entities)
 	{
 		AllocatedBuffer vBuffer;
-		size_t bufferSize = sizeof(rtVertexAttribute) * obj->prefab->_mesh->_vertices.size();
-		VulkanEngine::engine->create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, vBuffer);
+		size_t bufferSize = sizeof(rtVertexAttribute) * obj->prefab->_mesh->vertex_count();
+		VulkanEngine::engine->create_buffer(bufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, vBuffer);
 
 		std::vector<rtVertexAttribute> vAttr;
-		std::vector<Vertex> vertices = obj->prefab->_mesh->_vertices;
-		vAttr.reserve(vertices.size());
-		for (Vertex& v : vertices) {
+		const Vertex* vertices = obj->prefab->_mesh->vertex_data();
+		vAttr.reserve(obj->prefab->_mesh->vertex_count());
+		for (size_t i = 0; i < obj->prefab->_mesh->vertex_count(); i++) {
+			const Vertex& v = vertices[i];
 			vAttr.push_back({ {v.normal.x, v.normal.y, v.normal.z, 1}, {v.color.x, v.color.y, v.color.z, 1}, {v.uv.x, v.uv.y, 1, 1} });
 		}
 
-		void* vdata;
-		vmaMapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation, &vdata);
-		memcpy(vdata, vAttr.data(), bufferSize);
-		vmaUnmapMemory(VulkanEngine::engine->_allocator, vBuffer._allocation);
+		AssetLoader::get().upload([&](UploadQueue& queue) { queue.copy_buffer(vAttr.data(), bufferSize, vBuffer._buffer); }, []() {});
 
 		// Binding = 5 Vertices Info
 		VkDescriptorBufferInfo vertexBufferDescriptor = vkinit::descriptor_buffer_info(vBuffer._buffer, bufferSize);
 		vertexDescInfo.push_back(vertexBufferDescriptor);
 
 		// Binding = 6 Indices Info
-		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, sizeof(uint32_t) * obj->prefab->_mesh->_indices.size());
+		VkDescriptorBufferInfo indexBufferDescriptor = vkinit::descriptor_buffer_info(obj->prefab->_mesh->_indexBuffer._buffer, sizeof(uint32_t) * obj->prefab->_mesh->index_count());
 		indexDescInfo.push_back(indexBufferDescriptor);
 
 		for (Node* root : obj->prefab->_root)
@@ -5019,8 +5660,8 @@ void Renderer::create_hybrid_descriptors()
 
 	// Binding = 8 Skybox
 	VkDescriptorImageInfo skyboxImagesDesc[2];
-	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
-	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[0] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_8k.jpg")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+	skyboxImagesDesc[1] = { sampler, Texture::GET("LA_Downtown_Helipad_GoldenHour_Env.hdr")->wait()->imageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
 
 	// Binding = 9 Material info
 	VkDescriptorBufferInfo materialBufferInfo = vkinit::descriptor_buffer_info(_matBuffer._buffer, sizeof(GPUMaterial) * nMaterials);
@@ -5041,9 +5682,9 @@ void Renderer::create_hybrid_descriptors()
 	// Writes list
 	VkWriteDescriptorSet accelerationStructureWrite = vkinit::write_descriptor_acceleration_structure(_hybridDescSet, &descriptorAccelerationStructureInfo, 0);
 	VkWriteDescriptorSet storageImageWrite		= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, _hybridDescSet, &storageImageDescriptor, 1);
-	VkWriteDescriptorSet cameraWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _hybridDescSet, &cameraBufferInfo, 2);
+	VkWriteDescriptorSet cameraWrite			= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, _hybridDescSet, &cameraBufferInfo, 2);
 	VkWriteDescriptorSet gbuffersWrite			= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, gbuffersDescInfo.data(), 3, gbuffersDescInfo.size());
-	VkWriteDescriptorSet lightWrite				= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, &lightDescBuffer, 4);
+	VkWriteDescriptorSet lightWrite				= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, _hybridDescSet, &lightDescBuffer, 4);
 	VkWriteDescriptorSet vertexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, vertexDescInfo.data(), 5, nInstances);
 	VkWriteDescriptorSet indexBufferWrite		= vkinit::write_descriptor_buffer(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _hybridDescSet, indexDescInfo.data(), 6, nInstances);
 	VkWriteDescriptorSet texturesBufferWrite	= vkinit::write_descriptor_image(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _hybridDescSet, imageInfos.data(), 7, nTextures);
@@ -4,6 +4,12 @@
 
 #include "scene.h"
 #include "vk_textures.h"
+#include "surfel_gi.h"
+#include "frame_uniforms.h"
+#include "light_buffer.h"
+#include "light_clusters.h"
+#include "render_graph.h"
+#include "surfel_telemetry.h"
 
 struct FrameData
 {
@@ -25,50 +31,6 @@ struct pushConstants {
 	glm::mat4 render_matrix;
 };
 
-struct Surfel
-{
-	glm::vec3 position;
-	float padding0;
-	glm::vec3 normal;
-	float padding1;
-	glm::vec3 color;
-	float radius;
-};
-
-struct SurfelData
-{
-	glm::vec3 mean;
-	float pad0;
-
-	glm::vec3 shortMean;
-	float vbbr;
-
-	glm::vec3 variance;
-	float inconsistency;
-
-	glm::vec3 hitpos;
-	float padding0;
-
-	glm::vec3 hitnormal;
-	float padding1;
-
-	glm::vec3 hitenergy;
-	float padding2;
-
-	glm::vec3 traceresult;
-	float padding3;
-};
-
-
-static const unsigned int SURFEL_STATS_OFFSET_COUNT = 0;
-static const unsigned int SURFEL_INDIRECT_NUMTHREADS = 32;
-static const glm::uvec3 SURFEL_GRID_DIMENSIONS = glm::uvec3(128, 64, 128); // (64, 32, 64)   (128, 64, 128)
-static const unsigned int SURFEL_TABLE_SIZE = SURFEL_GRID_DIMENSIONS.x * SURFEL_GRID_DIMENSIONS.y * SURFEL_GRID_DIMENSIONS.z;
-static const unsigned int SURFEL_CAPACITY = 100000;
-static const float SURFEL_TARGET_COVERAGE = 0.5;
-const float SURFEL_MAX_RADIUS = 1;
-
-
 struct AccelerationStructure {
 	VkAccelerationStructureKHR	handle;
 	uint64_t					deviceAddress = 0;
@@ -83,6 +45,33 @@ struct RayTracingScratchBuffer {
 
 constexpr unsigned int FRAME_OVERLAP = 2;
 
+// Slots of the surfel stats readback ring, one more than the frames in flight so a slot is read before it is reused
+constexpr unsigned int SURFEL_STATS_READBACK_FRAMES = FRAME_OVERLAP + 1;
+
+// Passes of a frame in submission order, ids of the render graph passes
+enum FramePass
+{
+	PASS_GBUFFER,
+	PASS_SURFEL_COVERAGE,
+	PASS_PREPARE_INDIRECT,
+	PASS_GRID_RESET,
+	PASS_UPDATE_SURFELS,
+	PASS_SURFEL_COMPACT,
+	PASS_GRID_OFFSET,
+	PASS_SURFEL_BINNING,
+	PASS_SURFEL_SORT_ORDER,
+	PASS_SURFEL_SORT_SCATTER,
+	PASS_SURFEL_SORT_APPLY,
+	PASS_SURFEL_RAY_ALLOCATE,
+	PASS_SURFEL_TRACE,
+	PASS_SHADOW,
+	PASS_SURFEL_SHADE,
+	PASS_SURFEL_FILTER,
+	PASS_SURFEL_STATS,
+	PASS_DEFERRED,
+	PASS_COUNT
+};
+
 class Renderer {
 
 public:
@@ -131,21 +120,19 @@ public:
 	VkDescriptorSet				_objectDescriptorSet;
 	VkDescriptorSetLayout		_textureDescriptorSetLayout;
 	VkDescriptorSet				_textureDescriptorSet;
-	VkCommandBuffer				_offscreenComandBuffer;
+	VkCommandBuffer				_offscreenComandBuffer[FRAME_OVERLAP];
 	VkSampler					_offscreenSampler;
-	VkSemaphore					_offscreenSemaphore;
 	VkPipelineLayout			_offscreenPipelineLayout;
 	VkPipeline					_offscreenPipeline;
 
-	AllocatedBuffer				_cameraBuffer;
-	AllocatedBuffer				_cameraPositionBuffer;
+	// Camera, frame count, debug target and skybox matrix of every frame in flight
+	FrameUniforms				_frameUniforms;
 
 	// Skybox pass
 	VkDescriptorSetLayout		_skyboxDescriptorSetLayout;
 	VkDescriptorSet				_skyboxDescriptorSet;
 	VkPipeline					_skyboxPipeline;
 	VkPipelineLayout			_skyboxPipelineLayout;
-	AllocatedBuffer				_skyboxBuffer;
 
 	// RAYTRACING VARIABLES ------------------------
 	VkDescriptorPool			_rtDescriptorPool;
@@ -155,22 +142,19 @@ public:
 	VkPipeline					_rtPipeline;
 	VkPipelineLayout			_rtPipelineLayout;
 	VkCommandBuffer				_rtCommandBuffer;
-	VkSemaphore					_rtSemaphore;
 
 	std::vector<AccelerationStructure>	_bottomLevelAS;
 	AccelerationStructure				_topLevelAS;
 
 	std::vector<BlasInput>		_blas;
 	std::vector<TlasInstance>	_tlas;
-	AllocatedBuffer				_lightBuffer;
-	AllocatedBuffer				_debugBuffer;
+	LightBuffer					_lights;
+	LightClusters				_lightClusters;
 	AllocatedBuffer				_matBuffer;
 	AllocatedBuffer				_instanceBuffer;
-	AllocatedBuffer				_rtCameraBuffer;
 	AllocatedBuffer				_matricesBuffer;
 	AllocatedBuffer				_idBuffer;
 	AllocatedBuffer				_shadowSamplesBuffer;
-	AllocatedBuffer				_frameCountBuffer;
 
 	AllocatedBuffer				raygenShaderBindingTable;
 	AllocatedBuffer				missShaderBindingTable;
@@ -188,6 +172,7 @@ public:
 	PFN_vkGetRayTracingShaderGroupHandlesKHR			vkGetRayTracingShaderGroupHandlesKHR;
 	PFN_vkCreateRayTracingPipelinesKHR					vkCreateRayTracingPipelinesKHR;
 	PFN_vkCmdTraceRaysKHR								vkCmdTraceRaysKHR;
+	PFN_vkCmdTraceRaysIndirectKHR						vkCmdTraceRaysIndirectKHR;
 	PFN_vkDestroyAccelerationStructureKHR				vkDestroyAccelerationStructureKHR;
 
 
@@ -220,8 +205,7 @@ public:
 	//Texture						_shadowImage;
 	VkPipeline					_shadowPipeline;
 	VkPipelineLayout			_shadowPipelineLayout;
-	VkCommandBuffer				_shadowCommandBuffer;
-	VkSemaphore					_shadowSemaphore;
+	VkCommandBuffer				_shadowCommandBuffer[FRAME_OVERLAP];
 	std::vector<Texture>		_shadowImages;
 
 	AllocatedBuffer				sraygenSBT;
@@ -236,16 +220,14 @@ public:
 	VkDescriptorSet				_sPostDescSet;
 	VkDescriptorSetLayout		_sPostDescSetLayout;
 	std::vector<Texture>		_denoisedImages;
-	VkCommandBuffer				_denoiseCommandBuffer;
-	VkSemaphore					_denoiseSemaphore;
+	VkCommandBuffer				_denoiseCommandBuffer[FRAME_OVERLAP];
 	AllocatedBuffer				_denoiseFrameBuffer;
 
 
 
 
 
-	VkCommandBuffer				_SurfelPositionCmd;
-	VkSemaphore					_SurfelPositionSemaphore;
+	VkCommandBuffer				_SurfelPositionCmd[FRAME_OVERLAP];
 	VkDescriptorPool			_SurfelPositionDescPool;
 	VkDescriptorSet				_SurfelPositionDescSet;
 	VkDescriptorSetLayout		_SurfelPositionDescSetLayout;
@@ -255,7 +237,6 @@ public:
 
 
 	VkCommandBuffer				_PrepareIndirectCmdBuffer;
-	VkSemaphore					_PrepareIndirectSemaphore;
 	VkDescriptorPool			_PrepareIndirectDescPool;
 	VkDescriptorSet				_PrepareIndirectDescSet;
 	VkDescriptorSetLayout		_PrepareIndirectDescSetLayout;
@@ -264,7 +245,6 @@ public:
 
 
 	VkCommandBuffer				_GridResetCmdBuffer;
-	VkSemaphore					_GridResetSemaphore;
 	VkDescriptorPool			_GridResetDescPool;
 	VkDescriptorSet				_GridResetDescSet;
 	VkDescriptorSetLayout		_GridResetDescSetLayout;
@@ -273,7 +253,6 @@ public:
 
 
 	VkCommandBuffer				_UpdateSurfelsCmdBuffer;
-	VkSemaphore					_UpdateSurfelsSemaphore;
 	VkDescriptorPool			_UpdateSurfelsDescPool;
 	VkDescriptorSet				_UpdateSurfelsDescSet;
 	VkDescriptorSetLayout		_UpdateSurfelsDescSetLayout;
@@ -281,7 +260,6 @@ public:
 	VkPipelineLayout			_UpdateSurfelsPipelineLayout;
 
 	VkCommandBuffer				_GridOffsetCmdBuffer;
-	VkSemaphore					_GridOffsetSemaphore;
 	VkDescriptorPool			_GridOffsetDescPool;
 	VkDescriptorSet				_GridOffsetDescSet;
 	VkDescriptorSetLayout		_GridOffsetDescSetLayout;
@@ -289,13 +267,27 @@ public:
 	VkPipelineLayout			_GridOffsetPipelineLayout;
 
 	VkCommandBuffer				_SurfelBinningCmdBuffer;
-	VkSemaphore					_SurfelBinningSemaphore;
 	VkDescriptorPool			_SurfelBinningDescPool;
 	VkDescriptorSet				_SurfelBinningDescSet;
 	VkDescriptorSetLayout		_SurfelBinningDescSetLayout;
 	VkPipeline					_SurfelBinningPipeline;
 	VkPipelineLayout			_SurfelBinningPipelineLayout;
 
+	VkDescriptorPool			_SurfelRayAllocateDescPool;
+	VkDescriptorSet				_SurfelRayAllocateDescSet;
+	VkDescriptorSetLayout		_SurfelRayAllocateDescSetLayout;
+	VkPipeline					_SurfelRayAllocatePipeline;
+	VkPipelineLayout			_SurfelRayAllocatePipelineLayout;
+
+	// The three sort passes share one descriptor set
+	VkDescriptorPool			_SurfelSortDescPool;
+	VkDescriptorSet				_SurfelSortDescSet;
+	VkDescriptorSetLayout		_SurfelSortDescSetLayout;
+	VkPipelineLayout			_SurfelSortPipelineLayout;
+	VkPipeline					_SurfelSortOrderPipeline;
+	VkPipeline					_SurfelSortScatterPipeline;
+	VkPipeline					_SurfelSortApplyPipeline;
+
 
 	std::vector<VkRayTracingShaderGroupCreateInfoKHR> surfelShaderGroups{};
 	
@@ -304,31 +296,60 @@ public:
 	VkPipelineLayout			_SurfelRTXPipelineLayout;
 	VkDescriptorSet				_SurfelRTXDescSet;
 	VkDescriptorSetLayout		_SurfelRTXDescSetLayout;
-	VkCommandBuffer				_SurfelRTXCommandBuffer;
+	VkCommandBuffer				_SurfelRTXCommandBuffer[FRAME_OVERLAP];
 
 	AllocatedBuffer				_SurfelRTXraygenSBT;
 	AllocatedBuffer				_SurfelRTXmissSBT;
 	AllocatedBuffer				_SurfelRTXhitSBT;
 
-	VkCommandBuffer				_SurfelShadeCmdBuffer;
-	VkSemaphore					_SurfelShadeSemaphore;
+	VkCommandBuffer				_SurfelShadeCmdBuffer[FRAME_OVERLAP];
 	VkDescriptorPool			_SurfelShadeDescPool;
 	VkDescriptorSet				_SurfelShadeDescSet;
 	VkDescriptorSetLayout		_SurfelShadeDescSetLayout;
 	VkPipeline					_SurfelShadePipeline;
 	VkPipelineLayout			_SurfelShadePipelineLayout;
 
+	VkDescriptorPool			_SurfelFilterDescPool;
+	VkDescriptorSet				_SurfelFilterDescSet;
+	VkDescriptorSetLayout		_SurfelFilterDescSetLayout;
+	VkPipeline					_SurfelFilterPipeline;
+	VkPipelineLayout			_SurfelFilterPipelineLayout;
+
 
 	////Surfel GI
-	AllocatedBuffer				_SurfelPositionBuffer;
 	AllocatedBuffer				_SurfelBuffer;
 	AllocatedBuffer				_SurfelDataBuffer;
 	AllocatedBuffer				_SurfelStatsBuffer;
 	AllocatedBuffer				_SurfelGridBuffer;
 	AllocatedBuffer				_SurfelCellBuffer;
+	AllocatedBuffer				_SurfelAliveBuffer;
+	AllocatedBuffer				_SurfelDeadBuffer;
+	AllocatedBuffer				_SurfelRayRangeBuffer;		// SurfelRayRange per surfel
+	AllocatedBuffer				_SurfelRayQueueBuffer;		// surfel index per ray
+	AllocatedBuffer				_SurfelRayBuffer;			// SurfelRay per ray
+	AllocatedBuffer				_SurfelRemapBuffer;			// sorted slot per surfel slot
+	AllocatedBuffer				_SurfelSortBuffer;			// surfels in sorted order, copied back by the last sort pass
+	AllocatedBuffer				_SurfelDataSortBuffer;
+	AllocatedBuffer				_surfelCacheReadback;
+	AllocatedBuffer				_surfelStatsReadback;		// SURFEL_STATS_READBACK_FRAMES copies of the stats buffer, persistently mapped
+	SurfelStatsRing				_surfelStatsRing;
+	SurfelTelemetry				_surfelTelemetry;
+
+	// Sizes every surfel buffer and is passed to every surfel pipeline as specialization constants
+	SurfelConfig				_surfelConfig;
+	uint32_t					_surfelSpecData[SURFEL_SPEC_COUNT];
+	VkSpecializationMapEntry	_surfelSpecEntries[SURFEL_SPEC_COUNT];
+	VkSpecializationInfo		_surfelSpecInfo{};
+	bool						_surfelCacheDone{ false };
+	bool						_surfelCacheSaveRequested{ false };
+	int							_surfelCacheSaveFrame{ -1 };	// frame that recorded the snapshot copy, -1 when none is in flight
+	bool						_surfelCacheSaved{ false };		// one snapshot per run, the readback stays mapped until shutdown
 	Texture						_result;
 	Texture						_debugGI;
 
+	// Barriers between the passes and the single submit of a frame
+	RenderGraph					_graph;
+
 	int shaderIf;
 
 	void rasterize();
@@ -351,12 +372,47 @@ public:
 
 	FrameData& get_current_frame();
 
+	uint32_t frame_index() const { return *frameNumber % FRAME_OVERLAP; }
+
 	void create_storage_image();
 
+	void create_surfel_coverage_images();
+
+	void create_surfel_stats_readback();
+
+	// Copies the stats buffer into the slot of the frame, recorded in the main command buffer
+	void record_surfel_stats(VkCommandBuffer cmd);
+
+	// Reads the frames up to completed and writes them to the telemetry stream
+	void collect_surfel_stats(uint64_t completed);
+
+	// Copies the surfel buffers into the snapshot readback, after the PASS_SURFEL_STATS barrier
+	void record_surfel_cache_save(VkCommandBuffer cmd);
+
+	// Maps the readback of a finished frame and writes the snapshot on the ThreadPool
+	void write_surfel_cache();
+
+	// Coverage images at the new window size, called from recreate_renderer
+	void resize_surfel_coverage();
+
 	void recreate_renderer();
 
 	void buildTlas(const std::vector<TlasInstance>& input, VkBuildAccelerationStructureFlagsKHR flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, bool update = false);
 
+	// The next frame copies the surfel buffers out, the snapshot of the scene is written on the
+	// ThreadPool once that frame is done
+	void request_surfel_cache_save();
+
+	// Writes a snapshot whose frame has finished, or copies it out now if no frame recorded it. Call
+	// once the GPU is idle, the file is done before the deletion queue unmaps the readback buffer
+	void flush_surfel_cache();
+
+	// Counters of the most recent frame read back, a few frames behind the one being recorded
+	const SurfelFrameStats& surfel_stats() const { return _surfelStatsRing.latest(); }
+
+	// Reads every frame still in the ring and closes the telemetry stream, call once the GPU is idle
+	void flush_surfel_stats();
+
 private:
 
 	void init_framebuffers();
@@ -409,11 +465,16 @@ private:
 
 	//void build_raytracing_command_buffers();
 
-	void build_shadow_command_buffer();
+	void build_shadow_command_buffer(uint32_t frame);
 
-	void build_compute_command_buffer();
+	void build_compute_command_buffer(uint32_t frame);
 
+	void init_surfel_config();
 	void create_SurfelGi_resources();
+
+	void load_surfel_cache();
+
+	void init_render_graph();
 	
 	void surfel_position();
 
@@ -427,6 +488,13 @@ private:
 
 	void surfel_binning();
 
+	void surfel_sort();
+
+	void surfel_ray_allocate();
+
+	// Records the whole surfel update command buffer of a frame again
+	void record_surfel_update_chain(uint32_t frame);
+
 	void surfel_ray_tracing();
 
 	void surfel_shade();
@@ -440,37 +508,50 @@ private:
 
 	void init_surfel_position_pipeline();
 
-	void build_surfel_position_command_buffer();
+	void build_surfel_position_command_buffer(uint32_t frame);
 
 	void create_prepare_indirect_descriptors();
 
 	void init_prepare_indirect_pipeline();
 
-	void build_prepare_indirect_buffer();
+	void build_prepare_indirect_buffer(uint32_t frame);
 
 	void create_grid_reset_descriptors();
 
 	void init_grid_reset_pipeline();
 
-	void build_grid_reset_buffer();
+	void build_grid_reset_buffer(uint32_t frame);
 
 	void create_update_surfels_descriptors();
 
 	void init_update_surfels_pipeline();
 
-	void build_update_surfels_buffer();
+	void build_update_surfels_buffer(uint32_t frame);
+	void build_surfel_compact_buffer(uint32_t frame);
 
 	void create_grid_offset_descriptors();
 
 	void init_grid_offset_pipeline();
 
-	void build_grid_offset_buffer();
+	void build_grid_offset_buffer(uint32_t frame);
 
 	void create_surfel_binning_descriptors();
 
 	void init_surfel_binning_pipeline();
 
-	void build_surfel_binning_buffer();
+	void build_surfel_binning_buffer(uint32_t frame);
+
+	void create_surfel_sort_descriptors();
+
+	void init_surfel_sort_pipelines();
+
+	void build_surfel_sort_buffer(uint32_t frame);
+
+	void create_surfel_ray_allocate_descriptors();
+
+	void init_surfel_ray_allocate_pipeline();
+
+	void build_surfel_ray_allocate_buffer(uint32_t frame);
 
 
 	void create_surfel_rtx_descriptors();
@@ -479,14 +560,19 @@ private:
 
 	void create_surfel_rtx_SBT();
 
-	void create_surfel_rtx_cmd_buffer();
+	void create_surfel_rtx_cmd_buffer(uint32_t frame);
 
 
 	void create_surfel_shade_descriptors();
 
 	void init_surfel_shade_pipeline();
 
-	void build_surfel_shade_buffer();
+	void build_surfel_shade_buffer(uint32_t frame);
+
+	// Optional spatial filter, recorded in the shade command buffer
+	void create_surfel_filter_descriptors();
+
+	void init_surfel_filter_pipeline();
 
 	// POST
 	void create_post_renderPass();
@@ -0,0 +1,190 @@
+#include "sampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+static const float		SAMPLING_PI		= 3.14159265358979323846f;
+static const uint32_t	GOLDEN_RATIO	= 0x9E3779B9u;		// 2^32 / phi
+static const uint32_t	R2_X			= 0xC13FA9A9u;		// 2^32 / g, g the plastic number
+static const uint32_t	R2_Y			= 0x91E10DA5u;		// 2^32 / g^2
+
+uint32_t tea(uint32_t val0, uint32_t val1)
+{
+	uint32_t v0 = val0;
+	uint32_t v1 = val1;
+	uint32_t s0 = 0;
+
+	for (uint32_t n = 0; n < 16; n++)
+	{
+		s0 += 0x9e3779b9;
+		v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+		v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+	}
+
+	return v0;
+}
+
+// bitfieldReverse in GLSL
+static uint32_t reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// Each bit only depends on the ones below it, so on reversed bits it permutes every subinterval on its own
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+uint32_t owen_scramble(uint32_t x, uint32_t seed)
+{
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+glm::uvec2 sobol2(uint32_t index)
+{
+	// Dimension 0 is the van der Corput sequence, dimension 1 has the direction numbers of x + 1
+	const uint32_t x = reverse_bits(index);
+	uint32_t y = 0;
+	for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+	{
+		if (index & 1)
+			y ^= v;
+	}
+	return glm::uvec2(x, y);
+}
+
+glm::uvec2 sobol2_owen(uint32_t index, uint32_t seed)
+{
+	glm::uvec2 p = sobol2(owen_scramble(index, seed));
+	p.x = owen_scramble(p.x, tea(seed, 0));
+	p.y = owen_scramble(p.y, tea(seed, 1));
+	return p;
+}
+
+glm::uvec2 r2(uint32_t index)
+{
+	return glm::uvec2(index * R2_X, index * R2_Y);
+}
+
+float sample_float(uint32_t x)
+{
+	return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+glm::vec2 sample_float(const glm::uvec2& x)
+{
+	return glm::vec2(sample_float(x.x), sample_float(x.y));
+}
+
+glm::vec2 surfel_ray_sample(uint32_t surfel_index, uint32_t sample_index, uint32_t frame)
+{
+	return sample_float(sobol2_owen(sample_index, tea(surfel_index, 0)) + r2(frame));
+}
+
+float blue_noise_sample(float texel, uint32_t frame)
+{
+	return sample_float(((uint32_t)(texel * 16777216.0f) << 8) + frame * GOLDEN_RATIO);
+}
+
+glm::vec3 sample_cosine_hemisphere(const glm::vec3& n, const glm::vec2& u)
+{
+	const float flip = n.z >= 0.0f ? 1.0f : -1.0f;
+	const float a = -1.0f / (flip + n.z);
+	const float b = n.x * n.y * a;
+	const glm::vec3 b1 = glm::vec3(1.0f + flip * n.x * n.x * a, flip * b, -flip * n.x);
+	const glm::vec3 b2 = glm::vec3(b, flip + n.y * n.y * a, -n.y);
+
+	const float r = std::sqrt(u.x);
+	const float phi = 2.0f * SAMPLING_PI * u.y;
+
+	return glm::normalize(r * std::cos(phi) * b1 + r * std::sin(phi) * b2 + std::sqrt(std::max(0.0f, 1.0f - u.x)) * n);
+}
+
+int sampling_check()
+{
+	uint32_t netViolations = 0;		// elementary intervals of power of two prefixes of sobol2_owen without exactly one point
+	float r2Discrepancy = 0.0f;		// star discrepancy of the first 1024 points of R2 over a 64 x 64 grid of boxes, times 1024
+	float goldenGap = 0.0f;			// largest gap of blue_noise_sample over the frames, times their count
+
+	// Every 2^a x 2^b box of the 2^(a + b) first points holds exactly one
+	for (uint32_t seed = 0; seed < 4; seed++)
+	{
+		for (uint32_t m = 1; m <= 10; m++)
+		{
+			const uint32_t n = 1u << m;
+			for (uint32_t a = 0; a <= m; a++)
+			{
+				const uint32_t b = m - a;
+				std::vector<uint32_t> boxes(n, 0);
+				for (uint32_t i = 0; i < n; i++)
+				{
+					const glm::uvec2 p = sobol2_owen(i, tea(seed, 7));
+					const uint32_t x = a > 0 ? p.x >> (32 - a) : 0;
+					const uint32_t y = b > 0 ? p.y >> (32 - b) : 0;
+					boxes[(x << b) | y]++;
+				}
+				for (uint32_t count : boxes)
+					if (count != 1)
+						netViolations++;
+			}
+		}
+	}
+
+	const uint32_t points = 1024;
+	const uint32_t grid = 64;
+	for (uint32_t bx = 1; bx <= grid; bx++)
+	{
+		for (uint32_t by = 1; by <= grid; by++)
+		{
+			const glm::vec2 corner = glm::vec2(bx, by) / float(grid);
+			uint32_t inside = 0;
+			for (uint32_t i = 0; i < points; i++)
+			{
+				const glm::vec2 p = sample_float(r2(i));
+				if (p.x < corner.x && p.y < corner.y)
+					inside++;
+			}
+			r2Discrepancy = std::max(r2Discrepancy, std::abs(float(inside) - corner.x * corner.y * points));
+		}
+	}
+
+	std::vector<float> frames(points);
+	for (uint32_t i = 0; i < points; i++)
+		frames[i] = blue_noise_sample(0.3f, i);
+	std::sort(frames.begin(), frames.end());
+	goldenGap = frames.front() + 1.0f - frames.back();
+	for (uint32_t i = 1; i < points; i++)
+		goldenGap = std::max(goldenGap, frames[i] - frames[i - 1]);
+	goldenGap *= points;
+
+	uint32_t failed = 0;
+	auto expect = [&](bool condition, const char* what) {
+		if (!condition)
+		{
+			std::cout << "Sampling: " << what << " FAILED" << std::endl;
+			failed++;
+		}
+	};
+
+	// Owen scrambling keeps Sobol a (0, m, 2)-net, R2 stays within log2 of the count and the three gap theorem bounds the golden ratio by 1 + phi
+	expect(netViolations == 0, "Sobol nets");
+	expect(r2Discrepancy <= 10.0f, "R2 discrepancy");
+	expect(goldenGap <= 2.619f, "golden ratio gaps");
+
+	std::cout << "Sampling: " << netViolations << " Sobol net violations, R2 discrepancy " << r2Discrepancy << ", golden ratio gap "
+		<< goldenGap << ", " << (failed == 0 ? "all checks passed" : "checks FAILED") << std::endl;
+
+	return failed == 0 ? 0 : 1;
+}
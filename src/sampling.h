@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+#include <glm/glm/glm.hpp>
+
+// CPU side of data/shaders/sampling.glsl, the sample sequences of the surfel rays and of the
+// spawn chance. Everything up to the conversion to float is integer arithmetic, so both sides
+// produce the same bits; the warps to directions go through sqrt, sin and cos and only agree
+// to a few ulps.
+//
+// Surfel rays take an Owen scrambled 2D Sobol point per ray of a frame, seeded per surfel,
+// rotated every frame by the R2 sequence so consecutive frames fill the gaps of each other.
+// Any power of two prefix of a frame is a (0, m, 2)-net, a surfel with 4 rays puts one in each
+// quadrant of the square, where hashed samples clump and leave holes.
+
+// "GPU Random Numbers via the Tiny Encryption Algorithm", tea in random.glsl
+uint32_t tea(uint32_t val0, uint32_t val1);
+
+// Nested uniform (Owen) scramble of the bits of x, "Practical Hash-based Owen Scrambling", Burley 2020
+uint32_t owen_scramble(uint32_t x, uint32_t seed);
+
+// First two dimensions of the Sobol sequence, in 0.32 fixed point
+glm::uvec2 sobol2(uint32_t index);
+
+// Sobol point of index, shuffled and scrambled with seed
+glm::uvec2 sobol2_owen(uint32_t index, uint32_t seed);
+
+// R2, the additive recurrence of the plastic number, in 0.32 fixed point. Adding it wraps around
+// the unit square, a toroidal shift that keeps the stratification of the point it moves.
+glm::uvec2 r2(uint32_t index);
+
+// 0.32 fixed point to [0, 1), the top 24 bits so the float is exact
+float sample_float(uint32_t x);
+glm::vec2 sample_float(const glm::uvec2& x);
+
+// Sample sample_index of a surfel in frame
+glm::vec2 surfel_ray_sample(uint32_t surfel_index, uint32_t sample_index, uint32_t frame);
+
+// Spatiotemporal blue noise: the texel of a 2D blue noise tile, animated by the golden ratio so
+// every texel runs a low discrepancy sequence over the frames while neighbours stay blue
+float blue_noise_sample(float texel, uint32_t frame);
+
+// Cosine distributed direction about n, basis of "Building an Orthonormal Basis, Revisited"
+glm::vec3 sample_cosine_hemisphere(const glm::vec3& n, const glm::vec2& u);
+
+// Checks the equidistribution of the sequences above, returns the process exit code
+int sampling_check();
@@ -18,6 +18,8 @@ bool equals(int* a) { return *a > 1; }
 
 void Scene::create_scene(int i)
 {
+	_index = i;
+
 	switch (i)
 	{
 	case 0:
@@ -14,6 +14,8 @@ public:
 
 	Camera* _camera;
 
+	int _index{ -1 };	// what create_scene was called with
+
 	unsigned int get_drawable_nodes_size();
 	void create_scene(int i);
 private:
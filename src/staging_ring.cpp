@@ -0,0 +1,205 @@
+#include "staging_ring.h"
+
+#include <algorithm>
+#include <iostream>
+
+void StagingRing::init(StagingAllocator* allocator, uint64_t size)
+{
+	_allocator	= allocator;
+	_size		= size;
+	_mapped		= allocator->map(size);
+	_head		= 0;
+	_openBegin	= 0;
+	_regions.clear();
+
+	_stats = StagingStats();
+	_stats.capacity = size;
+}
+
+void StagingRing::cleanup()
+{
+	if (!_regions.empty())
+		_allocator->wait(_regions.back().ticket);
+	_regions.clear();
+
+	_allocator->unmap();
+	_mapped = nullptr;
+}
+
+bool StagingRing::allocate(uint64_t size, uint64_t alignment, StagingAllocation& allocation)
+{
+	if (size > _size)
+		return false;
+
+	alignment = std::max<uint64_t>(alignment, 1);
+
+	while (true)
+	{
+		// Align the position in the ring, not the ever growing offset
+		const uint64_t position = _head % _size;
+		uint64_t aligned = (position + alignment - 1) / alignment * alignment;
+
+		// Allocations never straddle the end of the ring, they skip to its start instead
+		if (aligned + size > _size)
+			aligned = _size;
+
+		const uint64_t begin = _head + (aligned - position);
+
+		// With nothing in flight the skipped bytes hold nothing to wait for, the ring starts over at begin
+		const bool empty = tail() == _head;
+		if (empty)
+			_openBegin = begin;
+
+		if (begin + size - tail() <= _size)
+		{
+			_stats.bytesWasted		+= empty ? 0 : begin - _head;
+			_stats.bytesAllocated	+= size;
+			_stats.allocations++;
+
+			_head = begin + size;
+			update_in_flight();
+
+			allocation.offset	= begin % _size;
+			allocation.size		= size;
+			allocation.data		= _mapped + allocation.offset;
+			return true;
+		}
+
+		if (_regions.empty())
+			return false;
+
+		// Take back whatever the GPU already finished before blocking on it
+		const size_t regions = _regions.size();
+		retire();
+		if (_regions.size() == regions)
+		{
+			_stats.stalls++;
+			_allocator->wait(_regions.front().ticket);
+			retire();
+		}
+	}
+}
+
+void StagingRing::fence(uint64_t ticket)
+{
+	if (open_empty())
+		return;
+
+	_regions.push_back({ _openBegin, _head, ticket });
+	_openBegin = _head;
+}
+
+void StagingRing::retire()
+{
+	if (_regions.empty())
+		return;
+
+	const uint64_t done = _allocator->completed();
+	while (!_regions.empty() && _regions.front().ticket <= done)
+		_regions.pop_front();
+
+	update_in_flight();
+}
+
+void StagingRing::update_in_flight()
+{
+	_stats.bytesInFlight = _head - tail();
+	_stats.peakBytesInFlight = std::max(_stats.peakBytesInFlight, _stats.bytesInFlight);
+}
+
+uint8_t* MockStagingAllocator::map(uint64_t size)
+{
+	_memory.assign(static_cast<size_t>(size), 0);
+	_mapped = true;
+	return _memory.data();
+}
+
+void MockStagingAllocator::unmap()
+{
+	_mapped = false;
+}
+
+void MockStagingAllocator::wait(uint64_t ticket)
+{
+	_waits++;
+	complete(ticket);
+}
+
+void MockStagingAllocator::complete(uint64_t ticket)
+{
+	_completed = std::max(_completed, ticket);
+}
+
+int staging_check()
+{
+	MockStagingAllocator allocator;
+	StagingRing ring;
+	ring.init(&allocator, 256);
+
+	uint32_t failed = 0;
+	auto expect = [&](bool condition, const char* what) {
+		if (!condition)
+		{
+			std::cout << "Staging ring: " << what << " FAILED" << std::endl;
+			failed++;
+		}
+	};
+
+	StagingAllocation a;
+
+	// Alignments that are not powers of two align the position in the ring
+	expect(ring.allocate(10, 1, a) && a.offset == 0, "first allocation");
+	expect(ring.allocate(7, 12, a) && a.offset == 12 && a.data == allocator.memory() + 12, "alignment 12");
+	expect(ring.allocate(5, 7, a) && a.offset == 21, "alignment 7");
+	expect(ring.stats().bytesWasted == 4 && ring.stats().bytesInFlight == 26, "alignment padding");
+
+	// The open region holds the space, only the owner can free it by fencing and submitting
+	expect(!ring.allocate(240, 1, a) && ring.stats().stalls == 0, "full open region");
+	expect(!ring.allocate(257, 1, a), "allocation larger than the ring");
+
+	// A fenced region stays in flight until its ticket completes
+	ring.fence(1);
+	ring.retire();
+	expect(ring.stats().bytesInFlight == 26 && ring.open_empty(), "fenced region in flight");
+	allocator.complete(1);
+	ring.retire();
+	expect(ring.stats().bytesInFlight == 0, "fenced region retired");
+
+	// Allocations never straddle the end of the ring, they skip to its start without waiting
+	expect(ring.allocate(200, 1, a) && a.offset == 26, "allocation up to the end");
+	ring.fence(2);
+	expect(ring.allocate(20, 1, a) && a.offset == 226, "allocation at the end");
+	ring.fence(3);
+	allocator.complete(2);
+	expect(ring.allocate(40, 1, a) && a.offset == 0, "wrap around");
+	expect(ring.stats().bytesWasted == 14 && ring.stats().bytesInFlight == 70 && ring.stats().stalls == 0, "skipped ring tail");
+
+	// A ring full of fenced regions waits for the oldest one and no further
+	ring.fence(4);
+	expect(ring.allocate(200, 1, a) && a.offset == 40, "allocation after a stall");
+	expect(ring.stats().stalls == 1 && allocator.waits() == 1 && allocator.completed() == 3, "stall on the oldest region");
+	expect(ring.stats().bytesInFlight == 250 && ring.stats().peakBytesInFlight == 250, "bytes in flight after a stall");
+
+	// Once nothing is in flight a skipped tail does not count against the ring
+	ring.fence(5);
+	allocator.complete(5);
+	ring.retire();
+	expect(ring.allocate(16, 1, a) && a.offset == 240, "allocation filling the ring");
+	expect(ring.allocate(100, 1, a) && a.offset == 0, "allocation after the ring end");
+	ring.fence(6);
+	allocator.complete(6);
+	ring.retire();
+	expect(ring.allocate(200, 1, a) && a.offset == 0 && ring.stats().stalls == 1, "empty ring starts over");
+	expect(ring.stats().allocations == 10 && ring.stats().bytesAllocated == 798, "allocation counters");
+
+	ring.fence(7);
+	ring.cleanup();
+	expect(allocator.completed() == 7 && !allocator.mapped(), "cleanup waits and unmaps");
+
+	const StagingStats& stats = ring.stats();
+	std::cout << "Staging ring: " << stats.allocations << " allocations, " << stats.bytesAllocated << " bytes, "
+		<< stats.bytesWasted << " wasted, peak " << stats.peakBytesInFlight << " of " << stats.capacity << " in flight, "
+		<< stats.stalls << " stalls, " << (failed == 0 ? "all checks passed" : "checks FAILED") << std::endl;
+
+	return failed == 0 ? 0 : 1;
+}
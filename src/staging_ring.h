@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// Memory and completion tracking behind a StagingRing. The engine backs it with a
+// persistently mapped VMA buffer and a timeline semaphore, a mock can back it with
+// plain memory and a counter.
+class StagingAllocator
+{
+public:
+	virtual ~StagingAllocator() {}
+
+	virtual uint8_t* map(uint64_t size) = 0;
+	virtual void unmap() = 0;
+
+	// Highest ticket the GPU has finished
+	virtual uint64_t completed() = 0;
+	virtual void wait(uint64_t ticket) = 0;
+};
+
+struct StagingAllocation
+{
+	uint8_t*	data;
+	uint64_t	offset;		// in the ring buffer
+	uint64_t	size;
+};
+
+struct StagingStats
+{
+	uint64_t	capacity{ 0 };
+	uint64_t	bytesInFlight{ 0 };		// allocated and not yet retired, the open region included
+	uint64_t	peakBytesInFlight{ 0 };
+	uint64_t	bytesAllocated{ 0 };
+	uint64_t	bytesWasted{ 0 };		// alignment padding and skipped ring tails
+	uint64_t	allocations{ 0 };
+	uint64_t	stalls{ 0 };			// waits on the GPU for space
+};
+
+// Ring suballocator over a persistently mapped staging buffer. Allocations go into the
+// open region until fence() closes it with the ticket of the submission that reads it;
+// its space is reused once the allocator reports that ticket as completed.
+class StagingRing
+{
+public:
+	void init(StagingAllocator* allocator, uint64_t size);
+	void cleanup();
+
+	// Reserves size bytes at an offset that is a multiple of alignment (any value, not only
+	// powers of two). Waits on fenced regions when the ring is full, returns false when
+	// the open region itself holds the space (or size exceeds the ring): the owner has
+	// to submit and fence it, then retry.
+	bool allocate(uint64_t size, uint64_t alignment, StagingAllocation& allocation);
+
+	// Closes the open region, it is released once ticket completes
+	void fence(uint64_t ticket);
+
+	// Releases every fenced region whose ticket has completed
+	void retire();
+
+	bool open_empty() const { return _openBegin == _head; }
+	uint64_t capacity() const { return _size; }
+	const StagingStats& stats() const { return _stats; }
+
+private:
+	struct Region
+	{
+		uint64_t	begin;		// offsets grow forever, the ring position is offset % size
+		uint64_t	end;
+		uint64_t	ticket;
+	};
+
+	StagingAllocator*	_allocator{ nullptr };
+	uint8_t*			_mapped{ nullptr };
+	uint64_t			_size{ 0 };
+	uint64_t			_head{ 0 };
+	uint64_t			_openBegin{ 0 };
+	std::deque<Region>	_regions;
+	StagingStats		_stats;
+
+	uint64_t tail() const { return _regions.empty() ? _openBegin : _regions.front().begin; }
+	void update_in_flight();
+};
+
+// StagingAllocator over plain memory. The GPU is a counter: complete() finishes every
+// ticket up to the one given, wait() does the same and counts how often it was needed.
+class MockStagingAllocator : public StagingAllocator
+{
+public:
+	uint8_t* map(uint64_t size) override;
+	void unmap() override;
+	uint64_t completed() override { return _completed; }
+	void wait(uint64_t ticket) override;
+
+	void complete(uint64_t ticket);
+
+	const uint8_t* memory() const { return _memory.data(); }
+	bool mapped() const { return _mapped; }
+	uint64_t waits() const { return _waits; }
+
+private:
+	std::vector<uint8_t>	_memory;
+	bool					_mapped{ false };
+	uint64_t				_completed{ 0 };
+	uint64_t				_waits{ 0 };
+};
+
+// Runs a StagingRing against MockStagingAllocator, returns the process exit code
+int staging_check();
@@ -0,0 +1,218 @@
+#include "surfel_cache.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static uint64_t align_offset(uint64_t offset)
+{
+	return (offset + SURFEL_CACHE_ALIGNMENT - 1) & ~(uint64_t)(SURFEL_CACHE_ALIGNMENT - 1);
+}
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static const uint64_t FNV_BASIS = 0xcbf29ce484222325ull;
+
+// Any member that moves or resizes invalidates old snapshots, not only a change of stride
+static uint64_t layout_hash()
+{
+	const uint32_t members[] = {
+		SURFEL_PACKED,
+		SURFEL_SH,
+#if SURFEL_PACKED
+		(uint32_t)sizeof(SurfelPacked),
+		(uint32_t)offsetof(SurfelPacked, position),
+		(uint32_t)offsetof(SurfelPacked, normal),
+		(uint32_t)offsetof(SurfelPacked, color),
+		(uint32_t)offsetof(SurfelPacked, radius),
+		(uint32_t)offsetof(SurfelPacked, lifetime),
+		(uint32_t)sizeof(SurfelDataPacked),
+		(uint32_t)offsetof(SurfelDataPacked, mean),
+		(uint32_t)offsetof(SurfelDataPacked, shortMean),
+		(uint32_t)offsetof(SurfelDataPacked, varianceRG),
+		(uint32_t)offsetof(SurfelDataPacked, varianceBVbbr),
+		(uint32_t)offsetof(SurfelDataPacked, inconsistency),
+#if SURFEL_SH
+		(uint32_t)offsetof(SurfelDataPacked, sh),
+#endif
+#else
+		(uint32_t)sizeof(Surfel),
+		(uint32_t)offsetof(Surfel, position),
+		(uint32_t)offsetof(Surfel, age),
+		(uint32_t)offsetof(Surfel, normal),
+		(uint32_t)offsetof(Surfel, unseen),
+		(uint32_t)offsetof(Surfel, color),
+		(uint32_t)offsetof(Surfel, radius),
+		(uint32_t)sizeof(SurfelData),
+		(uint32_t)offsetof(SurfelData, mean),
+		(uint32_t)offsetof(SurfelData, shortMean),
+		(uint32_t)offsetof(SurfelData, vbbr),
+		(uint32_t)offsetof(SurfelData, variance),
+		(uint32_t)offsetof(SurfelData, inconsistency),
+#if SURFEL_SH
+		(uint32_t)offsetof(SurfelData, shX),
+		(uint32_t)offsetof(SurfelData, shY),
+		(uint32_t)offsetof(SurfelData, shZ),
+#endif
+#endif
+		SURFEL_STATS_SIZE,
+		SURFEL_STATS_OFFSET_COUNT,
+		SURFEL_STATS_OFFSET_DEADCOUNT
+	};
+	return fnv1a(FNV_BASIS, members, sizeof(members));
+}
+
+static bool section_valid(const SurfelCacheSection& s, const uint64_t count, const size_t elementSize, const uint64_t fileSize)
+{
+	if (s.offset % SURFEL_CACHE_ALIGNMENT != 0 || s.offset > fileSize || s.count != count)
+		return false;
+	return s.count <= (fileSize - s.offset) / elementSize;
+}
+
+std::string SurfelCache::get_path(int scene)
+{
+	return "data/scene" + std::to_string(scene) + ".surfelcache";
+}
+
+uint64_t SurfelCache::scene_key(int scene, const std::vector<glm::mat4>& matrices)
+{
+	uint64_t key = fnv1a(FNV_BASIS, &scene, sizeof(scene));
+	return matrices.empty() ? key : fnv1a(key, matrices.data(), sizeof(glm::mat4) * matrices.size());
+}
+
+SurfelCacheHeader SurfelCache::layout(uint64_t sceneKey, const SurfelConfig& config)
+{
+	SurfelCacheHeader header{};
+	header.magic			= SURFEL_CACHE_MAGIC;
+	header.version			= SURFEL_CACHE_VERSION;
+	header.surfelStride		= sizeof(SurfelStorage);
+	header.surfelDataStride	= sizeof(SurfelDataStorage);
+	header.layout			= layout_hash();
+	header.sceneKey			= sceneKey;
+	header.capacity			= config.capacity;
+	header.budget			= config.budget();
+	header.gridDimensions[0]	= config.gridDimensions.x;
+	header.gridDimensions[1]	= config.gridDimensions.y;
+	header.gridDimensions[2]	= config.gridDimensions.z;
+	header.cellLimit		= config.cellLimit;
+
+	uint64_t offset = align_offset(sizeof(SurfelCacheHeader));
+	auto place = [&](SurfelCacheSection& s, const uint64_t count, const size_t elementSize) {
+		s.offset	= offset;
+		s.count		= count;
+		offset		= align_offset(offset + count * elementSize);
+	};
+
+	place(header.surfels,		config.capacity,	sizeof(SurfelStorage));
+	place(header.surfelData,	config.capacity,	sizeof(SurfelDataStorage));
+	place(header.stats,			SURFEL_STATS_SIZE,	sizeof(uint32_t));
+	place(header.alive,			config.capacity,	sizeof(uint32_t));
+	place(header.dead,			config.capacity,	sizeof(uint32_t));
+	header.fileSize = offset;
+
+	return header;
+}
+
+bool SurfelCache::load(const std::string& path, uint64_t sceneKey, const SurfelConfig& config)
+{
+	_file.reset();
+	_header = nullptr;
+
+	std::shared_ptr<MappedFile> file = MappedFile::open(path);
+	if (!file || file->size() < sizeof(SurfelCacheHeader))
+		return false;
+
+	const SurfelCacheHeader* header = reinterpret_cast<const SurfelCacheHeader*>(file->data());
+	const uint64_t fileSize = file->size();
+
+	if (header->magic != SURFEL_CACHE_MAGIC || header->version != SURFEL_CACHE_VERSION || header->fileSize != fileSize)
+		return false;
+	if (header->surfelStride != sizeof(SurfelStorage) || header->surfelDataStride != sizeof(SurfelDataStorage) || header->layout != layout_hash())
+		return false;
+	if (header->capacity != config.capacity || header->budget != config.budget() || header->sceneKey != sceneKey)
+		return false;
+
+	// Surfels are binned into cells of the grid they were spawned with
+	if (header->gridDimensions[0] != config.gridDimensions.x || header->gridDimensions[1] != config.gridDimensions.y ||
+		header->gridDimensions[2] != config.gridDimensions.z || header->cellLimit != config.cellLimit)
+		return false;
+
+	if (!section_valid(header->surfels, config.capacity, sizeof(SurfelStorage), fileSize) ||
+		!section_valid(header->surfelData, config.capacity, sizeof(SurfelDataStorage), fileSize) ||
+		!section_valid(header->stats, SURFEL_STATS_SIZE, sizeof(uint32_t), fileSize) ||
+		!section_valid(header->alive, config.capacity, sizeof(uint32_t), fileSize) ||
+		!section_valid(header->dead, config.capacity, sizeof(uint32_t), fileSize))
+		return false;
+
+	_file = file;
+	_header = header;
+
+	// Every index of the budget has to be either alive or free, once, or the
+	// allocator would hand out a slot twice or lose it for good
+	const uint32_t aliveCount = stats()[SURFEL_STATS_OFFSET_COUNT];
+	const uint32_t deadCount = stats()[SURFEL_STATS_OFFSET_DEADCOUNT];
+	const uint32_t budget = config.budget();
+	bool valid = (uint64_t)aliveCount + deadCount == budget;
+
+	std::vector<uint8_t> owners(budget, 0);
+	auto claim = [&](const uint32_t* list, uint32_t count) {
+		for (uint32_t i = 0; valid && i < count; i++)
+			valid = list[i] < budget && owners[list[i]]++ == 0;
+	};
+
+	if (valid)
+	{
+		claim(alive(), aliveCount);
+		claim(dead(), deadCount);
+	}
+
+	if (!valid)
+	{
+		_file.reset();
+		_header = nullptr;
+	}
+
+	return valid;
+}
+
+bool SurfelCache::write(const std::string& path, const SurfelCacheHeader& header, const uint8_t* image)
+{
+	// Write to a temporary file first so an interrupted write never looks valid
+	const std::string tmpPath = path + ".tmp";
+
+	FILE* f = fopen(tmpPath.c_str(), "wb");
+	if (!f)
+	{
+		std::cout << "Could not write surfel cache " << path << std::endl;
+		return false;
+	}
+
+	const size_t rest = (size_t)(header.fileSize - sizeof(header));
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	ok = ok && fwrite(image + sizeof(header), 1, rest, f) == rest;
+	ok = (fclose(f) == 0) && ok;
+
+	if (ok)
+	{
+		std::remove(path.c_str());
+		ok = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+	}
+
+	if (!ok)
+	{
+		std::remove(tmpPath.c_str());
+		std::cout << "Could not write surfel cache " << path << std::endl;
+	}
+
+	return ok;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "surfel_gi.h"
+
+#include <vector>
+
+// Snapshot of the surfel buffers of a scene, written on exit as data/scene<N>.surfelcache and
+// uploaded at start up so the radiance estimators start converged. Sections are laid out so a
+// mapped file can be copied to the GPU in place, and so a readback buffer of the same layout is
+// the file itself. A snapshot is only used when its version, struct layouts, surfel config and scene key match.
+
+static const uint32_t SURFEL_CACHE_MAGIC		= 0x43534753;	// "SGSC"
+static const uint32_t SURFEL_CACHE_VERSION		= 2;
+static const uint32_t SURFEL_CACHE_ALIGNMENT	= 16;
+
+struct SurfelCacheSection
+{
+	uint64_t	offset;
+	uint64_t	count;
+};
+
+struct SurfelCacheHeader
+{
+	uint32_t			magic;
+	uint32_t			version;
+	uint32_t			surfelStride;
+	uint32_t			surfelDataStride;
+	uint64_t			layout;			// hash of the member offsets of SurfelStorage and SurfelDataStorage
+	uint64_t			sceneKey;
+	uint32_t			capacity;
+	uint32_t			budget;
+	uint32_t			gridDimensions[3];	// SurfelConfig the snapshot was taken with
+	uint32_t			cellLimit;
+	uint64_t			fileSize;
+
+	SurfelCacheSection	surfels;		// SurfelStorage, _SurfelBuffer
+	SurfelCacheSection	surfelData;		// SurfelDataStorage, _SurfelDataBuffer
+	SurfelCacheSection	stats;			// uint32_t, _SurfelStatsBuffer
+	SurfelCacheSection	alive;			// uint32_t, first half of _SurfelAliveBuffer
+	SurfelCacheSection	dead;			// uint32_t, _SurfelDeadBuffer
+};
+
+class SurfelCache
+{
+public:
+	std::shared_ptr<MappedFile>	_file;
+	const SurfelCacheHeader*	_header{ nullptr };
+
+	static std::string get_path(int scene);
+
+	// Changes whenever the scene index or an object transform does
+	static uint64_t scene_key(int scene, const std::vector<glm::mat4>& matrices);
+
+	// Header with the sections laid out for the current build and config
+	static SurfelCacheHeader layout(uint64_t sceneKey, const SurfelConfig& config);
+
+	// Maps the snapshot at path, false if it is missing, stale, corrupt or taken with another config
+	bool load(const std::string& path, uint64_t sceneKey, const SurfelConfig& config);
+
+	// Writes header followed by the sections of image, laid out at the offsets of header.
+	// The first sizeof(header) bytes of image are skipped, a readback leaves them undefined.
+	static bool write(const std::string& path, const SurfelCacheHeader& header, const uint8_t* image);
+
+	const SurfelStorage*		surfels() const		{ return section<SurfelStorage>(_header->surfels); }
+	const SurfelDataStorage*	surfelData() const	{ return section<SurfelDataStorage>(_header->surfelData); }
+	const uint32_t*				stats() const		{ return section<uint32_t>(_header->stats); }
+	const uint32_t*				alive() const		{ return section<uint32_t>(_header->alive); }
+	const uint32_t*				dead() const		{ return section<uint32_t>(_header->dead); }
+
+	template<typename T>
+	const T* section(const SurfelCacheSection& s) const
+	{
+		return reinterpret_cast<const T*>(_file->data() + s.offset);
+	}
+};
@@ -0,0 +1,111 @@
+#include "surfel_cascades.h"
+
+#include <algorithm>
+
+float surfel_cascade_cellsize(uint32_t cascade)
+{
+	return SURFEL_MAX_RADIUS * (float)(1u << cascade);
+}
+
+glm::ivec3 surfel_cell(const glm::vec3& position, uint32_t cascade)
+{
+	return glm::ivec3(glm::floor(position / surfel_cascade_cellsize(cascade)));
+}
+
+bool surfel_cellvalid(const glm::ivec3& cell, uint32_t cascade, const glm::vec3& campos)
+{
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return false;
+
+	const glm::ivec3 local = cell - surfel_cell(campos, cascade) + glm::ivec3(SURFEL_GRID_DIMENSIONS / 2u);
+	if (local.x < 0 || local.x >= (int)SURFEL_GRID_DIMENSIONS.x)
+		return false;
+	if (local.y < 0 || local.y >= (int)SURFEL_GRID_DIMENSIONS.y)
+		return false;
+	if (local.z < 0 || local.z >= (int)SURFEL_GRID_DIMENSIONS.z)
+		return false;
+	return true;
+}
+
+static uint32_t part1by2(uint32_t x)
+{
+	x &= 0x3FFu;
+	x = (x | (x << 16)) & 0x030000FFu;
+	x = (x | (x << 8)) & 0x0300F00Fu;
+	x = (x | (x << 4)) & 0x030C30C3u;
+	x = (x | (x << 2)) & 0x09249249u;
+	return x;
+}
+
+static uint32_t find_msb(uint32_t x)
+{
+	uint32_t msb = 0;
+	while (x >>= 1)
+		msb++;
+	return msb;
+}
+
+uint32_t surfel_morton(const glm::uvec3& coord, const glm::uvec3& dim)
+{
+	const uint32_t bits = find_msb(std::min(dim.x, std::min(dim.y, dim.z)));
+	const uint32_t mask = (1u << bits) - 1;
+	const uint32_t morton = part1by2(coord.x & mask) | (part1by2(coord.y & mask) << 1) | (part1by2(coord.z & mask) << 2);
+
+	const glm::uvec3 high = glm::uvec3(coord.x >> bits, coord.y >> bits, coord.z >> bits);
+	const glm::uvec3 highDim = glm::uvec3(dim.x >> bits, dim.y >> bits, dim.z >> bits);
+	return (((high.z * highDim.y + high.y) * highDim.x + high.x) << (3 * bits)) | morton;
+}
+
+uint32_t surfel_cellindex(const glm::ivec3& cell, uint32_t cascade)
+{
+	// Two's complement wrap like uvec3(cell) & (dims - 1) in the shader
+	const glm::uvec3 coord = glm::uvec3(
+		(uint32_t)cell.x & (SURFEL_GRID_DIMENSIONS.x - 1),
+		(uint32_t)cell.y & (SURFEL_GRID_DIMENSIONS.y - 1),
+		(uint32_t)cell.z & (SURFEL_GRID_DIMENSIONS.z - 1));
+	return cascade * SURFEL_CASCADE_SIZE + surfel_morton(coord, SURFEL_GRID_DIMENSIONS);
+}
+
+uint32_t surfel_position_cascade(const glm::vec3& position, const glm::vec3& campos)
+{
+	for (uint32_t cascade = 0; cascade < SURFEL_CASCADE_COUNT; cascade++)
+	{
+		if (surfel_cellvalid(surfel_cell(position, cascade), cascade, campos))
+			return cascade;
+	}
+	return SURFEL_CASCADE_COUNT;
+}
+
+uint32_t surfel_radius_cascade(float radius)
+{
+	uint32_t cascade = 0;
+	while (cascade + 1 < SURFEL_CASCADE_COUNT && surfel_cascade_cellsize(cascade) < radius)
+		cascade++;
+	return cascade;
+}
+
+uint32_t surfel_cascade(const Surfel& surfel, const glm::vec3& campos)
+{
+	return std::max(surfel_radius_cascade(surfel.radius), surfel_position_cascade(surfel.position, campos));
+}
+
+bool surfel_cellintersects(const Surfel& surfel, const glm::ivec3& cell, uint32_t cascade, const glm::vec3& campos)
+{
+	if (!surfel_cellvalid(cell, cascade, campos))
+		return false;
+
+	const float cellsize = surfel_cascade_cellsize(cascade);
+	const glm::vec3 gridmin = glm::vec3(cell) * cellsize;
+	const glm::vec3 gridmax = glm::vec3(cell + glm::ivec3(1)) * cellsize;
+
+	const glm::vec3 closestPointInAabb = glm::min(glm::max(surfel.position, gridmin), gridmax);
+	return glm::distance(closestPointInAabb, surfel.position) < surfel.radius;
+}
+
+uint32_t surfel_lookup_cellindex(const glm::vec3& position, const glm::vec3& campos)
+{
+	const uint32_t cascade = surfel_position_cascade(position, campos);
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return SURFEL_TABLE_SIZE;
+	return surfel_cellindex(surfel_cell(position, cascade), cascade);
+}
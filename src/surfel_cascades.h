@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "surfel_gi.h"
+
+// CPU side of the surfel grid addressing in data/shaders/surfelGIutils.glsl.
+//
+// The grid is SURFEL_CASCADE_COUNT nested grids of SURFEL_GRID_DIMENSIONS cells centred
+// on the camera, cascade c has cells of SURFEL_MAX_RADIUS * 2^c. Cells are addressed by
+// their world space coordinates and wrap around their cascade, so a world cell keeps its
+// slot in the grid buffer while the camera moves. The grid is cleared and rebuilt every
+// frame, the wrap only keeps the addressing independent of the camera.
+
+float surfel_cascade_cellsize(uint32_t cascade);
+
+// World space cell of a position in a cascade
+glm::ivec3 surfel_cell(const glm::vec3& position, uint32_t cascade);
+
+// Whether the world cell is inside the cascade around the camera
+bool surfel_cellvalid(const glm::ivec3& cell, uint32_t cascade, const glm::vec3& campos);
+
+// Morton index of a coordinate in a grid of power of two dimensions, the bits all axes have are
+// interleaved and the extra high bits of the longer ones go on top in z-y-x order
+uint32_t surfel_morton(const glm::uvec3& coord, const glm::uvec3& dim);
+
+// Slot of a world cell in the grid buffer in Morton order, only meaningful for valid cells
+uint32_t surfel_cellindex(const glm::ivec3& cell, uint32_t cascade);
+
+// Innermost cascade holding the position, SURFEL_CASCADE_COUNT when it is outside all of them
+uint32_t surfel_position_cascade(const glm::vec3& position, const glm::vec3& campos);
+
+// Smallest cascade whose cells are as big as the radius
+uint32_t surfel_radius_cascade(float radius);
+
+// Outermost cascade a surfel is binned into, the one of its radius unless it is out of it.
+// It is also binned into the cascades from its position one up to this one.
+uint32_t surfel_cascade(const Surfel& surfel, const glm::vec3& campos);
+
+bool surfel_cellintersects(const Surfel& surfel, const glm::ivec3& cell, uint32_t cascade, const glm::vec3& campos);
+
+// Cell of a position in the innermost cascade holding it, SURFEL_TABLE_SIZE when there is none
+uint32_t surfel_lookup_cellindex(const glm::vec3& position, const glm::vec3& campos);
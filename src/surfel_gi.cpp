@@ -0,0 +1,344 @@
+#include "surfel_gi.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+#include <glm/glm/gtc/packing.hpp>
+
+#include "sampling.h"
+
+static const int	RGB9E5_BIAS		= 15;
+static const int	RGB9E5_MANTISSA	= 9;
+static const float	RGB9E5_MAX		= 65408.0f;		// 511 / 512 * 2^16
+static const float	HALF_MAX		= 65504.0f;
+static const float	SURFEL_PI		= 3.14159265358979323846f;
+
+uint32_t rgb9e5_encode(const glm::vec3& rgb)
+{
+	const glm::vec3 c = glm::clamp(rgb, glm::vec3(0.0f), glm::vec3(RGB9E5_MAX));
+	const float maxc = std::max(c.x, std::max(c.y, c.z));
+
+	// floor(log2(maxc)) from frexp, log2 can round across a power of two
+	int exponent;
+	std::frexp(maxc, &exponent);
+	int shared = std::max(-RGB9E5_BIAS - 1, exponent - 1) + 1 + RGB9E5_BIAS;
+	if (std::floor(std::ldexp(maxc, RGB9E5_MANTISSA + RGB9E5_BIAS - shared) + 0.5f) == (float)(1 << RGB9E5_MANTISSA))
+		shared++;
+
+	const float scale = std::ldexp(1.0f, RGB9E5_MANTISSA + RGB9E5_BIAS - shared);
+	const glm::uvec3 m = glm::uvec3(glm::floor(c * scale + 0.5f));
+	return m.x | (m.y << 9) | (m.z << 18) | ((uint32_t)shared << 27);
+}
+
+glm::vec3 rgb9e5_decode(uint32_t packed)
+{
+	const float scale = std::ldexp(1.0f, (int)(packed >> 27) - RGB9E5_BIAS - RGB9E5_MANTISSA);
+	return glm::vec3((float)(packed & 0x1FF), (float)((packed >> 9) & 0x1FF), (float)((packed >> 18) & 0x1FF)) * scale;
+}
+
+uint32_t oct_encode(const glm::vec3& n)
+{
+	const float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	glm::vec2 p = l1 > 0.0f ? glm::vec2(n.x, n.y) / l1 : glm::vec2(0.0f);
+	if (n.z < 0.0f)
+		p = (glm::vec2(1.0f) - glm::abs(glm::vec2(p.y, p.x))) * glm::vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+	return glm::packSnorm2x16(p);
+}
+
+glm::vec3 oct_decode(uint32_t packed)
+{
+	const glm::vec2 p = glm::unpackSnorm2x16(packed);
+	glm::vec3 n = glm::vec3(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+	const float t = std::max(-n.z, 0.0f);
+	n.x += n.x >= 0.0f ? -t : t;
+	n.y += n.y >= 0.0f ? -t : t;
+	return glm::normalize(n);
+}
+
+static uint32_t pack_half2(float a, float b)
+{
+	return glm::packHalf2x16(glm::clamp(glm::vec2(a, b), glm::vec2(-HALF_MAX), glm::vec2(HALF_MAX)));
+}
+
+glm::vec3 surfel_irradiance(const glm::vec3& color, const SurfelData& data, const glm::vec3& normal)
+{
+#if SURFEL_SH
+	return glm::max(glm::vec3(0.0f), color + data.shX * normal.x + data.shY * normal.y + data.shZ * normal.z);
+#else
+	(void)data;
+	(void)normal;
+	return color;
+#endif
+}
+
+SurfelPacked pack_surfel(const Surfel& surfel)
+{
+	SurfelPacked packed;
+	packed.position[0]	= surfel.position.x;
+	packed.position[1]	= surfel.position.y;
+	packed.position[2]	= surfel.position.z;
+	packed.normal		= oct_encode(surfel.normal);
+	packed.color		= rgb9e5_encode(surfel.color);
+	packed.radius		= surfel.radius;
+	packed.lifetime		= std::min(surfel.age, 0xFFFFu) | (std::min(surfel.unseen, 0xFFFFu) << 16);
+	return packed;
+}
+
+Surfel unpack_surfel(const SurfelPacked& packed)
+{
+	Surfel surfel{};
+	surfel.position	= glm::vec3(packed.position[0], packed.position[1], packed.position[2]);
+	surfel.normal	= oct_decode(packed.normal);
+	surfel.color	= rgb9e5_decode(packed.color);
+	surfel.radius	= packed.radius;
+	surfel.age		= packed.lifetime & 0xFFFF;
+	surfel.unseen	= packed.lifetime >> 16;
+	return surfel;
+}
+
+SurfelDataPacked pack_surfel_data(const SurfelData& data)
+{
+	SurfelDataPacked packed;
+	packed.mean				= rgb9e5_encode(data.mean);
+	packed.shortMean		= rgb9e5_encode(data.shortMean);
+	packed.varianceRG		= pack_half2(data.variance.x, data.variance.y);
+	packed.varianceBVbbr	= pack_half2(data.variance.z, data.vbbr);
+	packed.inconsistency	= data.inconsistency;
+#if SURFEL_SH
+	const float sh[10] = { data.shX.x, data.shX.y, data.shX.z, data.shY.x, data.shY.y, data.shY.z, data.shZ.x, data.shZ.y, data.shZ.z, 0.0f };
+	for (int i = 0; i < 5; i++)
+		packed.sh[i] = pack_half2(sh[2 * i], sh[2 * i + 1]);
+#endif
+	return packed;
+}
+
+SurfelData unpack_surfel_data(const SurfelDataPacked& packed)
+{
+	const glm::vec2 rg = glm::unpackHalf2x16(packed.varianceRG);
+	const glm::vec2 bv = glm::unpackHalf2x16(packed.varianceBVbbr);
+
+	SurfelData data{};
+	data.mean			= rgb9e5_decode(packed.mean);
+	data.shortMean		= rgb9e5_decode(packed.shortMean);
+	data.variance		= glm::vec3(rg.x, rg.y, bv.x);
+	data.vbbr			= bv.y;
+	data.inconsistency	= packed.inconsistency;
+#if SURFEL_SH
+	float sh[10];
+	for (int i = 0; i < 5; i++)
+	{
+		const glm::vec2 h = glm::unpackHalf2x16(packed.sh[i]);
+		sh[2 * i] = h.x;
+		sh[2 * i + 1] = h.y;
+	}
+	data.shX = glm::vec3(sh[0], sh[1], sh[2]);
+	data.shY = glm::vec3(sh[3], sh[4], sh[5]);
+	data.shZ = glm::vec3(sh[6], sh[7], sh[8]);
+#endif
+	return data;
+}
+
+static bool power_of_two(uint32_t x)
+{
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+bool SurfelConfig::valid() const
+{
+	if (!power_of_two(gridDimensions.x) || !power_of_two(gridDimensions.y) || !power_of_two(gridDimensions.z))
+		return false;
+
+	// Cell indices and index list slots are 32 bit in the shaders
+	if ((uint64_t)gridDimensions.x * gridDimensions.y * gridDimensions.z * SURFEL_CASCADE_COUNT > UINT32_MAX)
+		return false;
+	if (capacity == 0 || (uint64_t)capacity * 27 > UINT32_MAX)
+		return false;
+
+	// The ray demand is summed in fixed point, SURFEL_RAYS_MAX for every surfel has to fit
+	if (rayBudget == 0 || (uint64_t)capacity * SURFEL_RAYS_MAX * (uint32_t)SURFEL_RAY_DEMAND_SCALE > UINT32_MAX)
+		return false;
+
+	// The coverage pass packs the index of a pixel in its tile in 8 bits
+	if (coverageScale != 1 && coverageScale != 2 && coverageScale != 4)
+		return false;
+	if (tileSize.x == 0 || tileSize.y == 0 || tileSize.x * tileSize.y > 256)
+		return false;
+
+	return cellLimit > 0 && indirectThreads > 0 && indirectThreads <= 1024;
+}
+
+void SurfelConfig::specialization(uint32_t data[SURFEL_SPEC_COUNT]) const
+{
+	data[SURFEL_SPEC_CAPACITY]				= capacity;
+	data[SURFEL_SPEC_GRID_DIMENSIONS_X]		= gridDimensions.x;
+	data[SURFEL_SPEC_GRID_DIMENSIONS_Y]		= gridDimensions.y;
+	data[SURFEL_SPEC_GRID_DIMENSIONS_Z]		= gridDimensions.z;
+	data[SURFEL_SPEC_CELL_LIMIT]			= cellLimit;
+	data[SURFEL_SPEC_INDIRECT_NUMTHREADS]	= indirectThreads;
+	data[SURFEL_SPEC_TILE_WIDTH]			= tileSize.x;
+	data[SURFEL_SPEC_TILE_HEIGHT]			= tileSize.y;
+	data[SURFEL_SPEC_RAY_BUDGET]			= rayBudget;
+}
+
+SurfelConfig SurfelConfig::from_args(int argc, char* argv[])
+{
+	SurfelConfig config;
+
+	auto value = [&](int i) { return (uint32_t)strtoul(argv[i], nullptr, 10); };
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--surfel-capacity") == 0 && i + 1 < argc)
+			config.capacity = value(++i);
+		else if (strcmp(argv[i], "--surfel-cell-limit") == 0 && i + 1 < argc)
+			config.cellLimit = value(++i);
+		else if (strcmp(argv[i], "--surfel-threads") == 0 && i + 1 < argc)
+			config.indirectThreads = value(++i);
+		else if (strcmp(argv[i], "--surfel-rays") == 0 && i + 1 < argc)
+			config.rayBudget = value(++i);
+		else if (strcmp(argv[i], "--surfel-filter") == 0)
+			config.filter = true;
+		else if (strcmp(argv[i], "--surfel-coverage-scale") == 0 && i + 1 < argc)
+			config.coverageScale = value(++i);
+		else if (strcmp(argv[i], "--surfel-tile") == 0 && i + 2 < argc)
+		{
+			config.tileSize.x = value(++i);
+			config.tileSize.y = value(++i);
+		}
+		else if (strcmp(argv[i], "--surfel-grid") == 0 && i + 3 < argc)
+		{
+			config.gridDimensions.x = value(++i);
+			config.gridDimensions.y = value(++i);
+			config.gridDimensions.z = value(++i);
+		}
+	}
+
+	if (!config.valid())
+	{
+		std::cout << "Invalid surfel configuration, grid dimensions must be powers of two, the coverage scale 1, 2 or 4 and tiles at most 256 pixels, using the defaults" << std::endl;
+		return SurfelConfig();
+	}
+
+	return config;
+}
+
+static float max_component_error(const glm::vec3& a, const glm::vec3& b)
+{
+	const glm::vec3 diff = glm::abs(a - b);
+	return std::max(diff.x, std::max(diff.y, diff.z));
+}
+
+int surfel_pack_check()
+{
+	const uint32_t samples = 65536;
+
+	float radianceError = 0.0f;		// rgb9e5, relative to the largest component
+	float momentError = 0.0f;		// half floats, relative
+	float normalError = 0.0f;		// octahedral, radians
+	float exactError = 0.0f;		// positions, radius and inconsistency, kept as they are
+	uint32_t lifetimes = 0;			// ages or unseen counts below the saturation that changed
+
+	auto unit = [](uint32_t i, uint32_t k) { return (tea(i, k) & 0xFFFFFF) / 16777215.0f; };
+
+	// Radiance from 2^-8 to 2^12, moments from 2^-20 to 2^8, both on a log scale
+	auto radiance = [&](uint32_t i, uint32_t k) {
+		return glm::vec3(unit(i, k), unit(i, k + 1), unit(i, k + 2)) * std::exp2(-8.0f + 20.0f * unit(i, k + 3));
+	};
+	auto moment = [&](uint32_t i, uint32_t k) { return std::exp2(-20.0f + 28.0f * unit(i, k)); };
+	auto direction = [&](uint32_t i, uint32_t k) {
+		const float z = 2.0f * unit(i, k) - 1.0f;
+		const float phi = 2.0f * SURFEL_PI * unit(i, k + 1);
+		const float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+	};
+
+	auto radiance_error = [](const glm::vec3& a, const glm::vec3& b) {
+		return max_component_error(a, b) / std::max(std::max(a.x, std::max(a.y, a.z)), 1.0f / 16384);
+	};
+	auto moment_error = [](float a, float b) { return std::abs(a - b) / std::max(std::abs(a), 1.0f / 16384); };
+	auto angle = [](const glm::vec3& a, const glm::vec3& b) { return std::acos(glm::clamp(glm::dot(a, b), -1.0f, 1.0f)); };
+
+	for (uint32_t i = 0; i < samples; i++)
+	{
+		Surfel surfel{};
+		surfel.position = (glm::vec3(unit(i, 0), unit(i, 1), unit(i, 2)) * 2.0f - 1.0f) * 100.0f;
+		surfel.normal = direction(i, 3);
+		surfel.color = radiance(i, 5);
+		surfel.radius = std::exp2(4.0f * unit(i, 9));
+		surfel.age = tea(i, 10) % 0xFFFF;
+		surfel.unseen = tea(i, 11) % 0xFFFF;
+
+		SurfelData data{};
+		data.mean = radiance(i, 12);
+		data.shortMean = radiance(i, 16);
+		data.variance = glm::vec3(moment(i, 20), moment(i, 21), moment(i, 22));
+		data.vbbr = unit(i, 23);
+		data.inconsistency = unit(i, 24);
+#if SURFEL_SH
+		// Signed, up to about the radiance they modulate
+		data.shX = (radiance(i, 30) - radiance(i, 34)) * 0.5f;
+		data.shY = (radiance(i, 38) - radiance(i, 42)) * 0.5f;
+		data.shZ = (radiance(i, 46) - radiance(i, 50)) * 0.5f;
+#endif
+
+		// SurfelRay
+		const glm::vec3 traced = radiance(i, 25);
+
+		const Surfel s = unpack_surfel(pack_surfel(surfel));
+		const SurfelData d = unpack_surfel_data(pack_surfel_data(data));
+
+		radianceError = std::max(radianceError, radiance_error(surfel.color, s.color));
+		radianceError = std::max(radianceError, radiance_error(data.mean, d.mean));
+		radianceError = std::max(radianceError, radiance_error(data.shortMean, d.shortMean));
+		radianceError = std::max(radianceError, radiance_error(traced, rgb9e5_decode(rgb9e5_encode(traced))));
+
+		for (int c = 0; c < 3; c++)
+			momentError = std::max(momentError, moment_error(data.variance[c], d.variance[c]));
+		momentError = std::max(momentError, moment_error(data.vbbr, d.vbbr));
+#if SURFEL_SH
+		for (int c = 0; c < 3; c++)
+		{
+			momentError = std::max(momentError, moment_error(data.shX[c], d.shX[c]));
+			momentError = std::max(momentError, moment_error(data.shY[c], d.shY[c]));
+			momentError = std::max(momentError, moment_error(data.shZ[c], d.shZ[c]));
+		}
+
+		const glm::vec3 rayDirection = direction(i, 54);
+		normalError = std::max(normalError, angle(rayDirection, oct_decode(oct_encode(rayDirection))));
+#endif
+
+		normalError = std::max(normalError, angle(surfel.normal, s.normal));
+
+		exactError = std::max(exactError, max_component_error(surfel.position, s.position));
+		exactError = std::max(exactError, std::abs(surfel.radius - s.radius));
+		exactError = std::max(exactError, std::abs(data.inconsistency - d.inconsistency));
+
+		if (s.age != surfel.age || s.unseen != surfel.unseen)
+			lifetimes++;
+	}
+
+	uint32_t failed = 0;
+	auto expect = [&](bool condition, const char* what) {
+		if (!condition)
+		{
+			std::cout << "Surfel packing: " << what << " FAILED" << std::endl;
+			failed++;
+		}
+	};
+
+	expect(radianceError <= 1.0f / 256, "radiance round trip");
+	expect(momentError <= 1.0f / 1024, "moments round trip");
+	expect(normalError <= 1e-3f, "normals round trip");
+	expect(exactError == 0.0f, "exact members");
+	expect(lifetimes == 0, "lifetimes");
+
+	std::cout << std::scientific << std::setprecision(2) << "Surfel packing round trip over " << samples << " surfels: radiance " << radianceError
+		<< ", moments " << momentError << ", normals " << normalError << " rad" << std::defaultfloat << ", "
+		<< (failed == 0 ? "all checks passed" : "checks FAILED") << std::endl;
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm/glm.hpp>
+
+// Surfels are stored packed on the GPU (SurfelPacked, SurfelDataPacked). Build with SURFEL_PACKED=0,
+// here and in the shaders (glslc -DSURFEL_PACKED=0), to store the full precision structs instead.
+#ifndef SURFEL_PACKED
+#define SURFEL_PACKED 1
+#endif
+
+// Build with SURFEL_SH=1, here and in the shaders (glslc -DSURFEL_SH=1), to give SurfelData the linear
+// (L1 SH) part of the irradiance so it is evaluated against the normal of the pixel instead of the surfel's.
+#ifndef SURFEL_SH
+#define SURFEL_SH 0
+#endif
+
+// Surfel GI data shared by the GPU pipeline in Renderer and the CPU reference.
+// Layouts must match the structs declared in data/shaders/surfelGIutils.glsl.
+// The sizes below are the defaults of SurfelConfig, the CPU reference always runs with them.
+
+struct Surfel
+{
+	glm::vec3 position;
+	uint32_t age;		// frames alive
+	glm::vec3 normal;
+	uint32_t unseen;	// frames since it last covered a pixel
+	glm::vec3 color;
+	float radius;
+};
+
+struct SurfelData
+{
+	glm::vec3 mean;
+	float pad0;
+
+	glm::vec3 shortMean;
+	float vbbr;
+
+	glm::vec3 variance;
+	float inconsistency;
+
+#if SURFEL_SH
+	// Irradiance towards a normal n is color + shX * n.x + shY * n.y + shZ * n.z, see surfel_irradiance
+	glm::vec3 shX;
+	float pad1;
+	glm::vec3 shY;
+	float pad2;
+	glm::vec3 shZ;
+	float pad3;
+#endif
+};
+
+// 28 bytes instead of 48. Normal octahedral in snorm 16 x 2, color shared exponent RGB (rgb9e5),
+// age and unseen 16 bits each, saturating
+struct SurfelPacked
+{
+	float		position[3];
+	uint32_t	normal;
+	uint32_t	color;
+	float		radius;
+	uint32_t	lifetime;		// age in the low half, unseen in the high one
+};
+
+// 20 bytes instead of 48, 40 instead of 96 with SURFEL_SH. Radiance in rgb9e5, moments and SH in half floats
+struct SurfelDataPacked
+{
+	uint32_t	mean;
+	uint32_t	shortMean;
+	uint32_t	varianceRG;		// half2
+	uint32_t	varianceBVbbr;	// half2, variance.b and vbbr
+	float		inconsistency;
+#if SURFEL_SH
+	uint32_t	sh[5];			// half2, shX, shY and shZ one channel after the other, the last half unused
+#endif
+};
+
+// One traced ray of a surfel, written by surfelRayGen.rgen and integrated by surfelshade.comp.
+// The hit shader already added the irradiance cached by the surfels at the hit, so only the result is kept.
+struct SurfelRay
+{
+	uint32_t	radiance;		// rgb9e5, direct light at the hit plus the bounce off the surfels there
+#if SURFEL_SH
+	uint32_t	direction;		// octahedral, the SH are projected along it
+#endif
+};
+
+// The rays of a surfel are rayQueue[offset, offset + count), count is 0 when it traces nothing this frame
+struct SurfelRayRange
+{
+	uint32_t offset;
+	uint32_t count;
+};
+
+// std430 offsets of the GLSL structs, surfelGIutils.glsl declares the same members in the same order
+static_assert(sizeof(Surfel) == 48 && offsetof(Surfel, normal) == 16 && offsetof(Surfel, color) == 32, "Surfel does not match surfelGIutils.glsl");
+static_assert(sizeof(SurfelPacked) == 28 && offsetof(SurfelPacked, normal) == 12 && offsetof(SurfelPacked, lifetime) == 24, "SurfelPacked does not match surfelGIutils.glsl");
+#if SURFEL_SH
+static_assert(sizeof(SurfelData) == 96 && offsetof(SurfelData, inconsistency) == 44 && offsetof(SurfelData, shY) == 64, "SurfelData does not match surfelGIutils.glsl");
+static_assert(sizeof(SurfelDataPacked) == 40 && offsetof(SurfelDataPacked, sh) == 20, "SurfelDataPacked does not match surfelGIutils.glsl");
+static_assert(sizeof(SurfelRay) == 8, "SurfelRay does not match surfelGIutils.glsl");
+#else
+static_assert(sizeof(SurfelData) == 48 && offsetof(SurfelData, shortMean) == 16 && offsetof(SurfelData, inconsistency) == 44, "SurfelData does not match surfelGIutils.glsl");
+static_assert(sizeof(SurfelDataPacked) == 20 && offsetof(SurfelDataPacked, inconsistency) == 16, "SurfelDataPacked does not match surfelGIutils.glsl");
+static_assert(sizeof(SurfelRay) == 4, "SurfelRay does not match surfelGIutils.glsl");
+#endif
+
+#if SURFEL_PACKED
+typedef SurfelPacked		SurfelStorage;
+typedef SurfelDataPacked	SurfelDataStorage;
+#else
+typedef Surfel				SurfelStorage;
+typedef SurfelData			SurfelDataStorage;
+#endif
+
+// Same encodings as surfel_pack and surfel_data_pack in surfelGIutils.glsl, bit for bit
+uint32_t rgb9e5_encode(const glm::vec3& rgb);
+glm::vec3 rgb9e5_decode(uint32_t packed);
+uint32_t oct_encode(const glm::vec3& n);
+glm::vec3 oct_decode(uint32_t packed);
+
+// Irradiance of a surfel towards a normal, its color unless SURFEL_SH
+glm::vec3 surfel_irradiance(const glm::vec3& color, const SurfelData& data, const glm::vec3& normal);
+
+SurfelPacked pack_surfel(const Surfel& surfel);
+Surfel unpack_surfel(const SurfelPacked& packed);
+SurfelDataPacked pack_surfel_data(const SurfelData& data);
+SurfelData unpack_surfel_data(const SurfelDataPacked& packed);
+
+inline Surfel unpack_surfel(const Surfel& surfel) { return surfel; }
+inline SurfelData unpack_surfel_data(const SurfelData& data) { return data; }
+
+// Packs and unpacks synthetic surfels spanning the ranges the passes produce, returns the process exit code
+int surfel_pack_check();
+
+inline SurfelStorage store_surfel(const Surfel& surfel)
+{
+#if SURFEL_PACKED
+	return pack_surfel(surfel);
+#else
+	return surfel;
+#endif
+}
+
+inline SurfelDataStorage store_surfel_data(const SurfelData& data)
+{
+#if SURFEL_PACKED
+	return pack_surfel_data(data);
+#else
+	return data;
+#endif
+}
+
+// What a shader reads back after storing the value
+inline Surfel quantize_surfel(const Surfel& surfel) { return unpack_surfel(store_surfel(surfel)); }
+inline SurfelData quantize_surfel_data(const SurfelData& data) { return unpack_surfel_data(store_surfel_data(data)); }
+
+inline glm::vec3 quantize_surfel_color(const glm::vec3& color)
+{
+#if SURFEL_PACKED
+	return rgb9e5_decode(rgb9e5_encode(color));
+#else
+	return color;
+#endif
+}
+
+// The surfels of a cell are cellIndices[offset, offset + count)
+struct SurfelGridCell
+{
+	uint32_t count;
+	uint32_t offset;
+};
+
+
+static const unsigned int SURFEL_STATS_OFFSET_COUNT = 0;			// alive surfels, the alive list is [0, count)
+static const unsigned int SURFEL_STATS_OFFSET_NEXTCOUNT = 1;		// survivors of the update pass
+static const unsigned int SURFEL_STATS_OFFSET_INDIRECT = 2;
+static const unsigned int SURFEL_STATS_OFFSET_CELLALLOCATOR = 5;
+static const unsigned int SURFEL_STATS_OFFSET_DEADCOUNT = 6;		// free indices on the dead stack
+static const unsigned int SURFEL_STATS_OFFSET_LOWPOOL = 7;
+static const unsigned int SURFEL_STATS_OFFSET_TRACE = 8;			// VkTraceRaysIndirectCommandKHR over the ray queue
+static const unsigned int SURFEL_STATS_OFFSET_RAYALLOCATOR = 11;	// rays queued this frame, may run past the budget
+static const unsigned int SURFEL_STATS_OFFSET_RAYDEMAND = 12;		// rays the surfels asked for last frame, fixed point
+static const unsigned int SURFEL_STATS_OFFSET_NEXTRAYDEMAND = 13;	// same, summed this frame
+static const unsigned int SURFEL_STATS_OFFSET_SORT = 14;			// dispatch over the alive surfels on frames that sort them, 0 groups otherwise
+static const unsigned int SURFEL_STATS_OFFSET_SORTCELLS = 17;		// same over the cells of the grid
+static const unsigned int SURFEL_STATS_OFFSET_SORTSLOTS = 20;		// same over the surfel slots
+static const unsigned int SURFEL_STATS_OFFSET_SORTALLOCATOR = 23;	// sorted slots handed out
+static const unsigned int SURFEL_STATS_OFFSET_SORTCLOCK = 24;		// frames since the last sort
+static const unsigned int SURFEL_STATS_OFFSET_CELLOVERFLOW = 25;	// cells holding more than the cell limit this frame
+static const unsigned int SURFEL_STATS_OFFSET_SPAWNS = 26;			// surfels spawned since the start, wraps around
+static const unsigned int SURFEL_STATS_OFFSET_RECYCLES = 27;		// surfels recycled since the start, wraps around
+static const unsigned int SURFEL_STATS_SIZE = 28;
+static const unsigned int SURFEL_GRID_UNBUILT = 0xFFFFFFFF;		// cell allocator of a loaded snapshot, its grid is only binned by the first frame
+static const unsigned int SURFEL_INDIRECT_NUMTHREADS = 32;
+static const unsigned int SURFEL_CASCADE_COUNT = 4;
+static const glm::uvec3 SURFEL_GRID_DIMENSIONS = glm::uvec3(64, 32, 64);	// cells of one cascade, powers of two
+static const unsigned int SURFEL_CASCADE_SIZE = SURFEL_GRID_DIMENSIONS.x * SURFEL_GRID_DIMENSIONS.y * SURFEL_GRID_DIMENSIONS.z;
+static const unsigned int SURFEL_TABLE_SIZE = SURFEL_CASCADE_SIZE * SURFEL_CASCADE_COUNT;
+static const unsigned int SURFEL_CAPACITY = 100000;
+static const unsigned int SURFEL_CELL_LIMIT = 100;
+static const unsigned int SURFEL_CELL_INDEX_CAPACITY = SURFEL_CAPACITY * 27;	// 27 cells per cascade a surfel is binned into, most are binned into one
+static const float SURFEL_TARGET_COVERAGE = 0.5;
+
+// Surfel lifecycle, see surfel_recycle in surfelGIutils.glsl
+static const unsigned int SURFEL_BUDGET = SURFEL_CAPACITY;				// indices the dead stack starts with
+static const unsigned int SURFEL_RECYCLE_RESERVE = SURFEL_BUDGET / 16;
+static const unsigned int SURFEL_RECYCLE_FRAMES = 64;
+static const unsigned int SURFEL_RECYCLE_FRAMES_LOW = 8;
+static const unsigned int SURFEL_RECYCLE_MIN_AGE = 16;
+const float SURFEL_MAX_RADIUS = 1;
+
+// Ray allocation, see surfel_ray_demand in surfelRayAllocate.comp
+static const unsigned int SURFEL_RAY_BUDGET = SURFEL_CAPACITY;			// rays traced a frame at most
+static const unsigned int SURFEL_RAYS_MAX = 16;							// rays of one surfel a frame
+static const float SURFEL_RAYS_MIN = 0.125f;							// rays a frame of a converged surfel, on average
+static const unsigned int SURFEL_RAY_WARMUP = 16;						// frames a new surfel asks for SURFEL_RAYS_MAX
+static const float SURFEL_RAY_DEMAND_SCALE = 256.0f;					// fixed point of the demand sums
+
+static const float SURFEL_SH_BLEND = 0.08f;								// weight of a frame in the SH once warmed up, see surfelshade.comp
+
+// Surfels are sorted by the Morton order of their cell every SURFEL_SORT_INTERVAL frames, see surfelSortOrder.comp
+static const unsigned int SURFEL_SORT_INTERVAL = 64;
+
+// Spatial filter, see surfelFilter.comp
+static const float SURFEL_FILTER_NORMAL_POWER = 8.0f;
+static const float SURFEL_FILTER_PLANE = 0.25f;
+static const float SURFEL_FILTER_VARIANCE = 1.0f / 16;
+
+// constant_id of the specialization constants declared in surfelGIutils.glsl
+enum SurfelSpecConstant
+{
+	SURFEL_SPEC_CAPACITY,
+	SURFEL_SPEC_GRID_DIMENSIONS_X,
+	SURFEL_SPEC_GRID_DIMENSIONS_Y,
+	SURFEL_SPEC_GRID_DIMENSIONS_Z,
+	SURFEL_SPEC_CELL_LIMIT,
+	SURFEL_SPEC_INDIRECT_NUMTHREADS,	// local_size_x_id of the passes over the alive surfels
+	SURFEL_SPEC_TILE_WIDTH,				// local_size_x_id and local_size_y_id of the coverage pass
+	SURFEL_SPEC_TILE_HEIGHT,
+	SURFEL_SPEC_RAY_BUDGET,
+	SURFEL_SPEC_COUNT
+};
+
+// Budget and grid of the GPU pipeline, chosen at start up. Every surfel buffer is sized from it
+// and every surfel shader gets it as specialization constants, so quality can be traded for
+// memory and frame time without rebuilding the shaders.
+struct SurfelConfig
+{
+	uint32_t	capacity{ SURFEL_CAPACITY };
+	glm::uvec3	gridDimensions{ SURFEL_GRID_DIMENSIONS };	// powers of two
+	uint32_t	cellLimit{ SURFEL_CELL_LIMIT };
+	uint32_t	indirectThreads{ SURFEL_INDIRECT_NUMTHREADS };
+	uint32_t	coverageScale{ 1 };		// the coverage pass runs at 1 / coverageScale of the G-buffer resolution, 1, 2 or 4
+	glm::uvec2	tileSize{ 16, 16 };		// pixels of the coverage pass that share a spawn candidate, 256 at most
+	uint32_t	rayBudget{ SURFEL_RAY_BUDGET };
+	bool		filter{ false };		// blend the radiance of neighbouring surfels after shading
+
+	uint32_t cascade_size() const { return gridDimensions.x * gridDimensions.y * gridDimensions.z; }
+	uint32_t table_size() const { return cascade_size() * SURFEL_CASCADE_COUNT; }
+	uint32_t cell_index_capacity() const { return capacity * 27; }
+	uint32_t budget() const { return capacity; }
+	uint32_t recycle_reserve() const { return budget() / 16; }
+
+	// Pixels of the coverage pass for a G-buffer of width x height, and its groups
+	glm::uvec2 coverage_extent(uint32_t width, uint32_t height) const { return glm::uvec2((width + coverageScale - 1) / coverageScale, (height + coverageScale - 1) / coverageScale); }
+	glm::uvec2 coverage_groups(uint32_t width, uint32_t height) const { return (coverage_extent(width, height) + tileSize - 1u) / tileSize; }
+
+	bool valid() const;
+
+	// Values in constant_id order, the data of the VkSpecializationInfo
+	void specialization(uint32_t data[SURFEL_SPEC_COUNT]) const;
+
+	// Reads --surfel-capacity N, --surfel-grid X Y Z, --surfel-cell-limit N, --surfel-threads N,
+	// --surfel-rays N, --surfel-filter, --surfel-coverage-scale N and --surfel-tile W H,
+	// anything missing or invalid keeps its default
+	static SurfelConfig from_args(int argc, char* argv[]);
+};
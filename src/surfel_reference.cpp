@@ -0,0 +1,2221 @@
+#include "surfel_reference.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <utility>
+
+#include <glm/glm/gtc/matrix_transform.hpp>
+
+#include "camera.h"
+#include "sampling.h"
+#include "surfel_cache.h"
+#include "surfel_cascades.h"
+#include "surfel_telemetry.h"
+#include "thread_pool.h"
+
+// Shader constants that have no C++ counterpart in surfel_gi.h
+static const uint32_t	SURFEL_TILE_INIT			= 0xFF;		// not(0) from bitwise.glsl works on 8 bits
+static const float		SURFEL_RAY_TMIN				= 0.001f;
+static const float		SURFEL_RAY_TMAX				= 100.0f;
+static const float		SURFEL_PI					= 3.14159265358979323846f;
+
+// Alive list positions or grid cells per task of the stages that append to shared lists. The tasks
+// count, the chunks are scanned in order and the tasks write, so the lists come out as one thread
+// would write them whatever the number of threads.
+static const uint32_t	SURFEL_CHUNK_SIZE			= 2048;
+
+//------------------------------------------------------------------- GLSL helpers
+
+static float fract(float x)
+{
+	return x - std::floor(x);
+}
+
+// GLSL clamp(x, minVal, maxVal) is min(max(x, minVal), maxVal), the shaders
+// sometimes call it as clamp(0.0, 1.0, x) which ends up as min(1.0, x)
+static float glsl_clamp(float x, float minVal, float maxVal)
+{
+	return std::min(std::max(x, minVal), maxVal);
+}
+
+static glm::vec3 glsl_clamp(const glm::vec3& x, const glm::vec3& minVal, const glm::vec3& maxVal)
+{
+	return glm::min(glm::max(x, minVal), maxVal);
+}
+
+// surfel_recycle from surfelGIutils.glsl
+static bool surfel_recycle(const Surfel& surfel, uint32_t cascade, bool lowPool)
+{
+	if (cascade >= SURFEL_CASCADE_COUNT)
+		return true;
+	if (surfel.age < SURFEL_RECYCLE_MIN_AGE)
+		return false;
+	return surfel.unseen > (lowPool ? SURFEL_RECYCLE_FRAMES_LOW : SURFEL_RECYCLE_FRAMES);
+}
+
+static float smoothstep01(float x)
+{
+	const float t = glsl_clamp(x, 0.0f, 1.0f);
+	return t * t * (3.0f - 2.0f * t);
+}
+
+// hash2 from random.glsl, the two seed increments are evaluated left to right. With
+// cosine_sample_hemisphere it is how surfelRayGen.rgen sampled before sampling.glsl,
+// sampling_report measures against it.
+static glm::vec2 hash2(float& seed)
+{
+	seed += 0.1f;
+	const float a = seed;
+	seed += 0.1f;
+	const float b = seed;
+	return glm::vec2(fract(std::sin(a) * 43758.5453123f), fract(std::sin(b) * 22578.1459123f));
+}
+
+static glm::vec3 cosine_sample_hemisphere(const glm::vec3& n, float& seed)
+{
+	const glm::vec2 u = hash2(seed);
+
+	const float r = std::sqrt(u.x);
+	const float theta = 2.0f * 3.141592f * u.y;
+
+	const glm::vec3 B = glm::normalize(glm::cross(n, glm::vec3(0.0f, 1.0f, 1.0f)));
+	const glm::vec3 T = glm::cross(B, n);
+
+	return glm::normalize(r * std::sin(theta) * B + std::sqrt(1.0f - u.x) * n + r * std::cos(theta) * T);
+}
+
+static glm::vec3 reconstruct_position(const glm::vec2& uv, float z, const glm::mat4& inverseProj)
+{
+	const glm::vec4 position_v = inverseProj * glm::vec4(uv.x * 2 - 1, uv.y * 2 - 1, z, 1);
+	return glm::vec3(position_v) / position_v.w;
+}
+
+static float linearize_depth(float d, float zNear, float zFar)
+{
+	return zNear * zFar / (zFar + d * (zNear - zFar));
+}
+
+// Bilinear fetch with clamp to edge, what _SurfelPositionNormalSampler does
+template<typename T>
+static T sample_linear(const T* image, uint32_t width, uint32_t height, const glm::vec2& uv)
+{
+	const glm::vec2 coord = uv * glm::vec2(width, height) - 0.5f;
+	const glm::vec2 base = glm::floor(coord);
+	const glm::vec2 f = coord - base;
+
+	auto texel = [&](int x, int y) {
+		x = std::min(std::max(x, 0), (int)width - 1);
+		y = std::min(std::max(y, 0), (int)height - 1);
+		return image[y * width + x];
+	};
+
+	const int x = (int)base.x;
+	const int y = (int)base.y;
+	const T top = texel(x, y) * (1 - f.x) + texel(x + 1, y) * f.x;
+	const T bottom = texel(x, y + 1) * (1 - f.x) + texel(x + 1, y + 1) * f.x;
+	return top * (1 - f.y) + bottom * f.y;
+}
+
+static const glm::vec3 surfel_neighbor_offsets[27] = {
+	glm::vec3(-1, -1, -1), glm::vec3(-1, -1, 0), glm::vec3(-1, -1, 1),
+	glm::vec3(-1, 0, -1), glm::vec3(-1, 0, 0), glm::vec3(-1, 0, 1),
+	glm::vec3(-1, 1, -1), glm::vec3(-1, 1, 0), glm::vec3(-1, 1, 1),
+	glm::vec3(0, -1, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 1),
+	glm::vec3(0, 0, -1), glm::vec3(0, 0, 0), glm::vec3(0, 0, 1),
+	glm::vec3(0, 1, -1), glm::vec3(0, 1, 0), glm::vec3(0, 1, 1),
+	glm::vec3(1, -1, -1), glm::vec3(1, -1, 0), glm::vec3(1, -1, 1),
+	glm::vec3(1, 0, -1), glm::vec3(1, 0, 0), glm::vec3(1, 0, 1),
+	glm::vec3(1, 1, -1), glm::vec3(1, 1, 0), glm::vec3(1, 1, 1),
+};
+
+// Appends the cells surfel overlaps as cell << 32 | position, position its place in the alive list,
+// so sorting the pairs of a chunk groups them by cell and keeps each cell in alive list order.
+// Every cascade from the position one up to cascade, where lookups inside the surfel land.
+static void surfel_overlaps(const Surfel& surfel, uint32_t cascade, const glm::vec3& campos, uint32_t position, std::vector<uint64_t>& overlaps)
+{
+	for (uint32_t c = surfel_position_cascade(surfel.position, campos); c <= cascade; c++)
+	{
+		const glm::ivec3 gridpos = surfel_cell(surfel.position, c);
+
+		for (uint32_t i = 0; i < 27; ++i)
+		{
+			const glm::ivec3 gridpos2 = glm::ivec3(glm::vec3(gridpos) + surfel_neighbor_offsets[i]);
+			if (surfel_cellintersects(surfel, gridpos2, c, campos))
+				overlaps.push_back((uint64_t)surfel_cellindex(gridpos2, c) << 32 | position);
+		}
+	}
+}
+
+static void multiscale_mean_estimator(glm::vec3 y, SurfelData& data)
+{
+	glm::vec3 mean = data.mean;
+	glm::vec3 shortMean = data.shortMean;
+	float vbbr = data.vbbr;
+	glm::vec3 variance = data.variance;
+	float inconsistency = data.inconsistency;
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+
+	// Suppress fireflies.
+	{
+		glm::vec3 dev = glm::sqrt(glm::max(glm::vec3(1e-5f), variance));
+		glm::vec3 highThreshold = glm::vec3(0.1f) + shortMean + dev * 8.0f;
+		glm::vec3 overflow = glm::max(glm::vec3(0), y - highThreshold);
+		y -= overflow;
+	}
+
+	glm::vec3 delta = y - shortMean;
+	shortMean = glm::mix(shortMean, y, glm::vec3(0.08f));
+	glm::vec3 delta2 = y - shortMean;
+
+	float varianceBlend = 0.08f * 0.5f;
+	variance = glm::mix(variance, delta * delta2, varianceBlend);
+	glm::vec3 dev = glm::sqrt(glm::max(glm::vec3(1e-5f), variance));
+
+	glm::vec3 shortDiff = mean - shortMean;
+
+	float relativeDiff = glm::dot(luma, glm::abs(shortDiff) / glm::max(glm::vec3(1e-5f), dev));
+	inconsistency = glm::mix(inconsistency, relativeDiff, 0.08f);
+
+	float varianceBasedBlendReduction = glsl_clamp(glm::dot(luma, 0.5f * shortMean / glm::max(glm::vec3(1e-5f), dev)), 1.0f / 32, 1.0f);
+
+	glm::vec3 catchUpBlend = glm::vec3(glsl_clamp(smoothstep01(relativeDiff * std::max(0.02f, inconsistency - 0.2f)), 1.0f / 256, 1.0f));
+	catchUpBlend *= vbbr;
+
+	vbbr = glm::mix(vbbr, varianceBasedBlendReduction, 0.1f);
+	mean = glm::mix(mean, y, glsl_clamp(glm::vec3(0.0f), glm::vec3(1.0f), catchUpBlend));
+
+	data.mean = mean;
+	data.shortMean = shortMean;
+	data.vbbr = vbbr;
+	data.variance = variance;
+	data.inconsistency = inconsistency;
+}
+
+static double now_milliseconds()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//------------------------------------------------------------------- SurfelReference
+
+SurfelReference::SurfelReference()
+{
+	static const char* names[STAGE_COUNT] = {
+		"surfel_position",
+		"prepare_indirect",
+		"grid_reset",
+		"update_surfels",
+		"surfel_compact",
+		"grid_offset",
+		"surfel_binning",
+		"surfel_sort",
+		"surfel_ray_allocate",
+		"surfel_ray_tracing",
+		"surfel_shade",
+		"surfel_filter"
+	};
+
+	for (uint32_t i = 0; i < STAGE_COUNT; i++)
+		_timings[i].name = names[i];
+
+	reset();
+}
+
+void SurfelReference::reset()
+{
+	// As the shaders read cleared buffers, a zero normal comes back as +Z when packed
+	_surfels.assign(SURFEL_CAPACITY, quantize_surfel(Surfel{}));
+	_surfelData.assign(SURFEL_CAPACITY, quantize_surfel_data(SurfelData{}));
+	_stats.assign(SURFEL_STATS_SIZE, 0);
+	_gridCells.assign(SURFEL_TABLE_SIZE, SurfelGridCell{});
+	_cellIndices.clear();
+
+	// Same seed as Renderer::create_SurfelGi_resources, indices are popped in ascending order
+	_aliveList.assign(SURFEL_CAPACITY * 2, 0);
+	_deadList.assign(SURFEL_CAPACITY, 0);
+	_rayRanges.assign(SURFEL_CAPACITY, SurfelRayRange{});
+	_rayQueue.assign(SURFEL_RAY_BUDGET, 0);
+	_rays.assign(SURFEL_RAY_BUDGET, SurfelRay{});
+	for (uint32_t i = 0; i < SURFEL_BUDGET; i++)
+		_deadList[i] = SURFEL_BUDGET - 1 - i;
+	_stats[SURFEL_STATS_OFFSET_DEADCOUNT] = SURFEL_BUDGET;
+	_spawned = 0;
+	_recycled = 0;
+	_bouncedRays = 0;
+	_resultImage.clear();
+	_debugImage.clear();
+
+	for (SurfelStageTiming& timing : _timings)
+	{
+		timing.milliseconds = 0;
+		timing.items = 0;
+	}
+}
+
+void SurfelReference::run_frame(const SurfelFrameInput& input)
+{
+	surfel_position(input);
+	prepare_indirect();
+	grid_reset();
+	update_surfels(input);
+	surfel_compact();
+	grid_offset();
+	surfel_binning(input);
+	surfel_sort(input);
+	surfel_ray_allocate(input);
+	surfel_ray_tracing(input);
+	surfel_shade(input);
+	if (_filter)
+		surfel_filter(input);
+}
+
+uint32_t SurfelReference::surfel_count() const
+{
+	return std::min(_stats[SURFEL_STATS_OFFSET_COUNT], SURFEL_CAPACITY);
+}
+
+void SurfelReference::begin_stage(Stage stage)
+{
+	_currentStage = stage;
+	_stageStart = now_milliseconds();
+}
+
+void SurfelReference::end_stage(Stage stage, uint64_t items)
+{
+	assert(stage == _currentStage && "end_stage does not match the stage begun last");
+	_currentStage = STAGE_COUNT;
+	_timings[stage].milliseconds += now_milliseconds() - _stageStart;
+	_timings[stage].items += items;
+}
+
+// surfelRandomPos.comp: coverage per pixel, one spawn candidate per tile.
+// Tiles run in parallel against the grid binned by the previous frame and their
+// spawns are appended afterwards in tile order, surfel_binning adds them to the grid. The shader writes the
+// return value of atomicMin back into minTile, which races, the reference keeps
+// the real minimum. Surfels that cover a pixel are marked seen once every tile is done.
+void SurfelReference::surfel_position(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_POSITION);
+
+	struct Spawn
+	{
+		bool		valid{ false };
+		glm::vec3	position;
+		glm::vec3	normal;
+		uint32_t	cascade;
+	};
+
+	// The coverage images, the G-buffer is input.width x input.height
+	const uint32_t width = (input.width + input.coverageScale - 1) / input.coverageScale;
+	const uint32_t height = (input.height + input.coverageScale - 1) / input.coverageScale;
+	const uint32_t tileX = input.tileSize.x;
+	const uint32_t tileY = input.tileSize.y;
+	const uint32_t groupsX = (width + tileX - 1) / tileX;
+	const uint32_t groupsY = (height + tileY - 1) / tileY;
+	const glm::mat4 invViewProj = glm::inverse(input.projection * input.view);
+	const glm::vec3 campos = input.cameraPosition;
+
+	_resultImage.resize((size_t)width * height, glm::vec4(0));
+	_debugImage.resize((size_t)width * height, glm::vec4(0));
+
+	std::vector<Spawn> spawns((size_t)groupsX * groupsY);
+	std::vector<std::vector<uint32_t>> seen(spawns.size());
+
+	// A loaded snapshot has no grid until surfel_binning, nothing is covered and nothing spawns
+	const bool gridBuilt = _stats[SURFEL_STATS_OFFSET_CELLALLOCATOR] != SURFEL_GRID_UNBUILT;
+
+	ThreadPool::get().parallel_for(0, spawns.size(), 4, [&](size_t group) {
+		struct PixelState
+		{
+			bool		active{ false };
+			glm::vec3	P;
+			glm::vec3	N;
+			uint32_t	cascade;
+			float		coverage{ 0 };
+			float		depth{ 0 };
+			glm::vec4	color;
+			glm::vec4	debug;
+		};
+
+		const uint32_t groupX = (uint32_t)(group % groupsX);
+		const uint32_t groupY = (uint32_t)(group / groupsX);
+
+		PixelState pixels[256];
+		uint32_t minTile = SURFEL_TILE_INIT;
+
+		auto store = [&](uint32_t x, uint32_t y, std::vector<glm::vec4>& image, const glm::vec4& value) {
+			if (x < width && y < height)
+				image[(size_t)y * width + x] = value;
+		};
+
+		for (uint32_t ly = 0; ly < tileY; ly++)
+		{
+			for (uint32_t lx = 0; lx < tileX; lx++)
+			{
+				PixelState& state = pixels[ly * tileX + lx];
+				const uint32_t x = groupX * tileX + lx;
+				const uint32_t y = groupY * tileY + ly;
+				if (x >= width || y >= height)
+					continue;
+
+				// G-buffer texel under the centre of the pixel
+				const glm::uvec2 texel = glm::uvec2((2 * x + 1) * input.width / (2 * width), (2 * y + 1) * input.height / (2 * height));
+				const glm::vec2 uv = (glm::vec2(texel) + 0.5f) / glm::vec2(input.width, input.height);
+
+				const float depth = sample_linear(input.depth, input.width, input.height, uv);
+				const glm::vec3 worldpos = reconstruct_position(uv, depth, invViewProj);
+				const glm::vec4 vec4normal = sample_linear(input.normals, input.width, input.height, uv);
+				const glm::vec3 N = glm::normalize(glm::vec3(vec4normal) * 2.0f - glm::vec3(1.0f));
+
+				if (vec4normal.a == 0.0f)
+				{
+					store(x, y, _debugImage, glm::vec4(0));
+					store(x, y, _resultImage, glm::vec4(0));
+					continue;
+				}
+
+				const glm::vec3 P = worldpos;
+				const uint32_t cascade = surfel_position_cascade(P, campos);
+				const glm::ivec3 gridpos = surfel_cell(P, cascade);
+
+				if (!surfel_cellvalid(gridpos, cascade, campos))
+				{
+					store(x, y, _debugImage, glm::vec4(0));
+					store(x, y, _resultImage, glm::vec4(0));
+					continue;
+				}
+
+				glm::vec4 color = glm::vec4(0);
+				glm::vec4 debug = glm::vec4(0);
+				float coverage = 0;
+
+				const uint32_t cellindex = surfel_cellindex(gridpos, cascade);
+				const SurfelGridCell cell = _gridCells[cellindex];
+				const uint32_t cellcount = gridBuilt ? cell.count : 0;
+
+				for (uint32_t i = 0; i < cellcount; ++i)
+				{
+					const size_t slot = (size_t)cell.offset + i;
+					const uint32_t surfel_index = slot < _cellIndices.size() ? _cellIndices[slot] : 0;
+					const Surfel surfel = surfel_index < _surfels.size() ? _surfels[surfel_index] : Surfel{};
+
+					const glm::vec3 L = surfel.position - P;
+					const float dist2 = glm::dot(L, L);
+					if (dist2 < (surfel.radius * surfel.radius))
+					{
+						const glm::vec3 normal = glm::normalize(surfel.normal);
+						const float dotN = glm::dot(N, normal);
+						if (dotN > 0)
+						{
+							const float dist = std::sqrt(dist2);
+							float contribution = 1;
+
+							contribution *= glsl_clamp(dotN, 0.0f, 1.0f);
+							contribution *= glsl_clamp(1 - dist / surfel.radius, 0.0f, 1.0f);
+							contribution = smoothstep01(contribution);
+							coverage += contribution;
+
+							color += glm::vec4(surfel_irradiance(surfel.color, _surfelData[surfel_index], N), 1) * contribution;
+
+							seen[group].push_back(surfel_index);
+						}
+						if (dist2 <= (0.05f * 0.05f))
+							debug = glm::vec4(1.0f, 0.0f, 1.0f, 1.0f);
+					}
+				}
+
+				if (cellcount < SURFEL_CELL_LIMIT)
+				{
+					uint32_t surfel_count_at_pixel = 0;
+					surfel_count_at_pixel |= ((uint32_t)coverage & 0xFF) << 8;
+					surfel_count_at_pixel |= (lx * tileY + ly) & 0xFF;
+					minTile = std::min(minTile, surfel_count_at_pixel);
+				}
+
+				if (color.a > 0)
+				{
+					color = glm::vec4(glm::vec3(color) / color.a, glsl_clamp(color.a, 0.0f, 1.0f));
+				}
+
+				state.active = true;
+				state.P = P;
+				state.N = N;
+				state.cascade = cascade;
+				state.coverage = coverage;
+				state.depth = depth;
+				state.color = color;
+				state.debug = debug;
+			}
+		}
+
+		const uint32_t minPixel = minTile & 0xFF;
+
+		for (uint32_t ly = 0; ly < tileY; ly++)
+		{
+			for (uint32_t lx = 0; lx < tileX; lx++)
+			{
+				const PixelState& state = pixels[ly * tileX + lx];
+				if (!state.active)
+					continue;
+
+				const uint32_t x = groupX * tileX + lx;
+				const uint32_t y = groupY * tileY + ly;
+
+				if (gridBuilt && lx * tileY + ly == minPixel && state.coverage < SURFEL_TARGET_COVERAGE)
+				{
+					const float lineardepth = linearize_depth(state.depth, input.near, input.far) * (1 / input.far);
+					const float chance = std::pow(1 - lineardepth, 16.0f);
+
+					const glm::uvec2 uvBlue = glm::uvec2(groupX % 128, groupY % 128);
+					const glm::vec2 uvBlueNDC = (glm::vec2(uvBlue) + 0.5f) / 128.0f;
+					const float rand = blue_noise_sample(sample_linear(input.blueNoise, input.blueNoiseWidth, input.blueNoiseHeight, uvBlueNDC).x, input.frame);
+
+					if (rand >= chance)
+					{
+						Spawn& spawn = spawns[group];
+						spawn.valid = true;
+						spawn.position = state.P;
+						spawn.normal = state.N;
+						spawn.cascade = state.cascade;
+					}
+				}
+
+				store(x, y, _debugImage, state.debug);
+				store(x, y, _resultImage, state.color);
+			}
+		}
+	});
+
+	for (const std::vector<uint32_t>& indices : seen)
+		for (uint32_t surfel_index : indices)
+			if (surfel_index < _surfels.size())
+				_surfels[surfel_index].unseen = 0;
+
+	for (const Spawn& spawn : spawns)
+	{
+		if (!spawn.valid)
+			continue;
+
+		// Pop a free index, spawns are dropped once the budget is reached
+		uint32_t& dead = _stats[SURFEL_STATS_OFFSET_DEADCOUNT];
+		if (dead == 0)
+			continue;
+
+		const uint32_t surfel_alloc = _deadList[--dead];
+		_aliveList[_stats[SURFEL_STATS_OFFSET_COUNT]++] = surfel_alloc;
+		_stats[SURFEL_STATS_OFFSET_SPAWNS]++;
+		_spawned++;
+
+		Surfel surfel{};
+		surfel.position = spawn.position;
+		surfel.normal = spawn.normal;
+		surfel.radius = surfel_cascade_cellsize(spawn.cascade);
+
+		_surfels[surfel_alloc] = quantize_surfel(surfel);
+	}
+
+	end_stage(STAGE_SURFEL_POSITION, (uint64_t)width * height);
+}
+
+// prepareIndirect.comp
+void SurfelReference::prepare_indirect()
+{
+	begin_stage(STAGE_PREPARE_INDIRECT);
+
+	const uint32_t surfel_count = std::min(_stats[SURFEL_STATS_OFFSET_COUNT], SURFEL_CAPACITY);
+	_stats[SURFEL_STATS_OFFSET_COUNT] = surfel_count;
+	_stats[SURFEL_STATS_OFFSET_NEXTCOUNT] = 0;
+
+	_stats[SURFEL_STATS_OFFSET_INDIRECT + 0] = (surfel_count + SURFEL_INDIRECT_NUMTHREADS - 1) / SURFEL_INDIRECT_NUMTHREADS;
+	_stats[SURFEL_STATS_OFFSET_INDIRECT + 1] = 1;
+	_stats[SURFEL_STATS_OFFSET_INDIRECT + 2] = 1;
+	_stats[SURFEL_STATS_OFFSET_TRACE + 0] = 0;
+	_stats[SURFEL_STATS_OFFSET_TRACE + 1] = 1;
+	_stats[SURFEL_STATS_OFFSET_TRACE + 2] = 1;
+	_stats[SURFEL_STATS_OFFSET_RAYALLOCATOR] = 0;
+	_stats[SURFEL_STATS_OFFSET_RAYDEMAND] = _stats[SURFEL_STATS_OFFSET_NEXTRAYDEMAND];
+	_stats[SURFEL_STATS_OFFSET_NEXTRAYDEMAND] = 0;
+	_stats[SURFEL_STATS_OFFSET_CELLALLOCATOR] = 0;
+	_stats[SURFEL_STATS_OFFSET_CELLOVERFLOW] = 0;
+	_stats[SURFEL_STATS_OFFSET_LOWPOOL] = _stats[SURFEL_STATS_OFFSET_DEADCOUNT] < SURFEL_RECYCLE_RESERVE ? 1 : 0;
+
+	const uint32_t sortClock = _stats[SURFEL_STATS_OFFSET_SORTCLOCK] + 1;
+	const bool sort = sortClock >= SURFEL_SORT_INTERVAL;
+	_stats[SURFEL_STATS_OFFSET_SORTCLOCK] = sort ? 0 : sortClock;
+
+	_stats[SURFEL_STATS_OFFSET_SORT + 0] = sort ? _stats[SURFEL_STATS_OFFSET_INDIRECT + 0] : 0;
+	_stats[SURFEL_STATS_OFFSET_SORT + 1] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORT + 2] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORTCELLS + 0] = sort ? (SURFEL_TABLE_SIZE + 63) / 64 : 0;
+	_stats[SURFEL_STATS_OFFSET_SORTCELLS + 1] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORTCELLS + 2] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORTSLOTS + 0] = sort ? (SURFEL_CAPACITY + SURFEL_INDIRECT_NUMTHREADS - 1) / SURFEL_INDIRECT_NUMTHREADS : 0;
+	_stats[SURFEL_STATS_OFFSET_SORTSLOTS + 1] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORTSLOTS + 2] = 1;
+	_stats[SURFEL_STATS_OFFSET_SORTALLOCATOR] = 0;
+
+	end_stage(STAGE_PREPARE_INDIRECT, 1);
+}
+
+// gridReset.comp
+void SurfelReference::grid_reset()
+{
+	begin_stage(STAGE_GRID_RESET);
+
+	std::fill(_gridCells.begin(), _gridCells.end(), SurfelGridCell{});
+
+	end_stage(STAGE_GRID_RESET, SURFEL_TABLE_SIZE);
+}
+
+// updateSurfels.comp, ages every alive surfel, gives the recycled ones back to the dead
+// stack and counts the others in the cells they overlap. Both lists are appended to in
+// alive list order, the shader appends in whatever order its atomics land. Chunks of the
+// alive list run in parallel, their survivors and recycled surfels are placed after a scan.
+void SurfelReference::update_surfels(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_UPDATE_SURFELS);
+
+	const uint32_t count = surfel_count();
+	const uint32_t chunks = (count + SURFEL_CHUNK_SIZE - 1) / SURFEL_CHUNK_SIZE;
+	const glm::vec3 campos = input.cameraPosition;
+	const bool lowPool = _stats[SURFEL_STATS_OFFSET_LOWPOOL] != 0;
+
+	std::vector<uint8_t> recycled(count, 0);
+	std::vector<uint32_t> recycledCount(chunks, 0);
+	std::vector<std::vector<uint64_t>> overlaps(chunks);
+
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, count);
+
+		for (uint32_t i = first; i < last; i++)
+		{
+			const uint32_t surfel_index = _aliveList[i];
+			Surfel& surfel = _surfels[surfel_index];
+
+			if (surfel.age == 0)
+			{
+				SurfelData& surfel_data = _surfelData[surfel_index];
+				surfel_data.mean = glm::vec3(0.0f);
+				surfel_data.shortMean = glm::vec3(0.0f);
+				surfel_data.vbbr = 0.0f;
+				surfel_data.variance = glm::vec3(0.0f);
+				surfel_data.inconsistency = 0.0f;
+#if SURFEL_SH
+				surfel_data.shX = glm::vec3(0.0f);
+				surfel_data.shY = glm::vec3(0.0f);
+				surfel_data.shZ = glm::vec3(0.0f);
+#endif
+				surfel_data = quantize_surfel_data(surfel_data);
+			}
+
+			surfel.age++;
+			surfel.unseen++;
+
+			const uint32_t cascade = surfel_cascade(surfel, campos);
+			if (surfel_recycle(surfel, cascade, lowPool))
+			{
+				recycled[i] = 1;
+				recycledCount[chunk]++;
+				continue;
+			}
+
+			// Stored packed, position and radius used for the bins below are kept as they are
+			surfel = quantize_surfel(surfel);
+
+			surfel_overlaps(surfel, cascade, campos, i, overlaps[chunk]);
+		}
+	});
+
+	// Where each chunk starts appending, and the cell counts, which need no order
+	std::vector<glm::uvec2> offsets(chunks);
+	uint32_t recycledTotal = 0;
+	for (uint32_t chunk = 0; chunk < chunks; chunk++)
+	{
+		const uint32_t size = std::min(SURFEL_CHUNK_SIZE, count - chunk * SURFEL_CHUNK_SIZE);
+		offsets[chunk] = glm::uvec2(_stats[SURFEL_STATS_OFFSET_NEXTCOUNT], _stats[SURFEL_STATS_OFFSET_DEADCOUNT]);
+		_stats[SURFEL_STATS_OFFSET_NEXTCOUNT] += size - recycledCount[chunk];
+		_stats[SURFEL_STATS_OFFSET_DEADCOUNT] += recycledCount[chunk];
+		recycledTotal += recycledCount[chunk];
+
+		for (uint64_t overlap : overlaps[chunk])
+			_gridCells[overlap >> 32].count++;
+	}
+	_stats[SURFEL_STATS_OFFSET_RECYCLES] += recycledTotal;
+	_recycled += recycledTotal;
+
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, count);
+		uint32_t alive = offsets[chunk].x;
+		uint32_t dead = offsets[chunk].y;
+
+		for (uint32_t i = first; i < last; i++)
+		{
+			if (recycled[i])
+				_deadList[dead++] = _aliveList[i];
+			else
+				_aliveList[SURFEL_CAPACITY + alive++] = _aliveList[i];
+		}
+	});
+
+	end_stage(STAGE_UPDATE_SURFELS, count);
+}
+
+// Renderer::build_surfel_compact_buffer, the survivors become the alive list
+void SurfelReference::surfel_compact()
+{
+	begin_stage(STAGE_SURFEL_COMPACT);
+
+	const uint32_t count = _stats[SURFEL_STATS_OFFSET_NEXTCOUNT];
+	ThreadPool::get().parallel_for_range(0, count, SURFEL_CHUNK_SIZE * 8, [&](size_t first, size_t last) {
+		std::copy(_aliveList.begin() + SURFEL_CAPACITY + first, _aliveList.begin() + SURFEL_CAPACITY + last, _aliveList.begin() + first);
+	});
+	_stats[SURFEL_STATS_OFFSET_COUNT] = count;
+
+	end_stage(STAGE_SURFEL_COMPACT, count);
+}
+
+// gridOffset.comp. The shader takes one range of the index list per group with an
+// atomic, so its offsets are only ordered inside a group; the reference scans the
+// whole grid in order, in chunks of cells that sum their counts, then write their
+// offsets once the sums are scanned. The index list is sized to the overlaps, the
+// GPU buffer to SURFEL_CELL_INDEX_CAPACITY.
+void SurfelReference::grid_offset()
+{
+	begin_stage(STAGE_GRID_OFFSET);
+
+	const uint32_t cells = (uint32_t)_gridCells.size();
+	const uint32_t chunks = (cells + SURFEL_CHUNK_SIZE - 1) / SURFEL_CHUNK_SIZE;
+	std::vector<uint32_t> offsets(chunks, 0);
+	std::vector<uint32_t> overflow(chunks, 0);
+
+	ThreadPool::get().parallel_for(0, chunks, 16, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, cells);
+		for (uint32_t c = first; c < last; c++)
+		{
+			offsets[chunk] += _gridCells[c].count;
+			if (_gridCells[c].count > SURFEL_CELL_LIMIT)
+				overflow[chunk]++;
+		}
+	});
+
+	uint32_t offset = 0;
+	for (uint32_t chunk = 0; chunk < chunks; chunk++)
+	{
+		const uint32_t sum = offsets[chunk];
+		offsets[chunk] = offset;
+		offset += sum;
+		_stats[SURFEL_STATS_OFFSET_CELLOVERFLOW] += overflow[chunk];
+	}
+
+	ThreadPool::get().parallel_for(0, chunks, 16, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, cells);
+		uint32_t cellOffset = offsets[chunk];
+		for (uint32_t c = first; c < last; c++)
+		{
+			SurfelGridCell& cell = _gridCells[c];
+			cell.offset = cellOffset;
+			cellOffset += cell.count;
+			cell.count = 0;
+		}
+	});
+
+	_stats[SURFEL_STATS_OFFSET_CELLALLOCATOR] = offset;
+	_cellIndices.resize(offset);
+
+	end_stage(STAGE_GRID_OFFSET, SURFEL_TABLE_SIZE);
+}
+
+// surfelbinning.comp. Surfels are binned in alive list order, the shader fills a cell
+// in whatever order its atomics land. Chunks of the alive list find their cells in
+// parallel, a scan over the chunks gives each of them where its surfels go in a cell.
+void SurfelReference::surfel_binning(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_BINNING);
+
+	const uint32_t count = surfel_count();
+	const uint32_t chunks = (count + SURFEL_CHUNK_SIZE - 1) / SURFEL_CHUNK_SIZE;
+	const glm::vec3 campos = input.cameraPosition;
+
+	std::vector<std::vector<uint64_t>> overlaps(chunks);
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, count);
+		for (uint32_t i = first; i < last; i++)
+		{
+			const Surfel& surfel = _surfels[_aliveList[i]];
+			surfel_overlaps(surfel, surfel_cascade(surfel, campos), campos, i, overlaps[chunk]);
+		}
+		std::sort(overlaps[chunk].begin(), overlaps[chunk].end());
+	});
+
+	// The surfels of a cell in earlier chunks come first, each run of a cell in a chunk starts at the count so far
+	std::vector<std::vector<uint32_t>> starts(chunks);
+	for (uint32_t chunk = 0; chunk < chunks; chunk++)
+	{
+		const std::vector<uint64_t>& pairs = overlaps[chunk];
+		for (size_t run = 0; run < pairs.size();)
+		{
+			const uint32_t cellindex = uint32_t(pairs[run] >> 32);
+			size_t end = run + 1;
+			while (end < pairs.size() && uint32_t(pairs[end] >> 32) == cellindex)
+				end++;
+
+			starts[chunk].push_back(_gridCells[cellindex].count);
+			_gridCells[cellindex].count += uint32_t(end - run);
+			run = end;
+		}
+	}
+
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const std::vector<uint64_t>& pairs = overlaps[chunk];
+		uint32_t cellindex = UINT32_MAX;
+		size_t slot = 0;
+		size_t run = 0;
+		for (uint64_t pair : pairs)
+		{
+			if (uint32_t(pair >> 32) != cellindex)
+			{
+				cellindex = uint32_t(pair >> 32);
+				slot = (size_t)_gridCells[cellindex].offset + starts[chunk][run++];
+			}
+			if (slot < _cellIndices.size())
+				_cellIndices[slot] = _aliveList[uint32_t(pair)];
+			slot++;
+		}
+	});
+
+	end_stage(STAGE_SURFEL_BINNING, count);
+}
+
+std::vector<uint32_t> SurfelReference::sort_order(const glm::vec3& campos) const
+{
+	const uint32_t count = surfel_count();
+
+	// Home cell of each surfel, the one it is in when binned there
+	std::vector<uint32_t> home(count);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const Surfel& surfel = _surfels[_aliveList[i]];
+		const uint32_t cascade = surfel_cascade(surfel, campos);
+		const glm::ivec3 gridpos = surfel_cell(surfel.position, cascade);
+		const bool binned = cascade < SURFEL_CASCADE_COUNT && surfel_cellintersects(surfel, gridpos, cascade, campos);
+		home[i] = binned ? surfel_cellindex(gridpos, cascade) : UINT32_MAX;
+	}
+
+	std::vector<uint32_t> order(count);
+	for (uint32_t i = 0; i < count; i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return home[a] < home[b]; });
+
+	for (uint32_t& index : order)
+		index = _aliveList[index];
+	return order;
+}
+
+// surfelSortOrder.comp, surfelSortScatter.comp and surfelSortApply.comp, on the frames prepare_indirect
+// gives them groups. The shaders place each group of 64 cells where its atomic lands and the surfels
+// in no cell in any order; the reference scans the cells in order and keeps the alive list order
+// inside a cell, as surfel_binning filled it.
+void SurfelReference::surfel_sort(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_SORT);
+
+	if (_stats[SURFEL_STATS_OFFSET_SORTCELLS] == 0)
+	{
+		end_stage(STAGE_SURFEL_SORT, 0);
+		return;
+	}
+
+	const uint32_t count = surfel_count();
+	const std::vector<uint32_t> order = sort_order(input.cameraPosition);
+
+	std::vector<uint32_t> remap(SURFEL_CAPACITY, 0);
+	std::vector<Surfel> sorted(count);
+	std::vector<SurfelData> sortedData(count);
+	for (uint32_t slot = 0; slot < count; slot++)
+	{
+		remap[order[slot]] = slot;
+		sorted[slot] = _surfels[order[slot]];
+		sortedData[slot] = _surfelData[order[slot]];
+	}
+	_stats[SURFEL_STATS_OFFSET_SORTALLOCATOR] = count;
+
+	// The slots past the alive surfels keep what they held, as on the GPU
+	std::copy(sorted.begin(), sorted.end(), _surfels.begin());
+	std::copy(sortedData.begin(), sortedData.end(), _surfelData.begin());
+	for (uint32_t slot = 0; slot < count; slot++)
+		_aliveList[slot] = slot;
+	for (uint32_t slot = count; slot < SURFEL_BUDGET; slot++)
+		_deadList[SURFEL_BUDGET - 1 - slot] = slot;
+	_stats[SURFEL_STATS_OFFSET_DEADCOUNT] = SURFEL_BUDGET - count;
+
+	for (uint32_t& index : _cellIndices)
+		index = remap[index];
+
+	end_stage(STAGE_SURFEL_SORT, count);
+}
+
+// surfel_ray_demand in surfelRayAllocate.comp
+static float surfel_ray_demand(const Surfel& surfel, const SurfelData& data)
+{
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+
+	const float deviation = glm::dot(luma, glm::sqrt(glm::max(glm::vec3(0.0f), data.variance))) / std::max(glm::dot(luma, data.shortMean), 1e-3f);
+	float error = glsl_clamp(deviation + data.inconsistency, 0.0f, 1.0f);
+	if (surfel.age < SURFEL_RAY_WARMUP)
+		error = 1.0f;
+
+	return std::max(SURFEL_RAYS_MIN, SURFEL_RAYS_MAX * error);
+}
+
+// surfelRayAllocate.comp. The queue is filled in alive list order, the shader takes one
+// range per group with an atomic so its groups land in any order. Chunks of the alive list
+// count their rays in parallel, then fill the queue from where the scan over them puts each.
+void SurfelReference::surfel_ray_allocate(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_RAY_ALLOCATE);
+
+	const uint32_t count = surfel_count();
+	const uint32_t chunks = (count + SURFEL_CHUNK_SIZE - 1) / SURFEL_CHUNK_SIZE;
+	const float total = float(_stats[SURFEL_STATS_OFFSET_RAYDEMAND]) / SURFEL_RAY_DEMAND_SCALE;
+	const float scale = total > float(SURFEL_RAY_BUDGET) ? float(SURFEL_RAY_BUDGET) / total : 1.0f;
+
+	std::vector<uint32_t> rays(count);
+	std::vector<uint32_t> chunkRays(chunks, 0);
+	std::vector<uint32_t> chunkDemand(chunks, 0);
+	std::vector<uint32_t> chunkTrace(chunks, 0);
+
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, count);
+		for (uint32_t i = first; i < last; i++)
+		{
+			const uint32_t surfel_index = _aliveList[i];
+
+			const float demand = surfel_ray_demand(_surfels[surfel_index], _surfelData[surfel_index]);
+			chunkDemand[chunk] += uint32_t(demand * SURFEL_RAY_DEMAND_SCALE + 0.5f);
+
+			const float u = float(tea(surfel_index, input.frame) & 0xFFFFFF) / 16777216.0f;
+			rays[i] = std::min(uint32_t(demand * scale + u), SURFEL_RAYS_MAX);
+			chunkRays[chunk] += rays[i];
+		}
+	});
+
+	// The allocator value each chunk starts from
+	std::vector<uint32_t> allocators(chunks);
+	for (uint32_t chunk = 0; chunk < chunks; chunk++)
+	{
+		allocators[chunk] = _stats[SURFEL_STATS_OFFSET_RAYALLOCATOR];
+		_stats[SURFEL_STATS_OFFSET_RAYALLOCATOR] += chunkRays[chunk];
+		_stats[SURFEL_STATS_OFFSET_NEXTRAYDEMAND] += chunkDemand[chunk];
+	}
+
+	ThreadPool::get().parallel_for(0, chunks, 1, [&](size_t chunk) {
+		const uint32_t first = (uint32_t)chunk * SURFEL_CHUNK_SIZE;
+		const uint32_t last = std::min(first + SURFEL_CHUNK_SIZE, count);
+		uint32_t allocator = allocators[chunk];
+		for (uint32_t i = first; i < last; i++)
+		{
+			const uint32_t surfel_index = _aliveList[i];
+
+			const uint32_t offset = std::min(allocator, SURFEL_RAY_BUDGET);
+			const uint32_t end = std::min(offset + rays[i], SURFEL_RAY_BUDGET);
+			allocator += rays[i];
+
+			_rayRanges[surfel_index] = SurfelRayRange{ offset, end - offset };
+			std::fill(_rayQueue.begin() + offset, _rayQueue.begin() + end, surfel_index);
+
+			if (end > offset)
+				chunkTrace[chunk] = std::max(chunkTrace[chunk], end);
+		}
+	});
+
+	for (uint32_t chunk = 0; chunk < chunks; chunk++)
+		_stats[SURFEL_STATS_OFFSET_TRACE] = std::max(_stats[SURFEL_STATS_OFFSET_TRACE], chunkTrace[chunk]);
+
+	end_stage(STAGE_SURFEL_RAY_ALLOCATE, count);
+}
+
+SurfelShReport SurfelReference::sh_report(const SurfelFrameInput& input, uint32_t samples, uint32_t rays) const
+{
+	SurfelShReport report;
+
+	const uint32_t count = surfel_count();
+	const uint32_t stride = std::max(count / std::max(samples, 1u), 1u);
+	report.surfels = std::min(samples, count);
+
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+	std::vector<float> scalar((size_t)report.surfels * SURFEL_SH_TILTS, 0.0f);
+	std::vector<float> sh((size_t)report.surfels * SURFEL_SH_TILTS, 0.0f);
+
+	ThreadPool::get().parallel_for(0, report.surfels, 4, [&](size_t sample) {
+		const uint32_t surfel_index = _aliveList[sample * stride];
+		const Surfel& surfel = _surfels[surfel_index];
+		const glm::vec3 n = glm::normalize(surfel.normal);
+
+		// Cosine distributed about normal, seeded per surfel so the estimate and the truth use other rays
+		auto radiance = [&](const glm::vec3& normal, uint32_t r, uint32_t stream) {
+			const glm::vec3 direction = sample_cosine_hemisphere(normal, sample_float(sobol2_owen(r, tea(surfel_index, stream))));
+			bool bounced;
+			return std::make_pair(direction, trace_radiance(input, surfel.position + direction * 1e-2f, direction, bounced));
+		};
+
+		// Same fit as surfelshade.comp
+		glm::vec3 mean = glm::vec3(0.0f);
+		glm::vec3 moment[3] = { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f) };
+		for (uint32_t r = 0; r < rays; r++)
+		{
+			const std::pair<glm::vec3, glm::vec3> ray = radiance(n, r, 0);
+			mean += ray.second;
+			for (int axis = 0; axis < 3; axis++)
+				moment[axis] += ray.second * ray.first[axis];
+		}
+		mean /= float(rays);
+
+		const glm::vec3 momentN = moment[0] * n.x + moment[1] * n.y + moment[2] * n.z;
+		const float shScale = (8.0f / 3.0f) / float(rays);
+		const glm::vec3 shX = (moment[0] - momentN * n.x) * shScale;
+		const glm::vec3 shY = (moment[1] - momentN * n.y) * shScale;
+		const glm::vec3 shZ = (moment[2] - momentN * n.z) * shScale;
+
+		const glm::vec3 tangent = glm::normalize(glm::cross(n, glm::vec3(0.0f, 1.0f, 1.0f)));
+
+		for (uint32_t t = 0; t < SURFEL_SH_TILTS; t++)
+		{
+			const float angle = report.tilt[t] * SURFEL_PI / 180.0f;
+			const glm::vec3 tilted = glm::normalize(n * std::cos(angle) + tangent * std::sin(angle));
+
+			// Directions below the surface the surfel lies on are blocked by it
+			glm::vec3 truth = glm::vec3(0.0f);
+			for (uint32_t r = 0; r < rays * 4; r++)
+			{
+				const std::pair<glm::vec3, glm::vec3> ray = radiance(tilted, r, 1 + t);
+				if (glm::dot(ray.first, n) > 0)
+					truth += ray.second;
+			}
+			truth /= float(rays * 4);
+
+			const glm::vec3 fitted = glm::max(glm::vec3(0.0f), mean + shX * tilted.x + shY * tilted.y + shZ * tilted.z);
+			const float reference = std::max(glm::dot(luma, truth), 1e-3f);
+
+			scalar[sample * SURFEL_SH_TILTS + t] = std::abs(glm::dot(luma, mean) - glm::dot(luma, truth)) / reference;
+			sh[sample * SURFEL_SH_TILTS + t] = std::abs(glm::dot(luma, fitted) - glm::dot(luma, truth)) / reference;
+		}
+	});
+
+	for (uint32_t sample = 0; sample < report.surfels; sample++)
+	{
+		for (uint32_t t = 0; t < SURFEL_SH_TILTS; t++)
+		{
+			report.scalar[t] += scalar[sample * SURFEL_SH_TILTS + t] / float(report.surfels);
+			report.sh[t] += sh[sample * SURFEL_SH_TILTS + t] / float(report.surfels);
+		}
+	}
+
+	return report;
+}
+
+float SurfelReference::irradiance_error(const SurfelFrameInput& input, uint32_t samples, uint32_t rays) const
+{
+	const uint32_t count = surfel_count();
+	const uint32_t stride = std::max(count / std::max(samples, 1u), 1u);
+	const uint32_t surfels = std::min(samples, count);
+	if (surfels == 0)
+		return 0.0f;
+
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+	std::vector<float> error(surfels, 0.0f);
+
+	ThreadPool::get().parallel_for(0, surfels, 4, [&](size_t sample) {
+		const uint32_t surfel_index = _aliveList[sample * stride];
+		const Surfel& surfel = _surfels[surfel_index];
+		const glm::vec3 n = glm::normalize(surfel.normal);
+
+		// Its own stream, the rays of the frames are not reused
+		glm::vec3 truth = glm::vec3(0.0f);
+		for (uint32_t r = 0; r < rays; r++)
+		{
+			const glm::vec3 direction = sample_cosine_hemisphere(n, sample_float(sobol2_owen(r, tea(surfel_index, 0x5EED))));
+			bool bounced;
+			truth += trace_radiance(input, surfel.position + direction * 1e-2f, direction, bounced);
+		}
+		truth /= float(rays);
+
+		const float reference = std::max(glm::dot(luma, truth), 1e-3f);
+		const float relative = (glm::dot(luma, surfel.color) - glm::dot(luma, truth)) / reference;
+		error[sample] = relative * relative;
+	});
+
+	float sum = 0.0f;
+	for (float e : error)
+		sum += e;
+	return std::sqrt(sum / float(surfels));
+}
+
+SurfelSamplingReport SurfelReference::sampling_report(const SurfelFrameInput& input, uint32_t samples) const
+{
+	SurfelSamplingReport report;
+
+	// Irradiance estimates of single surfels as their rays come in over the frames
+	const uint32_t count = surfel_count();
+	const uint32_t stride = std::max(count / std::max(samples, 1u), 1u);
+	const uint32_t lastFrame = 1u << (SURFEL_SAMPLING_STEPS - 1);
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+	report.surfels = std::min(samples, count);
+
+	std::vector<float> hashed((size_t)report.surfels * SURFEL_SAMPLING_STEPS, 0.0f);
+	std::vector<float> sobol((size_t)report.surfels * SURFEL_SAMPLING_STEPS, 0.0f);
+
+	ThreadPool::get().parallel_for(0, report.surfels, 4, [&](size_t sample) {
+		const uint32_t surfel_index = _aliveList[sample * stride];
+		const Surfel& surfel = _surfels[surfel_index];
+		const glm::vec3 n = glm::normalize(surfel.normal);
+
+		auto radiance = [&](const glm::vec3& direction) {
+			bool bounced;
+			return glm::dot(luma, trace_radiance(input, surfel.position + direction * 1e-2f, direction, bounced));
+		};
+
+		float truth = 0.0f;
+		for (uint32_t r = 0; r < 1024; r++)
+			truth += radiance(sample_cosine_hemisphere(n, sample_float(sobol2_owen(r, tea(surfel_index, 2)))));
+		truth = std::max(truth / 1024.0f, 1e-3f);
+
+		float hashedSum = 0.0f;
+		float sobolSum = 0.0f;
+		uint32_t step = 0;
+
+		for (uint32_t frame = 0; frame < lastFrame; frame++)
+		{
+			for (uint32_t r = 0; r < SURFEL_SAMPLING_RAYS; r++)
+			{
+				float seed = fract(frame / 4096.0f) + (float(surfel_index) / float(SURFEL_CAPACITY)) * 3.43121412313f + float(r) * 0.2f;
+				hashedSum += radiance(glm::normalize(cosine_sample_hemisphere(n, seed)));
+				sobolSum += radiance(sample_cosine_hemisphere(n, surfel_ray_sample(surfel_index, r, frame)));
+			}
+
+			if (frame + 1 == (1u << step))
+			{
+				const float rays = float((frame + 1) * SURFEL_SAMPLING_RAYS);
+				hashed[sample * SURFEL_SAMPLING_STEPS + step] = std::pow((hashedSum / rays - truth) / truth, 2.0f);
+				sobol[sample * SURFEL_SAMPLING_STEPS + step] = std::pow((sobolSum / rays - truth) / truth, 2.0f);
+				step++;
+			}
+		}
+	});
+
+	for (uint32_t step = 0; step < SURFEL_SAMPLING_STEPS; step++)
+	{
+		for (uint32_t sample = 0; sample < report.surfels; sample++)
+		{
+			report.hashed[step] += hashed[sample * SURFEL_SAMPLING_STEPS + step];
+			report.sobol[step] += sobol[sample * SURFEL_SAMPLING_STEPS + step];
+		}
+		report.hashed[step] = std::sqrt(report.hashed[step] / std::max(report.surfels, 1u));
+		report.sobol[step] = std::sqrt(report.sobol[step] / std::max(report.surfels, 1u));
+	}
+
+	return report;
+}
+
+// surfel_cached_irradiance in surfelHit.rchit
+glm::vec4 SurfelReference::cached_irradiance(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& campos) const
+{
+	const uint32_t cellindex = surfel_lookup_cellindex(position, campos);
+	const SurfelGridCell cell = cellindex < _gridCells.size() ? _gridCells[cellindex] : SurfelGridCell{ 0, 0 };
+
+	glm::vec4 surfelGI = glm::vec4(0.0f);
+
+	for (uint32_t i = 0; i < cell.count; ++i)
+	{
+		const size_t slot = (size_t)cell.offset + i;
+		const uint32_t surfel_index = slot < _cellIndices.size() ? _cellIndices[slot] : 0;
+		const Surfel& surfel = _surfels[surfel_index];
+
+		const glm::vec3 L = surfel.position - position;
+		const float dist2 = glm::dot(L, L);
+		if (dist2 < (surfel.radius * surfel.radius))
+		{
+			const float dotN = glm::dot(normal, glm::normalize(surfel.normal));
+			if (dotN > 0)
+			{
+				float contribution = glsl_clamp(1 - std::sqrt(dist2) / surfel.radius, 0.0f, 1.0f);
+				contribution = smoothstep01(contribution);
+				contribution *= glsl_clamp(dotN, 0.0f, 1.0f);
+
+				surfelGI += glm::vec4(surfel_irradiance(surfel.color, _surfelData[surfel_index], normal), 1) * contribution;
+			}
+		}
+	}
+
+	return surfelGI;
+}
+
+// surfelHit.rchit + surfelMiss.rmiss, radiance of a ray leaving a surfel
+glm::vec3 SurfelReference::trace_radiance(const SurfelFrameInput& input, const glm::vec3& origin, const glm::vec3& direction, bool& bounced) const
+{
+	glm::vec3 colorAndDist = glm::vec3(0.0f);
+	glm::vec3 energy = glm::vec3(1.0f);
+	bounced = false;
+
+	SurfelRayHit hit;
+	if (input.tracer->trace(origin, direction, SURFEL_RAY_TMIN, SURFEL_RAY_TMAX, hit))
+	{
+		const glm::vec3 N = hit.normal;
+		const glm::vec3 worldPos = origin + direction * hit.t;
+
+		const glm::vec3 albedo = glm::pow(hit.albedo, glm::vec3(2.2f));
+		const glm::vec3 emissive = hit.emissive;
+
+		glm::vec3 result = glm::max(glm::vec3(0.0f), energy * emissive);
+		energy *= albedo;
+
+		// Like the shader these outlive a light that is out of range
+		float shadowFactor = 0.0f;
+		float dist = 0;
+		float NdotL = 0;
+		glm::vec3 lightning = glm::vec3(0);
+
+		for (const SurfelLight& light : input.lights)
+		{
+			const bool isDirectional = light.position.w < 0;
+			glm::vec3 L = isDirectional ? glm::vec3(light.position) : (glm::vec3(light.position) - worldPos);
+			const float light_max_distance = light.position.w;
+			const float light_intensity = isDirectional ? 1.0f : light.color.w;
+
+			const float dist2 = glm::dot(L, L);
+			const float range2 = light_max_distance * light_max_distance;
+			const float light_distance = glm::length(L);
+
+			if (dist2 < range2)
+			{
+				dist = std::sqrt(dist2);
+				L /= dist;
+				NdotL = glsl_clamp(0.0f, 1.0f, glm::dot(L, N));
+
+				if (NdotL > 0)
+				{
+					lightning = glm::vec3(light.color) * light_intensity;
+
+					const float att = glsl_clamp(0.0f, 1.0f, (1.0f - (dist2 / range2)));
+					lightning *= att * att;
+				}
+			}
+
+			if (NdotL > 0 && dist > 0)
+			{
+				const bool shadowed = input.tracer->occluded(worldPos + L * 0.01f, L, 0.001f, light_distance - 0.001f);
+				shadowFactor = shadowed ? 0.0f : 1.0f;
+			}
+
+			result += glm::max(glm::vec3(0), shadowFactor * energy * NdotL * lightning / SURFEL_PI);
+		}
+
+		const glm::vec4 surfelGI = cached_irradiance(worldPos, N, input.cameraPosition);
+		if (surfelGI.a > 0)
+		{
+			result += glsl_clamp(glm::vec3(0.0f), glm::vec3(1.0f), energy * glm::vec3(surfelGI) / surfelGI.a);
+			bounced = true;
+		}
+
+		colorAndDist += result;
+	}
+
+	return colorAndDist;
+}
+
+// surfelRayGen.rgen, one launch per entry of the ray queue.
+// The hits read surfel colors but nothing writes them until the shade stage, so there is no race.
+void SurfelReference::surfel_ray_tracing(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_RAY_TRACING);
+
+	const uint32_t count = std::min(_stats[SURFEL_STATS_OFFSET_TRACE], SURFEL_RAY_BUDGET);
+	const uint32_t frame = input.frame;
+	std::atomic<uint32_t> bounced(0);
+
+	ThreadPool::get().parallel_for(0, count, 256, [&](size_t ray) {
+		const uint32_t surfel_index = _rayQueue[ray];
+		const uint32_t sample_index = (uint32_t)ray - _rayRanges[surfel_index].offset;
+		const Surfel& surfel = _surfels[surfel_index];
+
+		const glm::vec3 n = glm::normalize(surfel.normal);
+
+		const glm::vec3 direction = sample_cosine_hemisphere(n, surfel_ray_sample(surfel_index, sample_index, frame));
+		const glm::vec3 origin = surfel.position + direction * 1e-2f;
+
+		bool hitSurfels;
+		_rays[ray].radiance = rgb9e5_encode(trace_radiance(input, origin, direction, hitSurfels));
+#if SURFEL_SH
+		_rays[ray].direction = oct_encode(direction);
+#endif
+		if (hitSurfels)
+			bounced++;
+	});
+
+	_bouncedRays = bounced;
+
+	end_stage(STAGE_SURFEL_RAY_TRACING, count);
+}
+
+// surfelshade.comp. Every invocation reads neighbour colors while others write
+// theirs, the reference reads the colors from before the pass.
+void SurfelReference::surfel_shade(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_SHADE);
+
+	const uint32_t count = std::min(_stats[SURFEL_STATS_OFFSET_COUNT], SURFEL_CAPACITY);
+	const std::vector<Surfel> snapshot(_surfels.begin(), _surfels.end());
+	const glm::vec3 campos = input.cameraPosition;
+
+	auto cell_surfel = [&](uint32_t cellindex, uint32_t i) {
+		const size_t slot = (size_t)_gridCells[cellindex].offset + i;
+		const uint32_t index = slot < _cellIndices.size() ? _cellIndices[slot] : 0;
+		return index < snapshot.size() ? snapshot[index] : Surfel{};
+	};
+
+	auto cell_count = [&](uint32_t cellindex) {
+		return cellindex < _gridCells.size() ? _gridCells[cellindex].count : 0u;
+	};
+
+	ThreadPool::get().parallel_for(0, count, 256, [&](size_t index) {
+		const uint32_t surfel_index = _aliveList[index];
+
+		// Surfels without rays this frame keep their estimate
+		const SurfelRayRange range = _rayRanges[surfel_index];
+		if (range.count == 0)
+			return;
+
+		SurfelData surfel_data = _surfelData[surfel_index];
+		const Surfel& surfel = snapshot[surfel_index];
+
+		glm::vec3 traced = glm::vec3(0.0f);
+#if SURFEL_SH
+		glm::vec3 moment[3] = { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec3(0.0f) };
+#endif
+
+		for (uint32_t r = 0; r < range.count; ++r)
+		{
+			const SurfelRay& ray = _rays[range.offset + r];
+			const glm::vec3 radiance = rgb9e5_decode(ray.radiance);
+
+			traced += radiance;
+#if SURFEL_SH
+			const glm::vec3 direction = oct_decode(ray.direction);
+			for (int axis = 0; axis < 3; axis++)
+				moment[axis] += radiance * direction[axis];
+#endif
+		}
+
+		glm::vec4 result = glm::vec4(traced / float(range.count), 1.0f);
+
+		const glm::vec3 surfpos = surfel.position;
+		const glm::vec3 surfN = glm::normalize(surfel.normal);
+		const float surfrad = surfel.radius;
+
+		// The cell the surfel itself was binned into
+		const uint32_t cascade = surfel_cascade(surfel, campos);
+		const uint32_t cellindex = cascade < SURFEL_CASCADE_COUNT ? surfel_cellindex(surfel_cell(surfpos, cascade), cascade) : SURFEL_TABLE_SIZE;
+		const uint32_t cellcount = cell_count(cellindex);
+
+		for (uint32_t i = 0; i < cellcount; ++i)
+		{
+			Surfel surfel2 = cell_surfel(cellindex, i);
+			surfel2.radius += surfrad;
+
+			const glm::vec3 L = surfel2.position - surfpos;
+			const float dist2 = glm::dot(L, L);
+			if (dist2 < (surfel2.radius * surfel2.radius))
+			{
+				const glm::vec3 normal = glm::normalize(surfel2.normal);
+				const float dotN = glm::dot(surfN, normal);
+				if (dotN > 0)
+				{
+					const float dist = std::sqrt(dist2);
+					float contribution = 1;
+
+					contribution *= glsl_clamp(1 - dist / surfel2.radius, 0.0f, 1.0f);
+					contribution = smoothstep01(contribution);
+					contribution *= glsl_clamp(dotN, 0.0f, 1.0f);
+
+					result += glm::vec4(surfel2.color, 1) * contribution;
+				}
+			}
+		}
+
+		multiscale_mean_estimator(glm::vec3(result) / result.a, surfel_data);
+
+#if SURFEL_SH
+		const glm::vec3 momentN = moment[0] * surfN.x + moment[1] * surfN.y + moment[2] * surfN.z;
+		const float shScale = (8.0f / 3.0f) / float(range.count);
+		const float shBlend = std::max(SURFEL_SH_BLEND, 1.0f / float(std::max(surfel.age, 1u)));
+
+		surfel_data.shX = glm::mix(surfel_data.shX, (moment[0] - momentN * surfN.x) * shScale, shBlend);
+		surfel_data.shY = glm::mix(surfel_data.shY, (moment[1] - momentN * surfN.y) * shScale, shBlend);
+		surfel_data.shZ = glm::mix(surfel_data.shZ, (moment[2] - momentN * surfN.z) * shScale, shBlend);
+#endif
+
+		_surfelData[surfel_index] = quantize_surfel_data(surfel_data);
+		_surfels[surfel_index].color = quantize_surfel_color(surfel_data.mean);
+	});
+
+	end_stage(STAGE_SURFEL_SHADE, count);
+}
+
+static float surfel_filter_confidence(const Surfel& surfel, const SurfelData& data)
+{
+	const glm::vec3 luma = glm::vec3(0.299f, 0.587f, 0.114f);
+
+	const float warmup = std::min(float(std::max(surfel.age, 1u)) / float(SURFEL_RAY_WARMUP), 1.0f);
+	const float mean = std::max(glm::dot(luma, data.shortMean), 1e-2f);
+	const float relativeVariance = glm::dot(luma, glm::max(glm::vec3(0.0f), data.variance)) / (mean * mean);
+
+	return warmup / (SURFEL_FILTER_VARIANCE + relativeVariance);
+}
+
+static float surfel_filter_weight(const Surfel& surfel, const Surfel& neighbour, float cellsize)
+{
+	const glm::vec3 L = neighbour.position - surfel.position;
+	const float dist = glm::length(L);
+	if (dist >= cellsize)
+		return 0.0f;
+
+	const float dotN = glm::dot(surfel.normal, neighbour.normal);
+	if (dotN <= 0.0f)
+		return 0.0f;
+
+	float weight = smoothstep01(1.0f - dist / cellsize);
+	weight *= std::pow(dotN, SURFEL_FILTER_NORMAL_POWER);
+	weight *= glsl_clamp(1.0f - std::abs(glm::dot(surfel.normal, L)) / (SURFEL_FILTER_PLANE * cellsize), 0.0f, 1.0f);
+	return weight;
+}
+
+// surfelFilter.comp: the mean of every alive surfel blended with the means of its neighbours in
+// the same cascade, weighted by confidence, into the surfel color. Only colors are written, the
+// positions and normals come from a snapshot so the order of the surfels doesn't matter.
+void SurfelReference::surfel_filter(const SurfelFrameInput& input)
+{
+	begin_stage(STAGE_SURFEL_FILTER);
+
+	const uint32_t count = std::min(_stats[SURFEL_STATS_OFFSET_COUNT], SURFEL_CAPACITY);
+	const std::vector<Surfel> snapshot(_surfels.begin(), _surfels.end());
+	const glm::vec3 campos = input.cameraPosition;
+
+	ThreadPool::get().parallel_for(0, count, 256, [&](size_t index) {
+		const uint32_t surfel_index = _aliveList[index];
+		const Surfel& surfel = snapshot[surfel_index];
+		const SurfelData& surfel_data = _surfelData[surfel_index];
+
+		const uint32_t cascade = surfel_cascade(surfel, campos);
+		if (cascade >= SURFEL_CASCADE_COUNT)
+			return;
+
+		const float cellsize = surfel_cascade_cellsize(cascade);
+		const glm::ivec3 gridpos = surfel_cell(surfel.position, cascade);
+
+		glm::vec4 result = glm::vec4(surfel_data.mean, 1.0f) * surfel_filter_confidence(surfel, surfel_data);
+
+		for (uint32_t i = 0; i < 27; ++i)
+		{
+			const glm::ivec3 cell = gridpos + glm::ivec3(surfel_neighbor_offsets[i]);
+			if (!surfel_cellvalid(cell, cascade, campos))
+				continue;
+
+			const SurfelGridCell& gridcell = _gridCells[surfel_cellindex(cell, cascade)];
+			for (uint32_t j = 0; j < gridcell.count; ++j)
+			{
+				const size_t slot = (size_t)gridcell.offset + j;
+				const uint32_t neighbour_index = slot < _cellIndices.size() ? _cellIndices[slot] : surfel_index;
+				if (neighbour_index == surfel_index || neighbour_index >= snapshot.size())
+					continue;
+
+				// Visited from its own cell only, it is listed in every cell it overlaps
+				const Surfel& neighbour = snapshot[neighbour_index];
+				if (surfel_cascade(neighbour, campos) != cascade || surfel_cell(neighbour.position, cascade) != cell)
+					continue;
+
+				const float weight = surfel_filter_weight(surfel, neighbour, cellsize);
+				if (weight > 0.0f)
+				{
+					const SurfelData& neighbour_data = _surfelData[neighbour_index];
+					result += glm::vec4(neighbour_data.mean, 1.0f) * weight * surfel_filter_confidence(neighbour, neighbour_data);
+				}
+			}
+		}
+
+		_surfels[surfel_index].color = quantize_surfel_color(glm::vec3(result) / std::max(result.a, 1e-6f));
+	});
+
+	end_stage(STAGE_SURFEL_FILTER, count);
+}
+
+//------------------------------------------------------------------- Comparison
+
+static float max_component_error(const glm::vec3& a, const glm::vec3& b)
+{
+	const glm::vec3 diff = glm::abs(a - b);
+	return std::max(diff.x, std::max(diff.y, diff.z));
+}
+
+SurfelCompareResult SurfelReference::compare_surfels(const Surfel* gpu, uint32_t count, float epsilon) const
+{
+	SurfelCompareResult result;
+	count = std::min(count, (uint32_t)_surfels.size());
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const Surfel& a = _surfels[i];
+		const Surfel& b = gpu[i];
+
+		float error = max_component_error(a.position, b.position);
+		error = std::max(error, max_component_error(a.normal, b.normal));
+		error = std::max(error, max_component_error(a.color, b.color));
+		error = std::max(error, std::abs(a.radius - b.radius));
+
+		result.maxError = std::max(result.maxError, error);
+		if (!(error <= epsilon))
+		{
+			result.firstMismatch = std::min(result.firstMismatch, i);
+			result.mismatches++;
+		}
+	}
+
+	return result;
+}
+
+SurfelCompareResult SurfelReference::compare_surfel_data(const SurfelData* gpu, uint32_t count, float epsilon) const
+{
+	SurfelCompareResult result;
+	count = std::min(count, (uint32_t)_surfelData.size());
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const SurfelData& a = _surfelData[i];
+		const SurfelData& b = gpu[i];
+
+		float error = max_component_error(a.mean, b.mean);
+		error = std::max(error, max_component_error(a.shortMean, b.shortMean));
+		error = std::max(error, max_component_error(a.variance, b.variance));
+		error = std::max(error, std::abs(a.vbbr - b.vbbr));
+		error = std::max(error, std::abs(a.inconsistency - b.inconsistency));
+#if SURFEL_SH
+		error = std::max(error, max_component_error(a.shX, b.shX));
+		error = std::max(error, max_component_error(a.shY, b.shY));
+		error = std::max(error, max_component_error(a.shZ, b.shZ));
+#endif
+
+		result.maxError = std::max(result.maxError, error);
+		if (!(error <= epsilon))
+		{
+			result.firstMismatch = std::min(result.firstMismatch, i);
+			result.mismatches++;
+		}
+	}
+
+	return result;
+}
+
+SurfelGridReport SurfelReference::grid_report(const glm::vec3& campos) const
+{
+	SurfelGridReport report;
+
+	// The layout before the prefix sum, SURFEL_CELL_LIMIT slots per cell, surfels past the limit dropped
+	const uint32_t count = surfel_count();
+	std::vector<uint32_t> denseCount(SURFEL_TABLE_SIZE, 0);
+	std::vector<uint32_t> dense((size_t)SURFEL_TABLE_SIZE * SURFEL_CELL_LIMIT);
+
+	for (uint32_t alive = 0; alive < count; alive++)
+	{
+		const uint32_t surfel_index = _aliveList[alive];
+		const Surfel& surfel = _surfels[surfel_index];
+		const uint32_t cascade = surfel_cascade(surfel, campos);
+
+		for (uint32_t c = surfel_position_cascade(surfel.position, campos); c <= cascade; c++)
+		{
+			const glm::ivec3 gridpos = surfel_cell(surfel.position, c);
+
+			for (uint32_t i = 0; i < 27; ++i)
+			{
+				const glm::ivec3 gridpos2 = glm::ivec3(glm::vec3(gridpos) + surfel_neighbor_offsets[i]);
+				if (surfel_cellintersects(surfel, gridpos2, c, campos))
+				{
+					const uint32_t cellindex = surfel_cellindex(gridpos2, c);
+					const uint32_t slot = denseCount[cellindex]++;
+					if (slot < SURFEL_CELL_LIMIT)
+						dense[(size_t)cellindex * SURFEL_CELL_LIMIT + slot] = surfel_index;
+				}
+			}
+		}
+	}
+
+	std::vector<uint32_t> sparseSet;
+	std::vector<uint32_t> denseSet;
+	for (uint32_t cellindex = 0; cellindex < SURFEL_TABLE_SIZE; cellindex++)
+	{
+		const SurfelGridCell& cell = _gridCells[cellindex];
+		if (cell.count == 0 && denseCount[cellindex] == 0)
+			continue;
+
+		report.overlaps += cell.count;
+		report.occupiedCells++;
+		report.maxCellCount = std::max(report.maxCellCount, cell.count);
+
+		if (denseCount[cellindex] > SURFEL_CELL_LIMIT)
+		{
+			report.overflowCells++;
+			continue;
+		}
+
+		if (cell.count != denseCount[cellindex] || (size_t)cell.offset + cell.count > _cellIndices.size())
+		{
+			report.mismatches++;
+			continue;
+		}
+
+		sparseSet.assign(_cellIndices.begin() + cell.offset, _cellIndices.begin() + cell.offset + cell.count);
+		denseSet.assign(dense.begin() + (size_t)cellindex * SURFEL_CELL_LIMIT, dense.begin() + (size_t)cellindex * SURFEL_CELL_LIMIT + cell.count);
+		std::sort(sparseSet.begin(), sparseSet.end());
+		std::sort(denseSet.begin(), denseSet.end());
+		if (sparseSet != denseSet)
+			report.mismatches++;
+	}
+
+	const uint64_t gridBytes = sizeof(SurfelGridCell) * (uint64_t)SURFEL_TABLE_SIZE;
+	report.denseBytes = sizeof(uint32_t) * (uint64_t)SURFEL_TABLE_SIZE * (SURFEL_CELL_LIMIT + 1);
+	report.sparseBytes = gridBytes + sizeof(uint32_t) * report.overlaps;
+	report.gpuBytes = gridBytes + sizeof(uint32_t) * (uint64_t)SURFEL_CELL_INDEX_CAPACITY;
+
+	return report;
+}
+
+// Set associative LRU cache, the ways of a set from the most to the least recently used
+struct LocalityCache
+{
+	std::vector<uint64_t>	lines;
+	uint64_t				accesses{ 0 };
+	uint64_t				misses{ 0 };
+
+	LocalityCache() : lines((size_t)SURFEL_LOCALITY_SETS * SURFEL_LOCALITY_WAYS, UINT64_MAX) {}
+
+	void access(uint64_t address)
+	{
+		const uint64_t line = address / SURFEL_LOCALITY_LINE;
+		uint64_t* set = &lines[(line % SURFEL_LOCALITY_SETS) * SURFEL_LOCALITY_WAYS];
+
+		uint32_t way = 0;
+		while (way < SURFEL_LOCALITY_WAYS - 1 && set[way] != line)
+			way++;
+		if (set[way] != line)
+			misses++;
+		for (; way > 0; way--)
+			set[way] = set[way - 1];
+		set[0] = line;
+		accesses++;
+	}
+};
+
+// Row major slot of a world cell, what surfel_cellindex was before the Morton order
+static uint32_t surfel_cellindex_linear(const glm::ivec3& cell, uint32_t cascade)
+{
+	const glm::uvec3 coord = glm::uvec3(
+		(uint32_t)cell.x & (SURFEL_GRID_DIMENSIONS.x - 1),
+		(uint32_t)cell.y & (SURFEL_GRID_DIMENSIONS.y - 1),
+		(uint32_t)cell.z & (SURFEL_GRID_DIMENSIONS.z - 1));
+	return cascade * SURFEL_CASCADE_SIZE + (coord.z * SURFEL_GRID_DIMENSIONS.y + coord.y) * SURFEL_GRID_DIMENSIONS.x + coord.x;
+}
+
+SurfelLocalityReport SurfelReference::locality_report(const glm::vec3& campos) const
+{
+	SurfelLocalityReport report;
+
+	std::vector<uint8_t> taken(SURFEL_CASCADE_SIZE, 0);
+	for (uint32_t z = 0; z < SURFEL_GRID_DIMENSIONS.z; z++)
+	{
+		for (uint32_t y = 0; y < SURFEL_GRID_DIMENSIONS.y; y++)
+		{
+			for (uint32_t x = 0; x < SURFEL_GRID_DIMENSIONS.x; x++)
+			{
+				const uint32_t morton = surfel_morton(glm::uvec3(x, y, z), SURFEL_GRID_DIMENSIONS);
+				if (morton >= SURFEL_CASCADE_SIZE || taken[morton]++)
+					report.mortonCollisions++;
+			}
+		}
+	}
+
+	// Bin the surfels like surfel_binning, the lists keyed by the Morton slot and counted in both layouts
+	const uint32_t count = surfel_count();
+	std::vector<uint32_t> mortonOffset(SURFEL_TABLE_SIZE + 1, 0);
+	std::vector<uint32_t> linearOffset(SURFEL_TABLE_SIZE + 1, 0);
+	std::vector<uint32_t> overlaps;
+
+	for (uint32_t alive = 0; alive < count; alive++)
+	{
+		const uint32_t surfel_index = _aliveList[alive];
+		const Surfel& surfel = _surfels[surfel_index];
+		const uint32_t cascade = surfel_cascade(surfel, campos);
+		const glm::ivec3 gridpos = surfel_cell(surfel.position, cascade);
+
+		for (uint32_t i = 0; i < 27; ++i)
+		{
+			const glm::ivec3 gridpos2 = glm::ivec3(glm::vec3(gridpos) + surfel_neighbor_offsets[i]);
+			if (surfel_cellintersects(surfel, gridpos2, cascade, campos))
+			{
+				const uint32_t cellindex = surfel_cellindex(gridpos2, cascade);
+				mortonOffset[cellindex + 1]++;
+				linearOffset[surfel_cellindex_linear(gridpos2, cascade) + 1]++;
+				overlaps.push_back(cellindex);
+				overlaps.push_back(surfel_index);
+			}
+		}
+	}
+
+	for (uint32_t cellindex = 0; cellindex < SURFEL_TABLE_SIZE; cellindex++)
+	{
+		mortonOffset[cellindex + 1] += mortonOffset[cellindex];
+		linearOffset[cellindex + 1] += linearOffset[cellindex];
+	}
+
+	std::vector<uint32_t> cellSurfels(overlaps.size() / 2);
+	std::vector<uint32_t> cellFill(mortonOffset.begin(), mortonOffset.end() - 1);
+	for (size_t i = 0; i < overlaps.size(); i += 2)
+		cellSurfels[cellFill[overlaps[i]]++] = overlaps[i + 1];
+
+	// Each buffer gets its own range of addresses
+	const uint64_t SURFELS = 1ull << 40;
+	const uint64_t DATA = 2ull << 40;
+	const uint64_t GRID = 3ull << 40;
+	const uint64_t CELLS = 4ull << 40;
+
+	// threads holds the surfel each thread shades, slots where each surfel is stored
+	auto replay = [&](const std::vector<uint32_t>& threads, const std::vector<uint32_t>& slots, bool morton) {
+		const std::vector<uint32_t>& offsets = morton ? mortonOffset : linearOffset;
+		LocalityCache cache;
+
+		for (uint32_t surfel_index : threads)
+		{
+			cache.access(SURFELS + (uint64_t)slots[surfel_index] * sizeof(SurfelStorage));
+			cache.access(DATA + (uint64_t)slots[surfel_index] * sizeof(SurfelDataStorage));
+
+			const Surfel& surfel = _surfels[surfel_index];
+			const uint32_t cascade = surfel_cascade(surfel, campos);
+			if (cascade >= SURFEL_CASCADE_COUNT)
+				continue;
+
+			const glm::ivec3 gridpos = surfel_cell(surfel.position, cascade);
+			for (uint32_t i = 0; i < 27; ++i)
+			{
+				const glm::ivec3 cell = glm::ivec3(glm::vec3(gridpos) + surfel_neighbor_offsets[i]);
+				if (!surfel_cellvalid(cell, cascade, campos))
+					continue;
+
+				const uint32_t cellindex = surfel_cellindex(cell, cascade);
+				const uint32_t slot = morton ? cellindex : surfel_cellindex_linear(cell, cascade);
+				cache.access(GRID + (uint64_t)slot * sizeof(SurfelGridCell));
+
+				for (uint32_t j = mortonOffset[cellindex]; j < mortonOffset[cellindex + 1]; j++)
+				{
+					cache.access(CELLS + (uint64_t)(offsets[slot] + j - mortonOffset[cellindex]) * sizeof(uint32_t));
+					cache.access(SURFELS + (uint64_t)slots[cellSurfels[j]] * sizeof(SurfelStorage));
+				}
+			}
+		}
+
+		report.accesses = cache.accesses;
+		return cache.accesses > 0 ? (float)cache.misses / cache.accesses : 0.0f;
+	};
+
+	std::vector<uint32_t> stored(_aliveList.begin(), _aliveList.begin() + count);
+	std::vector<uint32_t> slots(SURFEL_CAPACITY);
+	for (uint32_t i = 0; i < SURFEL_CAPACITY; i++)
+		slots[i] = i;
+
+	report.surfels = count;
+	report.storedLinear = replay(stored, slots, false);
+	report.storedMorton = replay(stored, slots, true);
+
+	// After the sort the alive list is 0 .. count - 1, thread i shades the surfel sorted to slot i
+	const std::vector<uint32_t> sorted = sort_order(campos);
+	for (uint32_t slot = 0; slot < count; slot++)
+		slots[sorted[slot]] = slot;
+	report.sortedMorton = replay(sorted, slots, true);
+
+	return report;
+}
+
+std::vector<uint32_t> SurfelReference::cascade_histogram(const glm::vec3& campos) const
+{
+	std::vector<uint32_t> histogram(SURFEL_CASCADE_COUNT + 1, 0);
+	for (uint32_t i = 0; i < surfel_count(); i++)
+		histogram[surfel_cascade(_surfels[_aliveList[i]], campos)]++;
+	return histogram;
+}
+
+SurfelPoolReport SurfelReference::pool_report() const
+{
+	SurfelPoolReport report;
+	report.alive = surfel_count();
+	report.free = std::min(_stats[SURFEL_STATS_OFFSET_DEADCOUNT], SURFEL_CAPACITY);
+	report.spawned = _spawned;
+	report.recycled = _recycled;
+
+	std::vector<uint8_t> owners(SURFEL_BUDGET, 0);
+	auto visit = [&](uint32_t surfel_index) {
+		if (surfel_index >= SURFEL_BUDGET || owners[surfel_index]++ > 0)
+			report.duplicates++;
+	};
+
+	for (uint32_t i = 0; i < report.alive; i++)
+		visit(_aliveList[i]);
+	for (uint32_t i = 0; i < report.free; i++)
+		visit(_deadList[i]);
+
+	for (uint8_t owner : owners)
+		if (owner == 0)
+			report.lost++;
+
+	return report;
+}
+
+SurfelRayReport SurfelReference::ray_report() const
+{
+	SurfelRayReport report;
+	report.surfels = surfel_count();
+	report.bounced = _bouncedRays;
+
+	for (uint32_t i = 0; i < report.surfels; i++)
+	{
+		const uint32_t surfel_index = _aliveList[i];
+		const uint32_t rays = _rayRanges[surfel_index].count;
+
+		report.rays += rays;
+		if (rays == 0)
+			report.idle++;
+		if (_surfels[surfel_index].age < SURFEL_RAY_WARMUP)
+		{
+			report.warming++;
+			report.warmingRays += rays;
+		}
+	}
+
+	return report;
+}
+
+bool SurfelReference::save_cache(const std::string& path, uint64_t sceneKey) const
+{
+	const SurfelCacheHeader header = SurfelCache::layout(sceneKey, SurfelConfig());
+	std::vector<uint8_t> image((size_t)header.fileSize, 0);
+
+	auto put = [&](const SurfelCacheSection& s, const void* data, size_t elementSize) {
+		memcpy(image.data() + s.offset, data, (size_t)(s.count * elementSize));
+	};
+
+	std::vector<SurfelStorage> surfels(_surfels.size());
+	std::vector<SurfelDataStorage> surfelData(_surfelData.size());
+	std::transform(_surfels.begin(), _surfels.end(), surfels.begin(), store_surfel);
+	std::transform(_surfelData.begin(), _surfelData.end(), surfelData.begin(), store_surfel_data);
+
+	put(header.surfels, surfels.data(), sizeof(SurfelStorage));
+	put(header.surfelData, surfelData.data(), sizeof(SurfelDataStorage));
+	put(header.stats, _stats.data(), sizeof(uint32_t));
+	put(header.alive, _aliveList.data(), sizeof(uint32_t));
+	put(header.dead, _deadList.data(), sizeof(uint32_t));
+
+	return SurfelCache::write(path, header, image.data());
+}
+
+bool SurfelReference::load_cache(const std::string& path, uint64_t sceneKey)
+{
+	SurfelCache cache;
+	if (!cache.load(path, sceneKey, SurfelConfig()))
+		return false;
+
+	const SurfelCacheHeader& header = *cache._header;
+	for (uint64_t i = 0; i < header.surfels.count; i++)
+		_surfels[i] = unpack_surfel(cache.surfels()[i]);
+	for (uint64_t i = 0; i < header.surfelData.count; i++)
+		_surfelData[i] = unpack_surfel_data(cache.surfelData()[i]);
+	std::copy(cache.stats(), cache.stats() + header.stats.count, _stats.begin());
+	std::copy(cache.alive(), cache.alive() + header.alive.count, _aliveList.begin());
+	std::copy(cache.dead(), cache.dead() + header.dead.count, _deadList.begin());
+	drop_grid();
+	return true;
+}
+
+void SurfelReference::drop_grid()
+{
+	std::fill(_gridCells.begin(), _gridCells.end(), SurfelGridCell{});
+	_cellIndices.clear();
+	_stats[SURFEL_STATS_OFFSET_CELLALLOCATOR] = SURFEL_GRID_UNBUILT;
+}
+
+void SurfelReference::print_timings() const
+{
+	std::cout << std::left << std::setw(20) << "stage" << std::right << std::setw(12) << "ms" << std::setw(16) << "items/s" << std::endl;
+	for (const SurfelStageTiming& timing : _timings)
+	{
+		if (timing.items == 0)
+			continue;
+
+		std::cout << std::left << std::setw(20) << timing.name << std::right << std::fixed
+			<< std::setprecision(3) << std::setw(12) << timing.milliseconds
+			<< std::setprecision(0) << std::setw(16) << timing.items_per_second() << std::endl;
+	}
+}
+
+//------------------------------------------------------------------- Benchmark
+
+// Cornell box made of axis aligned boxes, enough to exercise every stage
+class BoxSceneTracer : public SurfelTracer
+{
+public:
+	struct Box
+	{
+		glm::vec3	min;
+		glm::vec3	max;
+		glm::vec3	albedo;
+		glm::vec3	emissive;
+	};
+
+	std::vector<Box> _boxes;
+
+	BoxSceneTracer()
+	{
+		const glm::vec3 white = glm::vec3(0.8f);
+		const glm::vec3 red = glm::vec3(0.8f, 0.1f, 0.1f);
+		const glm::vec3 green = glm::vec3(0.1f, 0.8f, 0.1f);
+		const glm::vec3 none = glm::vec3(0.0f);
+
+		_boxes.push_back({ glm::vec3(-6, -1, -6), glm::vec3(6, 0, 6), white, none });		// floor
+		_boxes.push_back({ glm::vec3(-6, 10, -6), glm::vec3(6, 11, 6), white, none });		// ceiling
+		_boxes.push_back({ glm::vec3(-6, 0, -6), glm::vec3(6, 10, -5), white, none });		// back
+		_boxes.push_back({ glm::vec3(-6, 0, -5), glm::vec3(-5, 10, 6), red, none });		// left
+		_boxes.push_back({ glm::vec3(5, 0, -5), glm::vec3(6, 10, 6), green, none });		// right
+		_boxes.push_back({ glm::vec3(-1.5f, 9.9f, -1.5f), glm::vec3(1.5f, 10, 1.5f), white, glm::vec3(4.0f) });	// lamp
+		_boxes.push_back({ glm::vec3(-3.5f, 0, -3.0f), glm::vec3(-0.5f, 6, 0.0f), white, none });
+		_boxes.push_back({ glm::vec3(0.5f, 0, 0.0f), glm::vec3(3.5f, 3, 3.0f), white, none });
+	}
+
+	bool intersect(const Box& box, const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, float& t, glm::vec3& normal) const
+	{
+		const glm::vec3 inv = 1.0f / direction;
+		const glm::vec3 t0 = (box.min - origin) * inv;
+		const glm::vec3 t1 = (box.max - origin) * inv;
+		const glm::vec3 tnear = glm::min(t0, t1);
+		const glm::vec3 tfar = glm::max(t0, t1);
+
+		const float enter = std::max(tnear.x, std::max(tnear.y, tnear.z));
+		const float exit = std::min(tfar.x, std::min(tfar.y, tfar.z));
+		if (enter > exit || enter < tmin || enter > tmax)
+			return false;
+
+		t = enter;
+		if (enter == tnear.x)
+			normal = glm::vec3(direction.x > 0 ? -1 : 1, 0, 0);
+		else if (enter == tnear.y)
+			normal = glm::vec3(0, direction.y > 0 ? -1 : 1, 0);
+		else
+			normal = glm::vec3(0, 0, direction.z > 0 ? -1 : 1);
+		return true;
+	}
+
+	bool trace(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, SurfelRayHit& hit) const override
+	{
+		bool found = false;
+		for (const Box& box : _boxes)
+		{
+			float t;
+			glm::vec3 normal;
+			if (intersect(box, origin, direction, tmin, tmax, t, normal))
+			{
+				tmax = t;
+				hit.t = t;
+				hit.normal = normal;
+				hit.albedo = box.albedo;
+				hit.emissive = box.emissive;
+				hit.metallic = 0;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax) const override
+	{
+		float t;
+		glm::vec3 normal;
+		for (const Box& box : _boxes)
+			if (intersect(box, origin, direction, tmin, tmax, t, normal))
+				return true;
+		return false;
+	}
+};
+
+int SurfelReference::benchmark(uint32_t width, uint32_t height, uint32_t frames)
+{
+	std::cout << "Surfel reference benchmark " << width << "x" << height << ", " << frames << " frames, "
+		<< ThreadPool::get().size() + 1 << " threads" << std::endl;
+
+	BoxSceneTracer scene;
+
+	// Same matrices VulkanEngine::render builds for GPUCameraData
+	Camera camera(glm::vec3(0, 5, 16));
+	glm::mat4 projection = camera.getProjection((float)width / (float)height);
+	projection[1][1] *= -1;
+
+	SurfelFrameInput input;
+	input.width = width;
+	input.height = height;
+	input.view = camera.getView();
+	input.cameraPosition = camera._position;
+	input.projection = projection;
+	input.near = 0.1f;
+	input.far = 200.0f;
+	input.tracer = &scene;
+	input.lights.push_back({ glm::vec4(0, 9.5f, 0, 25.0f), glm::vec4(1, 1, 1, 4.0f) });
+
+	// Rasterize the G-buffer by casting primary rays
+	std::vector<glm::vec4> normals((size_t)width * height);
+	std::vector<float> depth((size_t)width * height);
+	const glm::mat4 viewProj = input.projection * input.view;
+	const glm::mat4 invViewProj = glm::inverse(viewProj);
+
+	ThreadPool::get().parallel_for(0, height, 8, [&](size_t y) {
+		for (uint32_t x = 0; x < width; x++)
+		{
+			const glm::vec2 uv = (glm::vec2(x, y) + 0.5f) / glm::vec2(width, height);
+			const glm::vec3 origin = reconstruct_position(uv, 0.0f, invViewProj);
+			const glm::vec3 target = reconstruct_position(uv, 1.0f, invViewProj);
+			const glm::vec3 direction = glm::normalize(target - origin);
+
+			SurfelRayHit hit;
+			const size_t pixel = y * width + x;
+			if (scene.trace(origin, direction, 0.0f, 1000.0f, hit))
+			{
+				const glm::vec4 clip = viewProj * glm::vec4(origin + direction * hit.t, 1.0f);
+				normals[pixel] = glm::vec4(hit.normal * 0.5f + 0.5f, 1.0f);
+				depth[pixel] = clip.z / clip.w;
+			}
+			else
+			{
+				normals[pixel] = glm::vec4(0.0f);
+				depth[pixel] = 1.0f;
+			}
+		}
+	});
+
+	// blueNoise.png is not loaded headless, hashed white noise drives the spawn chance instead
+	std::vector<glm::vec4> noise(128 * 128);
+	for (uint32_t i = 0; i < noise.size(); i++)
+	{
+		noise[i] = glm::vec4(
+			(tea(i, 0) & 0xFFFF) / 65535.0f,
+			(tea(i, 1) & 0xFFFF) / 65535.0f,
+			(tea(i, 2) & 0xFFFF) / 65535.0f,
+			1.0f);
+	}
+
+	input.normals = normals.data();
+	input.depth = depth.data();
+	input.blueNoise = noise.data();
+	input.blueNoiseWidth = 128;
+	input.blueNoiseHeight = 128;
+
+	// A second reference runs the spatial filter on the same frames, both are measured after 1, 2, 4 ... frames
+	SurfelReference reference;
+	SurfelReference filtered;
+	filtered._filter = true;
+
+	// The stats readback ring over plain memory: every frame is copied in at its end and read as many
+	// frames later as the renderer has in flight
+	const uint32_t readbackLag = 2;
+	std::vector<uint32_t> readbackMemory((size_t)(readbackLag + 1) * SURFEL_STATS_SIZE);
+	SurfelStatsRing readback;
+	readback.init(readbackMemory.data(), readbackLag + 1);
+	std::vector<SurfelFrameStats> telemetry;
+
+	std::vector<uint32_t> convergenceFrames;
+	std::vector<std::pair<float, float>> convergence;
+	SurfelLocalityReport locality;
+	for (uint32_t frame = 0; frame < frames; frame++)
+	{
+		input.frame = frame;
+		reference.run_frame(input);
+		filtered.run_frame(input);
+
+		const uint32_t slot = readback.begin_frame(frame);
+		std::copy(reference._stats.begin(), reference._stats.end(), readbackMemory.begin() + (size_t)slot * SURFEL_STATS_SIZE);
+		if (frame >= readbackLag)
+			readback.collect(frame - readbackLag, telemetry);
+
+		// Taken the frame before each sort, when the surfels are stored as they spawned since the last one
+		if (reference._stats[SURFEL_STATS_OFFSET_SORTCLOCK] == SURFEL_SORT_INTERVAL - 1 || (frame + 1 == frames && locality.surfels == 0))
+			locality = reference.locality_report(input.cameraPosition);
+
+		if (((frame + 1) & frame) == 0)
+		{
+			convergenceFrames.push_back(frame + 1);
+			convergence.push_back(std::make_pair(reference.irradiance_error(input, 128, 64), filtered.irradiance_error(input, 128, 64)));
+		}
+	}
+
+	readback.collect(UINT64_MAX, telemetry);
+
+	const SurfelPoolReport pool = reference.pool_report();
+
+	// Summed over the frames read back the counters have to account for the whole run
+	uint64_t telemetrySpawns = 0;
+	uint64_t telemetryRecycles = 0;
+	uint64_t telemetryRays = 0;
+	uint32_t telemetryOverLimit = 0;
+	bool telemetryValid = telemetry.size() == frames && readback.dropped() == 0;
+	for (size_t i = 0; i < telemetry.size(); i++)
+	{
+		telemetryValid = telemetryValid && telemetry[i].frame == i;
+		telemetrySpawns += telemetry[i].spawns;
+		telemetryRecycles += telemetry[i].recycles;
+		telemetryRays += telemetry[i].raysTraced;
+		telemetryOverLimit = std::max(telemetryOverLimit, telemetry[i].cellsOverLimit);
+	}
+	telemetryValid = telemetryValid && telemetrySpawns == pool.spawned && telemetryRecycles == pool.recycled &&
+		(telemetry.empty() || telemetry.back().surfels == reference.surfel_count());
+
+	std::cout << "Surfel telemetry: " << telemetry.size() << " frames read back " << readbackLag << " frames late through " << readback.depth()
+		<< " slots, " << telemetrySpawns << " spawned, " << telemetryRecycles << " recycled, " << telemetryRays << " rays traced, at most "
+		<< telemetryOverLimit << " cells over the limit" << std::endl;
+	if (!telemetryValid)
+		std::cout << "Surfel telemetry: " << readback.dropped() << " frames dropped, the counters do not match the reference" << std::endl;
+
+	std::cout << "Surfels alive: " << pool.alive << " of " << SURFEL_BUDGET << ", " << pool.free << " free, "
+		<< pool.spawned << " spawned, " << pool.recycled << " recycled" << std::endl;
+	if (!pool.valid())
+		std::cout << "Surfel pool: " << pool.lost << " indices lost, " << pool.duplicates << " held twice" << std::endl;
+
+	const SurfelRayReport rays = reference.ray_report();
+	std::cout << "Surfel rays: " << rays.rays << " of " << SURFEL_RAY_BUDGET << " for " << rays.surfels << " surfels, "
+		<< rays.warmingRays << " for the " << rays.warming << " warming up, " << rays.idle << " surfels idle, "
+		<< rays.bounced << " bounced off cached surfels" << std::endl;
+
+	// Bytes SURFEL_SH adds, see the static_asserts in surfel_gi.h
+	const uint32_t shBytes = SURFEL_PACKED ? 20 : 48;
+	const SurfelShReport sh = reference.sh_report(input, 256, 64);
+	std::cout << std::fixed << std::setprecision(3) << "Surfel irradiance off the surfel normal, " << sh.surfels << " surfels, error color / L1 SH:";
+	for (uint32_t t = 0; t < SURFEL_SH_TILTS; t++)
+		std::cout << " " << std::setprecision(0) << sh.tilt[t] << " deg " << std::setprecision(3) << sh.scalar[t] << " / " << sh.sh[t];
+	std::cout << std::defaultfloat << ", L1 SH " << (SURFEL_SH ? "on, costs " : "off, would cost ") << shBytes << " bytes a surfel" << std::endl;
+
+	const SurfelSamplingReport sampling = reference.sampling_report(input, 128);
+	std::cout << std::fixed << std::setprecision(3) << "Surfel sampling: " << sampling.surfels << " surfels, "
+		<< SURFEL_SAMPLING_RAYS << " rays a frame, error hashed / sobol:";
+	for (uint32_t step = 0; step < SURFEL_SAMPLING_STEPS; step++)
+		std::cout << " " << (1u << step) << " frames " << sampling.hashed[step] << " / " << sampling.sobol[step];
+	std::cout << std::defaultfloat << std::endl;
+	for (uint32_t step = 0; step < SURFEL_SAMPLING_STEPS; step++)
+	{
+		if (sampling.sobol[step] <= sampling.hashed[SURFEL_SAMPLING_STEPS - 1])
+		{
+			std::cout << "Surfel sampling: the error of " << (1u << (SURFEL_SAMPLING_STEPS - 1)) << " hashed frames is reached after "
+				<< (1u << step) << std::endl;
+			break;
+		}
+	}
+
+	std::cout << std::fixed << std::setprecision(3) << "Surfel filter convergence, error unfiltered / filtered:";
+	for (size_t step = 0; step < convergence.size(); step++)
+		std::cout << " " << convergenceFrames[step] << " frames " << convergence[step].first << " / " << convergence[step].second;
+	std::cout << std::defaultfloat << ", filter " << filtered._timings[STAGE_SURFEL_FILTER].milliseconds / std::max(frames, 1u) << " ms a frame" << std::endl;
+
+	const std::vector<uint32_t> cascades = reference.cascade_histogram(input.cameraPosition);
+	std::cout << "Surfels per cascade:";
+	for (uint32_t cascade = 0; cascade < SURFEL_CASCADE_COUNT; cascade++)
+		std::cout << " " << cascades[cascade];
+	std::cout << ", " << cascades[SURFEL_CASCADE_COUNT] << " outside" << std::endl;
+
+	const SurfelGridReport grid = reference.grid_report(input.cameraPosition);
+	const double MB = 1024.0 * 1024.0;
+
+	std::cout << std::fixed << std::setprecision(3) << "Surfel locality: " << locality.surfels << " surfels, " << locality.accesses
+		<< " accesses through " << SURFEL_LOCALITY_SETS * SURFEL_LOCALITY_WAYS * SURFEL_LOCALITY_LINE / 1024 << " KB, miss rate row major "
+		<< locality.storedLinear << ", Morton cells " << locality.storedMorton << ", sorted surfels " << locality.sortedMorton << std::defaultfloat << std::endl;
+	if (!locality.valid())
+		std::cout << "Surfel locality: " << locality.mortonCollisions << " cells without a Morton index of their own" << std::endl;
+
+	std::cout << "Surfel packing: " << sizeof(SurfelPacked) + sizeof(SurfelDataPacked) << " bytes a surfel instead of "
+		<< sizeof(Surfel) + sizeof(SurfelData) << (SURFEL_PACKED ? ", stored packed" : ", stored full") << std::endl;
+	std::cout << "Surfel grid: " << grid.overlaps << " overlaps in " << grid.occupiedCells << " cells, at most "
+		<< grid.maxCellCount << " per cell, " << grid.overflowCells << " over the dense limit" << std::endl;
+	std::cout << std::fixed << std::setprecision(2) << "Surfel grid memory: dense " << grid.denseBytes / MB
+		<< " MB, sparse " << grid.sparseBytes / MB << " MB (" << grid.gpuBytes / MB << " MB on the GPU), saved "
+		<< (grid.denseBytes - grid.sparseBytes) / MB << " MB" << std::endl;
+	if (grid.mismatches > 0)
+		std::cout << "Surfel grid: " << grid.mismatches << " cells differ from the dense layout" << std::endl;
+
+	// The snapshot has the layout Renderer::record_surfel_cache_save reads the GPU buffers back into, loaded
+	// and unpacked it is checked against the reference like a GPU readback. Warm start: a reference restored
+	// from it has to run the next frame exactly like the original would without its grid.
+	const std::string cachePath = "surfel_benchmark.surfelcache";
+	const uint64_t sceneKey = SurfelCache::scene_key(-1, {});
+	bool readbackValid = false;
+	bool cacheValid = false;
+	if (reference.save_cache(cachePath, sceneKey))
+	{
+		SurfelReference restored;
+		if (restored.load_cache(cachePath, sceneKey))
+		{
+			const SurfelCompareResult readback = reference.compare_surfels(restored._surfels.data(), SURFEL_CAPACITY);
+			const SurfelCompareResult readbackData = reference.compare_surfel_data(restored._surfelData.data(), SURFEL_CAPACITY);
+			readbackValid = readback.mismatches == 0 && readbackData.mismatches == 0;
+			std::cout << std::scientific << std::setprecision(2) << "Surfel readback: " << readback.mismatches + readbackData.mismatches
+				<< " slots differ, largest error " << std::max(readback.maxError, readbackData.maxError) << std::defaultfloat << std::endl;
+
+			input.frame = frames;
+			reference.drop_grid();
+			reference.run_frame(input);
+			restored.run_frame(input);
+
+			const SurfelCompareResult surfels = restored.compare_surfels(reference._surfels.data(), SURFEL_CAPACITY, 0.0f);
+			const SurfelCompareResult data = restored.compare_surfel_data(reference._surfelData.data(), SURFEL_CAPACITY, 0.0f);
+			cacheValid = surfels.mismatches == 0 && data.mismatches == 0 && restored._stats == reference._stats && restored._aliveList == reference._aliveList;
+		}
+		std::remove(cachePath.c_str());
+	}
+	std::cout << "Surfel cache: " << SurfelCache::layout(sceneKey, SurfelConfig()).fileSize / MB << " MB snapshot, warm start "
+		<< (cacheValid ? "matches" : "differs from") << " the original" << std::endl;
+
+	// The coverage pass at full, half and quarter resolution of the G-buffer, each run on a copy of the converged surfels
+	std::cout << std::fixed << std::setprecision(3) << "Surfel coverage:";
+	for (uint32_t scale = 1; scale <= 4; scale *= 2)
+	{
+		SurfelFrameInput scaled = input;
+		scaled.coverageScale = scale;
+
+		const uint32_t runs = 8;
+		double milliseconds = 0;
+		uint64_t pixels = 0;
+		uint32_t spawns = 0;
+		for (uint32_t run = 0; run < runs; run++)
+		{
+			SurfelReference copy = reference;
+			copy._timings[STAGE_SURFEL_POSITION] = SurfelStageTiming{ copy._timings[STAGE_SURFEL_POSITION].name };
+			copy.surfel_position(scaled);
+			milliseconds += copy._timings[STAGE_SURFEL_POSITION].milliseconds;
+			pixels = copy._timings[STAGE_SURFEL_POSITION].items;
+			spawns = copy.surfel_count() - reference.surfel_count();
+		}
+		std::cout << " 1/" << scale << " " << milliseconds / runs << " ms " << pixels << " pixels " << spawns << " spawns";
+	}
+	std::cout << std::defaultfloat << std::endl;
+
+	reference.print_timings();
+
+	return grid.mismatches == 0 && pool.valid() && readbackValid && cacheValid && locality.valid() && telemetryValid ? 0 : 1;
+}
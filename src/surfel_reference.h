@@ -0,0 +1,289 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "surfel_gi.h"
+
+// CPU reference of the surfel GI frame run by Renderer. Every stage mirrors its
+// shader in data/shaders and writes the same buffers, so the results can be
+// compared against GPU readbacks or profiled on machines without a GPU.
+//
+// The GPU stages race on the grid and on surfel colors; the reference resolves
+// those races deterministically (see the comments on each stage), so the oracle
+// is bit-comparable per surfel but spawn order may differ from a GPU run.
+
+// Unpacked GPULight (light_buffer.h), what the shaders get from unpackLight in helpers.glsl
+struct SurfelLight
+{
+	glm::vec4	position;	// w used for maxDistance, < 0 for directional lights
+	glm::vec4	color;		// w used for intensity
+};
+
+// Surface seen by a ray, what surfelHit.rchit reads from the scene buffers
+struct SurfelRayHit
+{
+	float		t;
+	glm::vec3	normal;		// world space, normalized
+	glm::vec3	albedo;		// as stored in the material, degamma is done by the stage
+	glm::vec3	emissive;
+	float		metallic;
+};
+
+// Scene queries used by the ray tracing stage, the CPU side of the TLAS
+class SurfelTracer
+{
+public:
+	virtual ~SurfelTracer() {}
+
+	virtual bool trace(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax, SurfelRayHit& hit) const = 0;
+	virtual bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax) const = 0;
+};
+
+// Per frame inputs, the bindings of the surfel descriptor sets
+struct SurfelFrameInput
+{
+	uint32_t					width{ 0 };
+	uint32_t					height{ 0 };
+	const glm::vec4*			normals{ nullptr };		// G-buffer normal target, xyz = N * 0.5 + 0.5, a = 0 on background
+	const float*				depth{ nullptr };		// G-buffer depth, [0, 1]
+
+	uint32_t					coverageScale{ 1 };		// SurfelConfig::coverageScale, the coverage images are this much smaller
+	glm::uvec2					tileSize{ 16, 16 };		// SurfelConfig::tileSize
+
+	uint32_t					blueNoiseWidth{ 0 };
+	uint32_t					blueNoiseHeight{ 0 };
+	const glm::vec4*			blueNoise{ nullptr };
+
+	glm::mat4					view{ 1 };
+	glm::mat4					projection{ 1 };
+	glm::vec3					cameraPosition{ 0 };	// GPUCameraData::pos, centre of the grid cascades
+	float						near{ 0.1f };
+	float						far{ 200.0f };
+	uint32_t					frame{ 0 };				// RTCameraData::frame.x
+
+	std::vector<SurfelLight>	lights;
+	const SurfelTracer*			tracer{ nullptr };
+};
+
+struct SurfelStageTiming
+{
+	const char*	name;
+	double		milliseconds{ 0 };
+	uint64_t	items{ 0 };				// surfels (or pixels for the coverage stage) processed
+
+	double items_per_second() const { return milliseconds > 0 ? items * 1000.0 / milliseconds : 0; }
+};
+
+// Sparse grid against the dense SURFEL_CELL_LIMIT slots per cell layout it replaced
+struct SurfelGridReport
+{
+	uint64_t	overlaps{ 0 };			// surfel-cell pairs, the length of the index list
+	uint32_t	occupiedCells{ 0 };
+	uint32_t	maxCellCount{ 0 };
+	uint32_t	overflowCells{ 0 };		// cells the dense layout could not hold, it dropped their extra surfels
+	uint32_t	mismatches{ 0 };		// cells that hold a different set of surfels in both layouts
+
+	uint64_t	denseBytes{ 0 };
+	uint64_t	sparseBytes{ 0 };		// sized to the overlaps
+	uint64_t	gpuBytes{ 0 };			// sized to SURFEL_CELL_INDEX_CAPACITY
+};
+
+// Alive list and dead stack against the index budget
+struct SurfelPoolReport
+{
+	uint32_t	alive{ 0 };
+	uint32_t	free{ 0 };
+	uint64_t	spawned{ 0 };
+	uint64_t	recycled{ 0 };
+	uint32_t	lost{ 0 };				// indices in neither list
+	uint32_t	duplicates{ 0 };		// indices in both lists, or twice in one
+
+	bool valid() const { return lost == 0 && duplicates == 0 && alive <= SURFEL_BUDGET; }
+};
+
+// Cache misses of the accesses surfelshade.comp and surfelFilter.comp make for every alive surfel: the
+// surfel, its data, the 27 cells around it and the surfels listed there. Replayed in thread order
+// through one set associative LRU cache, with the surfels as they are stored and as surfel_sort
+// would store them, and with the cells in row major and in Morton order.
+static const uint32_t SURFEL_LOCALITY_LINE = 128;			// bytes
+static const uint32_t SURFEL_LOCALITY_WAYS = 16;
+static const uint32_t SURFEL_LOCALITY_SETS = 64;			// 128 KB, about the L1 of one multiprocessor
+
+struct SurfelLocalityReport
+{
+	uint32_t	surfels{ 0 };
+	uint64_t	accesses{ 0 };
+	float		storedLinear{ 0 };		// miss rates, surfels as stored, cells in row major order
+	float		storedMorton{ 0 };		// same, cells in Morton order
+	float		sortedMorton{ 0 };		// surfels sorted by the Morton order of their cell
+	uint32_t	mortonCollisions{ 0 };	// cells of a cascade without a Morton index of their own
+
+	bool valid() const { return mortonCollisions == 0; }
+};
+
+// Rays of one frame split by how converged their surfels are
+struct SurfelRayReport
+{
+	uint32_t	surfels{ 0 };
+	uint32_t	rays{ 0 };
+	uint32_t	warming{ 0 };			// surfels younger than SURFEL_RAY_WARMUP
+	uint32_t	warmingRays{ 0 };
+	uint32_t	idle{ 0 };				// surfels that trace nothing this frame
+	uint32_t	bounced{ 0 };			// rays whose hit picked up the irradiance cached by the surfels there
+};
+
+// Irradiance of surfels towards normals tilted away from theirs, what the coverage pass shades a curved
+// or bumpy pixel with, estimated from the surfel color alone and with the L1 SH fit of SURFEL_SH
+static const uint32_t SURFEL_SH_TILTS = 3;
+
+struct SurfelShReport
+{
+	uint32_t	surfels{ 0 };
+	float		tilt[SURFEL_SH_TILTS]{ 15.0f, 30.0f, 45.0f };		// degrees
+	float		scalar[SURFEL_SH_TILTS]{};			// mean relative luma error against rays traced about the tilted normal
+	float		sh[SURFEL_SH_TILTS]{};
+};
+
+// Error of surfel irradiance estimates with the sequences of sampling.h against the hashed
+// sampling they replaced, each frame tracing SURFEL_SAMPLING_RAYS rays a surfel
+static const uint32_t SURFEL_SAMPLING_RAYS = 4;
+static const uint32_t SURFEL_SAMPLING_STEPS = 7;		// after 1, 2, 4 ... 64 frames
+
+struct SurfelSamplingReport
+{
+	uint32_t	surfels{ 0 };
+	float		hashed[SURFEL_SAMPLING_STEPS]{};	// rms relative luma error
+	float		sobol[SURFEL_SAMPLING_STEPS]{};
+};
+
+struct SurfelCompareResult
+{
+	uint32_t	mismatches{ 0 };
+	uint32_t	firstMismatch{ UINT32_MAX };
+	float		maxError{ 0 };
+};
+
+class SurfelReference
+{
+public:
+	enum Stage
+	{
+		STAGE_SURFEL_POSITION,
+		STAGE_PREPARE_INDIRECT,
+		STAGE_GRID_RESET,
+		STAGE_UPDATE_SURFELS,
+		STAGE_SURFEL_COMPACT,
+		STAGE_GRID_OFFSET,
+		STAGE_SURFEL_BINNING,
+		STAGE_SURFEL_SORT,
+		STAGE_SURFEL_RAY_ALLOCATE,
+		STAGE_SURFEL_RAY_TRACING,
+		STAGE_SURFEL_SHADE,
+		STAGE_SURFEL_FILTER,
+		STAGE_COUNT
+	};
+
+	// Same contents and sizes as the buffers made in Renderer::create_SurfelGi_resources with the default SurfelConfig
+	std::vector<Surfel>			_surfels;
+	std::vector<SurfelData>		_surfelData;
+	std::vector<uint32_t>		_stats;
+	std::vector<SurfelGridCell>	_gridCells;
+	std::vector<uint32_t>		_cellIndices;		// sized to the overlaps of the frame by grid_offset
+	std::vector<uint32_t>		_aliveList;			// alive indices, then the survivors of update_surfels
+	std::vector<uint32_t>		_deadList;			// free indices, popped from the back
+	std::vector<SurfelRayRange>	_rayRanges;			// rays of each surfel slot this frame
+	std::vector<uint32_t>		_rayQueue;			// surfel of each ray, SURFEL_RAY_BUDGET of them
+	std::vector<SurfelRay>		_rays;
+
+	// Storage images written by the coverage pass, SurfelConfig::coverage_extent of the G-buffer
+	std::vector<glm::vec4>		_resultImage;
+	std::vector<glm::vec4>		_debugImage;
+
+	SurfelStageTiming			_timings[STAGE_COUNT];
+
+	bool						_filter{ false };	// SurfelConfig::filter, run surfel_filter after surfel_shade
+
+	SurfelReference();
+
+	void reset();
+
+	// Runs every stage in pipeline order
+	void run_frame(const SurfelFrameInput& input);
+
+	void surfel_position(const SurfelFrameInput& input);
+	void prepare_indirect();
+	void grid_reset();
+	void update_surfels(const SurfelFrameInput& input);
+	void surfel_compact();
+	void grid_offset();
+	void surfel_binning(const SurfelFrameInput& input);
+	void surfel_sort(const SurfelFrameInput& input);
+	void surfel_ray_allocate(const SurfelFrameInput& input);
+	void surfel_ray_tracing(const SurfelFrameInput& input);
+	void surfel_shade(const SurfelFrameInput& input);
+	void surfel_filter(const SurfelFrameInput& input);
+
+	uint32_t surfel_count() const;
+
+	// Compare against buffers read back from the GPU and unpacked, epsilon is per component
+	SurfelCompareResult compare_surfels(const Surfel* gpu, uint32_t count, float epsilon = 1e-4f) const;
+	SurfelCompareResult compare_surfel_data(const SurfelData* gpu, uint32_t count, float epsilon = 1e-4f) const;
+
+	// Rebuilds the dense layout from the current surfels and checks every cell against it
+	SurfelGridReport grid_report(const glm::vec3& campos) const;
+
+	// Alive surfels in the order surfel_sort stores them: by the Morton index of their cell, then the
+	// ones in no cell, each in alive list order
+	std::vector<uint32_t> sort_order(const glm::vec3& campos) const;
+
+	// Replays the accesses of a frame on the current surfels, works on snapshots loaded with load_cache too
+	SurfelLocalityReport locality_report(const glm::vec3& campos) const;
+
+	// Alive surfels binned into each cascade around campos
+	std::vector<uint32_t> cascade_histogram(const glm::vec3& campos) const;
+
+	// Checks that every index of the budget is either alive or free, once
+	SurfelPoolReport pool_report() const;
+
+	// Rays queued by the last surfel_ray_allocate
+	SurfelRayReport ray_report() const;
+
+	// Fits both estimates from rays traced about the normal of up to samples alive surfels, independent of SURFEL_SH
+	SurfelShReport sh_report(const SurfelFrameInput& input, uint32_t samples, uint32_t rays) const;
+
+	// Estimates the irradiance of up to samples alive surfels with both samplings, sampling_check covers the sequences
+	SurfelSamplingReport sampling_report(const SurfelFrameInput& input, uint32_t samples) const;
+
+	// Rms relative luma error of the colors of up to samples alive surfels against rays traced about their normals
+	float irradiance_error(const SurfelFrameInput& input, uint32_t samples, uint32_t rays) const;
+
+	// Weighted colors of the surfels binned at a hit, rgb summed and a the total weight, zero when none covers it
+	glm::vec4 cached_irradiance(const glm::vec3& position, const glm::vec3& normal, const glm::vec3& campos) const;
+
+	// Snapshot in the SurfelCache layout, the same file Renderer::flush_surfel_cache writes. The grid is
+	// not part of it, a loaded snapshot is binned by its first frame
+	bool save_cache(const std::string& path, uint64_t sceneKey) const;
+	bool load_cache(const std::string& path, uint64_t sceneKey);
+
+	void print_timings() const;
+
+	// Headless benchmark on a procedural scene, returns the process exit code
+	static int benchmark(uint32_t width, uint32_t height, uint32_t frames);
+
+private:
+	void begin_stage(Stage stage);
+	void end_stage(Stage stage, uint64_t items);
+
+	// Forgets the grid like a snapshot load does, the next coverage pass spawns nothing
+	void drop_grid();
+
+	glm::vec3 trace_radiance(const SurfelFrameInput& input, const glm::vec3& origin, const glm::vec3& direction, bool& bounced) const;
+
+	Stage _currentStage{ STAGE_COUNT };		// begun and not ended yet, STAGE_COUNT between stages
+	double _stageStart{ 0 };
+	uint64_t _spawned{ 0 };
+	uint64_t _recycled{ 0 };
+	uint32_t _bouncedRays{ 0 };
+};
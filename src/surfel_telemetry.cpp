@@ -0,0 +1,112 @@
+#include "surfel_telemetry.h"
+#include "surfel_gi.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+SurfelFrameStats surfel_frame_stats(uint64_t frame, const uint32_t* stats, const uint32_t* previous)
+{
+	SurfelFrameStats result;
+	result.frame			= frame;
+	result.surfels			= stats[SURFEL_STATS_OFFSET_COUNT];
+	result.free				= stats[SURFEL_STATS_OFFSET_DEADCOUNT];
+	result.overlaps			= stats[SURFEL_STATS_OFFSET_CELLALLOCATOR];
+	result.cellsOverLimit	= stats[SURFEL_STATS_OFFSET_CELLOVERFLOW];
+	result.raysQueued		= stats[SURFEL_STATS_OFFSET_RAYALLOCATOR];
+	result.raysTraced		= stats[SURFEL_STATS_OFFSET_TRACE];
+	result.lowPool			= stats[SURFEL_STATS_OFFSET_LOWPOOL] != 0;
+	result.sorted			= stats[SURFEL_STATS_OFFSET_SORTCLOCK] == 0;
+
+	// Running totals, the unsigned difference survives them wrapping around
+	result.spawns	= stats[SURFEL_STATS_OFFSET_SPAWNS] - (previous ? previous[SURFEL_STATS_OFFSET_SPAWNS] : 0);
+	result.recycles	= stats[SURFEL_STATS_OFFSET_RECYCLES] - (previous ? previous[SURFEL_STATS_OFFSET_RECYCLES] : 0);
+	return result;
+}
+
+void SurfelStatsRing::init(const uint32_t* mapped, uint32_t depth)
+{
+	_mapped		= mapped;
+	_depth		= depth;
+	_pending.assign(depth, 0);
+	_previous.clear();
+	_latest		= SurfelFrameStats();
+	_dropped	= 0;
+}
+
+uint32_t SurfelStatsRing::begin_frame(uint64_t frame)
+{
+	const uint32_t slot = static_cast<uint32_t>(frame % _depth);
+	if (_pending[slot] != 0)
+		_dropped++;
+	_pending[slot] = frame + 1;
+	return slot;
+}
+
+void SurfelStatsRing::collect(uint64_t completed, std::vector<SurfelFrameStats>& frames)
+{
+	std::vector<uint32_t> slots;
+	for (uint32_t slot = 0; slot < _depth; slot++)
+	{
+		if (_pending[slot] != 0 && _pending[slot] - 1 <= completed)
+			slots.push_back(slot);
+	}
+	std::sort(slots.begin(), slots.end(), [&](uint32_t a, uint32_t b) { return _pending[a] < _pending[b]; });
+
+	for (uint32_t slot : slots)
+	{
+		const uint32_t* stats = _mapped + (size_t)slot * SURFEL_STATS_SIZE;
+		_latest = surfel_frame_stats(_pending[slot] - 1, stats, _previous.empty() ? nullptr : _previous.data());
+		_previous.assign(stats, stats + SURFEL_STATS_SIZE);
+		_pending[slot] = 0;
+		frames.push_back(_latest);
+	}
+}
+
+static bool ends_with(const std::string& s, const char* suffix)
+{
+	const size_t n = strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+bool SurfelTelemetry::open(const std::string& path)
+{
+	_json = ends_with(path, ".json") || ends_with(path, ".jsonl");
+	_file.open(path, std::ios::out | std::ios::trunc);
+	if (!_file.is_open())
+	{
+		std::cout << "Surfel telemetry: could not open " << path << std::endl;
+		return false;
+	}
+
+	if (!_json)
+		_file << "frame,surfels,free,spawns,recycles,overlaps,cells_over_limit,rays_queued,rays_traced,low_pool,sorted\n";
+
+	std::cout << "Surfel telemetry: writing " << (_json ? "JSON Lines" : "CSV") << " to " << path << std::endl;
+	return true;
+}
+
+void SurfelTelemetry::close()
+{
+	if (_file.is_open())
+		_file.close();
+}
+
+void SurfelTelemetry::write(const SurfelFrameStats& s)
+{
+	if (!_file.is_open())
+		return;
+
+	if (_json)
+	{
+		_file << "{\"frame\":" << s.frame << ",\"surfels\":" << s.surfels << ",\"free\":" << s.free
+			<< ",\"spawns\":" << s.spawns << ",\"recycles\":" << s.recycles << ",\"overlaps\":" << s.overlaps
+			<< ",\"cells_over_limit\":" << s.cellsOverLimit << ",\"rays_queued\":" << s.raysQueued << ",\"rays_traced\":" << s.raysTraced
+			<< ",\"low_pool\":" << (s.lowPool ? "true" : "false") << ",\"sorted\":" << (s.sorted ? "true" : "false") << "}\n";
+	}
+	else
+	{
+		_file << s.frame << "," << s.surfels << "," << s.free << "," << s.spawns << "," << s.recycles << "," << s.overlaps << ","
+			<< s.cellsOverLimit << "," << s.raysQueued << "," << s.raysTraced << "," << (s.lowPool ? 1 : 0) << "," << (s.sorted ? 1 : 0) << "\n";
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Counters of one frame, decoded from a copy of the surfel stats buffer
+struct SurfelFrameStats
+{
+	uint64_t	frame{ 0 };
+	uint32_t	surfels{ 0 };			// alive at the end of the frame
+	uint32_t	free{ 0 };				// indices on the dead stack
+	uint32_t	overlaps{ 0 };			// surfel-cell pairs in the index list
+	uint32_t	cellsOverLimit{ 0 };	// cells holding more than the cell limit
+	uint32_t	raysQueued{ 0 };		// asked for, may run past the ray budget
+	uint32_t	raysTraced{ 0 };		// the part of the queue the trace pass dispatched over
+	uint32_t	spawns{ 0 };			// since the frame read back before
+	uint32_t	recycles{ 0 };
+	bool		lowPool{ false };		// the update pass recycled aggressively
+	bool		sorted{ false };		// the surfels were sorted this frame
+};
+
+// previous is the copy of the frame read back before, nullptr for the first one
+SurfelFrameStats surfel_frame_stats(uint64_t frame, const uint32_t* stats, const uint32_t* previous);
+
+// Copies of the surfel stats buffer in persistently mapped memory, one slot per frame. The GPU
+// copies the buffer into the slot of a frame at its end, the CPU decodes it once the fence of that
+// frame has been waited on anyway. A slot is reused depth frames later, so with depth above the
+// frames in flight every frame is read once and the CPU never waits for the GPU.
+class SurfelStatsRing
+{
+public:
+	// mapped holds depth slots of SURFEL_STATS_SIZE uints
+	void init(const uint32_t* mapped, uint32_t depth);
+
+	// Slot the stats of frame are copied into
+	uint32_t begin_frame(uint64_t frame);
+
+	// Decodes every frame up to completed that was not read yet, oldest first
+	void collect(uint64_t completed, std::vector<SurfelFrameStats>& frames);
+
+	// Most recent frame read back
+	const SurfelFrameStats& latest() const { return _latest; }
+
+	uint32_t depth() const { return _depth; }
+
+	// Frames whose slot was reused before they were read
+	uint64_t dropped() const { return _dropped; }
+
+private:
+	const uint32_t*			_mapped{ nullptr };
+	uint32_t				_depth{ 0 };
+	std::vector<uint64_t>	_pending;		// frame + 1 of each slot not read yet, 0 once read
+	std::vector<uint32_t>	_previous;		// copy of the last slot read
+	SurfelFrameStats		_latest;
+	uint64_t				_dropped{ 0 };
+};
+
+// SurfelFrameStats as a stream, CSV with a header row, or JSON Lines when the path ends in .json or .jsonl
+class SurfelTelemetry
+{
+public:
+	bool open(const std::string& path);
+	void close();
+
+	void write(const SurfelFrameStats& stats);
+
+	bool is_open() const { return _file.is_open(); }
+
+private:
+	std::ofstream	_file;
+	bool			_json{ false };
+};
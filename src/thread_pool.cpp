@@ -0,0 +1,128 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned int threads)
+{
+	if (threads == 0)
+	{
+		const unsigned int hw = std::thread::hardware_concurrency();
+		threads = hw > 1 ? hw - 1 : 1;
+	}
+
+	for (unsigned int i = 0; i < threads; i++)
+		_workers.emplace_back([this]() { worker_loop(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_condition.notify_all();
+
+	for (std::thread& worker : _workers)
+		worker.join();
+}
+
+ThreadPool& ThreadPool::get()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+std::future<void> ThreadPool::enqueue(std::function<void()>&& job)
+{
+	auto task = std::make_shared<std::packaged_task<void()>>(std::move(job));
+	std::future<void> result = task->get_future();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_jobs.emplace([task]() { (*task)(); });
+	}
+	_condition.notify_one();
+	return result;
+}
+
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t)>& job)
+{
+	parallel_for_range(begin, end, grain, [&job](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++)
+			job(i);
+		});
+}
+
+void ThreadPool::parallel_for_range(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& job)
+{
+	if (end <= begin)
+		return;
+
+	grain = std::max<size_t>(grain, 1);
+	const size_t chunks = (end - begin + grain - 1) / grain;
+
+	if (chunks == 1 || _workers.empty())
+	{
+		job(begin, end);
+		return;
+	}
+
+	// Chunks are claimed through an atomic counter so the caller can help
+	// instead of blocking, and nested calls from a worker cannot deadlock.
+	// Helpers can still be queued after the last chunk is done and the call has
+	// returned, so they share the counters by value and only touch job for a
+	// chunk they claimed, which the caller is still waiting on.
+	struct Shared
+	{
+		std::atomic<size_t>		next{ 0 };
+		std::atomic<size_t>		done{ 0 };
+		std::mutex				mutex;
+		std::condition_variable	condition;
+	};
+	std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+	const std::function<void(size_t, size_t)>* work = &job;
+
+	auto run = [shared, work, begin, end, grain, chunks]() {
+		size_t chunk;
+		while ((chunk = shared->next.fetch_add(1)) < chunks)
+		{
+			const size_t first = begin + chunk * grain;
+			(*work)(first, std::min(first + grain, end));
+			if (shared->done.fetch_add(1) + 1 == chunks)
+			{
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				shared->condition.notify_all();
+			}
+		}
+	};
+
+	const size_t helpers = std::min<size_t>(_workers.size(), chunks - 1);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (size_t i = 0; i < helpers; i++)
+			_jobs.emplace(run);
+	}
+	_condition.notify_all();
+
+	run();
+
+	std::unique_lock<std::mutex> lock(shared->mutex);
+	shared->condition.wait(lock, [&]() { return shared->done.load() == chunks; });
+}
+
+void ThreadPool::worker_loop()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_condition.wait(lock, [this]() { return _stop || !_jobs.empty(); });
+			if (_stop && _jobs.empty())
+				return;
+			job = std::move(_jobs.front());
+			_jobs.pop();
+		}
+		job();
+	}
+}
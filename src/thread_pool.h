@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Small fixed-size worker pool used by the CPU side of the engine
+// (surfel reference, asset import). Tasks are plain std::function jobs.
+class ThreadPool
+{
+public:
+	// threads == 0 uses every hardware thread but the caller's
+	explicit ThreadPool(unsigned int threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Shared pool, created on first use
+	static ThreadPool& get();
+
+	unsigned int size() const { return static_cast<unsigned int>(_workers.size()); }
+
+	std::future<void> enqueue(std::function<void()>&& job);
+
+	// Runs job(i) for every i in [begin, end) split in chunks of grain items.
+	// The calling thread takes part and the call returns once every chunk is done.
+	void parallel_for(size_t begin, size_t end, size_t grain, const std::function<void(size_t)>& job);
+
+	// Same as parallel_for but hands whole [first, last) ranges to the job
+	void parallel_for_range(size_t begin, size_t end, size_t grain, const std::function<void(size_t, size_t)>& job);
+
+private:
+	std::vector<std::thread>			_workers;
+	std::queue<std::function<void()>>	_jobs;
+	std::mutex							_mutex;
+	std::condition_variable				_condition;
+	bool								_stop{ false };
+
+	void worker_loop();
+};
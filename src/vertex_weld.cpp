@@ -0,0 +1,336 @@
+#include "vertex_weld.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+
+static double now_ms()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t float_bits(float a, float b)
+{
+	// Fold -0 into +0 so the hash agrees with float ==
+	a = a == 0.0f ? 0.0f : a;
+	b = b == 0.0f ? 0.0f : b;
+	uint32_t ua, ub;
+	memcpy(&ua, &a, sizeof(ua));
+	memcpy(&ub, &b, sizeof(ub));
+	return (uint64_t)ua | ((uint64_t)ub << 32);
+}
+
+static inline uint64_t hash_combine(uint64_t h, uint64_t word)
+{
+	h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+	return (h << 31) | (h >> 33);
+}
+
+uint64_t hash_vertex(const Vertex& v)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ull;
+	h = hash_combine(h, float_bits(v.position.x, v.position.y));
+	h = hash_combine(h, float_bits(v.position.z, v.normal.x));
+	h = hash_combine(h, float_bits(v.normal.y, v.normal.z));
+	h = hash_combine(h, float_bits(v.color.x, v.color.y));
+	h = hash_combine(h, float_bits(v.color.z, v.uv.x));
+	h = hash_combine(h, float_bits(v.uv.y, 0.0f));
+
+	// murmur3 finalizer
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+//------------------------------------------------------------------- VertexTable
+
+void VertexTable::reserve(size_t count)
+{
+	// Keep the load factor under 1/2
+	size_t capacity = 16;
+	while (capacity < count * 2)
+		capacity <<= 1;
+
+	_slots.assign(capacity, { UINT32_MAX, 0 });
+	_mask = capacity - 1;
+	_count = 0;
+}
+
+void VertexTable::rehash(size_t capacity, const Vertex* vertices)
+{
+	std::vector<Slot> old;
+	old.swap(_slots);
+	_slots.assign(capacity, { UINT32_MAX, 0 });
+	_mask = capacity - 1;
+
+	for (const Slot& slot : old)
+	{
+		if (slot.index == UINT32_MAX)
+			continue;
+
+		size_t i = (size_t)hash_vertex(vertices[slot.index]) & _mask;
+		while (_slots[i].index != UINT32_MAX)
+			i = (i + 1) & _mask;
+		_slots[i] = slot;
+	}
+}
+
+uint32_t VertexTable::insert(const Vertex& v, uint64_t hash, uint32_t candidate, const Vertex* vertices, bool& inserted)
+{
+	if (_slots.empty())
+		reserve(0);
+	else if ((_count + 1) * 2 > _slots.size())
+		rehash(_slots.size() * 2, vertices);
+
+	const uint32_t tag = (uint32_t)(hash >> 32);
+	size_t i = (size_t)hash & _mask;
+	_lookups++;
+
+	while (true)
+	{
+		_probes++;
+		Slot& slot = _slots[i];
+		if (slot.index == UINT32_MAX)
+		{
+			slot.index = candidate;
+			slot.tag = tag;
+			_count++;
+			inserted = true;
+			return candidate;
+		}
+		if (slot.tag == tag && vertices[slot.index] == v)
+		{
+			inserted = false;
+			return slot.index;
+		}
+		i = (i + 1) & _mask;
+	}
+}
+
+//------------------------------------------------------------------- OBJ welding
+
+static inline Vertex obj_vertex(const tinyobj::attrib_t& attrib, const tinyobj::index_t& index)
+{
+	Vertex vertex{};
+
+	vertex.position = {
+		attrib.vertices[3 * index.vertex_index + 0],
+		attrib.vertices[3 * index.vertex_index + 1],
+		attrib.vertices[3 * index.vertex_index + 2]
+	};
+
+	if (index.normal_index >= 0)
+	{
+		vertex.normal = {
+			attrib.normals[3 * index.normal_index + 0],
+			attrib.normals[3 * index.normal_index + 1],
+			attrib.normals[3 * index.normal_index + 2]
+		};
+	}
+
+	vertex.color = { 1.0f, 1.0f, 1.0f };
+
+	if (index.texcoord_index >= 0 && attrib.texcoords.size() > 0)
+	{
+		vertex.uv = {
+			attrib.texcoords[2 * index.texcoord_index + 0],
+			1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
+		};
+	}
+
+	return vertex;
+}
+
+struct WeldShard
+{
+	const std::vector<tinyobj::index_t>*	corners;
+	size_t									first;		// first corner in the shape
+	size_t									count;
+	size_t									offset;		// first corner in the output
+	std::vector<Vertex>						vertices;	// unique in the shard, first use order
+	std::vector<uint64_t>					hashes;
+	std::vector<uint32_t>					remap;		// shard vertex -> output vertex
+};
+
+void weld_obj(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes,
+	std::vector<Vertex>& vertices, std::vector<uint32_t>& indices)
+{
+	std::vector<WeldShard> shards;
+	size_t corners = 0;
+	for (const tinyobj::shape_t& shape : shapes)
+	{
+		const size_t count = shape.mesh.indices.size();
+		for (size_t first = 0; first < count; first += WELD_SHARD_SIZE)
+		{
+			WeldShard shard;
+			shard.corners	= &shape.mesh.indices;
+			shard.first		= first;
+			shard.count		= std::min(WELD_SHARD_SIZE, count - first);
+			shard.offset	= corners + first;
+			shards.push_back(std::move(shard));
+		}
+		corners += count;
+	}
+
+	vertices.clear();
+	indices.resize(corners);
+
+	// Weld every shard on its own, indices get the shard local vertex
+	ThreadPool::get().parallel_for(0, shards.size(), 1, [&](size_t s) {
+		WeldShard& shard = shards[s];
+		VertexTable table;
+		table.reserve(shard.count / 4);
+		shard.vertices.reserve(shard.count / 4);
+		shard.hashes.reserve(shard.count / 4);
+
+		for (size_t c = 0; c < shard.count; c++)
+		{
+			const Vertex vertex = obj_vertex(attrib, (*shard.corners)[shard.first + c]);
+			const uint64_t hash = hash_vertex(vertex);
+
+			bool inserted;
+			const uint32_t index = table.insert(vertex, hash, (uint32_t)shard.vertices.size(), shard.vertices.data(), inserted);
+			if (inserted)
+			{
+				shard.vertices.push_back(vertex);
+				shard.hashes.push_back(hash);
+			}
+			indices[shard.offset + c] = index;
+		}
+	});
+
+	// Merge in shard order, this keeps the first use order of the serial weld
+	size_t candidates = 0;
+	for (const WeldShard& shard : shards)
+		candidates += shard.vertices.size();
+
+	VertexTable table;
+	table.reserve(candidates);
+	vertices.reserve(candidates);
+
+	for (WeldShard& shard : shards)
+	{
+		shard.remap.resize(shard.vertices.size());
+		for (size_t i = 0; i < shard.vertices.size(); i++)
+		{
+			bool inserted;
+			shard.remap[i] = table.insert(shard.vertices[i], shard.hashes[i], (uint32_t)vertices.size(), vertices.data(), inserted);
+			if (inserted)
+				vertices.push_back(shard.vertices[i]);
+		}
+		std::vector<Vertex>().swap(shard.vertices);
+		std::vector<uint64_t>().swap(shard.hashes);
+	}
+
+	ThreadPool::get().parallel_for(0, shards.size(), 1, [&](size_t s) {
+		const WeldShard& shard = shards[s];
+		for (size_t c = 0; c < shard.count; c++)
+			indices[shard.offset + c] = shard.remap[indices[shard.offset + c]];
+	});
+}
+
+//------------------------------------------------------------------- Benchmark
+
+// Hash the importer used before weld_obj, kept to measure against
+struct LegacyVertexHash
+{
+	size_t operator()(Vertex const& vertex) const {
+		return ((((std::hash<glm::vec3>()(vertex.position) ^
+			(std::hash<glm::vec3>()(vertex.normal) << 1)) >> 1) ^
+			(std::hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
+			(std::hash<glm::vec2>()(vertex.uv) << 1);
+	}
+};
+
+static void weld_obj_legacy(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes,
+	std::vector<Vertex>& vertices, std::vector<uint32_t>& indices, std::unordered_map<Vertex, uint32_t, LegacyVertexHash>& uniqueVertices)
+{
+	vertices.clear();
+	indices.clear();
+	uniqueVertices.clear();
+
+	for (const auto& shape : shapes)
+	{
+		for (const auto& index : shape.mesh.indices)
+		{
+			const Vertex vertex = obj_vertex(attrib, index);
+
+			if (uniqueVertices.count(vertex) == 0) {
+				uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
+				vertices.push_back(vertex);
+			}
+
+			indices.push_back(uniqueVertices[vertex]);
+		}
+	}
+}
+
+int weld_benchmark(const char* filename, uint32_t runs)
+{
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warn, err;
+
+	std::cout << "Loading " << filename << std::endl;
+	tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename, nullptr);
+	if (!err.empty())
+	{
+		std::cout << "ERR: " << err << std::endl;
+		return 1;
+	}
+
+	runs = std::max(runs, 1u);
+
+	std::vector<Vertex> legacyVertices, vertices;
+	std::vector<uint32_t> legacyIndices, indices;
+	std::unordered_map<Vertex, uint32_t, LegacyVertexHash> uniqueVertices;
+
+	double legacyMs = 1e30, weldMs = 1e30;
+	for (uint32_t run = 0; run < runs; run++)
+	{
+		double start = now_ms();
+		weld_obj_legacy(attrib, shapes, legacyVertices, legacyIndices, uniqueVertices);
+		legacyMs = std::min(legacyMs, now_ms() - start);
+
+		start = now_ms();
+		weld_obj(attrib, shapes, vertices, indices);
+		weldMs = std::min(weldMs, now_ms() - start);
+	}
+
+	const bool match = legacyVertices.size() == vertices.size() && legacyIndices == indices &&
+		std::equal(vertices.begin(), vertices.end(), legacyVertices.begin());
+
+	// Bucket quality of the old hash
+	size_t usedBuckets = 0, maxBucket = 0;
+	for (size_t b = 0; b < uniqueVertices.bucket_count(); b++)
+	{
+		const size_t size = uniqueVertices.bucket_size(b);
+		usedBuckets += size > 0;
+		maxBucket = std::max(maxBucket, size);
+	}
+
+	// Probe length of the new hash over the same unique vertices
+	VertexTable table;
+	table.reserve(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		bool inserted;
+		table.insert(vertices[i], hash_vertex(vertices[i]), (uint32_t)i, vertices.data(), inserted);
+	}
+
+	std::cout << std::fixed << std::setprecision(2);
+	std::cout << "Corners: " << indices.size() << ", unique vertices: " << vertices.size()
+		<< ", shapes: " << shapes.size() << ", threads: " << ThreadPool::get().size() + 1 << std::endl;
+	std::cout << "unordered_map: " << legacyMs << " ms, " << uniqueVertices.size() << " vertices in " << usedBuckets
+		<< " buckets, largest bucket " << maxBucket << std::endl;
+	std::cout << "weld_obj:      " << weldMs << " ms, " << (double)table.probes() / std::max<size_t>(table.lookups(), 1)
+		<< " probes per lookup" << std::endl;
+	std::cout << "Speedup: " << legacyMs / std::max(weldMs, 1e-6) << "x, output " << (match ? "matches" : "DIFFERS") << std::endl;
+
+	return match ? 0 : 1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "vk_mesh.h"
+#include "tiny_obj_loader.h"
+
+// Corners welded by a single task, big shapes are split in shards of this size
+static const size_t WELD_SHARD_SIZE = 64 * 1024;
+
+// 64 bit hash over every attribute of the vertex, consistent with Vertex::operator==
+// (-0 and +0 hash the same)
+uint64_t hash_vertex(const Vertex& v);
+
+// Open addressing table (linear probing, power of two capacity) that maps a vertex
+// to its index in an array owned by the caller
+class VertexTable
+{
+public:
+	void reserve(size_t count);
+
+	// Index of v in vertices, or candidate if v was not in the table.
+	// inserted tells which one it was; the caller is expected to append v when it is set.
+	uint32_t insert(const Vertex& v, uint64_t hash, uint32_t candidate, const Vertex* vertices, bool& inserted);
+
+	size_t size() const { return _count; }
+	size_t probes() const { return _probes; }
+	size_t lookups() const { return _lookups; }
+
+private:
+	struct Slot
+	{
+		uint32_t	index;		// UINT32_MAX when empty
+		uint32_t	tag;		// high half of the hash, avoids most vertex compares
+	};
+
+	std::vector<Slot>	_slots;
+	size_t				_mask{ 0 };
+	size_t				_count{ 0 };
+	size_t				_probes{ 0 };
+	size_t				_lookups{ 0 };
+
+	void rehash(size_t capacity, const Vertex* vertices);
+};
+
+// Builds the welded vertex/index arrays of an OBJ. Shapes are split in shards that are
+// welded in parallel on the ThreadPool, then merged in order, so the output is the same
+// as welding every corner serially in file order.
+void weld_obj(const tinyobj::attrib_t& attrib, const std::vector<tinyobj::shape_t>& shapes,
+	std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+// Times weld_obj against the std::unordered_map path on an OBJ file, returns the process exit code
+int weld_benchmark(const char* filename, uint32_t runs);
@@ -5,6 +5,7 @@
 #include "vk_initializers.h"
 #include "vk_textures.h"
 #include "window.h"
+#include "asset_loader.h"
 
 #define VMA_IMPLEMENTATION
 #include "vma/vk_mem_alloc.h"
@@ -41,9 +42,21 @@ void VulkanEngine::init()
 
 	init_upload_commands();
 
+	AssetLoader::get().init();
+
 	_scene = new Scene();
 	_scene->create_scene(1);
 
+	// Acceleration structures and descriptor sets are built once from every asset,
+	// so the scene has to be resident before the renderer is created
+	AssetLoader::get().wait_idle();
+
+	const UploadQueue& uploads = AssetLoader::get().queue();
+	const StagingStats& staging = uploads.stats();
+	std::cout << "Staging: " << staging.bytesAllocated / (1024 * 1024) << " MB in " << staging.allocations << " copies, "
+		<< uploads.batches() << " batches, peak in flight " << staging.peakBytesInFlight / (1024 * 1024) << " / "
+		<< staging.capacity / (1024 * 1024) << " MB, " << staging.stalls << " stalls" << std::endl;
+
 	init_ray_tracing();
 
 	// Add necessary features to the engine
@@ -69,6 +82,9 @@ void VulkanEngine::cleanup()
 
 		//vkDeviceWaitIdle(_device);
 
+		renderer->flush_surfel_stats();
+		renderer->flush_surfel_cache();
+
 		_mainDeletionQueue.flush();
 
 		vkDestroySurfaceKHR(_instance, _surface, nullptr);
@@ -102,7 +118,12 @@ void VulkanEngine::run()
 
 		while (SDL_PollEvent(&e) != 0)
 		{
-			if (e.type == SDL_QUIT) _bQuit = true;
+			// The last frame carries the copy of the surfel snapshot
+			if (e.type == SDL_QUIT)
+			{
+				_bQuit = true;
+				renderer->request_surfel_cache_save();
+			}
 			_window->handleEvent(e, dt);
 		}
 
@@ -126,45 +147,35 @@ void VulkanEngine::run()
 
 void VulkanEngine::update(const float dt)
 {
+	AssetLoader::get().update();
+
 	_window->input_update();
 	updateFrame();
-	updateCameraMatrices();
-
-	// Skybox Matrix followin the camera
-	if (_skyboxFollow) {
-		glm::mat4 skyMatrix = glm::translate(glm::mat4(1), _scene->_camera->_position);
-		void* skyMatData;
-		vmaMapMemory(_allocator, renderer->_skyboxBuffer._allocation, &skyMatData);
-		memcpy(skyMatData, &skyMatrix, sizeof(glm::mat4));
-		vmaUnmapMemory(_allocator, renderer->_skyboxBuffer._allocation);
-	}
 
-	// TODO unify with the deferred update buffer
-	void* rtLightData;
-	vmaMapMemory(_allocator, renderer->_lightBuffer._allocation, &rtLightData);
-	uboLight* rtLightUBO = (uboLight*)rtLightData;
-	for (int i = 0; i < _scene->_lights.size(); i++)
-	{
-		_scene->_lights[i]->update();
-		Light* l = _scene->_lights[i];
-		if (l->type == DIRECTIONAL_LIGHT) {
-			rtLightUBO[i].color		= glm::vec4(l->color.x, l->color.y, l->color.z, l->intensity);
-			rtLightUBO[i].position	= glm::vec4(l->position.x, l->position.y, l->position.z, -1);
-		}
-		else {
-			rtLightUBO[i].color		= glm::vec4(l->color.x, l->color.y, l->color.z, l->intensity);
-			rtLightUBO[i].position	= glm::vec4(l->position.x, l->position.y, l->position.z, l->maxDistance);
-			rtLightUBO[i].radius	= l->radius;
-		}
-	}
-	memcpy(rtLightData, rtLightUBO, sizeof(rtLightUBO));
-	vmaUnmapMemory(_allocator, renderer->_lightBuffer._allocation);
+	// The slice of this frame is free once the GPU is done with the frame that used it last
+	VK_CHECK(vkWaitForFences(_device, 1, &renderer->get_current_frame()._renderFence, VK_TRUE, 1000000000));
 
+	const uint32_t frame = renderer->frame_index();
+	updateCameraMatrices();
 
-	void* debugData;
-	vmaMapMemory(VulkanEngine::engine->_allocator, renderer->_debugBuffer._allocation, &debugData);
-	memcpy(debugData, &debugTarget, sizeof(uint32_t));
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, renderer->_debugBuffer._allocation);
+	// Skybox Matrix followin the camera
+	static glm::mat4 skyMatrix(1);
+	if (_skyboxFollow)
+		skyMatrix = glm::translate(glm::mat4(1), _scene->_camera->_position);
+	renderer->_frameUniforms.write(frame, FRAME_SKYBOX, skyMatrix);
+	renderer->_frameUniforms.write(frame, FRAME_DEBUG, debugTarget);
+
+	// Only the lights that moved or were edited are copied into the frame slice
+	for (Light* light : _scene->_lights)
+		light->update();
+	renderer->_lights.update(_scene->_lights);
+	renderer->_lights.upload(frame, renderer->_frameUniforms);
+
+	// Bin the lights in view space clusters for the deferred pass, same near and far as GPUCameraData
+	glm::mat4 projection = _scene->_camera->getProjection((float)_window->getWidth() / (float)_window->getHeight());
+	projection[1][1] *= -1;
+	renderer->_lightClusters.build(renderer->_lights.records(), _scene->_camera->getView(), projection, 0.1f, 200.0f);
+	renderer->_lightClusters.upload(frame, renderer->_frameUniforms);
 
 
 	// Shadow samples
@@ -193,6 +204,9 @@ void VulkanEngine::update(const float dt)
 
 void VulkanEngine::immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function)
 {
+	// Pending uploads go first so the commands below can read them
+	AssetLoader::get().flush();
+
 	VkCommandBufferAllocateInfo cmdAllocInfo = vkinit::command_buffer_allocate_info(_uploadContext._commandPool, 1);
 
 	VkCommandBuffer cmd;
@@ -239,6 +253,8 @@ VkCommandBuffer VulkanEngine::beginSingleTimeCommands() {
 void VulkanEngine::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
 	vkEndCommandBuffer(commandBuffer);
 
+	AssetLoader::get().flush();
+
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	submitInfo.commandBufferCount = 1;
@@ -320,7 +336,7 @@ void VulkanEngine::init_vulkan()
 
 	vkb::PhysicalDeviceSelector selector{ vkb_inst };
 	vkb::PhysicalDevice physicalDevice = selector
-		.set_minimum_version(1, 1)
+		.set_minimum_version(1, 2)
 		.set_surface(_surface)
 		.add_required_extensions(required_device_extensions)
 		.select()
@@ -654,11 +670,16 @@ void VulkanEngine::get_enabled_features()
 {
 	enabledIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
 	enabledIndexingFeatures.runtimeDescriptorArray = VK_TRUE;
+	enabledIndexingFeatures.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;	// deferred.frag picks shadow maps per cluster
 	enabledIndexingFeatures.pNext = nullptr;
 
+	enabledTimelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+	enabledTimelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
+	enabledTimelineSemaphoreFeatures.pNext = &enabledIndexingFeatures;
+
 	enabledBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
 	enabledBufferDeviceAddressFeatures.bufferDeviceAddress = VK_TRUE;
-	enabledBufferDeviceAddressFeatures.pNext = &enabledIndexingFeatures;
+	enabledBufferDeviceAddressFeatures.pNext = &enabledTimelineSemaphoreFeatures;
 
 	enabledRayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
 	enabledRayTracingPipelineFeatures.rayTracingPipeline = VK_TRUE;
@@ -779,36 +800,27 @@ void VulkanEngine::updateCameraMatrices()
 	glm::mat4 projection	= _scene->_camera->getProjection((float)_window->getWidth() / (float)_window->getHeight());
 	projection[1][1] *= -1;
 
-	if (memcmp(&prevView[0][0], &view[0][0], sizeof(glm::mat4)) != 0 || memcmp(&prevProj[0][0], &projection[0][0], sizeof(glm::mat4)) != 0)
-	{
-		void* camPosData;
-		vmaMapMemory(_allocator, renderer->_cameraPositionBuffer._allocation, &camPosData);
-		memcpy(camPosData, &_scene->_camera->_position, sizeof(glm::vec3));
-		vmaUnmapMemory(_allocator, renderer->_cameraPositionBuffer._allocation);
-
-		// Fill the GPU camera data struct
-		GPUCameraData cameraData;
-		cameraData.view			= view;
-		cameraData.projection	= projection;
-		cameraData.prevView		= prevView;
-		cameraData.prevProj		= prevProj;
-		cameraData.pos			= _scene->_camera->_position;
-		cameraData.near			= 0.1f;
-		cameraData.far			= 200.0f;
-
-		prevView = view;
-		prevProj = projection;
-
-		void* data;
-		vmaMapMemory(_allocator, renderer->_cameraBuffer._allocation, &data);
-		memcpy(data, &cameraData, sizeof(GPUCameraData));
-		vmaUnmapMemory(_allocator, renderer->_cameraBuffer._allocation);
-	}
+	// Every frame in flight has its own slice, so the camera is written each frame
+	const uint32_t frame = renderer->frame_index();
+	FrameUniforms& uniforms = renderer->_frameUniforms;
+
+	uniforms.write(frame, FRAME_CAMERA_POSITION, _scene->_camera->_position);
+
+	// Fill the GPU camera data struct
+	GPUCameraData cameraData;
+	cameraData.view			= view;
+	cameraData.projection	= projection;
+	cameraData.prevView		= prevView;
+	cameraData.prevProj		= prevProj;
+	cameraData.pos			= _scene->_camera->_position;
+	cameraData.near			= 0.1f;
+	cameraData.far			= 200.0f;
+
+	prevView = view;
+	prevProj = projection;
 
-	void* frameData;
-	vmaMapMemory(_allocator, renderer->_frameCountBuffer._allocation, &frameData);
-	memcpy(frameData, &_denoise_frame, sizeof(int));
-	vmaUnmapMemory(_allocator, renderer->_frameCountBuffer._allocation);
+	uniforms.write(frame, FRAME_CAMERA, cameraData);
+	uniforms.write(frame, FRAME_COUNT, _denoise_frame);
 
 	// Copy RAY-TRACING camera, it need the inverse
 	// --------------------------------------------
@@ -822,10 +834,7 @@ void VulkanEngine::updateCameraMatrices()
 
 	//std::cout << _denoise_frame << std::endl;
 
-	void* rtCameraData;
-	vmaMapMemory(_allocator, renderer->_rtCameraBuffer._allocation, &rtCameraData);
-	memcpy(rtCameraData, &rtCamera, sizeof(RTCameraData));
-	vmaUnmapMemory(_allocator, renderer->_rtCameraBuffer._allocation);
+	uniforms.write(frame, FRAME_RT_CAMERA, rtCamera);
 }
 
 VkPipeline PipelineBuilder::build_pipeline(VkDevice device, VkRenderPass pass)
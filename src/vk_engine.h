@@ -76,12 +76,6 @@ struct GPUObjectData {
 	glm::mat4 modelMatrix;
 };
 
-struct uboLight {
-	glm::vec4	position;	// w used for maxDistance
-	glm::vec4	color;		// w used for intensity;
-	alignas(16) float	radius;		// the radius of sphere light for soft shadows purpose
-};
-
 struct UploadContext {
 	VkFence			_uploadFence;
 	VkCommandPool	_commandPool;
@@ -108,6 +102,12 @@ public:
 
 	bool _skyboxFollow{ true };
 
+	// Surfel budget and grid, set before init
+	SurfelConfig _surfelConfig;
+
+	// CSV or JSON Lines stream of the surfel counters of every frame, none when empty
+	std::string _surfelTelemetryPath;
+
 	Window *_window;
 	Scene* _scene;
 
@@ -160,6 +160,7 @@ public:
 	int _samples = 1;
 
 	VkPhysicalDeviceDescriptorIndexingFeaturesEXT		enabledIndexingFeatures{};
+	VkPhysicalDeviceTimelineSemaphoreFeatures			enabledTimelineSemaphoreFeatures{};
 
 	// vkRay
 	VkPhysicalDeviceRayTracingPipelinePropertiesKHR		_rtProperties;
@@ -3,6 +3,13 @@
 #include "vk_initializers.h"
 #include "vk_engine.h"
 #include "vk_utils.h"
+#include "mesh_cache.h"
+#include "vertex_weld.h"
+#include "thread_pool.h"
+#include "asset_loader.h"
+
+#include <algorithm>
+#include <chrono>
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -64,17 +71,6 @@ VertexInputDescription Vertex::get_vertex_description()
 	return description;
 }
 
-namespace std {
-	template<> struct hash<Vertex> {
-		size_t operator()(Vertex const& vertex) const {
-			return ((((hash<glm::vec3>()(vertex.position) ^
-				(hash<glm::vec3>()(vertex.normal) << 1)) >> 1) ^
-				(hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-				(hash<glm::vec2>()(vertex.uv) << 1);
-		}
-	};
-}
-
 Mesh* Mesh::GET(const char* filename)
 {
 	std::string s = filename;
@@ -83,7 +79,27 @@ Mesh* Mesh::GET(const char* filename)
 	if(!_loadedMeshes[name])
 	{
 		Mesh* mesh = new Mesh();
-		mesh->load_from_obj(name.c_str());
+
+		// The file is read and welded on a worker, the mesh is loaded once the AssetLoader records its upload
+		AssetLoader::get().load(
+			[=]() {
+				MeshCache cache;
+				if (cache.load(name, 0))
+				{
+					mesh->load_from_cache(cache);
+				}
+				else if (mesh->load_from_obj(name.c_str()))
+				{
+					MeshCache::write(name, 0, *mesh, {});
+				}
+			},
+			[=](UploadQueue& queue) {
+				mesh->record_upload(queue);
+			},
+			[=]() {
+				mesh->_resident = true;
+			});
+
 		_loadedMeshes[name] = mesh;
 		return mesh;
 	}
@@ -112,52 +128,20 @@ bool Mesh::load_from_obj(const char* filename)
 		return false;
 	}
 
-	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
-
-	for (const auto& shape : shapes)
-	{
-		for (const auto& index : shape.mesh.indices)
-		{
-			Vertex vertex{};
-
-			vertex.position = {
-				attrib.vertices[3 * index.vertex_index + 0],
-				attrib.vertices[3 * index.vertex_index + 1],
-				attrib.vertices[3 * index.vertex_index + 2]
-			};
-
-			vertex.normal = {
-				attrib.normals[3 * index.normal_index + 0],
-				attrib.normals[3 * index.normal_index + 1],
-				attrib.normals[3 * index.normal_index + 2]
-			};
-
-			vertex.color = { 1.0f, 1.0f, 1.0f };
-
-			if (attrib.texcoords.size() > 0)
-			{
-				vertex.uv = {
-					attrib.texcoords[2 * index.texcoord_index + 0],
-					1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-				};
-			}
-
-
-			if (uniqueVertices.count(vertex) == 0) {
-				uniqueVertices[vertex] = static_cast<uint32_t>(_vertices.size());
-				_vertices.push_back(vertex);
-			}
-
-			_indices.push_back(uniqueVertices[vertex]);
-		}
-	}
-
-	// upload mesh
-	upload();
+	weld_obj(attrib, shapes, _vertices, _indices);
 
 	return true;
 }
 
+void Mesh::load_from_cache(const MeshCache& cache)
+{
+	_cacheFile			= cache._file;
+	_cachedVertices		= cache.vertices();
+	_cachedIndices		= cache.indices();
+	_cachedVertexCount	= static_cast<size_t>(cache._header->vertices.count);
+	_cachedIndexCount	= static_cast<size_t>(cache._header->indices.count);
+}
+
 Mesh* Mesh::get_quad()
 {
 
@@ -262,76 +246,34 @@ Mesh* Mesh::get_cube()
 	return _loadedMeshes["cube"];
 }
 
-void Mesh::create_vertex_buffer()
+void Mesh::create_vertex_buffer(UploadQueue& queue)
 {
-	const size_t bufferSize = _vertices.size() * sizeof(Vertex);
-
-	VkBufferCreateInfo stagingBufferInfo = vkinit::buffer_create_info(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	const size_t bufferSize = vertex_count() * sizeof(Vertex);
 
 	VmaAllocationCreateInfo vmaAllocInfo = {};
-	vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-
-	AllocatedBuffer stagingBuffer;
-
-	VK_CHECK(vmaCreateBuffer(VulkanEngine::engine->_allocator, 
-		&stagingBufferInfo, &vmaAllocInfo, 
-		&stagingBuffer._buffer, 
-		&stagingBuffer._allocation, 
-		nullptr));
-
-	// Copy Vertex data
-	void* data;
-	vmaMapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation, &data);
-	memcpy(data, _vertices.data(), _vertices.size() * sizeof(Vertex));
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation);
+	vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
 
 	VkBufferCreateInfo vertexBufferInfo = vkinit::buffer_create_info(bufferSize,
 		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
 
-	vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-
 	VK_CHECK(vmaCreateBuffer(VulkanEngine::engine->_allocator, &vertexBufferInfo, &vmaAllocInfo,
 		&_vertexBuffer._buffer,
 		&_vertexBuffer._allocation,
 		nullptr));
 
 	// Copy vertex data
-	VulkanEngine::engine->immediate_submit([=](VkCommandBuffer cmd) {
-		VkBufferCopy copy;
-		copy.dstOffset = 0;
-		copy.srcOffset = 0;
-		copy.size = bufferSize;
-		vkCmdCopyBuffer(cmd, stagingBuffer._buffer, _vertexBuffer._buffer, 1, &copy);
-		});
+	queue.copy_buffer(vertex_data(), bufferSize, _vertexBuffer._buffer);
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vmaDestroyBuffer(VulkanEngine::engine->_allocator, this->_vertexBuffer._buffer, this->_vertexBuffer._allocation);
 		});
-
-	vmaDestroyBuffer(VulkanEngine::engine->_allocator, stagingBuffer._buffer, stagingBuffer._allocation);
-
 }
 
-void Mesh::create_index_buffer()
+void Mesh::create_index_buffer(UploadQueue& queue)
 {
-	const size_t bufferSize = _indices.size() * sizeof(uint32_t);
-	VkBufferCreateInfo stagingBufferInfo = vkinit::buffer_create_info(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+	const size_t bufferSize = index_count() * sizeof(uint32_t);
 
 	VmaAllocationCreateInfo vmaAllocInfo = {};
-	vmaAllocInfo.usage = VMA_MEMORY_USAGE_CPU_ONLY;
-
-	AllocatedBuffer stagingBuffer;
-
-	VK_CHECK(vmaCreateBuffer(VulkanEngine::engine->_allocator, &stagingBufferInfo, &vmaAllocInfo,
-		&stagingBuffer._buffer,
-		&stagingBuffer._allocation,
-		nullptr));
-
-	void* data;
-	vmaMapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation, &data);
-	memcpy(data, _indices.data(), _indices.size() * sizeof(uint32_t));
-	vmaUnmapMemory(VulkanEngine::engine->_allocator, stagingBuffer._allocation);
-
 	vmaAllocInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
 
 	VkBufferCreateInfo indexBufferInfo = vkinit::buffer_create_info(bufferSize,
@@ -343,25 +285,49 @@ void Mesh::create_index_buffer()
 		nullptr));
 
 	// Copy index data
-	VulkanEngine::engine->immediate_submit([=](VkCommandBuffer cmd) {
-		VkBufferCopy copy;
-		copy.dstOffset = 0;
-		copy.srcOffset = 0;
-		copy.size = bufferSize;
-		vkCmdCopyBuffer(cmd, stagingBuffer._buffer, _indexBuffer._buffer, 1, &copy);
-		});
+	queue.copy_buffer(index_data(), bufferSize, _indexBuffer._buffer);
 
 	VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
 		vmaDestroyBuffer(VulkanEngine::engine->_allocator, this->_indexBuffer._buffer, this->_indexBuffer._allocation);
 		});
-	
-	vmaDestroyBuffer(VulkanEngine::engine->_allocator, stagingBuffer._buffer, stagingBuffer._allocation);
+}
+
+void Mesh::record_upload(UploadQueue& queue)
+{
+	// A file that failed to load has no arrays, Vulkan does not take empty buffers
+	if (vertex_count() > 0 && index_count() > 0)
+	{
+		create_vertex_buffer(queue);
+		create_index_buffer(queue);
+	}
+
+	_loaded = true;
+
+	std::vector<std::function<void()>> callbacks;
+	callbacks.swap(_loadedCallbacks);
+	for (std::function<void()>& callback : callbacks)
+		callback();
 }
 
 void Mesh::upload()
 {
-	create_vertex_buffer();
-	create_index_buffer();
+	AssetLoader::get().upload(
+		[this](UploadQueue& queue) { record_upload(queue); },
+		[this]() { _resident = true; });
+}
+
+void Mesh::on_loaded(std::function<void()>&& callback)
+{
+	if (_loaded)
+		callback();
+	else
+		_loadedCallbacks.push_back(std::move(callback));
+}
+
+Mesh* Mesh::wait()
+{
+	AssetLoader::get().wait([this]() { return _resident; });
+	return this;
 }
 
 BlasInput Mesh::mesh_to_geometry()
@@ -372,7 +338,7 @@ BlasInput Mesh::mesh_to_geometry()
 	vertexBufferDeviceAddress.deviceAddress = VulkanEngine::engine->getBufferDeviceAddress(_vertexBuffer._buffer);
 	indexBufferDeviceAddress.deviceAddress	= VulkanEngine::engine->getBufferDeviceAddress(_indexBuffer._buffer);
 
-	const uint32_t nTriangles = _indices.size() / 3;
+	const uint32_t nTriangles = static_cast<uint32_t>(index_count() / 3);
 
 	// Set the triangles geometry
 	VkAccelerationStructureGeometryTrianglesDataKHR triangles{};
@@ -381,7 +347,7 @@ BlasInput Mesh::mesh_to_geometry()
 	triangles.vertexFormat	= VK_FORMAT_R32G32B32_SFLOAT;
 	triangles.vertexData	= vertexBufferDeviceAddress;
 	triangles.vertexStride	= sizeof(Vertex);
-	triangles.maxVertex		= static_cast<uint32_t>(_vertices.size());
+	triangles.maxVertex		= static_cast<uint32_t>(vertex_count());
 	triangles.indexData		= indexBufferDeviceAddress;
 	triangles.indexType		= VK_INDEX_TYPE_UINT32;
 
@@ -643,7 +609,182 @@ void Prefab::draw(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, glm::ma
 	}
 }
 
-void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, const bool invertNormals)
+// Output ranges of a glTF primitive, sized by loadNode and filled by loadModel
+struct GltfPrimitive
+{
+	const tinygltf::Primitive*	primitive;
+	Primitive*					target;
+	uint32_t					firstVertex;
+	uint32_t					vertexCount;
+	uint32_t					firstIndex;
+	uint32_t					indexCount;
+};
+
+// Accessors of a primitive, resolved once before decoding. Missing attributes stay null.
+struct GltfAccessors
+{
+	const uint8_t*	position{ nullptr };
+	const uint8_t*	normal{ nullptr };
+	const uint8_t*	texCoord{ nullptr };
+	const uint8_t*	index{ nullptr };
+	size_t			positionStride{ 0 };
+	size_t			normalStride{ 0 };
+	size_t			texCoordStride{ 0 };
+	size_t			indexStride{ 0 };
+	int				indexType{ 0 };
+};
+
+// Vertices or indices [first, last) of one primitive, the unit of work of the decode pass
+struct GltfDecodeChunk
+{
+	uint32_t	primitive;
+	bool		indices;
+	uint32_t	first;
+	uint32_t	last;
+};
+
+// Vertices/indices decoded by a single task, big primitives are split across the pool
+static const uint32_t GLTF_DECODE_GRAIN = 16 * 1024;
+
+// tinygltf reports a stride it cannot work out, from a bad component or element type, as -1
+static bool accessor_data(const tinygltf::Model& tmodel, const int index, const uint8_t*& data, size_t& stride)
+{
+	const tinygltf::Accessor& accessor = tmodel.accessors[index];
+	const tinygltf::BufferView& view = tmodel.bufferViews[accessor.bufferView];
+	const int byteStride = accessor.ByteStride(view);
+	if (byteStride < 0)
+		return false;
+
+	stride = static_cast<size_t>(byteStride);
+	data = &tmodel.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset];
+	return true;
+}
+
+static bool attribute_data(const tinygltf::Model& tmodel, const tinygltf::Primitive& tprimitive, const char* name, const uint8_t*& data, size_t& stride)
+{
+	auto it = tprimitive.attributes.find(name);
+	if (it == tprimitive.attributes.end())
+		return true;
+	return accessor_data(tmodel, it->second, data, stride);
+}
+
+static bool resolve_accessors(const tinygltf::Model& tmodel, const tinygltf::Primitive& tprimitive, GltfAccessors& accessors)
+{
+	// glTF supports multiple texture coordinate sets, we only load the first one
+	if (!attribute_data(tmodel, tprimitive, "POSITION", accessors.position, accessors.positionStride) ||
+		!attribute_data(tmodel, tprimitive, "NORMAL", accessors.normal, accessors.normalStride) ||
+		!attribute_data(tmodel, tprimitive, "TEXCOORD_0", accessors.texCoord, accessors.texCoordStride))
+		return false;
+
+	if (tprimitive.indices < 0)
+		return true;
+
+	accessors.indexType = tmodel.accessors[tprimitive.indices].componentType;
+	return accessor_data(tmodel, tprimitive.indices, accessors.index, accessors.indexStride);
+}
+
+static void decode_vertices(const GltfAccessors& accessors, const GltfPrimitive& prim, const uint32_t first, const uint32_t last, Vertex* vertices, const bool invertNormals)
+{
+	for (size_t v = first; v < last; v++)
+	{
+		glm::vec3 normal = accessors.normal ? glm::normalize(glm::make_vec3(reinterpret_cast<const float*>(accessors.normal + v * accessors.normalStride))) : glm::vec3(0.0f);
+		Vertex& vert	= vertices[prim.firstVertex + v];
+		vert.position	= glm::make_vec3(reinterpret_cast<const float*>(accessors.position + v * accessors.positionStride));
+		vert.normal		= invertNormals ? normal * glm::vec3(-1) : normal;
+		vert.uv			= accessors.texCoord ? glm::make_vec2(reinterpret_cast<const float*>(accessors.texCoord + v * accessors.texCoordStride)) : glm::vec2(0.0f);
+		vert.color		= glm::vec3(1.0f);
+	}
+}
+
+template<typename T>
+static void decode_indices(const GltfAccessors& accessors, const GltfPrimitive& prim, const uint32_t first, const uint32_t last, uint32_t* indices)
+{
+	for (size_t i = first; i < last; i++)
+		indices[prim.firstIndex + i] = *reinterpret_cast<const T*>(accessors.index + i * accessors.indexStride) + prim.firstVertex;
+}
+
+static void decode_chunk(const GltfAccessors& accessors, const GltfPrimitive& prim, const GltfDecodeChunk& chunk, Vertex* vertices, uint32_t* indices, const bool invertNormals)
+{
+	if (!chunk.indices)
+	{
+		decode_vertices(accessors, prim, chunk.first, chunk.last, vertices, invertNormals);
+		return;
+	}
+
+	// Non indexed primitives draw their vertices in order
+	if (!accessors.index)
+	{
+		for (uint32_t i = chunk.first; i < chunk.last; i++)
+			indices[prim.firstIndex + i] = prim.firstVertex + i;
+		return;
+	}
+
+	// glTF supports different component types of indices
+	switch (accessors.indexType) {
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
+		decode_indices<uint32_t>(accessors, prim, chunk.first, chunk.last, indices);
+		break;
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
+		decode_indices<uint16_t>(accessors, prim, chunk.first, chunk.last, indices);
+		break;
+	case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+		decode_indices<uint8_t>(accessors, prim, chunk.first, chunk.last, indices);
+		break;
+	}
+}
+
+void Prefab::loadModel(const tinygltf::Model& tmodel, const bool invertNormals)
+{
+	const tinygltf::Scene& scene = tmodel.scenes[0];
+	_mesh = new Mesh();
+
+	// First pass builds the hierarchy and the materials and sizes every primitive
+	std::vector<GltfPrimitive> primitives;
+	for (const int node : scene.nodes)
+	{
+		loadNode(tmodel, tmodel.nodes[node], nullptr, primitives);
+	}
+
+	if (!primitives.empty())
+	{
+		const GltfPrimitive& last = primitives.back();
+		_mesh->_vertices.resize(last.firstVertex + last.vertexCount);
+		_mesh->_indices.resize(last.firstIndex + last.indexCount);
+	}
+
+	Vertex* vertices = _mesh->_vertices.data();
+	uint32_t* indices = _mesh->_indices.data();
+
+	// Resolves the accessors and splits every primitive in chunks, so the second pass
+	// is a single flat loop over the pool whatever the number and size of the primitives
+	std::vector<GltfAccessors> accessors(primitives.size());
+	std::vector<GltfDecodeChunk> chunks;
+	for (uint32_t i = 0; i < primitives.size(); i++)
+	{
+		GltfPrimitive& prim = primitives[i];
+		if (!resolve_accessors(tmodel, *prim.primitive, accessors[i]))
+		{
+			// Its range stays in the mesh, zeroed and never drawn
+			std::cerr << "glTF primitive " << i << " has an accessor with an invalid byte stride, skipped" << std::endl;
+			prim.target->indexCount = 0;
+			std::fill(indices + prim.firstIndex, indices + prim.firstIndex + prim.indexCount, prim.firstVertex);
+			continue;
+		}
+
+		for (uint32_t first = 0; first < prim.vertexCount; first += GLTF_DECODE_GRAIN)
+			chunks.push_back({ i, false, first, std::min(first + GLTF_DECODE_GRAIN, prim.vertexCount) });
+		for (uint32_t first = 0; first < prim.indexCount; first += GLTF_DECODE_GRAIN)
+			chunks.push_back({ i, true, first, std::min(first + GLTF_DECODE_GRAIN, prim.indexCount) });
+	}
+
+	// Second pass decodes the accessors straight into their ranges
+	ThreadPool::get().parallel_for(0, chunks.size(), 1, [&](size_t i) {
+		const GltfDecodeChunk& chunk = chunks[i];
+		decode_chunk(accessors[chunk.primitive], primitives[chunk.primitive], chunk, vertices, indices, invertNormals);
+		});
+}
+
+void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, std::vector<GltfPrimitive>& primitives)
 {
 	// Init node and compute its local matrix
 	Node* node = new Node();
@@ -654,111 +795,60 @@ void Prefab::loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode
 	{
 		for (size_t i = 0; i < tnode.children.size(); i++)
 		{
-			loadNode(tmodel, tmodel.nodes[tnode.children[i]], node);
+			loadNode(tmodel, tmodel.nodes[tnode.children[i]], node, primitives);
 		}
 	}
 
-	// If node contains mesh data, load vertices and indices from the buffers
+	// If node contains mesh data, reserve its vertices and indices, they are decoded later by loadModel
 	if (tnode.mesh > -1)
 	{
-		const tinygltf::Mesh mesh = tmodel.meshes[tnode.mesh];
+		const tinygltf::Mesh& mesh = tmodel.meshes[tnode.mesh];
 		// Iterate through all primitives in mesh
 		for (size_t i = 0; i < mesh.primitives.size(); i++)
 		{
 			const tinygltf::Primitive& tprimitive = mesh.primitives[i];
-			uint32_t firstIndex = static_cast<uint32_t>(_mesh->_indices.size());
-			uint32_t firstVertex = static_cast<uint32_t>(_mesh->_vertices.size());
-			uint32_t indexCount = 0;
-			uint32_t vertexCount = 0;
 
-			//Vertices
+			GltfPrimitive range{};
+			range.primitive = &tprimitive;
+			if (!primitives.empty())
 			{
-				const float* positionBuffer = nullptr;
-				const float* normalsBuffer = nullptr;
-				const float* texCoordsBuffer = nullptr;
-
-				// Get buffer data for vertex position
-				if (tprimitive.attributes.find("POSITION") != tprimitive.attributes.end()) {
-					const tinygltf::Accessor& accessor = tmodel.accessors[tprimitive.attributes.find("POSITION")->second];
-					const tinygltf::BufferView& view = tmodel.bufferViews[accessor.bufferView];
-					positionBuffer = reinterpret_cast<const float*>(&(tmodel.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-					vertexCount = accessor.count;
-				}
-				// Get buffer data for vertex normals
-				if (tprimitive.attributes.find("NORMAL") != tprimitive.attributes.end()) {
-					const tinygltf::Accessor& accessor = tmodel.accessors[tprimitive.attributes.find("NORMAL")->second];
-					const tinygltf::BufferView& view = tmodel.bufferViews[accessor.bufferView];
-					normalsBuffer = reinterpret_cast<const float*>(&(tmodel.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-				}
-				// Get buffer data for vertex texture coordinates
-				// glTF supports multiple sets, we only load the first one
-				if (tprimitive.attributes.find("TEXCOORD_0") != tprimitive.attributes.end()) {
-					const tinygltf::Accessor& accessor = tmodel.accessors[tprimitive.attributes.find("TEXCOORD_0")->second];
-					const tinygltf::BufferView& view = tmodel.bufferViews[accessor.bufferView];
-					texCoordsBuffer = reinterpret_cast<const float*>(&(tmodel.buffers[view.buffer].data[accessor.byteOffset + view.byteOffset]));
-				}
+				range.firstVertex	= primitives.back().firstVertex + primitives.back().vertexCount;
+				range.firstIndex	= primitives.back().firstIndex + primitives.back().indexCount;
+			}
+
+			auto position = tprimitive.attributes.find("POSITION");
+			if (position != tprimitive.attributes.end())
+				range.vertexCount = static_cast<uint32_t>(tmodel.accessors[position->second].count);
 
-				// Append data to model's vertex buffer
-				for (size_t v = 0; v < vertexCount; v++) 
+			if (tprimitive.indices > -1)
+			{
+				const int componentType = tmodel.accessors[tprimitive.indices].componentType;
+				if (componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT &&
+					componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT &&
+					componentType != TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE)
 				{
-					glm::vec3 normal = glm::normalize(glm::vec3(normalsBuffer ? glm::make_vec3(&normalsBuffer[v * 3]) : glm::vec3(0.0f)));
-					Vertex vert{};
-					vert.position	= glm::vec4(glm::make_vec3(&positionBuffer[v * 3]), 1.0f);
-					vert.normal		= invertNormals ? normal * glm::vec3(-1) : normal;
-					vert.uv			= texCoordsBuffer ? glm::make_vec2(&texCoordsBuffer[v * 2]) : glm::vec3(0.0f);
-					vert.color		= glm::vec3(1.0f);
-					_mesh->_vertices.push_back(vert);
+					std::cerr << "Index component type " << componentType << " not supported!" << std::endl;
+					continue;
 				}
+				range.indexCount = static_cast<uint32_t>(tmodel.accessors[tprimitive.indices].count);
 			}
-			//Indices
+			else
 			{
-				const tinygltf::Accessor& accessor		= tmodel.accessors[tprimitive.indices];
-				const tinygltf::BufferView& bufferView	= tmodel.bufferViews[accessor.bufferView];
-				const tinygltf::Buffer& buffer			= tmodel.buffers[bufferView.buffer];
-
-				indexCount += static_cast<uint32_t>(accessor.count);
-
-				// glTF supports different component types of indices
-				switch (accessor.componentType) {
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
-					uint32_t* buf = new uint32_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint32_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						_mesh->_indices.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
-					uint16_t* buf = new uint16_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint16_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						_mesh->_indices.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
-					uint8_t* buf = new uint8_t[accessor.count];
-					memcpy(buf, &buffer.data[accessor.byteOffset + bufferView.byteOffset], accessor.count * sizeof(uint8_t));
-					for (size_t index = 0; index < accessor.count; index++) {
-						_mesh->_indices.push_back(buf[index] + firstVertex);
-					}
-					break;
-				}
-				default:
-					std::cerr << "Index component type " << accessor.componentType << " not supported!" << std::endl;
-					return;
-				}
+				range.indexCount = range.vertexCount;
 			}
 
 			// Load the primitive information
 			Primitive* prim = new Primitive();
-			prim->firstIndex	= firstIndex;
-			prim->indexCount	= indexCount;
-			prim->firstVertex	= firstVertex;
-			prim->vertexCount	= vertexCount;
+			prim->firstIndex	= range.firstIndex;
+			prim->indexCount	= range.indexCount;
+			prim->firstVertex	= range.firstVertex;
+			prim->vertexCount	= range.vertexCount;
 			prim->materialID	= loadMaterial(tmodel, tprimitive.material);
 			loadTextures(tmodel, prim->materialID);
 			node->_primitives.push_back(prim);
+
+			range.target = prim;
+			primitives.push_back(range);
 		}
 	}
 
@@ -828,18 +918,123 @@ void Prefab::loadTextures(const tinygltf::Model& tmodel, const int index)
 	}
 }
 
+void Prefab::loadFromCache(const MeshCache& cache)
+{
+	_mesh = new Mesh();
+	_mesh->load_from_cache(cache);
+	_mesh->upload();
+
+	// Materials go through the same dedup as loadMaterial, textures are stored by path
+	const MeshCacheMaterial* cacheMaterials = cache.materials();
+	std::vector<int> materialIDs(static_cast<size_t>(cache._header->materials.count));
+	for (size_t i = 0; i < materialIDs.size(); i++)
+	{
+		const MeshCacheMaterial& m = cacheMaterials[i];
+		auto texture_id = [&](const uint32_t offset) {
+			const char* path = cache.string(offset);
+			if (!path)
+				return -1;
+			Texture::GET(path);
+			return Texture::get_id(path);
+		};
+
+		Material* mat = new Material();
+		mat->diffuseColor				= glm::vec4(m.diffuseColor[0], m.diffuseColor[1], m.diffuseColor[2], m.diffuseColor[3]);
+		mat->metallicFactor				= m.metallicFactor;
+		mat->roughnessFactor			= m.roughnessFactor;
+		mat->ior						= m.ior;
+		mat->uvFactor					= m.uvFactor;
+		mat->shadingModel				= m.shadingModel;
+		mat->diffuseTexture				= texture_id(m.diffuseTexture);
+		mat->metallicRoughnessTexture	= texture_id(m.metallicRoughnessTexture);
+		mat->emissiveTexture			= texture_id(m.emissiveTexture);
+		mat->normalTexture				= texture_id(m.normalTexture);
+
+		if (Material::exists(mat))
+		{
+			materialIDs[i] = Material::getIndex(mat);
+			delete mat;
+		}
+		else
+		{
+			Material::_materials.push_back(mat);
+			materialIDs[i] = Material::_materials.size() - 1;
+		}
+	}
+
+	// Nodes are stored parents first
+	const MeshCacheNode* cacheNodes = cache.nodes();
+	const MeshCachePrimitive* cachePrimitives = cache.primitives();
+	std::vector<Node*> nodes(static_cast<size_t>(cache._header->nodes.count));
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const MeshCacheNode& n = cacheNodes[i];
+
+		Node* node = new Node();
+		node->_parent = NULL;
+		node->_matrix = glm::make_mat4x4(n.matrix);
+
+		for (uint32_t p = 0; p < n.primitiveCount; p++)
+		{
+			const MeshCachePrimitive& cp = cachePrimitives[n.firstPrimitive + p];
+
+			Primitive* prim = new Primitive();
+			prim->firstIndex	= cp.firstIndex;
+			prim->indexCount	= cp.indexCount;
+			prim->firstVertex	= cp.firstVertex;
+			prim->vertexCount	= cp.vertexCount;
+			prim->materialID	= materialIDs[cp.material];
+			node->_primitives.push_back(prim);
+		}
+
+		if (n.parent >= 0)
+		{
+			node->_parent = nodes[n.parent];
+			nodes[n.parent]->_children.push_back(node);
+		}
+		else
+		{
+			_root.push_back(node);
+		}
+
+		nodes[i] = node;
+	}
+}
+
 void Prefab::createOBJprefab(Mesh* mesh)
 {
 	Node* node = new Node();
 	_mesh = mesh;
 	Primitive* p = new Primitive();
-	p->indexCount		= _mesh ? _mesh->_indices.size() : 0;
-	p->vertexCount		= _mesh ? _mesh->_vertices.size() : 0;
 	p->materialID	= Material::setDefaultMaterial();
+	// Meshes from files only know their size once the loader has decoded them
+	if (_mesh)
+	{
+		_mesh->on_loaded([p, mesh]() {
+			p->indexCount	= static_cast<uint32_t>(mesh->index_count());
+			p->vertexCount	= static_cast<uint32_t>(mesh->vertex_count());
+			});
+	}
 	node->_primitives.push_back(p);
 	_root.push_back(node);
 }
 
+// State of a glTF import shared by its AssetLoader callbacks
+struct GltfImport
+{
+	MeshCache			cache;
+	tinygltf::Model		model;
+	std::string			warn, err;
+	bool				cached{ false };
+	bool				loaded{ false };
+	bool				built{ false };
+
+	std::chrono::steady_clock::time_point	start;
+	std::chrono::steady_clock::time_point	parsed;
+	std::chrono::steady_clock::duration		decoded{ 0 };
+	std::chrono::steady_clock::time_point	uploadStart;
+};
+
 Prefab* Prefab::GET(const std::string filename, bool invertNormals)
 {
 	std::string name = vkutil::findFile(filename, searchPaths, true);
@@ -865,32 +1060,72 @@ Prefab* Prefab::GET(const std::string filename, bool invertNormals)
 				return nullptr;
 			}
 
-			std::cout << "Loading gltf... " << filename << std::endl;
-
-			tinygltf::Model		gltfModel;
-			tinygltf::TinyGLTF	gltfContext;
-			std::string			warn, err;
-			bool				fileLoaded{ false };
+			const uint32_t cacheFlags = invertNormals ? MESH_CACHE_INVERT_NORMALS : 0;
+
+			// The cache is read or the file parsed on a worker, the prefab is built on the main thread
+			// where its materials and textures are created, and its upload timed until it is resident
+			std::shared_ptr<GltfImport> import = std::make_shared<GltfImport>();
+			import->start = std::chrono::steady_clock::now();
+
+			AssetLoader::get().load(
+				[=]() {
+					import->cached = import->cache.load(name, cacheFlags);
+					if (import->cached)
+						return;
+
+					std::cout << "Loading gltf... " << filename << std::endl;
+
+					tinygltf::TinyGLTF gltfContext;
+					import->loaded = binary ? gltfContext.LoadBinaryFromFile(&import->model, &import->err, &import->warn, name)
+						: gltfContext.LoadASCIIFromFile(&import->model, &import->err, &import->warn, name);
+					import->parsed = std::chrono::steady_clock::now();
+				},
+				[=](UploadQueue&) {
+					if (import->cached)
+					{
+						prefab->loadFromCache(import->cache);
+					}
+					else
+					{
+						if (!import->err.empty())
+							throw std::runtime_error(import->err.c_str());
+
+						if (import->loaded)
+						{
+							const auto decodeStart = std::chrono::steady_clock::now();
+							prefab->loadModel(import->model, invertNormals);
+							import->decoded = std::chrono::steady_clock::now() - decodeStart;
+
+							prefab->_mesh->upload();
+							MeshCache::write(name, cacheFlags, *prefab->_mesh, prefab->_root);
+						}
+					}
+					import->uploadStart = std::chrono::steady_clock::now();
+					import->built = true;
+				},
+				[=]() {
+					if (!prefab->_mesh)
+						return;
+
+					const auto resident = std::chrono::steady_clock::now();
+					typedef std::chrono::duration<double, std::milli> ms;
+					if (import->cached)
+					{
+						std::cout << "Imported " << filename << " from cache in " << ms(resident - import->start).count() << " ms" << std::endl;
+						return;
+					}
 
-			fileLoaded = binary ? gltfContext.LoadBinaryFromFile(&gltfModel, &err, &warn, vkutil::findFile(filename, searchPaths, true))
-				: gltfContext.LoadASCIIFromFile(&gltfModel, &err, &warn, vkutil::findFile(filename, searchPaths, true));
+					std::cout << "Imported " << filename << " in " << ms(resident - import->start).count() << " ms (parse "
+						<< ms(import->parsed - import->start).count() << ", decode " << ms(import->decoded).count() << ", upload "
+						<< ms(resident - import->uploadStart).count() << "), " << prefab->_mesh->_vertices.size() << " vertices, "
+						<< prefab->_mesh->_indices.size() << " indices" << std::endl;
+				});
 
-			if (!err.empty())
-				throw std::runtime_error(err.c_str());
+			// Callers use the hierarchy right away, other assets keep streaming while the file is parsed
+			AssetLoader::get().wait([import]() { return import->built; });
 
-			if (fileLoaded)
+			if (import->cached || import->loaded)
 			{
-				// TODO: import materials
-				const tinygltf::Scene& scene = gltfModel.scenes[0];
-				prefab->_mesh = new Mesh();
-
-				for (const int node : scene.nodes)
-				{
-					prefab->loadNode(gltfModel, gltfModel.nodes[node], nullptr, invertNormals);
-				}
-
-				prefab->_mesh->upload();
-
 				_prefabsMap[name] = prefab;
 				return prefab;
 			}
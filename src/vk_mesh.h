@@ -4,6 +4,12 @@
 #include <vk_textures.h>
 #include "material.h"
 
+#include <memory>
+
+class MappedFile;
+class MeshCache;
+class UploadQueue;
+
 struct VertexInputDescription{
 	std::vector<VkVertexInputBindingDescription> bindings;
 	std::vector<VkVertexInputAttributeDescription> attributes;
@@ -28,7 +34,7 @@ struct Vertex
 	static VertexInputDescription get_vertex_description();
 
 	bool operator==(const Vertex& other) const {
-		return position == other.position && color == other.color && uv == other.uv;
+		return position == other.position && normal == other.normal && color == other.color && uv == other.uv;
 	}
 };
 
@@ -74,12 +80,30 @@ struct Mesh
 	static std::unordered_map<std::string, Mesh*> _loadedMeshes;
 	std::vector<Vertex>		_vertices;
 	std::vector<uint32_t>	_indices;
+
+	// Set when the mesh was loaded from its cache, the arrays then stay in the mapped file
+	std::shared_ptr<MappedFile>	_cacheFile;
+	const Vertex*				_cachedVertices{ nullptr };
+	const uint32_t*				_cachedIndices{ nullptr };
+	size_t						_cachedVertexCount{ 0 };
+	size_t						_cachedIndexCount{ 0 };
 	
 	AllocatedBuffer			_vertexBuffer;
 	AllocatedBuffer			_indexBuffer;
 
+	// Loaded: the arrays are in place and the buffers exist. Resident: the GPU copies are done.
+	bool								_loaded{ false };
+	bool								_resident{ false };
+	std::vector<std::function<void()>>	_loadedCallbacks;
+
+	// Returns right away, meshes from files stream in through the AssetLoader
 	static Mesh* GET(const char* filename);
 
+	const Vertex*	vertex_data() const		{ return _cacheFile ? _cachedVertices : _vertices.data(); }
+	const uint32_t*	index_data() const		{ return _cacheFile ? _cachedIndices : _indices.data(); }
+	size_t			vertex_count() const	{ return _cacheFile ? _cachedVertexCount : _vertices.size(); }
+	size_t			index_count() const		{ return _cacheFile ? _cachedIndexCount : _indices.size(); }
+
 	static Mesh* get_quad();
 	static Mesh* get_triangle();
 	static Mesh* get_cube();
@@ -87,11 +111,20 @@ struct Mesh
 	void upload();
 	BlasInput mesh_to_geometry();
 
+	// Runs callback once the mesh is loaded, right away if it already is
+	void on_loaded(std::function<void()>&& callback);
+
+	// Blocks until the mesh is resident, for code that draws it right away
+	Mesh* wait();
+
 private:
+	friend class Prefab;
 
 	bool load_from_obj(const char* filename);
-	void create_vertex_buffer();
-	void create_index_buffer();
+	void load_from_cache(const MeshCache& cache);
+	void record_upload(UploadQueue& queue);
+	void create_vertex_buffer(UploadQueue& queue);
+	void create_index_buffer(UploadQueue& queue);
 };
 
 class Node
@@ -130,6 +163,8 @@ namespace tinygltf {
 	class Model;
 };
 
+struct GltfPrimitive;
+
 class Prefab
 {
 public:
@@ -146,7 +181,9 @@ public:
 
 private:
 
-	void loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, const bool invertNormals = false);
+	void loadModel(const tinygltf::Model& tmodel, const bool invertNormals);
+	void loadNode(const tinygltf::Model& tmodel, const tinygltf::Node& tnode, Node* parent, std::vector<GltfPrimitive>& primitives);
+	void loadFromCache(const MeshCache& cache);
 	int loadMaterial(const tinygltf::Model& tmodel, const int index);
 	void loadTextures(const tinygltf::Model&, const int index);
 	void drawNode(VkCommandBuffer& cmd, VkPipelineLayout pipelineLayout, Node& node, glm::mat4& model);
@@ -4,6 +4,9 @@
 #include "vk_engine.h"
 #include "stb_image/stb_image.h"
 #include "vk_utils.h"
+#include "asset_loader.h"
+
+#include <memory>
 
 extern std::vector<std::string> searchPaths;
 std::vector<std::pair<std::string, Texture*>> Texture::_textures;
@@ -19,87 +22,38 @@ bool vkutil::load_image_from_file(VulkanEngine& engine, const char* filename, Al
 		return false;
 	}
 
-	void* pixels_ptr = pixels;
-	VkDeviceSize imageSize = texWidth * textHeight * 4;
+	bool done = false;
+	AssetLoader::get().upload(
+		[&](UploadQueue& queue) { upload_image(engine, queue, pixels, texWidth, textHeight, outImage); },
+		[&]() { done = true; });
+	AssetLoader::get().wait([&]() { return done; });
 
-	// The format R8G8B8A8 match exactly with the pixels loaded from stbi_load lib
-	VkFormat image_format = VK_FORMAT_R8G8B8A8_UNORM;
+	stbi_image_free(pixels);
 
-	// Allocate temporary buffer for holding texture data to upload
-	AllocatedBuffer stagingBuffer;
-	engine.create_buffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, stagingBuffer, false);
+	std::cout << "Texture loaded successfully " << filename << std::endl;
 
-	void* data;
-	vmaMapMemory(engine._allocator, stagingBuffer._allocation, &data);
-	memcpy(data, pixels_ptr, static_cast<size_t>(imageSize));
-	vmaUnmapMemory(engine._allocator, stagingBuffer._allocation);
+	return true;
+}
 
-	stbi_image_free(pixels);
+void vkutil::upload_image(VulkanEngine& engine, UploadQueue& queue, const void* pixels, int width, int height, AllocatedImage& outImage)
+{
+	// The format R8G8B8A8 match exactly with the pixels loaded from stbi_load lib
+	VkFormat image_format = VK_FORMAT_R8G8B8A8_UNORM;
 
 	VkExtent3D imageExtent;
-	imageExtent.width = static_cast<uint32_t>(texWidth);
-	imageExtent.height = static_cast<uint32_t>(textHeight);
+	imageExtent.width = static_cast<uint32_t>(width);
+	imageExtent.height = static_cast<uint32_t>(height);
 	imageExtent.depth = 1;
 
 	VkImageCreateInfo dimb_info = vkinit::image_create_info(
 		image_format, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, imageExtent);
 
-	AllocatedImage newImage;
-
 	VmaAllocationCreateInfo dimg_allocinfo = {};
 	dimg_allocinfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
 
-	vmaCreateImage(engine._allocator, &dimb_info, &dimg_allocinfo, &newImage._image, &newImage._allocation, nullptr);
-
-	engine.immediate_submit([&](VkCommandBuffer cmd) {
-		VkImageSubresourceRange range;
-		range.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
-		range.baseMipLevel		= 0;
-		range.levelCount		= 1;
-		range.baseArrayLayer	= 0;
-		range.layerCount		= 1;
-
-		VkImageMemoryBarrier imageBarrier_toTransfer = {};
-		imageBarrier_toTransfer.sType				= VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-		imageBarrier_toTransfer.pNext				= nullptr;
-		imageBarrier_toTransfer.oldLayout			= VK_IMAGE_LAYOUT_UNDEFINED;
-		imageBarrier_toTransfer.newLayout			= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageBarrier_toTransfer.image				= newImage._image;
-		imageBarrier_toTransfer.subresourceRange	= range;
-		imageBarrier_toTransfer.srcAccessMask		= 0;
-		imageBarrier_toTransfer.dstAccessMask		= VK_ACCESS_TRANSFER_WRITE_BIT;
-
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
-			0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toTransfer);
-
-		VkBufferImageCopy copyRegion = {};
-		copyRegion.bufferOffset						= 0;
-		copyRegion.bufferRowLength					= 0;
-		copyRegion.bufferImageHeight				= 0;
-		copyRegion.imageSubresource.aspectMask		= VK_IMAGE_ASPECT_COLOR_BIT;
-		copyRegion.imageSubresource.mipLevel		= 0;
-		copyRegion.imageSubresource.baseArrayLayer	= 0;
-		copyRegion.imageSubresource.layerCount		= 1;
-		copyRegion.imageExtent						= imageExtent;
-
-		vkCmdCopyBufferToImage(cmd, stagingBuffer._buffer, newImage._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
-
-		VkImageMemoryBarrier imageBarrier_toReadable = imageBarrier_toTransfer;
-		imageBarrier_toReadable.oldLayout		= VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageBarrier_toReadable.newLayout		= VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		imageBarrier_toReadable.srcAccessMask	= VK_ACCESS_TRANSFER_WRITE_BIT;
-		imageBarrier_toReadable.dstAccessMask	= VK_ACCESS_SHADER_READ_BIT;
-
-		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &imageBarrier_toReadable);
-
-	});
-
-	vmaDestroyBuffer(engine._allocator, stagingBuffer._buffer, stagingBuffer._allocation);
+	vmaCreateImage(engine._allocator, &dimb_info, &dimg_allocinfo, &outImage._image, &outImage._allocation, nullptr);
 
-	std::cout << "Texture loaded successfully " << filename << std::endl;
-
-	outImage = newImage;
-	return true;
+	queue.copy_image(pixels, imageExtent, 4, outImage._image);
 }
 
 bool vkutil::load_cubemap(VulkanEngine& engine, const char* filename, VkFormat format, AllocatedImage& outImage)
@@ -137,22 +91,59 @@ Texture* Texture::GET(const char* filename, const bool cubemap)
 		}
 	}
 
-	// Load texture if it does not exist
+	// Load texture if it does not exist, decoding happens on a worker and the
+	// copy is batched with the rest of the frame's uploads
 	Texture* t = new Texture();
-	vkutil::load_image_from_file(*VulkanEngine::engine, name.c_str(), t->image);
-	VkImageViewCreateInfo imageInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, t->image._image, VK_IMAGE_ASPECT_COLOR_BIT);
-	vkCreateImageView(VulkanEngine::engine->_device, &imageInfo, nullptr, &t->imageView);
-
 	_textures.push_back({ name, t });
 
-	VulkanEngine::engine->_mainDeletionQueue.push_function([=](){
-		vkDestroyImageView(VulkanEngine::engine->_device, t->imageView, nullptr);
-		vmaDestroyImage(VulkanEngine::engine->_allocator, t->image._image, t->image._allocation);
+	struct Pixels
+	{
+		stbi_uc*	data{ nullptr };
+		int			width{ 0 };
+		int			height{ 0 };
+	};
+	std::shared_ptr<Pixels> pixels = std::make_shared<Pixels>();
+
+	AssetLoader::get().load(
+		[=]() {
+			int channels;
+			pixels->data = stbi_load(name.c_str(), &pixels->width, &pixels->height, &channels, STBI_rgb_alpha);
+		},
+		[=](UploadQueue& queue) {
+			// Missing files get a white texel so the descriptors stay valid
+			static const uint32_t white = 0xFFFFFFFF;
+			if (!pixels->data)
+				std::cout << "Failed to load texture file: " << name << std::endl;
+
+			vkutil::upload_image(*VulkanEngine::engine, queue,
+				pixels->data ? (const void*)pixels->data : (const void*)&white,
+				pixels->data ? pixels->width : 1, pixels->data ? pixels->height : 1, t->image);
+
+			if (pixels->data)
+				stbi_image_free(pixels->data);
+			pixels->data = nullptr;
+
+			VkImageViewCreateInfo imageInfo = vkinit::image_view_create_info(VK_FORMAT_R8G8B8A8_UNORM, t->image._image, VK_IMAGE_ASPECT_COLOR_BIT);
+			vkCreateImageView(VulkanEngine::engine->_device, &imageInfo, nullptr, &t->imageView);
+
+			VulkanEngine::engine->_mainDeletionQueue.push_function([=]() {
+				vkDestroyImageView(VulkanEngine::engine->_device, t->imageView, nullptr);
+				vmaDestroyImage(VulkanEngine::engine->_allocator, t->image._image, t->image._allocation);
+				});
+		},
+		[=]() {
+			t->_resident = true;
 		});
 
 	return t;
 }
 
+Texture* Texture::wait()
+{
+	AssetLoader::get().wait([this]() { return _resident; });
+	return this;
+}
+
 int Texture::get_id(const char* filename)
 {
 	std::string name = vkutil::findFile(filename, searchPaths, true);
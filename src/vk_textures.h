@@ -5,18 +5,28 @@
 
 class VulkanEngine;
 
+class UploadQueue;
+
 struct Texture {
 	AllocatedImage  image;
 	VkImageView		imageView;
+	bool			_resident{ false };	// image and view are valid once set
 
 	static std::vector<std::pair<std::string, Texture*>> _textures;
+	// Returns right away, the image streams in through the AssetLoader
 	static Texture* GET(const char* filename, const bool cubemap = false);
 	static int get_id(const char* filename);
+
+	// Blocks until the texture is resident, for code that binds it right away
+	Texture* wait();
 };
 
 namespace vkutil {
 
 	bool load_image_from_file(VulkanEngine& engine, const char* filename, AllocatedImage& outImage);
 
+	// Creates an RGBA8 image and records the copy of pixels into it
+	void upload_image(VulkanEngine& engine, UploadQueue& queue, const void* pixels, int width, int height, AllocatedImage& outImage);
+
 	bool load_cubemap(VulkanEngine& engine, const char* filename, VkFormat format, AllocatedImage& outImage);
 }
\ No newline at end of file